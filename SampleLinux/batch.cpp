@@ -0,0 +1,253 @@
+// batch runner:
+// runs many headless simulations of the tracker field, one per configuration, in parallel
+// across the cores, and writes a table of annual energy per configuration.
+//
+// the configurations are either the full grid of the listed values, or (with -samples)
+// random draws between the smallest and largest listed value of each parameter:
+//
+//	batch -pitch 1.5,2,3 -tilt 45,60,75 -height 0.6,1.2 -mode true,back -out sweep.csv
+//	batch -pitch 1.5,4 -tilt 30,85 -samples 200 -seed 7 -weather site.wthr
+//
+// other options:
+//	-rows N		rows in the field (default 3)
+//	-perrow N	panels per row (default 3)
+//	-days D		days to simulate (default 365)
+//	-dt S		seconds per tick (default 300)
+//	-threads T	worker threads (default: all the cores)
+//	-heightmap F	the site's terrain, a 16-bit png or raw .r16 (default: flat ground)
+//	-terrainsize S	x and z extent of the heightmap (default 10)
+//	-terrainheight H	height of its highest possible sample (default 1)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "simulation.h"
+
+
+struct BatchResult
+{
+	SimConfig	config;
+	float		gcr;
+	double		annualPerPanel;		// kWh per m^2 of panel, per year
+	double		annualField;		// kWh per m^2, summed over the field, per year
+	bool		ok;
+};
+
+
+// "1.5,2,3" -> { 1.5, 2., 3. }:
+
+static std::vector<float>
+ParseList( const char *arg )
+{
+	std::vector<float> values;
+	const char *cp = arg;
+	while( *cp != '\0' )
+	{
+		char *end;
+		float v = strtof( cp, &end );
+		if( end == cp )
+			break;
+		values.push_back( v );
+		cp = *end == ',' ? end+1 : end;
+	}
+	return values;
+}
+
+
+// "true,back" -> { TRUE_TRACKING, BACKTRACKING }:
+
+static std::vector<int>
+ParseModes( const char *arg )
+{
+	std::vector<int> modes;
+	if( strstr( arg, "true" ) != NULL )
+		modes.push_back( TRUE_TRACKING );
+	if( strstr( arg, "back" ) != NULL )
+		modes.push_back( BACKTRACKING );
+	return modes;
+}
+
+
+// one whole simulation -- everything it touches lives in its own Simulation:
+
+static void
+RunOne( BatchResult *r, int days, float dt )
+{
+	// the batch already runs a simulation per core, so each one shades on its own thread:
+	Simulation sim;
+	r->config.shadingThreads = 1;
+	r->ok = sim.Init( r->config );
+	if( ! r->ok )
+		return;
+
+	long numSteps = (long)( (double)days * SECONDS_PER_DAY / dt );
+	for( long s = 0; s < numSteps; s++ )
+		sim.Step( dt, true );
+
+	double scale = 365. / (double)days;
+	r->gcr = sim.GetMeanGroundCoverage( );
+	r->annualField = sim.GetTotalEnergy( ) * scale;
+	r->annualPerPanel = r->annualField / (double)sim.GetNumPanels( );
+}
+
+
+int
+main( int argc, char *argv[ ] )
+{
+	SimConfig base;
+	std::vector<float> pitches( 1, base.rowPitch );
+	std::vector<float> tilts( 1, base.maxTilt );
+	std::vector<float> heights( 1, base.pivotHeight );
+	std::vector<int> modes( 1, base.trackingMode );
+	int days = 365;
+	float dt = 300.f;
+	int numThreads = 0;
+	int numSamples = 0;
+	unsigned int seed = 1;
+	const char *outPath = NULL;
+
+	for( int i = 1; i < argc; i++ )
+	{
+		const char *opt = argv[i];
+		const char *val = i+1 < argc ? argv[i+1] : NULL;
+		if( val == NULL )
+		{
+			fprintf( stderr, "Option '%s' needs a value\n", opt );
+			return 1;
+		}
+		i++;
+
+		if(      strcmp( opt, "-pitch" ) == 0 )	pitches = ParseList( val );
+		else if( strcmp( opt, "-tilt" ) == 0 )		tilts = ParseList( val );
+		else if( strcmp( opt, "-height" ) == 0 )	heights = ParseList( val );
+		else if( strcmp( opt, "-mode" ) == 0 )		modes = ParseModes( val );
+		else if( strcmp( opt, "-rows" ) == 0 )		base.numRows = atoi( val );
+		else if( strcmp( opt, "-perrow" ) == 0 )	base.panelsPerRow = atoi( val );
+		else if( strcmp( opt, "-days" ) == 0 )		days = atoi( val );
+		else if( strcmp( opt, "-dt" ) == 0 )		dt = (float)atof( val );
+		else if( strcmp( opt, "-threads" ) == 0 )	numThreads = atoi( val );
+		else if( strcmp( opt, "-samples" ) == 0 )	numSamples = atoi( val );
+		else if( strcmp( opt, "-seed" ) == 0 )		seed = (unsigned int)atoi( val );
+		else if( strcmp( opt, "-weather" ) == 0 )	base.weatherPath = val;
+		else if( strcmp( opt, "-heightmap" ) == 0 )	base.heightmapPath = val;
+		else if( strcmp( opt, "-terrainsize" ) == 0 )	base.terrainSize = (float)atof( val );
+		else if( strcmp( opt, "-terrainheight" ) == 0 )	base.terrainHeight = (float)atof( val );
+		else if( strcmp( opt, "-out" ) == 0 )		outPath = val;
+		else
+		{
+			fprintf( stderr, "Unknown option '%s'\n", opt );
+			return 1;
+		}
+	}
+	if( pitches.empty( )  ||  tilts.empty( )  ||  heights.empty( )  ||  modes.empty( )  ||  days < 1  ||  dt <= 0.f )
+	{
+		fprintf( stderr, "Nothing to run\n" );
+		return 1;
+	}
+
+	// the configurations, all decided up front so the results don't depend on the thread count:
+
+	std::vector<BatchResult> results;
+	if( numSamples > 0 )
+	{
+		std::mt19937 rng( seed );
+		std::uniform_real_distribution<float> unit( 0.f, 1.f );
+		for( int s = 0; s < numSamples; s++ )
+		{
+			BatchResult r;
+			r.config = base;
+			float lo, hi;
+			lo = *std::min_element( pitches.begin( ), pitches.end( ) );	hi = *std::max_element( pitches.begin( ), pitches.end( ) );
+			r.config.rowPitch = lo + unit( rng ) * ( hi - lo );
+			lo = *std::min_element( tilts.begin( ), tilts.end( ) );		hi = *std::max_element( tilts.begin( ), tilts.end( ) );
+			r.config.maxTilt = lo + unit( rng ) * ( hi - lo );
+			lo = *std::min_element( heights.begin( ), heights.end( ) );	hi = *std::max_element( heights.begin( ), heights.end( ) );
+			r.config.pivotHeight = lo + unit( rng ) * ( hi - lo );
+			r.config.trackingMode = modes[ rng( ) % modes.size( ) ];
+			results.push_back( r );
+		}
+	}
+	else
+	{
+		for( int m = 0; m < (int)modes.size( ); m++ )
+		for( int p = 0; p < (int)pitches.size( ); p++ )
+		for( int t = 0; t < (int)tilts.size( ); t++ )
+		for( int h = 0; h < (int)heights.size( ); h++ )
+		{
+			BatchResult r;
+			r.config = base;
+			r.config.trackingMode = modes[m];
+			r.config.rowPitch = pitches[p];
+			r.config.maxTilt = tilts[t];
+			r.config.pivotHeight = heights[h];
+			results.push_back( r );
+		}
+	}
+	int numRuns = (int)results.size( );
+
+	// one task per configuration, handed out to the workers through a shared counter:
+
+	if( numThreads <= 0 )
+		numThreads = (int)std::thread::hardware_concurrency( );
+	if( numThreads < 1 )
+		numThreads = 1;
+	if( numThreads > numRuns )
+		numThreads = numRuns;
+	fprintf( stderr, "Running %d simulations of %d days on %d threads\n", numRuns, days, numThreads );
+
+	std::atomic<int> nextRun( 0 );
+	std::atomic<int> numDone( 0 );
+	std::vector<std::thread> workers;
+	for( int t = 0; t < numThreads; t++ )
+	{
+		workers.push_back( std::thread( [&]( )
+		{
+			int r;
+			while( ( r = nextRun++ ) < numRuns )
+			{
+				RunOne( &results[r], days, dt );
+				int done = ++numDone;
+				if( done % 10 == 0  ||  done == numRuns )
+					fprintf( stderr, "  %d / %d\n", done, numRuns );
+			}
+		} ) );
+	}
+	for( int t = 0; t < numThreads; t++ )
+		workers[t].join( );
+
+	// the summary table:
+
+	FILE *out = stdout;
+	if( outPath != NULL )
+	{
+		out = fopen( outPath, "w" );
+		if( out == NULL )
+		{
+			fprintf( stderr, "Cannot create '%s'\n", outPath );
+			return 1;
+		}
+	}
+	fprintf( out, "run,mode,row_pitch,max_tilt,pivot_height,gcr,annual_kwh_per_panel,annual_kwh_field\n" );
+	for( int r = 0; r < numRuns; r++ )
+	{
+		BatchResult &b = results[r];
+		if( ! b.ok )
+		{
+			fprintf( out, "%d,failed\n", r );
+			continue;
+		}
+		fprintf( out, "%d,%s,%.3f,%.2f,%.3f,%.3f,%.2f,%.2f\n", r,
+			b.config.trackingMode == BACKTRACKING ? "backtracking" : "true",
+			b.config.rowPitch, b.config.maxTilt, b.config.pivotHeight, b.gcr,
+			b.annualPerPanel, b.annualField );
+	}
+	if( out != stdout )
+		fclose( out );
+	return 0;
+}
@@ -0,0 +1,448 @@
+// microbenchmarks (Google Benchmark) for the simulation kernels, the loaders and the log writer:
+//
+//	make bench
+//	./bench --benchmark_out=bench.json --benchmark_out_format=json
+//	./bench --benchmark_filter=Rotations
+//
+// keep the json from a known-good build and diff a new one against it with benchmark's
+// tools/compare.py (compare.py benchmarks old.json new.json) to catch regressions.
+// the sizes are panel counts, keytime counts, mesh and image edge lengths, and log records.
+// run it from this directory, so grass.jpg is found. the obj and bmp inputs are generated
+// into /tmp (or $TMPDIR) when the benchmarks start, and removed when they finish.
+// the obj loader and the vbo make GL calls, so a 1x1 offscreen context (offscreen.cpp, EGL --
+// no display needed) is made current before anything runs; if it can't be, they're skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <GL/gl.h>
+
+#include <benchmark/benchmark.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "simulation.h"
+#include "keytime.h"
+#include "offscreen.h"
+#include "vertexbufferobject.h"
+
+
+// the vector helpers loadobjfile.cpp expects its includer to have:
+
+void
+Cross( float v1[3], float v2[3], float vout[3] )
+{
+	float tmp[3];
+	tmp[0] = v1[1]*v2[2] - v2[1]*v1[2];
+	tmp[1] = v2[0]*v1[2] - v1[0]*v2[2];
+	tmp[2] = v1[0]*v2[1] - v2[0]*v1[1];
+	vout[0] = tmp[0];
+	vout[1] = tmp[1];
+	vout[2] = tmp[2];
+}
+
+
+float
+Unit( float vin[3], float vout[3] )
+{
+	float dist = sqrtf( vin[0]*vin[0] + vin[1]*vin[1] + vin[2]*vin[2] );
+	if( dist > 0. )
+	{
+		vout[0] = vin[0] / dist;
+		vout[1] = vin[1] / dist;
+		vout[2] = vin[2] / dist;
+	}
+	else
+	{
+		vout[0] = vin[0];
+		vout[1] = vin[1];
+		vout[2] = vin[2];
+	}
+	return dist;
+}
+
+#include "loadobjfile.cpp"
+
+unsigned char *	BmpToTexture( char *, int *, int * );
+
+
+static OffscreenContext	Context;
+static bool		HaveContext = false;
+
+
+// for the benchmarks whose GL calls need a context -- without one they'd time nothing:
+
+static bool
+NeedContext( benchmark::State &state )
+{
+	if( ! HaveContext )
+		state.SkipWithError( "No GL context (an EGL pbuffer couldn't be made)" );
+	return HaveContext;
+}
+
+
+// the loaders print a line per file, which would swamp the benchmark's own output:
+
+class QuietStderr
+{
+private:
+	int	saved;
+
+public:
+	QuietStderr( )
+	{
+		fflush( stderr );
+		saved = dup( 2 );
+		int null = open( "/dev/null", O_WRONLY );
+		dup2( null, 2 );
+		close( null );
+	}
+
+	~QuietStderr( )
+	{
+		fflush( stderr );
+		dup2( saved, 2 );
+		close( saved );
+	}
+};
+
+
+static std::string
+TempPath( const char *name, int size )
+{
+	const char *dir = getenv( "TMPDIR" );
+	char path[512];
+	snprintf( path, sizeof(path), "%s/bench-%d-%s-%d", dir != NULL ? dir : "/tmp", (int)getpid( ), name, size );
+	return path;
+}
+
+
+// an n x n grid of quads, as 2*n*n triangles with normals and texture coordinates:
+
+static void
+WriteGridObj( const char *path, int n )
+{
+	FILE *fp = fopen( path, "w" );
+	if( fp == NULL )
+		return;
+	for( int j = 0; j <= n; j++ )
+		for( int i = 0; i <= n; i++ )
+		{
+			float s = (float)i / n;
+			float t = (float)j / n;
+			fprintf( fp, "v %f %f %f\n", s, 0.1f * sinf( 6.f * s ) * cosf( 6.f * t ), t );
+			fprintf( fp, "vt %f %f\n", s, t );
+		}
+	fprintf( fp, "vn 0 1 0\n" );
+	for( int j = 0; j < n; j++ )
+		for( int i = 0; i < n; i++ )
+		{
+			int a = j*(n+1) + i + 1;	// obj indices are 1-based
+			int b = a + 1;
+			int c = a + n+1;
+			int d = c + 1;
+			fprintf( fp, "f %d/%d/1 %d/%d/1 %d/%d/1\n", a, a, b, b, d, d );
+			fprintf( fp, "f %d/%d/1 %d/%d/1 %d/%d/1\n", a, a, d, d, c, c );
+		}
+	fclose( fp );
+}
+
+
+// an n x n 24-bit uncompressed bmp:
+
+static void
+WriteBmp( const char *path, int n )
+{
+	FILE *fp = fopen( path, "wb" );
+	if( fp == NULL )
+		return;
+	int rowBytes = ( 3*n + 3 ) & ~3;
+	int offset = 14 + 40;
+	int header[13] = { offset + rowBytes*n, 0, offset,  40, n, n, 0, 0, rowBytes*n, 2835, 2835, 0, 0 };
+	fwrite( "BM", 1, 2, fp );
+	fwrite( &header[0], 4, 3, fp );
+	fwrite( &header[3], 4, 3, fp );
+	short planes = 1, bits = 24;
+	fwrite( &planes, 2, 1, fp );
+	fwrite( &bits, 2, 1, fp );
+	fwrite( &header[7], 4, 6, fp );
+	std::vector<unsigned char> row( rowBytes, 0 );
+	for( int t = 0; t < n; t++ )
+	{
+		for( int s = 0; s < n; s++ )
+		{
+			row[3*s+0] = (unsigned char)s;
+			row[3*s+1] = (unsigned char)t;
+			row[3*s+2] = (unsigned char)( s ^ t );
+		}
+		fwrite( row.data( ), 1, rowBytes, fp );
+	}
+	fclose( fp );
+}
+
+
+// a square-ish field of about numPanels panels:
+
+static SimConfig
+FieldOf( int numPanels )
+{
+	SimConfig config;
+	config.numRows = (int)sqrtf( (float)numPanels );
+	config.panelsPerRow = numPanels / config.numRows;
+	return config;
+}
+
+
+static void
+BM_ComputePanelRotations( benchmark::State &state )
+{
+	int n = (int)state.range( 0 );
+	int mode = (int)state.range( 1 );
+	Simulation sim;
+	sim.Init( FieldOf( n ) );
+	n = sim.GetNumPanels( );
+	std::vector<float> gcr( n, 0.5f ), angles( n );
+	glm::vec3 sun( 8.f, 10.f, 3.f );
+	for( auto _ : state )
+	{
+		ComputePanelRotations( sim.GetPositions( ), n, sun, mode, DEFAULT_MAX_TILT, gcr.data( ), angles.data( ) );
+		benchmark::DoNotOptimize( angles.data( ) );
+	}
+	state.SetItemsProcessed( state.iterations( ) * n );
+}
+BENCHMARK( BM_ComputePanelRotations )->ArgsProduct( { { 9, 1024, 16384 }, { TRUE_TRACKING, BACKTRACKING } } );
+
+
+static void
+BM_ComputePlaneOfArray( benchmark::State &state )
+{
+	int n = (int)state.range( 0 );
+	int model = (int)state.range( 1 );
+	std::vector<float> angles( n ), beam( n ), sky( n ), ground( n );
+	for( int i = 0; i < n; i++ )
+		angles[i] = -60.f + 120.f * i / n;
+	PlaneOfArray poa = { beam.data( ), sky.data( ), ground.data( ) };
+	WeatherRecord wx = { 0., 650.f, 700.f, 120.f, 0.2f };
+	glm::vec3 sunDir = glm::normalize( glm::vec3( 0.6f, 0.7f, 0.2f ) );
+	for( auto _ : state )
+	{
+		ComputePlaneOfArray( angles.data( ), n, sunDir, wx, model, DEFAULT_ALBEDO, &poa );
+		benchmark::DoNotOptimize( beam.data( ) );
+	}
+	state.SetItemsProcessed( state.iterations( ) * n );
+}
+BENCHMARK( BM_ComputePlaneOfArray )->ArgsProduct( { { 9, 1024, 16384 }, { ISOTROPIC, PEREZ } } );
+
+
+// the whole per-tick sunlight update: rotations, shading and irradiance:
+
+static void
+BM_UpdateSunlight( benchmark::State &state )
+{
+	Simulation sim;
+	sim.Init( FieldOf( (int)state.range( 0 ) ) );
+	sim.SetDayFraction( 0.15f );
+	for( auto _ : state )
+	{
+		sim.UpdateSunlight( );
+		benchmark::DoNotOptimize( sim.GetStrength( ) );
+	}
+	state.SetItemsProcessed( state.iterations( ) * sim.GetNumPanels( ) );
+}
+BENCHMARK( BM_UpdateSunlight )->Arg( 9 )->Arg( 100 )->Arg( 1024 )->Arg( 4096 );
+
+
+// a panel tilted 60 degrees in a 1-degree sun, and a vertical one 41m down-sun that only the rays
+// from its lower half are low enough to hit: a quarter of its 4x4 samples are shaded. the walk
+// along the sun ray has to reach as far as those rays do, so a different answer fails this:
+
+static void
+BM_ShadeLowSunFarBlocker( benchmark::State &state )
+{
+	ShadingEngine shading;
+	shading.SetNumThreads( 1 );
+	shading.SetSamplesPerSide( 4 );
+	glm::vec3 pivots[2] = { glm::vec3( 0.f, 0.f, 0.f ), glm::vec3( 41.3f, 0.f, 0.f ) };
+	float angles[2] = { 60.f, 90.f };
+	float elevation = glm::radians( 1.f );
+	glm::vec3 sun( cosf( elevation ), sinf( elevation ), 0.f );
+	float shaded[2] = { 0.f, 0.f };
+	for( auto _ : state )
+	{
+		shading.Compute( pivots, angles, 2, sun, shaded );
+		benchmark::DoNotOptimize( shaded );
+	}
+	if( fabsf( shaded[0] - 0.25f ) > 1.e-6f  ||  shaded[1] != 0.f )
+		state.SkipWithError( "the low sun's far blocker was missed" );
+}
+BENCHMARK( BM_ShadeLowSunFarBlocker );
+
+
+static void
+BM_KeytimesGetValue( benchmark::State &state )
+{
+	int numKeys = (int)state.range( 0 );
+	Keytimes keys;
+	for( int i = 0; i < numKeys; i++ )
+		keys.AddTimeValue( (float)i, sinf( (float)i ) );
+	float t = 0.f;
+	float dt = 0.37f;
+	for( auto _ : state )
+	{
+		benchmark::DoNotOptimize( keys.GetValue( t ) );
+		t += dt;
+		if( t > numKeys )
+			t -= numKeys;
+	}
+}
+BENCHMARK( BM_KeytimesGetValue )->Arg( 4 )->Arg( 16 )->Arg( 64 )->Arg( 256 );
+
+
+// LoadObjFile the way it's meant to be used, compiled into a display list: the parse and the
+// immediate-mode calls that record the triangles:
+
+static void
+BM_LoadObjFile( benchmark::State &state )
+{
+	if( ! NeedContext( state ) )
+		return;
+	int n = (int)state.range( 0 );
+	std::string path = TempPath( "grid.obj", n );
+	WriteGridObj( path.c_str( ), n );
+	GLuint list = glGenLists( 1 );
+	{
+		QuietStderr quiet;
+		for( auto _ : state )
+		{
+			glNewList( list, GL_COMPILE );
+			benchmark::DoNotOptimize( LoadObjFile( (char *)path.c_str( ) ) );
+			glEndList( );
+		}
+	}
+	glDeleteLists( list, 1 );
+	state.SetItemsProcessed( state.iterations( ) * 2 * n * n );
+	unlink( path.c_str( ) );
+}
+BENCHMARK( BM_LoadObjFile )->Arg( 16 )->Arg( 64 )->Arg( 256 )->Unit( benchmark::kMillisecond );
+
+
+static void
+BM_BmpToTexture( benchmark::State &state )
+{
+	int n = (int)state.range( 0 );
+	std::string path = TempPath( "image.bmp", n );
+	WriteBmp( path.c_str( ), n );
+	{
+		QuietStderr quiet;
+		for( auto _ : state )
+		{
+			int width, height;
+			unsigned char *texture = BmpToTexture( (char *)path.c_str( ), &width, &height );
+			if( texture == NULL )
+			{
+				state.SkipWithError( "BmpToTexture failed" );
+				break;
+			}
+			delete [ ] texture;
+		}
+	}
+	state.SetBytesProcessed( state.iterations( ) * 3 * n * n );
+	unlink( path.c_str( ) );
+}
+BENCHMARK( BM_BmpToTexture )->Arg( 64 )->Arg( 256 )->Arg( 1024 )->Unit( benchmark::kMillisecond );
+
+
+static void
+BM_StbiLoadGrass( benchmark::State &state )
+{
+	long long bytes = 0;
+	for( auto _ : state )
+	{
+		int width, height, channels;
+		unsigned char *data = stbi_load( "grass.jpg", &width, &height, &channels, 0 );
+		if( data == NULL )
+		{
+			state.SkipWithError( "Cannot load grass.jpg (run from SampleLinux)" );
+			break;
+		}
+		bytes += (long long)width * height * channels;
+		stbi_image_free( data );
+	}
+	state.SetBytesProcessed( bytes );
+}
+BENCHMARK( BM_StbiLoadGrass )->Unit( benchmark::kMillisecond );
+
+
+// building a vbo a vertex at a time, as an n x n triangle grid, with and without
+// collapsing the shared vertices. glBegin( ) resets the GL's primitive restart state:
+
+static void
+BM_VertexBufferObjectAddVertex( benchmark::State &state )
+{
+	if( ! NeedContext( state ) )
+		return;
+	int n = (int)state.range( 0 );
+	bool collapse = state.range( 1 ) != 0;
+	for( auto _ : state )
+	{
+		VertexBufferObject vbo;
+		vbo.Init( );
+		vbo.CollapseCommonVertices( collapse );
+		vbo.glBegin( GL_TRIANGLES );
+		for( int j = 0; j < n; j++ )
+			for( int i = 0; i < n; i++ )
+			{
+				float x0 = (float)i, x1 = (float)( i+1 );
+				float z0 = (float)j, z1 = (float)( j+1 );
+				vbo.glVertex3f( x0, 0.f, z0 );	vbo.glVertex3f( x1, 0.f, z0 );	vbo.glVertex3f( x1, 0.f, z1 );
+				vbo.glVertex3f( x0, 0.f, z0 );	vbo.glVertex3f( x1, 0.f, z1 );	vbo.glVertex3f( x0, 0.f, z1 );
+			}
+		vbo.glEnd( );
+	}
+	state.SetItemsProcessed( state.iterations( ) * 6 * n * n );
+}
+BENCHMARK( BM_VertexBufferObjectAddVertex )->ArgsProduct( { { 16, 64, 256 }, { 0, 1 } } )->Unit( benchmark::kMicrosecond );
+
+
+// the log writer, appending records for every panel to a file the way main.cpp does:
+
+static void
+BM_WritePanelLogs( benchmark::State &state )
+{
+	Simulation sim;
+	sim.Init( FieldOf( (int)state.range( 0 ) ) );
+	sim.UpdateSunlight( );
+	sim.RecordLog( 1.f );
+	const std::vector<PanelLog> &logs = sim.GetLogs( );
+	std::string path = TempPath( "panel.log", (int)logs.size( ) );
+	for( auto _ : state )
+	{
+		std::ofstream logFile( path, std::ios::trunc );
+		WritePanelLogs( logFile, logs.data( ), (int)logs.size( ) );
+	}
+	state.SetItemsProcessed( state.iterations( ) * logs.size( ) );
+	unlink( path.c_str( ) );
+}
+BENCHMARK( BM_WritePanelLogs )->Arg( 9 )->Arg( 1024 )->Arg( 16384 )->Unit( benchmark::kMicrosecond );
+
+
+int
+main( int argc, char *argv[ ] )
+{
+	benchmark::Initialize( &argc, argv );
+	if( benchmark::ReportUnrecognizedArguments( argc, argv ) )
+		return 1;
+	HaveContext = Context.Create( 1, 1 );
+	benchmark::RunSpecifiedBenchmarks( );
+	benchmark::Shutdown( );
+	Context.Destroy( );
+	return 0;
+}
@@ -0,0 +1,487 @@
+#include "blockcompress.h"
+
+#include <string.h>
+#include <math.h>
+
+
+size_t
+BlockCompressedSize( int format, int width, int height )
+{
+	size_t blocks = (size_t)( ( width + 3 ) / 4 ) * ( ( height + 3 ) / 4 );
+	return blocks * ( format == BLOCK_BC1 ? 8 : 16 );
+}
+
+
+int
+BlockFormatOf( unsigned int glInternalFormat )
+{
+	switch( glInternalFormat )
+	{
+		case GL_FORMAT_BC1:	return BLOCK_BC1;
+		case GL_FORMAT_BC3:	return BLOCK_BC3;
+		case GL_FORMAT_BC7:	return BLOCK_BC7;
+	}
+	return -1;
+}
+
+
+// the 16 pixels of the block at (bx,by), repeating the last row and column past the edges:
+
+static void
+LoadBlock( const unsigned char *rgba, int width, int height, int bx, int by, float px[16][4] )
+{
+	for( int y = 0; y < 4; y++ )
+	{
+		int sy = by*4 + y < height ? by*4 + y : height - 1;
+		for( int x = 0; x < 4; x++ )
+		{
+			int sx = bx*4 + x < width ? bx*4 + x : width - 1;
+			const unsigned char *p = &rgba[ 4 * ( (size_t)sy * width + sx ) ];
+			for( int c = 0; c < 4; c++ )
+				px[ 4*y + x ][c] = p[c];
+		}
+	}
+}
+
+
+static void
+StoreBlock( const unsigned char block[16][4], int width, int height, int bx, int by, unsigned char *rgba )
+{
+	for( int y = 0; y < 4  &&  by*4 + y < height; y++ )
+		for( int x = 0; x < 4  &&  bx*4 + x < width; x++ )
+			memcpy( &rgba[ 4 * ( (size_t)( by*4 + y ) * width + bx*4 + x ) ], block[ 4*y + x ], 4 );
+}
+
+
+// the two ends of the pixels' spread along their principal axis, in the first dims channels:
+
+static void
+FindEndpoints( const float px[16][4], int dims, float lo[4], float hi[4] )
+{
+	float mean[4] = { 0., 0., 0., 0. };
+	for( int i = 0; i < 16; i++ )
+		for( int c = 0; c < dims; c++ )
+			mean[c] += px[i][c] / 16.f;
+
+	float cov[4][4] = { { 0. } };
+	for( int i = 0; i < 16; i++ )
+		for( int r = 0; r < dims; r++ )
+			for( int c = 0; c < dims; c++ )
+				cov[r][c] += ( px[i][r] - mean[r] ) * ( px[i][c] - mean[c] );
+
+	// power iteration:
+	float axis[4] = { 1., 1., 1., 1. };
+	for( int iter = 0; iter < 8; iter++ )
+	{
+		float next[4] = { 0., 0., 0., 0. };
+		float biggest = 0.;
+		for( int r = 0; r < dims; r++ )
+		{
+			for( int c = 0; c < dims; c++ )
+				next[r] += cov[r][c] * axis[c];
+			biggest = fmaxf( biggest, fabsf( next[r] ) );
+		}
+		if( biggest < 1.e-6f )
+			break;			// all the pixels are the same: any axis will do
+		for( int c = 0; c < dims; c++ )
+			axis[c] = next[c] / biggest;
+	}
+	float len2 = 0.;
+	for( int c = 0; c < dims; c++ )
+		len2 += axis[c] * axis[c];
+
+	float tmin = 0., tmax = 0.;
+	for( int i = 0; i < 16; i++ )
+	{
+		float t = 0.;
+		for( int c = 0; c < dims; c++ )
+			t += ( px[i][c] - mean[c] ) * axis[c];
+		t /= len2;
+		tmin = fminf( tmin, t );
+		tmax = fmaxf( tmax, t );
+	}
+	for( int c = 0; c < dims; c++ )
+	{
+		lo[c] = fminf( fmaxf( mean[c] + tmin * axis[c], 0.f ), 255.f );
+		hi[c] = fminf( fmaxf( mean[c] + tmax * axis[c], 0.f ), 255.f );
+	}
+}
+
+
+static int
+Nearest( const float p[4], const unsigned char palette[ ][4], int numColors, int dims )
+{
+	int best = 0;
+	float bestError = 1.e30f;
+	for( int i = 0; i < numColors; i++ )
+	{
+		float error = 0.;
+		for( int c = 0; c < dims; c++ )
+		{
+			float d = p[c] - palette[i][c];
+			error += d * d;
+		}
+		if( error < bestError )
+		{
+			bestError = error;
+			best = i;
+		}
+	}
+	return best;
+}
+
+
+// BC1 / the color half of BC3:
+
+static unsigned short
+To565( const float c[4] )
+{
+	int r = (int)( c[0] * 31.f / 255.f + .5f );
+	int g = (int)( c[1] * 63.f / 255.f + .5f );
+	int b = (int)( c[2] * 31.f / 255.f + .5f );
+	return (unsigned short)( ( r << 11 ) | ( g << 5 ) | b );
+}
+
+
+static void
+From565( unsigned short v, unsigned char c[4] )
+{
+	int r = ( v >> 11 ) & 31, g = ( v >> 5 ) & 63, b = v & 31;
+	c[0] = (unsigned char)( ( r << 3 ) | ( r >> 2 ) );
+	c[1] = (unsigned char)( ( g << 2 ) | ( g >> 4 ) );
+	c[2] = (unsigned char)( ( b << 3 ) | ( b >> 2 ) );
+	c[3] = 255;
+}
+
+
+static void
+ColorPalette( unsigned short c0, unsigned short c1, bool fourColors, unsigned char palette[4][4] )
+{
+	From565( c0, palette[0] );
+	From565( c1, palette[1] );
+	for( int c = 0; c < 3; c++ )
+	{
+		if( fourColors )
+		{
+			palette[2][c] = (unsigned char)( ( 2*palette[0][c] + palette[1][c] ) / 3 );
+			palette[3][c] = (unsigned char)( ( palette[0][c] + 2*palette[1][c] ) / 3 );
+		}
+		else
+		{
+			palette[2][c] = (unsigned char)( ( palette[0][c] + palette[1][c] ) / 2 );
+			palette[3][c] = 0;
+		}
+	}
+	palette[2][3] = 255;
+	palette[3][3] = fourColors ? 255 : 0;
+}
+
+
+// always in the four-color mode, c0 > c1, which is the only mode BC3 has:
+
+static void
+CompressColorBlock( const float px[16][4], unsigned char *out )
+{
+	float lo[4], hi[4];
+	FindEndpoints( px, 3, lo, hi );
+	unsigned short c0 = To565( hi );
+	unsigned short c1 = To565( lo );
+	if( c0 < c1 )
+	{
+		unsigned short t = c0;	c0 = c1;	c1 = t;
+	}
+
+	unsigned int indices = 0;
+	if( c0 != c1 )
+	{
+		unsigned char palette[4][4];
+		ColorPalette( c0, c1, true, palette );
+		for( int i = 0; i < 16; i++ )
+			indices |= (unsigned int)Nearest( px[i], palette, 4, 3 ) << ( 2*i );
+	}
+
+	out[0] = (unsigned char)c0;	out[1] = (unsigned char)( c0 >> 8 );
+	out[2] = (unsigned char)c1;	out[3] = (unsigned char)( c1 >> 8 );
+	for( int b = 0; b < 4; b++ )
+		out[4+b] = (unsigned char)( indices >> ( 8*b ) );
+}
+
+
+static void
+DecompressColorBlock( const unsigned char *in, bool alwaysFourColors, unsigned char block[16][4] )
+{
+	unsigned short c0 = (unsigned short)( in[0] | ( in[1] << 8 ) );
+	unsigned short c1 = (unsigned short)( in[2] | ( in[3] << 8 ) );
+	unsigned int indices = in[4] | ( in[5] << 8 ) | ( in[6] << 16 ) | ( (unsigned int)in[7] << 24 );
+	unsigned char palette[4][4];
+	ColorPalette( c0, c1, alwaysFourColors || c0 > c1, palette );
+	for( int i = 0; i < 16; i++ )
+		memcpy( block[i], palette[ ( indices >> ( 2*i ) ) & 3 ], 4 );
+}
+
+
+// the alpha half of BC3, in its eight-value mode, a0 > a1:
+
+static void
+CompressAlphaBlock( const float px[16][4], unsigned char *out )
+{
+	float amin = 255., amax = 0.;
+	for( int i = 0; i < 16; i++ )
+	{
+		amin = fminf( amin, px[i][3] );
+		amax = fmaxf( amax, px[i][3] );
+	}
+	int a0 = (int)( amax + .5f ), a1 = (int)( amin + .5f );
+
+	unsigned long long indices = 0;
+	if( a0 != a1 )
+	{
+		unsigned char palette[8][4];
+		palette[0][0] = (unsigned char)a0;
+		palette[1][0] = (unsigned char)a1;
+		for( int k = 1; k < 7; k++ )
+			palette[k+1][0] = (unsigned char)( ( ( 7 - k ) * a0 + k * a1 ) / 7 );
+		for( int i = 0; i < 16; i++ )
+		{
+			float a[4] = { px[i][3], 0., 0., 0. };
+			indices |= (unsigned long long)Nearest( a, palette, 8, 1 ) << ( 3*i );
+		}
+	}
+
+	out[0] = (unsigned char)a0;
+	out[1] = (unsigned char)a1;
+	for( int b = 0; b < 6; b++ )
+		out[2+b] = (unsigned char)( indices >> ( 8*b ) );
+}
+
+
+static void
+DecompressAlphaBlock( const unsigned char *in, unsigned char block[16][4] )
+{
+	int a0 = in[0], a1 = in[1];
+	unsigned char palette[8];
+	palette[0] = (unsigned char)a0;
+	palette[1] = (unsigned char)a1;
+	if( a0 > a1 )
+	{
+		for( int k = 1; k < 7; k++ )
+			palette[k+1] = (unsigned char)( ( ( 7 - k ) * a0 + k * a1 ) / 7 );
+	}
+	else
+	{
+		for( int k = 1; k < 5; k++ )
+			palette[k+1] = (unsigned char)( ( ( 5 - k ) * a0 + k * a1 ) / 5 );
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+	unsigned long long indices = 0;
+	for( int b = 0; b < 6; b++ )
+		indices |= (unsigned long long)in[2+b] << ( 8*b );
+	for( int i = 0; i < 16; i++ )
+		block[i][3] = palette[ ( indices >> ( 3*i ) ) & 7 ];
+}
+
+
+// BC7 mode 6. the bits go in least-significant first:
+
+static const int Bc7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static void
+PutBits( unsigned char *out, int &pos, unsigned int value, int numBits )
+{
+	for( int b = 0; b < numBits; b++, pos++ )
+		if( value & ( 1u << b ) )
+			out[ pos >> 3 ] |= (unsigned char)( 1 << ( pos & 7 ) );
+}
+
+
+static unsigned int
+GetBits( const unsigned char *in, int &pos, int numBits )
+{
+	unsigned int value = 0;
+	for( int b = 0; b < numBits; b++, pos++ )
+		if( in[ pos >> 3 ] & ( 1 << ( pos & 7 ) ) )
+			value |= 1u << b;
+	return value;
+}
+
+
+static void
+Bc7Palette( const unsigned char e0[4], const unsigned char e1[4], unsigned char palette[16][4] )
+{
+	for( int i = 0; i < 16; i++ )
+		for( int c = 0; c < 4; c++ )
+			palette[i][c] = (unsigned char)( ( ( 64 - Bc7Weights[i] ) * e0[c] + Bc7Weights[i] * e1[c] + 32 ) >> 6 );
+}
+
+
+// the 7-bit endpoint and the p-bit shared by its four channels that come closest to e:
+
+static int
+Bc7Quantize( const float e[4], unsigned char q[4], unsigned char full[4] )
+{
+	int bestP = 0;
+	float bestError = 1.e30f;
+	for( int p = 0; p < 2; p++ )
+	{
+		float error = 0.;
+		for( int c = 0; c < 4; c++ )
+		{
+			int c7 = (int)( ( e[c] - p ) / 2.f + .5f );
+			c7 = c7 < 0 ? 0 : ( c7 > 127 ? 127 : c7 );
+			float d = e[c] - ( 2*c7 + p );
+			error += d * d;
+		}
+		if( error < bestError )
+		{
+			bestError = error;
+			bestP = p;
+		}
+	}
+	for( int c = 0; c < 4; c++ )
+	{
+		int c7 = (int)( ( e[c] - bestP ) / 2.f + .5f );
+		q[c] = (unsigned char)( c7 < 0 ? 0 : ( c7 > 127 ? 127 : c7 ) );
+		full[c] = (unsigned char)( 2*q[c] + bestP );
+	}
+	return bestP;
+}
+
+
+static void
+CompressBc7Block( const float px[16][4], unsigned char *out )
+{
+	float lo[4], hi[4];
+	FindEndpoints( px, 4, lo, hi );
+	unsigned char q[2][4], full[2][4];
+	int p[2];
+	p[0] = Bc7Quantize( lo, q[0], full[0] );
+	p[1] = Bc7Quantize( hi, q[1], full[1] );
+
+	unsigned char palette[16][4];
+	Bc7Palette( full[0], full[1], palette );
+	int indices[16];
+	for( int i = 0; i < 16; i++ )
+		indices[i] = Nearest( px[i], palette, 16, 4 );
+
+	// the first pixel's index is stored with its top bit implied 0:
+	if( indices[0] >= 8 )
+	{
+		for( int c = 0; c < 4; c++ )
+		{
+			unsigned char t = q[0][c];	q[0][c] = q[1][c];	q[1][c] = t;
+		}
+		int t = p[0];	p[0] = p[1];	p[1] = t;
+		for( int i = 0; i < 16; i++ )
+			indices[i] = 15 - indices[i];
+	}
+
+	memset( out, 0, 16 );
+	int pos = 0;
+	PutBits( out, pos, 1 << 6, 7 );			// mode 6
+	for( int c = 0; c < 4; c++ )
+	{
+		PutBits( out, pos, q[0][c], 7 );
+		PutBits( out, pos, q[1][c], 7 );
+	}
+	PutBits( out, pos, p[0], 1 );
+	PutBits( out, pos, p[1], 1 );
+	PutBits( out, pos, indices[0], 3 );
+	for( int i = 1; i < 16; i++ )
+		PutBits( out, pos, indices[i], 4 );
+}
+
+
+static bool
+DecompressBc7Block( const unsigned char *in, unsigned char block[16][4] )
+{
+	int pos = 0;
+	if( GetBits( in, pos, 7 ) != 1 << 6 )
+		return false;				// not mode 6
+	unsigned char e[2][4];
+	for( int c = 0; c < 4; c++ )
+	{
+		e[0][c] = (unsigned char)GetBits( in, pos, 7 );
+		e[1][c] = (unsigned char)GetBits( in, pos, 7 );
+	}
+	int p0 = GetBits( in, pos, 1 ), p1 = GetBits( in, pos, 1 );
+	for( int c = 0; c < 4; c++ )
+	{
+		e[0][c] = (unsigned char)( 2*e[0][c] + p0 );
+		e[1][c] = (unsigned char)( 2*e[1][c] + p1 );
+	}
+	unsigned char palette[16][4];
+	Bc7Palette( e[0], e[1], palette );
+	for( int i = 0; i < 16; i++ )
+		memcpy( block[i], palette[ GetBits( in, pos, i == 0 ? 3 : 4 ) ], 4 );
+	return true;
+}
+
+
+void
+CompressBlocks( int format, const unsigned char *rgba, int width, int height, unsigned char *out )
+{
+	int bw = ( width + 3 ) / 4, bh = ( height + 3 ) / 4;
+	float px[16][4];
+	for( int by = 0; by < bh; by++ )
+		for( int bx = 0; bx < bw; bx++ )
+		{
+			LoadBlock( rgba, width, height, bx, by, px );
+			switch( format )
+			{
+				case BLOCK_BC1:
+					CompressColorBlock( px, out );
+					out += 8;
+					break;
+
+				case BLOCK_BC3:
+					CompressAlphaBlock( px, out );
+					CompressColorBlock( px, out + 8 );
+					out += 16;
+					break;
+
+				case BLOCK_BC7:
+					CompressBc7Block( px, out );
+					out += 16;
+					break;
+			}
+		}
+}
+
+
+// for when the GL can't take the blocks as they are:
+
+bool
+DecompressBlocks( int format, const unsigned char *blocks, int width, int height, unsigned char *rgba )
+{
+	int bw = ( width + 3 ) / 4, bh = ( height + 3 ) / 4;
+	unsigned char block[16][4];
+	for( int by = 0; by < bh; by++ )
+		for( int bx = 0; bx < bw; bx++ )
+		{
+			switch( format )
+			{
+				case BLOCK_BC1:
+					DecompressColorBlock( blocks, false, block );
+					blocks += 8;
+					break;
+
+				case BLOCK_BC3:
+					DecompressColorBlock( blocks + 8, true, block );
+					DecompressAlphaBlock( blocks, block );
+					blocks += 16;
+					break;
+
+				case BLOCK_BC7:
+					if( ! DecompressBc7Block( blocks, block ) )
+						return false;
+					blocks += 16;
+					break;
+
+				default:
+					return false;
+			}
+			StoreBlock( block, width, height, bx, by, rgba );
+		}
+	return true;
+}
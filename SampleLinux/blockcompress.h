@@ -0,0 +1,35 @@
+#ifndef BLOCKCOMPRESS_H
+#define BLOCKCOMPRESS_H
+
+#include <stddef.h>
+
+
+// block compression of 8-bit rgba images, 4x4 pixels to a block:
+//	BC1 (S3TC DXT1)		8 bytes a block, rgb, no alpha
+//	BC3 (S3TC DXT5)		16 bytes a block, rgb + interpolated alpha
+//	BC7 (BPTC)		16 bytes a block, rgba. only mode 6 (one subset, 7-bit endpoints with a
+//				p-bit, 4-bit indices) is written, and only mode 6 is decoded back
+//
+// the endpoints are the extremes of the block's pixels along their principal axis.
+// images that aren't a multiple of 4 are padded by repeating their last row and column.
+// rgba is width*height*4 bytes, top row first; the blocks come out in the same row order.
+
+enum BlockFormats
+{
+	BLOCK_BC1,
+	BLOCK_BC3,
+	BLOCK_BC7
+};
+
+// the GL internal formats they're uploaded as:
+const unsigned int GL_FORMAT_BC1 = 0x83F0;		// GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+const unsigned int GL_FORMAT_BC3 = 0x83F3;		// GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+const unsigned int GL_FORMAT_BC7 = 0x8E8C;		// GL_COMPRESSED_RGBA_BPTC_UNORM
+
+
+size_t		BlockCompressedSize( int format, int width, int height );
+void		CompressBlocks( int format, const unsigned char *rgba, int width, int height, unsigned char *out );
+bool		DecompressBlocks( int format, const unsigned char *blocks, int width, int height, unsigned char *rgba );
+int		BlockFormatOf( unsigned int glInternalFormat );	// -1 if not one of the above
+
+#endif	// BLOCKCOMPRESS_H
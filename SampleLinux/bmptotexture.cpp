@@ -1,8 +1,16 @@
 #include <stdio.h>
+#include <string.h>
+
+// the byte swizzles use SSSE3 shuffles when the cpu has them (checked at run time):
+#if defined(__GNUC__)  &&  ( defined(__x86_64__)  ||  defined(__i386__) )
+#define BMP_SSSE3
+#include <immintrin.h>
+#endif
 
 #define VERBOSE		false
 
 unsigned char *	BmpToTexture( char *, int *, int * );
+unsigned char *	BmpToTextureAlpha( char *, int *, int * );
 int		ReadInt( FILE * );
 short		ReadShort( FILE * );
 
@@ -11,6 +19,7 @@ short		ReadShort( FILE * );
 #define BI_RGB			0
 #define BI_RLE8			1
 #define BI_RLE4			2
+#define BI_BITFIELDS		3
 #endif
 
 
@@ -29,10 +38,10 @@ struct bmih
 {
 	int biSize;		// info header size, should be 40
 	int biWidth;		// image width
-	int biHeight;		// image height
+	int biHeight;		// image height, negative if the rows are stored top-to-bottom
 	short biPlanes;		// #color planes, should be 1
 	short biBitCount;	// #bits/pixel, should be 1, 4, 8, 16, 24, 32
-	int biCompression;	// BI_RGB, BI_RLE4, BI_RLE8
+	int biCompression;	// BI_RGB, BI_RLE4, BI_RLE8, BI_BITFIELDS
 	int biSizeImage;
 	int biXPixelsPerMeter;
 	int biYPixelsPerMeter;
@@ -42,8 +51,120 @@ struct bmih
 
 
 
-unsigned char *
-BmpToTexture( char *filename, int *width, int *height )
+// converting one row of pixels, bgr(a) in the file to rgb(a) in the texture.
+// the SSSE3 versions do 4 pixels per shuffle and return how many pixels they did;
+// the scalar loops finish the row. 16-byte loads and stores may run past the 4 pixels,
+// so the vector loops stop while that is still inside the row:
+
+#ifdef BMP_SSSE3
+
+static const bool HaveSsse3 = __builtin_cpu_supports( "ssse3" );
+
+__attribute__((target("ssse3")))
+static int
+Bgr24ToRgb( const unsigned char *src, unsigned char *dst, int n )
+{
+	const __m128i shuffle = _mm_setr_epi8( 2,1,0, 5,4,3, 8,7,6, 11,10,9, -1,-1,-1,-1 );
+	int s = 0;
+	for( ; s + 6 <= n; s += 4 )
+		_mm_storeu_si128( (__m128i *)&dst[3*s], _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)&src[3*s] ), shuffle ) );
+	return s;
+}
+
+__attribute__((target("ssse3")))
+static int
+Bgr24ToRgba( const unsigned char *src, unsigned char *dst, int n )
+{
+	const __m128i shuffle = _mm_setr_epi8( 2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1 );
+	const __m128i opaque = _mm_set1_epi32( (int)0xff000000 );
+	int s = 0;
+	for( ; s + 6 <= n; s += 4 )
+	{
+		__m128i p = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)&src[3*s] ), shuffle );
+		_mm_storeu_si128( (__m128i *)&dst[4*s], _mm_or_si128( p, opaque ) );
+	}
+	return s;
+}
+
+__attribute__((target("ssse3")))
+static int
+Bgra32ToRgb( const unsigned char *src, unsigned char *dst, int n )
+{
+	const __m128i shuffle = _mm_setr_epi8( 2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1 );
+	int s = 0;
+	for( ; s + 6 <= n; s += 4 )
+		_mm_storeu_si128( (__m128i *)&dst[3*s], _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)&src[4*s] ), shuffle ) );
+	return s;
+}
+
+__attribute__((target("ssse3")))
+static int
+Bgra32ToRgba( const unsigned char *src, unsigned char *dst, int n, bool opaque )
+{
+	const __m128i shuffle = _mm_setr_epi8( 2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15 );
+	const __m128i alpha = _mm_set1_epi32( opaque ? (int)0xff000000 : 0 );
+	int s = 0;
+	for( ; s + 4 <= n; s += 4 )
+	{
+		__m128i p = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)&src[4*s] ), shuffle );
+		_mm_storeu_si128( (__m128i *)&dst[4*s], _mm_or_si128( p, alpha ) );
+	}
+	return s;
+}
+
+#endif
+
+
+static void
+ConvertRow( const unsigned char *src, unsigned char *dst, int n, int bitCount, int outComps,
+		bool opaque, const unsigned char *palette )
+{
+	int s = 0;
+
+	if( bitCount == 8 )
+	{
+		for( ; s < n; s++ )
+		{
+			const unsigned char *c = &palette[ 4*src[s] ];		// b, g, r, reserved
+			unsigned char *d = &dst[ outComps*s ];
+			d[0] = c[2];
+			d[1] = c[1];
+			d[2] = c[0];
+			if( outComps == 4 )
+				d[3] = 255;
+		}
+		return;
+	}
+
+	int inComps = bitCount / 8;
+#ifdef BMP_SSSE3
+	if( HaveSsse3 )
+	{
+		if( inComps == 3 )
+			s = outComps == 3 ? Bgr24ToRgb( src, dst, n ) : Bgr24ToRgba( src, dst, n );
+		else
+			s = outComps == 3 ? Bgra32ToRgb( src, dst, n ) : Bgra32ToRgba( src, dst, n, opaque );
+	}
+#endif
+	for( ; s < n; s++ )
+	{
+		const unsigned char *p = &src[ inComps*s ];
+		unsigned char *d = &dst[ outComps*s ];
+		d[0] = p[2];
+		d[1] = p[1];
+		d[2] = p[0];
+		if( outComps == 4 )
+			d[3] = ( inComps == 4  &&  ! opaque ) ? p[3] : 255;
+	}
+}
+
+
+// read a bmp into a new[ ]'ed texture of outComps (3 or 4) bytes per pixel, bottom row first.
+// the headers are read a field at a time, the pixels in one fread( ), and then converted
+// a row at a time, so a big image goes at about the speed of the disk and memory:
+
+static unsigned char *
+DecodeBmp( char *filename, int *width, int *height, int outComps )
 {
 	FILE* fp;
 #ifdef _WIN32
@@ -77,245 +198,154 @@ BmpToTexture( char *filename, int *width, int *height )
 		return NULL;
 	}
 
-
 	FileHeader.bfSize = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "FileHeader.bfSize = %d\n", FileHeader.bfSize );
-
 	FileHeader.bfReserved1 = ReadShort( fp );
 	FileHeader.bfReserved2 = ReadShort( fp );
-
 	FileHeader.bfOffBytes = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "FileHeader.bfOffBytes = %d\n", FileHeader.bfOffBytes );
-
+	if( VERBOSE )	fprintf( stderr, "FileHeader.bfSize = %d, bfOffBytes = %d\n", FileHeader.bfSize, FileHeader.bfOffBytes );
 
 	InfoHeader.biSize = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biSize = %d\n", InfoHeader.biSize );
 	InfoHeader.biWidth = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biWidth = %d\n", InfoHeader.biWidth );
 	InfoHeader.biHeight = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biHeight = %d\n", InfoHeader.biHeight );
-
-	// the horizontal and vertical dimensions:
-	int nums = InfoHeader.biWidth;
-	int numt = InfoHeader.biHeight;
-
-	// the horizontal dimension as the next lower multiple of 4:
-	int nums4 = 4 * (nums / 4);
-
 	InfoHeader.biPlanes = ReadShort( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biPlanes = %d\n", InfoHeader.biPlanes );
-
 	InfoHeader.biBitCount = ReadShort( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biBitCount = %d\n", InfoHeader.biBitCount );
-
-	fprintf(stderr, "Image file '%s' has pixel dimensions %dx%d and %d bits/pixel\n", filename, nums, numt, InfoHeader.biBitCount);
-
 	InfoHeader.biCompression = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biCompression = %d\n", InfoHeader.biCompression );
-
 	InfoHeader.biSizeImage = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biSizeImage = %d\n", InfoHeader.biSizeImage );
-
 	InfoHeader.biXPixelsPerMeter = ReadInt( fp );
 	InfoHeader.biYPixelsPerMeter = ReadInt( fp );
-
 	InfoHeader.biClrUsed = ReadInt( fp );
-	if( VERBOSE )	fprintf( stderr, "InfoHeader.biClrUsed = %d\n", InfoHeader.biClrUsed );
-
 	InfoHeader.biClrImportant = ReadInt( fp );
+	if( VERBOSE )	fprintf( stderr, "InfoHeader: size = %d, %d x %d, %d bits/pixel, compression = %d, %d colors\n",
+				InfoHeader.biSize, InfoHeader.biWidth, InfoHeader.biHeight, InfoHeader.biBitCount,
+				InfoHeader.biCompression, InfoHeader.biClrUsed );
 
-	// pixels will be stored bottom-to-top, left-to-right:
-	int numcomps = InfoHeader.biBitCount / 8;
-	if( VERBOSE )	fprintf( stderr, "numcomps = %d\n", numcomps );
+	// the horizontal and vertical dimensions:
+	int nums = InfoHeader.biWidth;
+	int numt = InfoHeader.biHeight < 0 ? -InfoHeader.biHeight : InfoHeader.biHeight;
+	bool topDown = InfoHeader.biHeight < 0;
+	int bitCount = InfoHeader.biBitCount;
 
-	unsigned char *texture = new unsigned char[ 3 * nums * numt ];
-	if( texture == NULL )
+	fprintf(stderr, "Image file '%s' has pixel dimensions %dx%d and %d bits/pixel\n", filename, nums, numt, bitCount);
+
+	if( nums <= 0  ||  numt <= 0  ||  FileHeader.bfOffBytes <= 0 )
 	{
-		fprintf( stderr, "Cannot allocate the texture array!\n" );
+		fprintf( stderr, "Bad image dimensions: %d x %d\n", nums, numt );
+		fclose( fp );
+		return NULL;
+	}
+	if( bitCount != 8  &&  bitCount != 24  &&  bitCount != 32 )
+	{
+		fprintf( stderr, "Can only handle 8, 24, or 32 bits/pixel, not %d\n", bitCount );
+		fclose( fp );
 		return NULL;
 	}
 
 
-	// extra padding bytes:
-
-	//fprintf(stderr, "BitCount = %d ; Width = %d\n", InfoHeader.biBitCount, InfoHeader.biWidth);
-	//int requiredRowSizeInBytes = 4 * ( ( InfoHeader.biBitCount*InfoHeader.biWidth + 31 ) / 32 );
-	//float num = InfoHeader.biBitCount*InfoHeader.biWidth + 31.;
-	//float denom =  32.;
-	//int requiredRowSizeInWords = (int)(InfoHeader.biBitCount * InfoHeader.biWidth + 31) / 32;	// next highest integer
-	//int requiredRowSizeInBytes = 4 * requiredRowSizeInWords;
-
-	//requiredRowSizeInBytes = 4 * ifloor( num / denom );
-	//fprintf( stderr, "requiredRowSizeInBytes using floor = %d\n", requiredRowSizeInBytes );
-
-	//num = InfoHeader.biBitCount*InfoHeader.biWidth;
-	//requiredRowSizeInBytes = 4 * iceil( num / denom );
-	//fprintf( stderr, "requiredRowSizeInBytes using ceil = %d\n", requiredRowSizeInBytes );
-
-	//if( VERBOSE )	fprintf( stderr, "requiredRowSizeInBytes = %d\n", requiredRowSizeInBytes );
-
-
-	int rowSizeInBytes = numcomps * nums;
-	int numExtra = 4 - ( rowSizeInBytes % 4 );
-	if( numExtra == 4 )
-		numExtra = 0;
-	if( VERBOSE )	fprintf( stderr, "NumExtra padding = %d\n", numExtra );
-	//fprintf( stderr, "rowSizeInBytes = %d\n", rowSizeInBytes );
-	//fprintf(stderr, "NumExtra padding = %d\n", numExtra);
-
+	// 8 and 24-bit do not want to see the compression bits set.
+	// 32-bit can have bitfields, as long as they're the usual bgra order -- the masks are right after
+	// the 40-byte header part, and only a v4/v5 header has the alpha one.
+	// without bitfields, the 4th byte is alpha unless it is 0 everywhere (see below):
 
-	// we can handle 24 bits of direct color:
-	if( InfoHeader.biBitCount == 24 )
+	bool opaque = true;
+	if( bitCount == 32  &&  InfoHeader.biCompression == BI_BITFIELDS )
 	{
-		// 24-bit does not want to see the compression bits set:
-
-		if (InfoHeader.biCompression != 0)
+		unsigned int red = ReadInt( fp );
+		unsigned int green = ReadInt( fp );
+		unsigned int blue = ReadInt( fp );
+		unsigned int alpha = InfoHeader.biSize >= 56 ? ReadInt( fp ) : 0;
+		if( red != 0x00ff0000  ||  green != 0x0000ff00  ||  blue != 0x000000ff  ||  ( alpha != 0  &&  alpha != 0xff000000 ) )
 		{
-			fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-			fclose(fp);
+			fprintf( stderr, "Can't handle 32-bit color masks 0x%08x 0x%08x 0x%08x 0x%08x\n", red, green, blue, alpha );
+			fclose( fp );
 			return NULL;
 		}
+		opaque = alpha == 0;
+	}
+	else if( InfoHeader.biCompression != BI_RGB )
+	{
+		fprintf( stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression );
+		fclose( fp );
+		return NULL;
+	}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
 
-		if( numcomps == 3  ||  numcomps == 4 )
-		{
-			unsigned char *tp = &texture[0];	// at the start
-			for (int t = 0; t < numt; t++)
-			{
-				for( int s = 0; s < nums4; s++ )
-				{
-					if( numcomps == 4 )
-						(void)fgetc( fp );					// a
-					unsigned char b = fgetc( fp );			// b
-					unsigned char g = fgetc( fp );			// g
-					unsigned char r = fgetc( fp );			// r
-					*tp++ = r;
-					*tp++ = g;
-					*tp++ = b;
-				}
-				for (int s = nums4; s < nums; s++)
-				{
-					if (numcomps == 4)
-						(void)fgetc(fp);					// a
-					unsigned char b = fgetc(fp);			// b
-					unsigned char g = fgetc(fp);			// g
-					unsigned char r = fgetc(fp);			// r
-				}
-				for( int e = 0; e < numExtra; e++ )
-				{
-					unsigned char uc = fgetc( fp );
-					//if( uc != 0 )
-						//fprintf( stderr, "%4d: %3d ", t, uc );
-				}
-			}
-		}
-	}
+	// 8 bits of indirect color: the color table follows the info header:
 
-	// we can also handle 8 bits of indirect color:
-	if (InfoHeader.biBitCount == 8 && InfoHeader.biClrUsed == 256)
+	unsigned char palette[4*256];
+	memset( palette, 0, sizeof(palette) );
+	if( bitCount == 8 )
 	{
-		// 8-bit does not want to see the compression bits set:
-
-		if (InfoHeader.biCompression != 0)
+		int numColors = InfoHeader.biClrUsed > 0  &&  InfoHeader.biClrUsed < 256 ? InfoHeader.biClrUsed : 256;
+		fseek( fp, 14 + InfoHeader.biSize, SEEK_SET );
+		if( fread( palette, 4, numColors, fp ) != (size_t)numColors )
 		{
-			fprintf(stderr, "Wrong type of image compression: %d\n", InfoHeader.biCompression);
-			fclose(fp);
+			fprintf( stderr, "Bmp file '%s' has a short color table\n", filename );
+			fclose( fp );
 			return NULL;
 		}
-		struct rgba32
-		{
-			unsigned char r, g, b, a;
-		};
-		struct rgba32* colorTable = new struct rgba32[InfoHeader.biClrUsed];
+	}
 
-		rewind(fp);
-		fseek(fp, sizeof(struct bmfh) + InfoHeader.biSize - 2, SEEK_SET);
-		for (int c = 0; c < InfoHeader.biClrUsed; c++)
-		{
-			colorTable[c].b = fgetc(fp);
-			colorTable[c].g = fgetc(fp);
-			colorTable[c].r = fgetc(fp);
-			colorTable[c].a = fgetc(fp);
-			if (VERBOSE)	fprintf(stderr, "%4d:\t0x%02x\t0x%02x\t0x%02x\t0x%02x\n",
-				c, colorTable[c].r, colorTable[c].g, colorTable[c].b, colorTable[c].a);
-		}
 
-		rewind(fp);
-		fseek(fp, FileHeader.bfOffBytes, SEEK_SET);
+	// each row is padded to a multiple of 4 bytes:
 
-		if( numcomps == 1 )
-		{
-			unsigned char *tp = &texture[0];	// at the start
-			for (int t = 0; t < numt; t++)
-			{
-				for (int s = 0; s < nums4; s++)
-				{
-					int index = fgetc(fp);
-					unsigned char r = colorTable[index].r;	// r
-					unsigned char g = colorTable[index].g;	// g
-					unsigned char b = colorTable[index].b;	// b
-					*tp++ = r;
-					*tp++ = g;
-					*tp++ = b;
-				}
-				for (int s = nums4; s < nums; s++)
-				{
-					int index = fgetc(fp);
-				}
-				for (int e = 0; e < numExtra; e++)
-				{
-					unsigned char uc = fgetc(fp);
-				}
-			}
-		}
-		delete[] colorTable;
-	}
+	size_t rowSizeInBytes = 4 * ( ( (size_t)bitCount * nums + 31 ) / 32 );
+	size_t numPixelBytes = rowSizeInBytes * numt;
+	if( VERBOSE )	fprintf( stderr, "rowSizeInBytes = %d\n", (int)rowSizeInBytes );
 
-	// we can handle 32 bits of direct color:
-	if (InfoHeader.biBitCount == 32)
+	unsigned char *pixels = new unsigned char[ numPixelBytes ];
+	fseek( fp, FileHeader.bfOffBytes, SEEK_SET );
+	size_t numRead = fread( pixels, 1, numPixelBytes, fp );
+	fclose( fp );
+	if( numRead != numPixelBytes )
 	{
-		// 32-bit doesn't mind if the compression bits are set -- we just ignore them:
-		rewind( fp );
-		fseek( fp, FileHeader.bfOffBytes, SEEK_SET );
+		fprintf( stderr, "Bmp file '%s' is short: %d of %d bytes of pixels\n", filename, (int)numRead, (int)numPixelBytes );
+		delete [ ] pixels;
+		return NULL;
+	}
 
-		if( numcomps == 4 )
+	if( bitCount == 32  &&  InfoHeader.biCompression == BI_RGB  &&  outComps == 4 )
+	{
+		unsigned char alphas = 0;
+		for( int t = 0; t < numt; t++ )
 		{
-			unsigned char *tp = &texture[0];	// at the start
-			for (int t = 0; t < numt; t++)
-			{
-				for (int s = 0; s < nums4; s++)
-				{
-					unsigned char b = fgetc(fp);			// b
-					unsigned char g = fgetc(fp);			// g
-					unsigned char r = fgetc(fp);			// r
-					unsigned char a = fgetc(fp);				// a
-					*tp++ = r;
-					*tp++ = g;
-					*tp++ = b;
-				}
-				for (int s = nums4; s < nums; s++)
-				{
-					unsigned char b = fgetc(fp);			// b
-					unsigned char g = fgetc(fp);			// g
-					unsigned char r = fgetc(fp);			// r
-					unsigned char a = fgetc(fp);			// a
-				}
-				for (int e = 0; e < numExtra; e++)
-				{
-					unsigned char a = fgetc(fp);
-				}
-			}
+			const unsigned char *p = &pixels[ t * rowSizeInBytes ];
+			for( int s = 0; s < nums; s++ )
+				alphas |= p[ 4*s + 3 ];
 		}
+		opaque = alphas == 0;
 	}
 
-	*width  = nums4;
+	unsigned char *texture = new unsigned char[ (size_t)outComps * nums * numt ];
+	for( int t = 0; t < numt; t++ )
+	{
+		const unsigned char *src = &pixels[ ( topDown ? numt - 1 - t : t ) * rowSizeInBytes ];
+		unsigned char *dst = &texture[ (size_t)t * nums * outComps ];
+		ConvertRow( src, dst, nums, bitCount, outComps, opaque, palette );
+	}
+	delete [ ] pixels;
+
+	*width  = nums;
 	*height = numt;
+	return texture;
+}
 
-	fclose( fp );
 
-	return texture;
+// rgb, 3 bytes per pixel, bottom row first (what glTexImage2D( ..., GL_RGB, ... ) wants):
+
+unsigned char *
+BmpToTexture( char *filename, int *width, int *height )
+{
+	return DecodeBmp( filename, width, height, 3 );
+}
+
+
+// rgba, 4 bytes per pixel, bottom row first. the alpha comes from a 32-bit bmp with an alpha mask,
+// and is 255 otherwise:
+
+unsigned char *
+BmpToTextureAlpha( char *filename, int *width, int *height )
+{
+	return DecodeBmp( filename, width, height, 4 );
 }
 
 
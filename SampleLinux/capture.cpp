@@ -0,0 +1,288 @@
+#include "capture.h"
+
+#include <string.h>
+#include <filesystem>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include "glew.h"
+#include <GL/gl.h>
+#endif
+
+#include "image.h"
+
+
+FrameCapture::FrameCapture( )
+{
+	format = CAPTURE_PNG;
+	running = false;
+	for( int i = 0; i < CAPTURE_PBOS; i++ )
+	{
+		pbos[i] = 0;
+		pboWidth[i] = pboHeight[i] = 0;
+		pboFrame[i] = -1;
+	}
+	next = 0;
+	numFrames = 0;
+	dropped = 0;
+	quit = false;
+	yuvFile = NULL;
+	yuvWidth = yuvHeight = 0;
+	written = 0;
+}
+
+
+// Stop( ) needs the GL context, so by the time this runs it should already have been called:
+
+FrameCapture::~FrameCapture( )
+{
+	if( encoder.joinable( ) )
+	{
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			quit = true;
+		}
+		wake.notify_one( );
+		encoder.join( );
+	}
+	if( yuvFile != NULL )
+		fclose( yuvFile );
+}
+
+
+bool
+FrameCapture::Start( const char *captureDir, int captureFormat )
+{
+	std::error_code ec;
+	std::filesystem::create_directories( captureDir, ec );
+	if( ! std::filesystem::is_directory( captureDir, ec ) )
+	{
+		fprintf( stderr, "Cannot create capture directory '%s'\n", captureDir );
+		return false;
+	}
+	dir = captureDir;
+	format = captureFormat;
+	next = 0;
+	numFrames = 0;
+	dropped = 0;
+	written = 0;
+	yuvWidth = yuvHeight = 0;
+	quit = false;
+	running = true;
+	encoder = std::thread( &FrameCapture::Run, this );
+	fprintf( stderr, "Capturing frames to '%s' as %s\n", captureDir, format == CAPTURE_YUV ? "yuv420p" : "png" );
+	return true;
+}
+
+
+// call after drawing a frame, before swapping, with the current context:
+
+void
+FrameCapture::Grab( int width, int height )
+{
+	if( ! running  ||  width <= 0  ||  height <= 0 )
+		return;
+
+	// this slot's last frame was read back CAPTURE_PBOS-1 frames ago, so mapping it won't wait:
+
+	int slot = next;
+	if( pboFrame[slot] >= 0 )
+		Collect( slot );
+
+	if( pbos[slot] == 0 )
+		glGenBuffers( 1, &pbos[slot] );
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, pbos[slot] );
+	if( pboWidth[slot] != width  ||  pboHeight[slot] != height )
+	{
+		glBufferData( GL_PIXEL_PACK_BUFFER, 4 * (GLsizeiptr)width * height, NULL, GL_STREAM_READ );
+		pboWidth[slot] = width;
+		pboHeight[slot] = height;
+	}
+	glPixelStorei( GL_PACK_ALIGNMENT, 4 );
+	glReadPixels( 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void *)0 );
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+	pboFrame[slot] = numFrames++;
+	next = ( next + 1 ) % CAPTURE_PBOS;
+}
+
+
+// map a slot's pixels and hand a copy to the encoder:
+
+void
+FrameCapture::Collect( int slot )
+{
+	Frame frame;
+	frame.width = pboWidth[slot];
+	frame.height = pboHeight[slot];
+	frame.number = pboFrame[slot];
+	pboFrame[slot] = -1;
+	size_t size = 4 * (size_t)frame.width * frame.height;
+
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		if( ! spare.empty( ) )
+		{
+			frame.rgba.swap( spare.back( ) );
+			spare.pop_back( );
+		}
+	}
+	frame.rgba.resize( size );
+
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, pbos[slot] );
+	void *pixels = glMapBufferRange( GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT );
+	if( pixels != NULL )
+	{
+		memcpy( frame.rgba.data( ), pixels, size );
+		glUnmapBuffer( GL_PIXEL_PACK_BUFFER );
+	}
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+	if( pixels == NULL )
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		if( (int)queue.size( ) >= CAPTURE_MAX_QUEUED )
+		{
+			spare.push_back( std::vector<unsigned char>( ) );
+			spare.back( ).swap( queue.front( ).rgba );
+			queue.pop_front( );
+			dropped++;
+		}
+		queue.push_back( std::move( frame ) );
+	}
+	wake.notify_one( );
+}
+
+
+// read back the frames still in the ring, write everything that's queued, and finish.
+// needs the same current context as Grab( ):
+
+void
+FrameCapture::Stop( )
+{
+	if( ! running )
+		return;
+	for( int i = 0; i < CAPTURE_PBOS; i++ )
+	{
+		int slot = ( next + i ) % CAPTURE_PBOS;
+		if( pboFrame[slot] >= 0 )
+			Collect( slot );
+		if( pbos[slot] != 0 )
+			glDeleteBuffers( 1, &pbos[slot] );
+		pbos[slot] = 0;
+		pboWidth[slot] = pboHeight[slot] = 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_one( );
+	encoder.join( );
+	running = false;
+
+	if( yuvFile != NULL )
+		fclose( yuvFile );
+	yuvFile = NULL;
+	fprintf( stderr, "Captured %ld frames to '%s', %ld dropped\n", written, dir.c_str( ), dropped );
+}
+
+
+void
+FrameCapture::Run( )
+{
+	Frame frame;
+	for( ; ; )
+	{
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [this]( ) { return ! queue.empty( ) || quit; } );
+			if( queue.empty( ) )
+				return;		// quitting, with everything written
+			frame = std::move( queue.front( ) );
+			queue.pop_front( );
+		}
+
+		Encode( frame );
+
+		std::lock_guard<std::mutex> guard( lock );
+		spare.push_back( std::move( frame.rgba ) );
+	}
+}
+
+
+// BT.601 limited range, the chroma averaged over each 2x2 block:
+
+static inline unsigned char
+Luma( const unsigned char *p )
+{
+	return (unsigned char)( ( ( 66*p[0] + 129*p[1] + 25*p[2] + 128 ) >> 8 ) + 16 );
+}
+
+
+void
+FrameCapture::Encode( Frame &frame )
+{
+	FlipRows( frame.rgba.data( ), frame.width, frame.height );
+
+	if( format == CAPTURE_PNG )
+	{
+		char path[1024];
+		snprintf( path, sizeof(path), "%s/frame-%06ld.png", dir.c_str( ), frame.number );
+		if( WritePng( path, frame.width, frame.height, frame.rgba.data( ) ) )
+			written++;
+		return;
+	}
+
+	// one yuv file holds one frame size -- the first one captured:
+
+	if( yuvFile == NULL  &&  yuvWidth == 0 )
+	{
+		char path[1024];
+		snprintf( path, sizeof(path), "%s/capture-%dx%d.yuv", dir.c_str( ), frame.width, frame.height );
+		yuvFile = fopen( path, "wb" );
+		if( yuvFile == NULL )
+			fprintf( stderr, "Cannot create capture file '%s'\n", path );
+		yuvWidth = frame.width;
+		yuvHeight = frame.height;
+	}
+	if( yuvFile == NULL  ||  frame.width != yuvWidth  ||  frame.height != yuvHeight )
+		return;
+
+	int w = frame.width, h = frame.height;
+	int cw = ( w + 1 ) / 2, ch = ( h + 1 ) / 2;
+	yuv.resize( (size_t)w * h + 2 * (size_t)cw * ch );
+	unsigned char *yp = &yuv[0];
+	unsigned char *up = &yuv[ (size_t)w * h ];
+	unsigned char *vp = up + (size_t)cw * ch;
+	const unsigned char *rgba = frame.rgba.data( );
+
+	for( int y = 0; y < h; y++ )
+		for( int x = 0; x < w; x++ )
+			*yp++ = Luma( &rgba[ 4 * ( (size_t)y * w + x ) ] );
+
+	for( int cy = 0; cy < ch; cy++ )
+		for( int cx = 0; cx < cw; cx++ )
+		{
+			int r = 0, g = 0, b = 0, n = 0;
+			for( int dy = 0; dy < 2  &&  2*cy + dy < h; dy++ )
+				for( int dx = 0; dx < 2  &&  2*cx + dx < w; dx++ )
+				{
+					const unsigned char *p = &rgba[ 4 * ( (size_t)( 2*cy + dy ) * w + 2*cx + dx ) ];
+					r += p[0];	g += p[1];	b += p[2];
+					n++;
+				}
+			r /= n;		g /= n;		b /= n;
+			*up++ = (unsigned char)( ( ( -38*r -  74*g + 112*b + 128 ) >> 8 ) + 128 );
+			*vp++ = (unsigned char)( ( ( 112*r -  94*g -  18*b + 128 ) >> 8 ) + 128 );
+		}
+
+	if( fwrite( yuv.data( ), 1, yuv.size( ), yuvFile ) == yuv.size( ) )
+		written++;
+}
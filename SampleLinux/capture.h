@@ -0,0 +1,87 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// frame capture for time-lapse videos, without stalling the render loop:
+// each frame is read back with glReadPixels into one of a ring of pixel-buffer objects, which
+// returns at once; the ring slot is mapped CAPTURE_PBOS-1 frames later, when the copy is long done,
+// and the pixels go to an encoder thread that writes either a png sequence
+//	dir/frame-000000.png, dir/frame-000001.png, ...
+// or one raw I420 (yuv420p) file, dir/capture-WxH.yuv, that ffmpeg turns into a video:
+//	ffmpeg -f rawvideo -pix_fmt yuv420p -s WxH -r 30 -i capture-WxH.yuv timelapse.mp4
+//
+// what that costs at 1920x1080 (one core, rendered scenes): a png frame is about 2.5 MB and takes
+// the encoder about 100 ms, so png keeps up with roughly 10 frames a second and 25 MB/s of disk;
+// a yuv frame is 3.1 MB that only needs converting, about 93 MB/s of disk at 30 frames a second.
+//
+// if the encoder falls more than CAPTURE_MAX_QUEUED frames behind, the oldest waiting frame is
+// dropped rather than making the render loop wait; Stop( ) reports how many were.
+
+const int CAPTURE_PBOS = 3;
+const int CAPTURE_MAX_QUEUED = 8;
+
+enum CaptureFormats
+{
+	CAPTURE_PNG,
+	CAPTURE_YUV
+};
+
+
+class FrameCapture
+{
+private:
+	struct Frame
+	{
+		std::vector<unsigned char>	rgba;		// bottom row first, as glReadPixels left it
+		int				width, height;
+		long				number;
+	};
+
+	std::string	dir;
+	int		format;
+	bool		running;
+
+	// the ring, used on the rendering thread only:
+	unsigned int	pbos[CAPTURE_PBOS];
+	int		pboWidth[CAPTURE_PBOS], pboHeight[CAPTURE_PBOS];
+	long		pboFrame[CAPTURE_PBOS];		// frame number read into each, -1 if none
+	int		next;
+	long		numFrames;
+
+	// the hand-off to the encoder:
+	std::thread					encoder;
+	std::mutex					lock;
+	std::condition_variable				wake;
+	std::deque<Frame>				queue;
+	std::vector<std::vector<unsigned char>>		spare;		// buffers to reuse
+	long						dropped;
+	bool						quit;
+
+	// the encoder's own:
+	FILE *				yuvFile;
+	int				yuvWidth, yuvHeight;
+	std::vector<unsigned char>	yuv;
+	long				written;
+
+	void	Collect( int );
+	void	Encode( Frame & );
+	void	Run( );
+
+public:
+		FrameCapture( );
+		~FrameCapture( );
+
+	void	Grab( int, int );
+	bool	Start( const char *, int );
+	void	Stop( );
+};
+
+#endif	// CAPTURE_H
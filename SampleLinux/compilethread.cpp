@@ -0,0 +1,234 @@
+#include "compilethread.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include "glew.h"
+#include <GL/gl.h>
+#endif
+
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <GL/glx.h>
+#endif
+
+
+CompileThread	ShaderCompiler;
+
+
+CompileThread::CompileThread( )
+{
+	quit = false;
+	state = -1;
+	egl = false;
+	display = surface = context = NULL;
+}
+
+
+// the thread's context is left for the process's exit to clean up: by the time this runs
+// the window's display may already be closed:
+
+CompileThread::~CompileThread( )
+{
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_all( );
+	if( worker.joinable( ) )
+		worker.join( );
+}
+
+
+void
+CompileThread::InitThreads( )
+{
+#ifdef __linux__
+	XInitThreads( );
+#endif
+}
+
+
+bool
+CompileThread::Start( )
+{
+	if( state >= 0 )
+		return state == 1;
+	state = 0;
+#ifdef __linux__
+	// a context sharing objects with the current one, and a 1x1 surface to make it current on:
+	EGLContext eglShare = eglGetCurrentContext( );
+	if( eglShare != EGL_NO_CONTEXT )
+	{
+		EGLDisplay dpy = eglGetCurrentDisplay( );
+		EGLint id = 0, numConfigs = 0;
+		EGLConfig config;
+		eglQueryContext( dpy, eglShare, EGL_CONFIG_ID, &id );
+		const EGLint configAttribs[ ] = { EGL_CONFIG_ID, id, EGL_NONE };
+		if( ! eglChooseConfig( dpy, configAttribs, &config, 1, &numConfigs )  ||  numConfigs < 1 )
+			return false;
+		const EGLint surfaceAttribs[ ] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		EGLSurface eglSurface = eglCreatePbufferSurface( dpy, config, surfaceAttribs );
+		EGLContext eglContext = eglCreateContext( dpy, config, eglShare, NULL );
+		if( eglSurface == EGL_NO_SURFACE  ||  eglContext == EGL_NO_CONTEXT )
+		{
+			fprintf( stderr, "Cannot create a shader compiling context: EGL error 0x%x\n", eglGetError( ) );
+			if( eglSurface != EGL_NO_SURFACE )
+				eglDestroySurface( dpy, eglSurface );
+			return false;
+		}
+		egl = true;
+		display = dpy;
+		surface = eglSurface;
+		context = eglContext;
+	}
+	else
+	{
+		GLXContext glxShare = glXGetCurrentContext( );
+		Display *dpy = glXGetCurrentDisplay( );
+		if( glxShare == NULL  ||  dpy == NULL )
+			return false;
+		int screen = 0, numConfigs = 0;
+		glXQueryContext( dpy, glxShare, GLX_SCREEN, &screen );
+		const int configAttribs[ ] = { GLX_DRAWABLE_TYPE, GLX_PBUFFER_BIT, GLX_RENDER_TYPE, GLX_RGBA_BIT, None };
+		GLXFBConfig *configs = glXChooseFBConfig( dpy, screen, configAttribs, &numConfigs );
+		if( configs == NULL  ||  numConfigs < 1 )
+			return false;
+		const int pbufferAttribs[ ] = { GLX_PBUFFER_WIDTH, 1, GLX_PBUFFER_HEIGHT, 1, None };
+		GLXContext glxContext = glXCreateNewContext( dpy, configs[0], GLX_RGBA_TYPE, glxShare, True );
+		GLXPbuffer pbuffer = glxContext != NULL ? glXCreatePbuffer( dpy, configs[0], pbufferAttribs ) : 0;
+		XFree( configs );
+		if( pbuffer == 0 )
+		{
+			fprintf( stderr, "Cannot create a shader compiling context\n" );
+			if( glxContext != NULL )
+				glXDestroyContext( dpy, glxContext );
+			return false;
+		}
+		egl = false;
+		display = dpy;
+		surface = (void *)(uintptr_t)pbuffer;
+		context = glxContext;
+	}
+
+	// the thread says whether it could make the context current before this goes on:
+	state = -1;
+	worker = std::thread( &CompileThread::Run, this );
+	std::unique_lock<std::mutex> guard( lock );
+	wake.wait( guard, [this] { return state >= 0; } );
+	if( state == 1 )
+		return true;
+	guard.unlock( );
+	worker.join( );
+	fprintf( stderr, "Cannot make the shader compiling context current\n" );
+	return false;
+#else
+	return false;
+#endif
+}
+
+
+void
+CompileThread::Submit( std::shared_ptr<CompileJob> job )
+{
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		jobs.push_back( job );
+	}
+	wake.notify_all( );
+}
+
+
+void
+CompileThread::Run( )
+{
+#ifdef __linux__
+	bool current;
+	if( egl )
+	{
+		eglBindAPI( EGL_OPENGL_API );
+		current = eglMakeCurrent( (EGLDisplay)display, (EGLSurface)surface, (EGLSurface)surface, (EGLContext)context );
+	}
+	else
+	{
+		GLXPbuffer pbuffer = (GLXPbuffer)(uintptr_t)surface;
+		current = glXMakeContextCurrent( (Display *)display, pbuffer, pbuffer, (GLXContext)context );
+	}
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		state = current ? 1 : 0;
+	}
+	wake.notify_all( );
+	if( ! current )
+		return;
+
+	for( ; ; )
+	{
+		std::shared_ptr<CompileJob> job;
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [this] { return quit  ||  ! jobs.empty( ); } );
+			if( quit )
+				return;
+			job = jobs.front( );
+			jobs.pop_front( );
+		}
+		Compile( *job );
+		job->done.store( true, std::memory_order_release );
+	}
+#endif
+}
+
+
+// on the thread. the glFinish( ) is what makes the program complete for the other context:
+
+void
+CompileThread::Compile( CompileJob &job )
+{
+	job.ok = true;
+	std::vector<GLuint> shaders;
+	for( int i = 0; i < (int)job.sources.size( ); i++ )
+	{
+		GLuint shader = glCreateShader( job.types[i] );
+		const GLchar *source = job.sources[i].c_str( );
+		glShaderSource( shader, 1, &source, NULL );
+		glCompileShader( shader );
+		shaders.push_back( shader );
+
+		GLint status;
+		glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
+		if( status == GL_FALSE )
+		{
+			GLchar infoLog[1024];
+			glGetShaderInfoLog( shader, sizeof(infoLog), NULL, infoLog );
+			job.log += "Shader '" + job.names[i] + "' did not compile, keeping the old program:\n" + infoLog + "\n";
+			job.ok = false;
+		}
+		else
+			glAttachShader( job.program, shader );
+	}
+
+	if( job.ok )
+	{
+		glLinkProgram( job.program );
+		GLint linked;
+		glGetProgramiv( job.program, GL_LINK_STATUS, &linked );
+		if( linked == GL_FALSE )
+		{
+			GLchar infoLog[1024];
+			glGetProgramInfoLog( job.program, sizeof(infoLog), NULL, infoLog );
+			job.log += std::string( "Shader Program did not link, keeping the old program:\n" ) + infoLog + "\n";
+			job.ok = false;
+		}
+	}
+	for( int i = 0; i < (int)shaders.size( ); i++ )
+		glDeleteShader( shaders[i] );
+	glFinish( );
+}
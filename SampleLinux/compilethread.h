@@ -0,0 +1,75 @@
+#ifndef COMPILETHREAD_H
+#define COMPILETHREAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// a thread with a GL context of its own, sharing objects with the one that started it, that
+// compiles and links programs the render loop asked for -- where the GL can't do that on its own
+// threads (no KHR_parallel_shader_compile), so a glGetShaderiv( ) on the render thread would
+// wait for the compiler:
+//
+//	Start( )	on the render thread, with its context current. false if no shared context
+//			can be made (only EGL and GLX contexts, on Linux, can be shared here)
+//	Submit( job )	the job's shaders are compiled, attached to its program and linked, and
+//			their logs kept; done is set once the program is usable from any context
+//
+// with GLX the thread talks to the same X display as the window, so InitThreads( ) has to come
+// before glutInit( ).
+//
+// the program object is the caller's, made with glCreateProgram( ) before Submit( ), so anything
+// that has to be set on it before linking can be. a job that fails leaves the program unlinked
+// for the caller to delete.
+
+struct CompileJob
+{
+	unsigned int			program;
+	std::vector<unsigned int>	types;		// GL_VERTEX_SHADER, ...
+	std::vector<std::string>	sources;	// whole, defines and all
+	std::vector<std::string>	names;		// for the log
+
+	bool				ok;		// filled in by the thread, before done
+	std::string			log;		// what to tell the user if it didn't compile or link
+	std::atomic<bool>		done;
+
+	CompileJob( ) : program( 0 ), ok( false ), done( false ) { }
+};
+
+
+class CompileThread
+{
+private:
+	std::deque<std::shared_ptr<CompileJob>>	jobs;
+	std::mutex			lock;			// guards jobs, quit and state
+	std::condition_variable		wake;
+	std::thread			worker;
+	bool				quit;
+	int				state;			// -1 not tried, 0 can't, 1 running
+	bool				egl;			// else GLX
+	void *				display;		// EGLDisplay or Display *
+	void *				surface;		// 1x1 EGLSurface or GLXPbuffer
+	void *				context;		// EGLContext or GLXContext
+
+	void	Compile( CompileJob & );
+	void	Run( );
+
+public:
+		CompileThread( );
+		~CompileThread( );
+
+	bool	Start( );
+	void	Submit( std::shared_ptr<CompileJob> );
+
+	static void	InitThreads( );
+};
+
+extern CompileThread	ShaderCompiler;
+
+#endif	// COMPILETHREAD_H
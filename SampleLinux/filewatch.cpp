@@ -0,0 +1,188 @@
+#include "filewatch.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+
+FileWatcher	ShaderFiles;
+
+
+FileWatcher::FileWatcher( )
+{
+	fd = -1;
+	wakeup[0] = wakeup[1] = -1;
+}
+
+
+FileWatcher::~FileWatcher( )
+{
+	Stop( );
+}
+
+
+// the whole file, or false if it can't be read right now (an editor may be between
+// deleting the old one and renaming the new one in):
+
+static bool
+ReadFile( const std::string &path, std::string &source )
+{
+	FILE *fp = fopen( path.c_str( ), "rb" );
+	if( fp == NULL )
+		return false;
+	source.clear( );
+	char buf[4096];
+	size_t n;
+	while( ( n = fread( buf, 1, sizeof(buf), fp ) ) > 0 )
+		source.append( buf, n );
+	fclose( fp );
+	return true;
+}
+
+
+bool
+FileWatcher::Watch( const std::string &path )
+{
+#ifdef __linux__
+	std::lock_guard<std::mutex> guard( lock );
+	for( int i = 0; i < (int)files.size( ); i++ )
+		if( files[i].path == path )
+			return true;
+
+	if( fd < 0 )
+	{
+		fd = inotify_init1( IN_CLOEXEC );
+		if( fd < 0  ||  pipe( wakeup ) != 0 )
+		{
+			fprintf( stderr, "Cannot watch files for changes\n" );
+			if( fd >= 0 )
+				close( fd );
+			fd = -1;
+			return false;
+		}
+		watcher = std::thread( &FileWatcher::Run, this );
+	}
+
+	// the directory is watched, not the file, so a save that replaces the file is seen too:
+	File file;
+	size_t slash = path.rfind( '/' );
+	std::string dir = slash == std::string::npos ? "." : path.substr( 0, slash + 1 );
+	file.name = slash == std::string::npos ? path : path.substr( slash + 1 );
+	file.wd = inotify_add_watch( fd, dir.c_str( ), IN_CLOSE_WRITE | IN_MOVED_TO );
+	if( file.wd < 0 )
+	{
+		fprintf( stderr, "Cannot watch '%s' for changes\n", path.c_str( ) );
+		return false;
+	}
+	file.path = path;
+	file.saves = 0;
+	files.push_back( file );
+	return true;
+#else
+	(void)path;
+	return false;
+#endif
+}
+
+
+bool
+FileWatcher::Changed( const std::string &path, long &seen, std::string &source )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	for( int i = 0; i < (int)files.size( ); i++ )
+	{
+		if( files[i].path == path  &&  files[i].saves != seen )
+		{
+			source = files[i].source;
+			seen = files[i].saves;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void
+FileWatcher::Stop( )
+{
+#ifdef __linux__
+	if( watcher.joinable( ) )
+	{
+		if( write( wakeup[1], "q", 1 ) != 1 )
+			fprintf( stderr, "Cannot stop the file watcher\n" );
+		watcher.join( );
+	}
+	if( fd >= 0 )
+	{
+		close( fd );
+		close( wakeup[0] );
+		close( wakeup[1] );
+	}
+	fd = -1;
+	wakeup[0] = wakeup[1] = -1;
+	files.clear( );
+#endif
+}
+
+
+// on the watcher thread: name, in the directory with watch descriptor wd, was just written:
+
+void
+FileWatcher::Saved( int wd, const char *name )
+{
+	std::string path;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		for( int i = 0; i < (int)files.size( ); i++ )
+			if( files[i].wd == wd  &&  files[i].name == name )
+				path = files[i].path;
+	}
+	std::string source;
+	if( path.empty( )  ||  ! ReadFile( path, source ) )
+		return;
+
+	std::lock_guard<std::mutex> guard( lock );
+	for( int i = 0; i < (int)files.size( ); i++ )
+	{
+		if( files[i].path == path )
+		{
+			files[i].source = source;
+			files[i].saves++;
+		}
+	}
+}
+
+
+void
+FileWatcher::Run( )
+{
+#ifdef __linux__
+	for( ; ; )
+	{
+		struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wakeup[0], POLLIN, 0 } };
+		if( poll( fds, 2, -1 ) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			return;
+		}
+		if( fds[1].revents != 0 )
+			return;
+
+		alignas(struct inotify_event) char buf[4096];
+		ssize_t n = read( fd, buf, sizeof(buf) );
+		if( n <= 0 )
+			continue;
+		for( char *p = buf; p < buf + n; )
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+			if( event->len > 0 )
+				Saved( event->wd, event->name );
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#endif
+}
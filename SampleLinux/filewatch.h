@@ -0,0 +1,55 @@
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// files whose new contents are wanted as soon as they're saved -- shaders, for hot reload.
+// a thread blocks on inotify for the directories the files are in, and when one of them is
+// written (or renamed into place, the way most editors save) reads the whole file, so the
+// GL thread only ever picks up contents that are already in memory:
+//
+//	Watch( path )			from then on, saves of path are noticed
+//	Changed( path, seen, source )	true with the new contents if path was saved since the
+//					save numbered seen, which it updates -- so any number of
+//					programs built from one file each see every save
+//
+// only on Linux; elsewhere Watch( ) says no and nothing ever changes.
+
+class FileWatcher
+{
+private:
+	struct File
+	{
+		std::string	path;
+		int		wd;			// what inotify reports it as: its directory's
+		std::string	name;			// watch descriptor, and the name in there
+		std::string	source;
+		long		saves;
+	};
+
+	std::vector<File>	files;
+	std::mutex		lock;			// guards files
+	std::thread		watcher;
+	int			fd;			// inotify instance, -1 if none
+	int			wakeup[2];		// a pipe that tells the thread to quit
+
+	void	Run( );
+	void	Saved( int, const char * );
+
+public:
+		FileWatcher( );
+		~FileWatcher( );
+
+	bool	Changed( const std::string &, long &seen, std::string & );
+	void	Stop( );
+	bool	Watch( const std::string & );
+};
+
+extern FileWatcher	ShaderFiles;
+
+#endif	// FILEWATCH_H
@@ -1,4 +1,13 @@
 #include "glslprogram.h"
+#include "programcache.h"
+#include "filewatch.h"
+#include "glstate.h"
+#include "compilethread.h"
+
+// KHR_parallel_shader_compile is newer than glew.h:
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR	0x91B1
+#endif
 
 
 struct GLshadertype
@@ -52,6 +61,9 @@ GetExtension( char *file )
 
 GLSLProgram::GLSLProgram( )
 {
+	Verbose = false;
+	Pending = 0;
+	Watching = false;
 	Init( );
 }
 
@@ -68,13 +80,106 @@ GLSLProgram::Create( char *file0, char *file1, char *file2, char *file3, char *
 }
 
 
+// the whole file, or false if it can't be read:
+
+static bool
+ReadSource( const char *file, std::string &source )
+{
+	FILE *in = fopen( file, "rb" );
+	if( in == NULL )
+		return false;
+	source.clear( );
+	char buf[4096];
+	size_t n;
+	while( ( n = fread( buf, 1, sizeof(buf), in ) ) > 0 )
+		source.append( buf, n );
+	fclose( in );
+	return true;
+}
+
+
+// the strings glShaderSource( ) gets for source: the defines go right after the #version line,
+// which has to come first:
+
+static int
+SourceStrings( const char *source, const std::string &defines, const GLchar **strings, GLint *lengths )
+{
+	strings[0] = source;
+	lengths[0] = -1;
+	if( defines.empty( ) )
+		return 1;
+
+	const char *rest = source;
+	const char *version = strstr( source, "#version" );
+	if( version != NULL )
+	{
+		const char *eol = strchr( version, '\n' );
+		rest = eol != NULL ? eol + 1 : version + strlen( version );
+	}
+	lengths[0] = (GLint)( rest - source );
+	strings[1] = defines.c_str( );
+	lengths[1] = -1;
+	strings[2] = rest;
+	lengths[2] = -1;
+	return 3;
+}
+
+
+// the GL's shader type for a file, from its extension. 0 if it's not one this can build:
+
+static GLenum
+GlShaderType( char *file )
+{
+	char *extension = GetExtension( file );
+	if( extension == NULL )
+		return 0;
+	int maxShaderTypes = sizeof(ShaderTypes) / sizeof(struct GLshadertype);
+	for( int i = 0; i < maxShaderTypes; i++ )
+	{
+		if( strcmp( extension, ShaderTypes[i].extension ) == 0 )
+		{
+			switch( ShaderTypes[i].name )
+			{
+				case VERTEX_SHADER_TYPE:		return GL_VERTEX_SHADER;
+				case FRAGMENT_SHADER_TYPE:		return GL_FRAGMENT_SHADER;
+#ifdef GEOMETRY
+				case GEOMETRY_SHADER_TYPE:		return GL_GEOMETRY_SHADER;
+#endif
+#ifdef TESSELLATION
+				case TESS_CONTROL_SHADER_TYPE:		return GL_TESS_CONTROL_SHADER;
+				case TESS_EVALUATION_SHADER_TYPE:	return GL_TESS_EVALUATION_SHADER;
+#endif
+#ifdef COMPUTE
+				case COMPUTE_SHADER_TYPE:		return GL_COMPUTE_SHADER;
+#endif
+			}
+		}
+	}
+	return 0;
+}
+
+
+// the shader cache key for the files' names (their extensions say the stage), contents and the defines:
+
+unsigned long long
+GLSLProgram::Key( )
+{
+	unsigned long long key = ProgramCache::Hash( Defines.c_str( ), Defines.size( ) + 1 );
+	for( int i = 0; i < (int)Files.size( ); i++ )
+	{
+		key = ProgramCache::Hash( Files[i].c_str( ), Files[i].size( ) + 1, key );
+		key = ProgramCache::Hash( Sources[i].c_str( ), Sources[i].size( ) + 1, key );
+	}
+	return key;
+}
+
+
 // this is the varargs version of the Create method
 
 bool
 GLSLProgram::CreateHelper( char *file0, ... )
 {
 	GLsizei n = 0;
-	GLchar *buf;
 
 	Valid = true;
 	Vshader = Fshader = 0;
@@ -88,13 +193,42 @@ GLSLProgram::CreateHelper( char *file0, ... )
 	Cshader = 0;
 #endif
 
-	AttributeLocs.clear();
-	UniformLocs.clear();
+	Attributes.clear();
+	Uniforms.clear();
+
+	// kept for Reload( ). if the same files have been linked before -- by this driver -- the
+	// program comes from the shader cache, with no compiling:
+
+	va_list args;
+	va_start( args, file0 );
+	Files.clear( );
+	Sources.clear( );
+	std::vector<bool> read;
+	bool readable = true;
+	for( char *file = file0; file != NULL; file = va_arg( args, char * ) )
+	{
+		Files.push_back( file );
+		Sources.push_back( std::string( ) );
+		read.push_back( ReadSource( file, Sources.back( ) ) );
+		readable = read.back( )  &&  readable;
+	}
+	va_end( args );
+	unsigned long long key = readable ? Key( ) : 0;
+	if( key != 0 )
+	{
+		Program = Programs.Load( "glsl", key );
+		if( Program != 0 )
+		{
+			if( Verbose )
+				fprintf( stderr, "Shader Program loaded from the shader cache.\n" );
+			CacheVariables( );
+			return Valid;
+		}
+	}
 
 	Program = glCreateProgram( );
 	CheckGlErrors( "glCreateProgram" );
 
-	va_list args;
 	va_start( args, file0 );
 
 	// This is a little dicey
@@ -105,7 +239,7 @@ GLSLProgram::CreateHelper( char *file0, ... )
 
 	char *file = file0;
 	int type;
-	while( file != NULL )
+	for( int index = 0; file != NULL; index++ )
 	{
 		type = -1;
 		char *extension = GetExtension( file );
@@ -231,16 +365,14 @@ GLSLProgram::CreateHelper( char *file0, ... )
 		}
 
 
-		// read the shader source into a buffer:
+		// the source that was read above -- the one the cache key is made from, not the file
+		// again, which a save could have changed since:
 
 		if( ! SkipToNextVararg )
 		{
-			FILE * in;
-			int length;
 			FILE * logfile;
 
-			in = fopen( file, "rb" );
-			if( in == NULL )
+			if( ! read[index] )
 			{
 				fprintf( stderr, "Cannot open shader file '%s'\n", file );
 				Valid = false;
@@ -249,24 +381,13 @@ GLSLProgram::CreateHelper( char *file0, ... )
 
 			if( ! SkipToNextVararg )
 			{
-				fseek( in, 0, SEEK_END );
-				length = ftell( in );
-				fseek( in, 0, SEEK_SET );		// rewind
-
-				buf = new GLchar[length+1];
-				fread( buf, sizeof(GLchar), length, in );
-				buf[length] = '\0';
-				fclose( in ) ;
-
-				GLchar *strings[2];
-				int n = 0;
-				strings[n] = buf;
-				n++;
+				const GLchar *strings[3];
+				GLint lengths[3];
+				int n = SourceStrings( Sources[index].c_str( ), Defines, strings, lengths );
 
 				// Tell GL about the source:
 
-				glShaderSource( shader, n, (const GLchar **)strings, NULL );
-				delete [ ] buf;
+				glShaderSource( shader, n, strings, lengths );
 				CheckGlErrors( "Shader Source" );
 
 				// compile:
@@ -319,6 +440,7 @@ GLSLProgram::CreateHelper( char *file0, ... )
 
 	// link the entire shader program:
 
+	Programs.PrepareToLink( Program );
 	glLinkProgram( Program );
 	CheckGlErrors( "Link Shader 1");
 
@@ -341,6 +463,7 @@ GLSLProgram::CreateHelper( char *file0, ... )
 			delete [ ] infoLog;
 
 		}
+		GlState.ForgetProgram( Program );
 		glDeleteProgram( Program );
 		Valid = false;
 	}
@@ -363,6 +486,9 @@ GLSLProgram::CreateHelper( char *file0, ... )
 			if( Verbose )
 				fprintf( stderr, "Shader Program validated.\n" );
 		}
+		if( Valid  &&  key != 0 )
+			Programs.Save( "glsl", key, Program );
+		CacheVariables( );
 	}
 
 	return Valid;
@@ -370,26 +496,26 @@ GLSLProgram::CreateHelper( char *file0, ... )
 
 
 void
-GLSLProgram::DisableVertexAttribArray( const char *name )
+GLSLProgram::DisableVertexAttribArray( GlslName name )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( (char *)name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glDisableVertexAttribArray( loc );
+		glDisableVertexAttribArray( v->loc );
 	}
 }
 
 
 
 void
-GLSLProgram::EnableVertexAttribArray( const char *name )
+GLSLProgram::EnableVertexAttribArray( GlslName name )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( (char *)name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glEnableVertexAttribArray( loc );
+		glEnableVertexAttribArray( v->loc );
 	}
 }
 
@@ -457,11 +583,12 @@ GLSLProgram::GetAttributeTypeAndSize( GLchar *name, GLint *sizep, GLenum *typep
 }
 
 
+// what the system can do is only listed when verbose (SetVerbose( ) before Init( )):
+// a program that's a global is constructed before there's a GL to ask.
+
 void
 GLSLProgram::Init( )
 {
-	Verbose = false;
-
 	const GLubyte* extensions = glGetString(GL_EXTENSIONS);
 	if( extensions != NULL )
 	{
@@ -485,7 +612,8 @@ GLSLProgram::Init( )
 		CanDoTessellationShaders = IsExtensionSupported( "GL_ARB_tessellation_shader" );
 		CanDoGeometryShaders     = IsExtensionSupported( "GL_ARB_geometry_shader4" )  ||  IsExtensionSupported( "GL_EXT_geometry_shader4" ) || IsExtensionSupported("GL_EXT_geometry_shader");
 		CanDoFragmentShaders     = IsExtensionSupported( "GL_ARB_fragment_shader" );
-		fprintf( stderr, "This system can handle:\n" );
+		if( Verbose )
+			fprintf( stderr, "This system can handle:\n" );
 	}
 	else
 	{
@@ -494,10 +622,16 @@ GLSLProgram::Init( )
 		CanDoTessellationShaders = true;
 		CanDoGeometryShaders     = true;
 		CanDoFragmentShaders     = true;
-		fprintf( stderr, "Your system's OpenGL is not telling me what extensions you have.\n" );
-		fprintf( stderr, "So, I am going to assume that your system can handle:\n" );
+		if( Verbose )
+		{
+			fprintf( stderr, "Your system's OpenGL is not telling me what extensions you have.\n" );
+			fprintf( stderr, "So, I am going to assume that your system can handle:\n" );
+		}
 	}
 
+	if( ! Verbose )
+		return;
+
 	if( CanDoVertexShaders )                fprintf( stderr, "\tvertex shaders \n" );
 	if( CanDoFragmentShaders )              fprintf( stderr, "\tfragment shaders \n" );
 	if( CanDoGeometryShaders )              fprintf( stderr, "\tgeometry shaders \n" );
@@ -523,6 +657,13 @@ GLSLProgram::IsNotValid( )
 }
 
 
+void
+GLSLProgram::SetDefines( const char *defines )
+{
+	Defines = defines != NULL ? defines : "";
+}
+
+
 void
 GLSLProgram::SetVerbose( bool v )
 {
@@ -546,11 +687,7 @@ GLSLProgram::Use( )
 void
 GLSLProgram::Use( GLuint p )
 {
-	if( p != CurrentProgram )
-	{
-		glUseProgram( p );
-		CurrentProgram = p;
-	}
+	GlState.UseProgram( p );
 };
 
 
@@ -561,81 +698,200 @@ GLSLProgram::UseFixedFunction( )
 };
 
 
-int
-GLSLProgram::GetAttributeLocation( char *name )
+// the slot for hash: its own, or the empty one where it would go:
+
+GLSLProgram::Variable *
+GLSLProgram::Find( std::vector<Variable> &table, unsigned int hash )
 {
-	std::map<char *, int>::iterator pos;
+	if( table.empty( ) )
+		return NULL;
+	size_t mask = table.size( ) - 1;
+	for( size_t i = hash & mask; ; i = ( i + 1 ) & mask )
+		if( table[i].type == 0  ||  table[i].hash == hash )
+			return &table[i];
+}
+
 
-	pos = AttributeLocs.find( name );
-	if( pos == AttributeLocs.end() )
+void
+GLSLProgram::Insert( std::vector<Variable> &table, Variable var )
+{
+	size_t used = 0;
+	for( size_t i = 0; i < table.size( ); i++ )
+		used += table[i].type != 0;
+	if( 2 * ( used + 1 ) > table.size( ) )
 	{
-		AttributeLocs[name] = glGetAttribLocation( this->Program, name );
+		std::vector<Variable> old;
+		old.swap( table );
+		Variable empty = { 0, -1, 0, 0, false };
+		table.assign( old.empty( ) ? 16 : 2 * old.size( ), empty );
+		for( size_t i = 0; i < old.size( ); i++ )
+			if( old[i].type != 0 )
+				*Find( table, old[i].hash ) = old[i];
 	}
+	*Find( table, var.hash ) = var;
+}
 
-	return AttributeLocs[name];
-};
 
+// right after linking: every active uniform and attribute, with its location, size and type.
+// an array is there as both "name[0]" (what the GL calls it) and "name":
 
 void
-GLSLProgram::SetAttributePointer3fv( char* name, float* vals )
+GLSLProgram::CacheVariables( )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( name ) )  >= 0 )
+	Uniforms.clear( );
+	Attributes.clear( );
+
+	GLint count, bufsize;
+	glGetProgramiv( Program, GL_ACTIVE_UNIFORMS, &count );
+	glGetProgramiv( Program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &bufsize );
+	std::vector<char> lname( bufsize + 1 );
+	for( int i = 0; i < count; i++ )
+	{
+		Variable var;
+		glGetActiveUniform( Program, i, bufsize, NULL, &var.size, &var.type, lname.data( ) );
+		var.loc = glGetUniformLocation( Program, lname.data( ) );
+		var.hash = GlslHash( lname.data( ) );
+		var.used = false;
+		if( Find( Uniforms, var.hash ) != NULL  &&  Find( Uniforms, var.hash )->type != 0 )
+			fprintf( stderr, "Uniform variable '%s' hashes the same as another -- rename one of them\n", lname.data( ) );
+		Insert( Uniforms, var );
+
+		char *bracket = strstr( lname.data( ), "[0]" );
+		if( bracket != NULL )
+		{
+			*bracket = '\0';
+			var.hash = GlslHash( lname.data( ) );
+			Insert( Uniforms, var );
+		}
+	}
+
+	glGetProgramiv( Program, GL_ACTIVE_ATTRIBUTES, &count );
+	glGetProgramiv( Program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &bufsize );
+	lname.resize( bufsize + 1 );
+	for( int i = 0; i < count; i++ )
+	{
+		Variable var;
+		glGetActiveAttrib( Program, i, bufsize, NULL, &var.size, &var.type, lname.data( ) );
+		var.loc = glGetAttribLocation( Program, lname.data( ) );
+		var.hash = GlslHash( lname.data( ) );
+		var.used = false;
+		Insert( Attributes, var );
+	}
+}
+
+
+// NULL if the program doesn't have it.
+// a name that wasn't in the table when the program was linked (an element of an array, say,
+// or one the program doesn't have) is asked of the GL once, and remembered either way:
+
+GLSLProgram::Variable *
+GLSLProgram::GetAttribute( GlslName name )
+{
+	Variable *v = Find( Attributes, name.hash );
+	if( v == NULL  ||  v->type == 0 )
+	{
+		Variable var = { name.hash, glGetAttribLocation( this->Program, name.name ), 0, GL_FLOAT, false };
+		if( var.loc >= 0 )
+			GetAttributeTypeAndSize( (GLchar *)name.name, &var.size, &var.type );
+		Insert( Attributes, var );
+		v = Find( Attributes, name.hash );
+	}
+	if( Verbose  &&  ! v->used )
+		fprintf( stderr, "Location of attribute '%s' in Program %d = %d\n", name.name, this->Program, v->loc );
+	v->used = true;
+	return v->loc >= 0 ? v : NULL;
+}
+
+
+GLSLProgram::Variable *
+GLSLProgram::GetUniform( GlslName name )
+{
+	Variable *v = Find( Uniforms, name.hash );
+	if( v == NULL  ||  v->type == 0 )
+	{
+		// "name[i]" is the same type as "name[0]":
+		Variable var = { name.hash, glGetUniformLocation( this->Program, name.name ), 0, GL_FLOAT, false };
+		const char *bracket = strchr( name.name, '[' );
+		if( var.loc >= 0  &&  bracket != NULL )
+		{
+			std::string first( name.name, bracket - name.name );
+			Variable *array = Find( Uniforms, GlslHash( first.c_str( ) ) );
+			if( array != NULL  &&  array->type != 0 )
+			{
+				var.size = 1;
+				var.type = array->type;
+			}
+		}
+		Insert( Uniforms, var );
+		v = Find( Uniforms, name.hash );
+	}
+	if( Verbose  &&  ! v->used )
+	{
+		fprintf( stderr, "Location of '%s' in Program %d = %d\n", name.name, this->Program, v->loc );
+		if( v->loc < 0 )
+			fprintf( stderr, "Location of uniform variable '%s' is -1\n", name.name );
+	}
+	v->used = true;
+	return v->loc >= 0 ? v : NULL;
+}
+
+
+void
+GLSLProgram::SetAttributePointer3fv( GlslName name, float* vals )
+{
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glVertexAttribPointer( loc, 3, GL_FLOAT, GL_FALSE, 0, vals );
+		glVertexAttribPointer( v->loc, 3, GL_FLOAT, GL_FALSE, 0, vals );
 	}
 };
 
 
 #ifdef NOT_SUPPORTED_BY_OPENGL
 void
-GLSLProgram::SetAttributeVariable( char* name, int val )
+GLSLProgram::SetAttributeVariable( GlslName name, int val )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glVertexAttrib1i( loc, val );
+		glVertexAttrib1i( v->loc, val );
 	}
 };
 #endif
 
 
 void
-GLSLProgram::SetAttributeVariable( char* name, int val )
+GLSLProgram::SetAttributeVariable( GlslName name, int val )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetAttributeTypeAndSize( name, &size, &type );
-
-		switch( type )
+		switch( v->type )
 		{
 #ifdef NOT_SUPPORTED_BY_OPENGL
 			case GL_INT:
-				glVertexAttrib1i( loc, val );
+				glVertexAttrib1i( v->loc, val );
 				break;
 #endif
 
 			case GL_FLOAT:
-				glVertexAttrib1f( loc, (float)val );
+				glVertexAttrib1f( v->loc, (float)val );
 				break;
 
 			case GL_DOUBLE:
-				glVertexAttrib1d( loc, (double)val );
+				glVertexAttrib1d( v->loc, (double)val );
 				break;
 
 			default:
-				fprintf( stderr, "Setting attribute variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting attribute variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
 #ifdef NOT_SUPPORTED_BY_OPENGL
-		glVertexAttrib1i( loc, val );
+		glVertexAttrib1i( v->loc, val );
 #endif
 #endif
 	}
@@ -643,165 +899,124 @@ GLSLProgram::SetAttributeVariable( char* name, int val )
 
 
 void
-GLSLProgram::SetAttributeVariable( char* name, float val )
+GLSLProgram::SetAttributeVariable( GlslName name, float val )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetAttributeTypeAndSize( name, &size, &type );
-
-		switch( type )
+		switch( v->type )
 		{
 #ifdef NOT_SUPPORTED_BY_OPENGL
 			case GL_INT:
-				glVertexAttrib1i( loc, (int)val );
+				glVertexAttrib1i( v->loc, (int)val );
 				break;
 #endif
 
 			case GL_FLOAT:
-				glVertexAttrib1f( loc, val );
+				glVertexAttrib1f( v->loc, val );
 				break;
 
 			case GL_DOUBLE:
-				glVertexAttrib1d( loc, (double)val );
+				glVertexAttrib1d( v->loc, (double)val );
 				break;
 
 			default:
-				fprintf( stderr, "Setting attribute variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting attribute variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glVertexAttrib1f( loc, val );
+		glVertexAttrib1f( v->loc, val );
 #endif
 	}
 };
 
 
 void
-GLSLProgram::SetAttributeVariable( char* name, double val )
+GLSLProgram::SetAttributeVariable( GlslName name, double val )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetAttributeTypeAndSize( name, &size, &type );
-
-		switch( type )
+		switch( v->type )
 		{
 #ifdef NOT_SUPPORTED_BY_OPENGL
 			case GL_INT:
-				glVertexAttrib1i( loc, (int)val );
+				glVertexAttrib1i( v->loc, (int)val );
 				break;
 #endif
 
 			case GL_FLOAT:
-				glVertexAttrib1f( loc, (float)val );
+				glVertexAttrib1f( v->loc, (float)val );
 				break;
 
 			case GL_DOUBLE:
-				glVertexAttrib1d( loc, val );
+				glVertexAttrib1d( v->loc, val );
 				break;
 
 			default:
-				fprintf( stderr, "Setting attribute variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting attribute variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glVertexAttrib1d( loc, val );
+		glVertexAttrib1d( v->loc, val );
 #endif
 	}
 };
 
 
 void
-GLSLProgram::SetAttributeVariable( char* name, float val0, float val1, float val2 )
+GLSLProgram::SetAttributeVariable( GlslName name, float val0, float val1, float val2 )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glVertexAttrib3f( loc, val0, val1, val2 );
+		glVertexAttrib3f( v->loc, val0, val1, val2 );
 	}
 };
 
 
 void
-GLSLProgram::SetAttributeVariable( char* name, float vals[3] )
+GLSLProgram::SetAttributeVariable( GlslName name, float vals[3] )
 {
-	int loc;
-	if( ( loc = GetAttributeLocation( name ) )  >= 0 )
+	Variable *v = GetAttribute( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glVertexAttrib3fv( loc, vals );
+		glVertexAttrib3fv( v->loc, vals );
 	}
 };
 
 
-int
-GLSLProgram::GetUniformLocation( char *name )
-{
-	std::map<char *, int>::iterator pos;
-
-	pos = UniformLocs.find( name );
-	//if( Verbose )
-		//fprintf( stderr, "Uniform: pos = 0x%016x ; size = %d ; end = 0x%016x\n", pos, UniformLocs.size(), UniformLocs.end() );
-	if( pos == UniformLocs.end() )
-	{
-		GLuint loc = glGetUniformLocation( this->Program, name );
-		UniformLocs[name] = loc;
-		if( Verbose )
-			fprintf( stderr, "Location of '%s' in Program %d = %d\n", name, this->Program, loc );
-	}
-	else
-	{
-		if( Verbose )
-		{
-			fprintf( stderr, "Location = %d\n", UniformLocs[name] );
-			if( UniformLocs[name] == -1 )
-				fprintf( stderr, "Location of uniform variable '%s' is -1\n", name );
-		}
-	}
-
-	return UniformLocs[name];
-};
-
-
 void
-GLSLProgram::SetUniformVariable( char* name, int val )
+GLSLProgram::SetUniformVariable( GlslName name, int val )
 {
-	int loc;
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetUniformTypeAndSize( name, &size, &type );
-
-		switch( type )
+		switch( v->type )
 		{
 			case GL_INT:
-				glUniform1i( loc, val );
+				glUniform1i( v->loc, val );
 				break;
 
 			case GL_FLOAT:
-				glUniform1f( loc, (float)val );
+				glUniform1f( v->loc, (float)val );
 				break;
 
 			case GL_DOUBLE:
-				glUniform1d( loc, (double)val );
+				glUniform1d( v->loc, (double)val );
 				break;
 
 			default:
-				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glUniform1i( loc, val );
+		glUniform1i( v->loc, val );
 #endif
 	}
 
@@ -809,148 +1024,135 @@ GLSLProgram::SetUniformVariable( char* name, int val )
 
 
 void
-GLSLProgram::SetUniformVariable( char* name, float val )
+GLSLProgram::SetUniformVariable( GlslName name, float val )
 {
-	int loc;
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetUniformTypeAndSize( name, &size, &type );
-
-		switch( type )
+		switch( v->type )
 		{
 			case GL_INT:
-				glUniform1i( loc, (int)val );
+				glUniform1i( v->loc, (int)val );
 				break;
 
 			case GL_FLOAT:
-				glUniform1f( loc, val );
+				glUniform1f( v->loc, val );
 				break;
 
 			case GL_DOUBLE:
-				glUniform1d( loc, (double)val );
+				glUniform1d( v->loc, (double)val );
 				break;
 
 			default:
-				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glUniform1f( loc, val );
+		glUniform1f( v->loc, val );
 #endif
 	}
 };
 
 
 void
-GLSLProgram::SetUniformVariable( char* name, double val )
+GLSLProgram::SetUniformVariable( GlslName name, double val )
 {
-	int loc;
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetUniformTypeAndSize( name, &size, &type );
-		switch( type )
+		switch( v->type )
 		{
 			case GL_INT:
-				glUniform1i( loc, (int)val );
+				glUniform1i( v->loc, (int)val );
 				break;
 
 			case GL_FLOAT:
-				glUniform1f( loc, (float)val );
+				glUniform1f( v->loc, (float)val );
 				break;
 
 			case GL_DOUBLE:
-				glUniform1d( loc, val );
+				glUniform1d( v->loc, val );
 				break;
 
 			default:
-				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glUniform1d( loc, val );
+		glUniform1d( v->loc, val );
 #endif
 	}
 };
 
 
 void
-GLSLProgram::SetUniformVariable( char* name, float val0, float val1, float val2 )
+GLSLProgram::SetUniformVariable( GlslName name, float val0, float val1, float val2 )
 {
-	int loc;
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetUniformTypeAndSize( name, &size, &type );
-		switch( size )
+		switch( v->type )
 		{
-			case 3:
-				glUniform3f( loc, val0, val1, val2 );
+			case GL_FLOAT_VEC3:
+				glUniform3f( v->loc, val0, val1, val2 );
 				break;
 
-			case 4:
-				glUniform4f( loc, val0, val1, val2, 1.f );
+			case GL_FLOAT_VEC4:
+				glUniform4f( v->loc, val0, val1, val2, 1.f );
 				break;
 
 			default:
-				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glUniform3f( loc, val0, val1, val2 );
+		glUniform3f( v->loc, val0, val1, val2 );
 #endif
 	}
 };
 
 
 void
-GLSLProgram::SetUniformVariable( char* name, float val0, float val1, float val2, float val3 )
+GLSLProgram::SetUniformVariable( GlslName name, float val0, float val1, float val2, float val3 )
 {
-	int loc;
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetUniformTypeAndSize( name, &size, &type );
-		switch( size )
+		switch( v->type )
 		{
-			case 3:
-				glUniform3f( loc, val0, val1, val2 );
+			case GL_FLOAT_VEC3:
+				glUniform3f( v->loc, val0, val1, val2 );
 				break;
 
-			case 4:
-				glUniform4f( loc, val0, val1, val2, val3 );
+			case GL_FLOAT_VEC4:
+				glUniform4f( v->loc, val0, val1, val2, val3 );
 				break;
 
 			default:
-				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glUniform4f( loc, val0, val1, val2, val3 );
+		glUniform4f( v->loc, val0, val1, val2, val3 );
 #endif
 	}
 };
 
 
 void
-GLSLProgram::SetUniformVariable( char* name, float vals[3] )
+GLSLProgram::SetUniformVariable( GlslName name, float vals[3] )
 {
-	int loc;
 	//fprintf( stderr, "Found a 3-element array\n" );
 
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glUniform3fv( loc, 1, vals );
+		glUniform3fv( v->loc, 1, vals );
 	}
 };
 
@@ -959,92 +1161,86 @@ GLSLProgram::SetUniformVariable( char* name, float vals[3] )
 #ifdef GLM
 
 void
-GLSLProgram::SetUniformVariable( char *name, glm::vec3 v3 )
+GLSLProgram::SetUniformVariable( GlslName name, glm::vec3 v3 )
 {
-	int loc;
 	//fprintf( stderr, "Found a vec3\n" );
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetUniformTypeAndSize( name, &size, &type );
-		switch( size )
+		switch( v->type )
 		{
-			case 3:
-				glUniform3f( loc, v3.x, v3.y, v3.z );
+			case GL_FLOAT_VEC3:
+				glUniform3f( v->loc, v3.x, v3.y, v3.z );
 				break;
 
-			case 4:
-				glUniform4f( loc, v3.x, v3.y, v3.z, 1.f );
+			case GL_FLOAT_VEC4:
+				glUniform4f( v->loc, v3.x, v3.y, v3.z, 1.f );
 				break;
 
 			default:
-				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glUniform3f( loc, v3.x, v3.y, v3.z );
+		glUniform3f( v->loc, v3.x, v3.y, v3.z );
 #endif
 	}
 };
 
 void
-GLSLProgram::SetUniformVariable( char *name, glm::vec4 v4 )
+GLSLProgram::SetUniformVariable( GlslName name, glm::vec4 v4 )
 {
-	int loc;
 	//fprintf( stderr, "Found a vec4\n" );
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
 #ifdef TYPE_CHECKS
-		GLint  size;
-		GLenum type;
-		GetUniformTypeAndSize( name, &size, &type );
-		switch( size )
+		switch( v->type )
 		{
-			case 3:
-				glUniform3f( loc, v4.x, v4.y, v4.z );
+			case GL_FLOAT_VEC3:
+				glUniform3f( v->loc, v4.x, v4.y, v4.z );
 				break;
 
-			case 4:
-				glUniform4f( loc, v4.x, v4.y, v4.z, v4.w );
+			case GL_FLOAT_VEC4:
+				glUniform4f( v->loc, v4.x, v4.y, v4.z, v4.w );
 				break;
 
 			default:
-				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name );
+				fprintf( stderr, "Setting uniform variable '%s': please be more explicit with the variable type\n", name.name );
 		}
 #else
-		glUniform4f( loc, v4.x, v4.y, v4.z, v4.w );
+		glUniform4f( v->loc, v4.x, v4.y, v4.z, v4.w );
 #endif
 	}
 };
 
 
 void
-GLSLProgram::SetUniformVariable( char *name, glm::mat3 m3 )
+GLSLProgram::SetUniformVariable( GlslName name, glm::mat3 m3 )
 {
-	int loc;
 	// fprintf( stderr, "Found a mat3\n" );
 
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glUniformMatrix3fv( loc, 1, GL_FALSE, glm::value_ptr( m3 ) );
+		glUniformMatrix3fv( v->loc, 1, GL_FALSE, glm::value_ptr( m3 ) );
 	}
 };
 
 
 void
-GLSLProgram::SetUniformVariable( char *name, glm::mat4 m4 )
+GLSLProgram::SetUniformVariable( GlslName name, glm::mat4 m4 )
 {
-	int loc;
 	// fprintf( stderr, "Found a mat4\n" );
 
-	if( ( loc = GetUniformLocation( name ) )  >= 0 )
+	Variable *v = GetUniform( name );
+	if( v != NULL )
 	{
 		this->Use();
-		glUniformMatrix4fv( loc, 1, GL_FALSE, glm::value_ptr( m4 ) );
+		glUniformMatrix4fv( v->loc, 1, GL_FALSE, glm::value_ptr( m4 ) );
 	}
 };
 
@@ -1087,7 +1283,297 @@ GLSLProgram::IsExtensionSupported( const char *extension )
 }
 
 
-int GLSLProgram::CurrentProgram = 0;
+// after Create( ): false if the files can't be watched (or aren't files), and then Reload( ) never does anything:
+
+bool
+GLSLProgram::Watch( )
+{
+	Watching = ! Files.empty( );
+	Saves.assign( Files.size( ), 0 );
+	for( int i = 0; i < (int)Files.size( ); i++ )
+	{
+		Watching = ShaderFiles.Watch( Files[i] )  &&  Watching;
+		std::string current;
+		ShaderFiles.Changed( Files[i], Saves[i], current );	// saves from before this was built don't count
+	}
+
+	// the compiling thread's context is made now rather than in the first frame that needs it:
+	if( Watching  &&  ! CanCompileInParallel( ) )
+		ShaderCompiler.Start( );
+	return Watching;
+}
+
+
+bool
+GLSLProgram::CanCompileInParallel( )
+{
+	if( ParallelCompile < 0 )
+		ParallelCompile = IsExtensionSupported( "GL_KHR_parallel_shader_compile" )  ||  IsExtensionSupported( "GL_ARB_parallel_shader_compile" );
+	return ParallelCompile != 0;
+}
+
+
+// once a frame, between frames. see the top of glslprogram.h:
+
+bool
+GLSLProgram::Reload( )
+{
+	if( ! Watching )
+		return false;
+
+	// a build is never finished in the frame it was started in:
+	if( Pending == 0 )
+	{
+		bool changed = false;
+		for( int i = 0; i < (int)Files.size( ); i++ )
+			changed = ShaderFiles.Changed( Files[i], Saves[i], Sources[i] )  ||  changed;
+		if( changed )
+			StartBuild( );
+		return false;
+	}
+
+	if( Job != NULL )
+	{
+		if( ! Job->done.load( std::memory_order_acquire ) )
+			return false;
+	}
+	else if( ParallelCompile )
+	{
+		GLint done = GL_FALSE;
+		glGetProgramiv( Pending, GL_COMPLETION_STATUS_KHR, &done );
+		if( done == GL_FALSE )
+			return false;
+	}
+	return FinishBuild( );
+}
+
+
+// compiles the sources and links them into Pending without waiting: on the driver's threads where
+// the GL has KHR_parallel_shader_compile, on ShaderCompiler's otherwise. with neither, the GL
+// compiles here, and only the wait for the result is put off to the next frame:
+
+void
+GLSLProgram::StartBuild( )
+{
+	Pending = glCreateProgram( );
+	Programs.PrepareToLink( Pending );
+	if( ! CanCompileInParallel( )  &&  ShaderCompiler.Start( ) )
+	{
+		Job = std::make_shared<CompileJob>( );
+		Job->program = Pending;
+		for( int i = 0; i < (int)Files.size( ); i++ )
+		{
+			GLenum type = GlShaderType( (char *)Files[i].c_str( ) );
+			if( type == 0 )
+				continue;
+			const GLchar *strings[3];
+			GLint lengths[3];
+			int n = SourceStrings( Sources[i].c_str( ), Defines, strings, lengths );
+			std::string source;
+			for( int k = 0; k < n; k++ )
+				source.append( strings[k], lengths[k] < 0 ? strlen( strings[k] ) : lengths[k] );
+			Job->types.push_back( type );
+			Job->sources.push_back( source );
+			Job->names.push_back( Files[i] );
+		}
+		ShaderCompiler.Submit( Job );
+		return;
+	}
+
+	PendingShaders.assign( Files.size( ), 0 );
+	for( int i = 0; i < (int)Files.size( ); i++ )
+	{
+		GLenum type = GlShaderType( (char *)Files[i].c_str( ) );
+		if( type == 0 )
+			continue;
+		const GLchar *strings[3];
+		GLint lengths[3];
+		int n = SourceStrings( Sources[i].c_str( ), Defines, strings, lengths );
+		PendingShaders[i] = glCreateShader( type );
+		glShaderSource( PendingShaders[i], n, strings, lengths );
+		glCompileShader( PendingShaders[i] );
+		glAttachShader( Pending, PendingShaders[i] );
+	}
+	glLinkProgram( Pending );
+}
+
+
+// once Pending is compiled and linked: it becomes the program, or is reported and deleted:
+
+bool
+GLSLProgram::FinishBuild( )
+{
+	if( Job != NULL )
+	{
+		fprintf( stderr, "%s", Job->log.c_str( ) );
+		bool ok = Job->ok;
+		Job.reset( );
+		if( ! ok )
+		{
+			glDeleteProgram( Pending );
+			Pending = 0;
+			return false;
+		}
+		return Adopt( );
+	}
+
+	bool compiled = true;
+	for( int i = 0; i < (int)PendingShaders.size( ); i++ )
+	{
+		if( PendingShaders[i] == 0 )
+			continue;
+		GLint status;
+		glGetShaderiv( PendingShaders[i], GL_COMPILE_STATUS, &status );
+		if( status == GL_FALSE )
+		{
+			GLchar infoLog[1024];
+			glGetShaderInfoLog( PendingShaders[i], sizeof(infoLog), NULL, infoLog );
+			fprintf( stderr, "Shader '%s' did not compile, keeping the old program:\n%s\n", Files[i].c_str( ), infoLog );
+			compiled = false;
+		}
+		glDeleteShader( PendingShaders[i] );
+	}
+	PendingShaders.clear( );
+
+	GLint linked;
+	glGetProgramiv( Pending, GL_LINK_STATUS, &linked );
+	if( compiled  &&  linked == GL_FALSE )
+	{
+		GLchar infoLog[1024];
+		glGetProgramInfoLog( Pending, sizeof(infoLog), NULL, infoLog );
+		fprintf( stderr, "Shader Program did not link, keeping the old program:\n%s\n", infoLog );
+	}
+	if( ! compiled  ||  linked == GL_FALSE )
+	{
+		glDeleteProgram( Pending );
+		Pending = 0;
+		return false;
+	}
+	return Adopt( );
+}
+
+
+// Pending, linked, replaces the program:
+
+bool
+GLSLProgram::Adopt( )
+{
+	bool current = GlState.IsCurrent( Program );
+	GlState.ForgetProgram( Program );
+	glDeleteProgram( Program );
+	Program = Pending;
+	Pending = 0;
+	if( current )
+		Use( );
+	Valid = true;
+	CacheVariables( );
+	Programs.Save( "glsl", Key( ), Program );
+	fprintf( stderr, "Shader Program reloaded:" );
+	for( int i = 0; i < (int)Files.size( ); i++ )
+		fprintf( stderr, " %s", Files[i].c_str( ) );
+	fprintf( stderr, "\n" );
+	return true;
+}
+
+
+GLSLPermutations::GLSLPermutations( )
+{
+	Watching = false;
+}
+
+
+GLSLPermutations::~GLSLPermutations( )
+{
+	for( int i = 0; i < (int)Variants.size( ); i++ )
+		delete Variants[i];
+}
+
+
+// just remembers the files and features -- nothing is compiled until Get( ):
+
+void
+GLSLPermutations::Create( const char * const *features, int numFeatures, char *file0, char *file1, char *file2, char *file3, char *file4, char *file5 )
+{
+	if( numFeatures > GLSL_MAX_FEATURES )
+	{
+		fprintf( stderr, "%d shader features, only %d can be permuted\n", numFeatures, GLSL_MAX_FEATURES );
+		numFeatures = GLSL_MAX_FEATURES;
+	}
+	Features.assign( features, features + numFeatures );
+
+	char *files[6] = { file0, file1, file2, file3, file4, file5 };
+	Files.clear( );
+	for( int i = 0; i < 6  &&  files[i] != NULL; i++ )
+		Files.push_back( files[i] );
+
+	for( int i = 0; i < (int)Variants.size( ); i++ )
+		delete Variants[i];
+	Variants.assign( 1 << numFeatures, NULL );
+}
+
+
+// the variant with the features in mask, built now if it hasn't been.
+// a variant that doesn't compile is still kept (not Valid( )), so it's only reported once:
+
+GLSLProgram *
+GLSLPermutations::Get( unsigned int mask )
+{
+	if( mask >= Variants.size( ) )
+		return NULL;
+	if( Variants[mask] != NULL )
+		return Variants[mask];
+
+	std::string defines = Defines;
+	for( int i = 0; i < (int)Features.size( ); i++ )
+		defines += "#define " + Features[i] + ( ( mask & ( 1u << i ) ) != 0 ? " 1\n" : " 0\n" );
+
+	char *files[6] = { NULL, NULL, NULL, NULL, NULL, NULL };
+	for( int i = 0; i < (int)Files.size( ); i++ )
+		files[i] = (char *)Files[i].c_str( );
+
+	GLSLProgram *variant = new GLSLProgram( );
+	variant->SetDefines( defines.c_str( ) );
+	variant->Create( files[0], files[1], files[2], files[3], files[4], files[5] );
+	if( Watching )
+		variant->Watch( );
+	Variants[mask] = variant;
+	return variant;
+}
+
+
+// every variant built so far. true if any of them is a new program now:
+
+bool
+GLSLPermutations::Reload( )
+{
+	bool reloaded = false;
+	for( int i = 0; i < (int)Variants.size( ); i++ )
+		if( Variants[i] != NULL )
+			reloaded = Variants[i]->Reload( )  ||  reloaded;
+	return reloaded;
+}
+
+
+void
+GLSLPermutations::SetDefines( const char *defines )
+{
+	Defines = defines != NULL ? defines : "";
+}
+
+
+// the variants built so far and any built from now on:
+
+void
+GLSLPermutations::Watch( )
+{
+	Watching = true;
+	for( int i = 0; i < (int)Variants.size( ); i++ )
+		if( Variants[i] != NULL )
+			Variants[i]->Watch( );
+}
+
+
+int GLSLProgram::ParallelCompile = -1;
 
 
 
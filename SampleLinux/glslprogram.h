@@ -66,8 +66,10 @@ inline int GetOSU(int flag)
 //********************************************************************************
 
 #include "glut.h"
-#include <map>
 #include <stdarg.h>
+#include <memory>
+#include <string>
+#include <vector>
 
 
 //********************************************************************************
@@ -88,6 +90,46 @@ inline int GetOSU(int flag)
 //
 //********************************************************************************
 
+// uniform and attribute names are looked up by their 32-bit FNV-1a hash.
+// the hash of a constexpr GlslName is worked out by the compiler, so a name that's set every
+// frame costs nothing to look up but an index into the program's table of its variables:
+//
+//	static constexpr GlslName LightPosition( "uLightPosition" );
+//	...
+//	Pattern.SetUniformVariable( LightPosition, x, y, z );
+//
+// plain strings still work, and are hashed when they're passed in.
+
+constexpr unsigned int
+GlslHash( const char *s, unsigned int h = 2166136261u )
+{
+	return *s == '\0' ? h : GlslHash( s + 1, ( h ^ (unsigned char)*s ) * 16777619u );
+}
+
+struct GlslName
+{
+	const char *	name;
+	unsigned int	hash;
+
+	constexpr GlslName( const char *s ) : name( s ), hash( GlslHash( s ) ) { }
+};
+
+
+// hot reload: after Create( ), Watch( ) has the program's files watched for saves, and
+// Reload( ), called once a frame between frames, builds the program again from what was saved.
+// the compile and link run on the driver's threads where the GL has KHR_parallel_shader_compile,
+// and on a thread with a shared context of its own (compilethread.h) where it doesn't, and
+// Reload( ) only asks whether they're done, so no frame waits for them.
+// the new program replaces the old one in the frame Reload( ) returns true -- any locations
+// the caller looked up itself have to be looked up again then. one that doesn't compile or
+// link is reported and thrown away, and the old one carries on.
+//
+// SetDefines( ) before Create( ) gives every file #define lines, right after its #version.
+
+
+struct CompileJob;
+
+
 // shader types:
 enum ShaderTypes
 {
@@ -100,7 +142,27 @@ enum ShaderTypes
 class GLSLProgram
 {
   private:
-	std::map<char *, int>	AttributeLocs;
+	// everything the program says is active, filled in once it's linked, in open-addressed
+	// tables keyed by the name's hash (a power of 2 long, at most half full).
+	// names that aren't active are remembered too, with a location of -1:
+	struct Variable
+	{
+		unsigned int	hash;
+		int		loc;		// -1 for an empty slot or a name the program doesn't have
+		GLint		size;
+		GLenum		type;		// 0 for an empty slot
+		bool		used;
+	};
+
+	std::vector<Variable>	Attributes;
+	std::string		Defines;	// put after each file's #version line
+	std::vector<std::string>	Files;	// what Create( ) was given
+	std::vector<std::string>	Sources;	// and what was in them, as last compiled
+	GLuint			Pending;	// the program being built again from edited files, or 0
+	std::vector<GLuint>	PendingShaders;
+	std::shared_ptr<CompileJob>	Job;	// Pending's, when ShaderCompiler is building it
+	std::vector<long>	Saves;		// of each file, seen by Reload( )
+	bool			Watching;
 #ifdef COMPUTE
 	char *			Cfile;
 	unsigned int		Cshader;
@@ -119,15 +181,18 @@ class GLSLProgram
 	char *			TEfile;
 	unsigned int		TEshader;
 #endif
-	std::map<char *, int>	UniformLocs;
+	std::vector<Variable>	Uniforms;
 	bool			Valid;
 	char *			Vfile;
 	GLuint			Vshader;
 	bool			Verbose;
 
-	static int		CurrentProgram;
+	static int		ParallelCompile;	// KHR_parallel_shader_compile: -1 until asked
 
+	bool	Adopt( );
 	void	AttachShader( GLuint );
+	void	CacheVariables( );
+	bool	CanCompileInParallel( );
 	bool	CanDoComputeShaders;
 	bool	CanDoFragmentShaders;
 	bool	CanDoGeometryShaders;
@@ -135,48 +200,88 @@ class GLSLProgram
 	bool	CanDoVertexShaders;
 	int	CompileShader( GLuint );
 	bool	CreateHelper( char *, ... );
-	int	GetAttributeLocation( char * );
-	int	GetUniformLocation( char * );
+	bool	FinishBuild( );
+	Variable *	GetAttribute( GlslName );
+	Variable *	GetUniform( GlslName );
+	unsigned long long	Key( );
+	void	StartBuild( );
+
+	static Variable *	Find( std::vector<Variable> &, unsigned int );
+	static void		Insert( std::vector<Variable> &, Variable );
 
 
   public:
 		GLSLProgram( );
 
 	bool	Create( char *, char * = NULL, char * = NULL, char * = NULL, char * = NULL, char * = NULL );
-	void	DisableVertexAttribArray( const char * );
-	void	EnableVertexAttribArray( const char * );
+	void	DisableVertexAttribArray( GlslName );
+	void	EnableVertexAttribArray( GlslName );
 	int	GetAttributeTypeAndSize( GLchar *, GLint *, GLenum * );
+	GLuint	GetProgram( )		{ return Program; }
 	int	GetUniformTypeAndSize(   GLchar *, GLint *, GLenum * );
 	void	Init( );
 	bool	IsExtensionSupported( const char * );
 	bool	IsNotValid( );
 	bool	IsValid( );
-	void	SetAttributePointer3fv( char *, float * );
-	void	SetAttributeVariable( char *, int );
-	void	SetAttributeVariable( char *, float );
-	void	SetAttributeVariable( char *, double );
-	void	SetAttributeVariable( char *, float, float, float );
-	void	SetAttributeVariable( char *, float[3] );
-	void	VertexAttrib3f( const char *, float, float, float );
-	void	SetUniformVariable( char *, int );
-	void	SetUniformVariable( char *, float );
-	void	SetUniformVariable( char *, double );
-	void	SetUniformVariable( char *, float, float, float );
-	void	SetUniformVariable( char *, float, float, float, float );
-	void	SetUniformVariable( char *, float[3] );
+	bool	Reload( );
+	void	SetAttributePointer3fv( GlslName, float * );
+	void	SetAttributeVariable( GlslName, int );
+	void	SetAttributeVariable( GlslName, float );
+	void	SetAttributeVariable( GlslName, double );
+	void	SetAttributeVariable( GlslName, float, float, float );
+	void	SetAttributeVariable( GlslName, float[3] );
+	void	VertexAttrib3f( GlslName, float, float, float );
+	void	SetUniformVariable( GlslName, int );
+	void	SetUniformVariable( GlslName, float );
+	void	SetUniformVariable( GlslName, double );
+	void	SetUniformVariable( GlslName, float, float, float );
+	void	SetUniformVariable( GlslName, float, float, float, float );
+	void	SetUniformVariable( GlslName, float[3] );
 
 #ifdef GLM
-	void	SetUniformVariable( char *, glm::vec3 );
-	void	SetUniformVariable( char *, glm::vec4 );
-	void	SetUniformVariable( char *, glm::mat3 );
-	void	SetUniformVariable( char *, glm::mat4 );
+	void	SetUniformVariable( GlslName, glm::vec3 );
+	void	SetUniformVariable( GlslName, glm::vec4 );
+	void	SetUniformVariable( GlslName, glm::mat3 );
+	void	SetUniformVariable( GlslName, glm::mat4 );
 #endif
 
+	void	SetDefines( const char * );
 	void	SetVerbose( bool );
 	void	UnUse( );
 	void	Use( );
 	void	Use( GLuint );
 	void	UseFixedFunction( );
+	bool	Watch( );
+};
+
+
+// one set of shader files, built as a program for each combination of features a draw asks for.
+// feature i is "#define <its name> 1" in the variants whose mask has bit i, and "#define
+// <its name> 0" in the rest, so what would be a uniform bool tested by every fragment is a
+// branch the compiler takes out. a variant is built the first time Get( ) asks for it and kept,
+// indexed by its mask -- Get( ) the ones the frames will use up front, so no frame compiles.
+// variants draw best sorted by mask, so the program changes as seldom as it can.
+
+const int GLSL_MAX_FEATURES = 8;
+
+class GLSLPermutations
+{
+  private:
+	std::string			Defines;	// every variant's, before the features'
+	std::vector<std::string>	Features;
+	std::vector<std::string>	Files;
+	std::vector<GLSLProgram *>	Variants;	// by mask, NULL until built
+	bool				Watching;
+
+  public:
+		GLSLPermutations( );
+		~GLSLPermutations( );
+
+	void		Create( const char * const *features, int numFeatures, char *, char * = NULL, char * = NULL, char * = NULL, char * = NULL, char * = NULL );
+	GLSLProgram *	Get( unsigned int mask );
+	bool		Reload( );
+	void		SetDefines( const char * );
+	void		Watch( );
 };
 
 #endif		// #ifndef GLSLPROGRAM_CPP
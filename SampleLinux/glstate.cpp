@@ -0,0 +1,372 @@
+#include "glstate.h"
+
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include "glew.h"
+#include <GL/gl.h>
+#endif
+
+
+GLStateCache	GlState;
+
+
+GLStateCache::GLStateCache( )
+{
+	issued = elided = 0;
+	Forget( );
+}
+
+
+// every binding and enable is unknown, so the next call for each goes to the GL:
+
+void
+GLStateCache::Forget( )
+{
+	current = -1;
+	program = vertexArray = activeUnit = -1;
+	for( int i = 0; i < GLSTATE_TEXTURE_UNITS; i++ )
+		textures[i] = -1;
+	arrayBuffer = packBuffer = unpackBuffer = -1;
+	drawFramebuffer = readFramebuffer = -1;
+	viewport[0] = viewport[1] = 0;
+	viewport[2] = viewport[3] = -1;
+	depthTest = blend = cullFace = -1;
+}
+
+
+// when p is deleted: the GL may hand its name out again, to a program with other uniforms:
+
+void
+GLStateCache::ForgetProgram( unsigned int p )
+{
+	for( int i = 0; i < (int)programs.size( ); i++ )
+	{
+		if( programs[i].program == p )
+		{
+			programs.erase( programs.begin( ) + i );
+			break;
+		}
+	}
+	if( program == (long)p )
+		program = -1;
+
+	// the erase moved the bound program's entry, if it was after p's:
+	current = -1;
+	for( int i = 0; i < (int)programs.size( ); i++ )
+		if( (long)programs[i].program == program )
+			current = i;
+}
+
+
+void
+GLStateCache::ResetCounts( )
+{
+	issued = elided = 0;
+}
+
+
+// true, and the shadow updated, if setting shadow to value is a change:
+
+bool
+GLStateCache::Changes( long &shadow, long value )
+{
+	if( shadow == value )
+	{
+		elided++;
+		return false;
+	}
+	shadow = value;
+	issued++;
+	return true;
+}
+
+
+int *
+GLStateCache::Flag( unsigned int cap )
+{
+	switch( cap )
+	{
+		case GL_DEPTH_TEST:	return &depthTest;
+		case GL_BLEND:		return &blend;
+		case GL_CULL_FACE:	return &cullFace;
+	}
+	return NULL;
+}
+
+
+void
+GLStateCache::UseProgram( unsigned int p )
+{
+	if( current < 0  ||  programs[current].program != p )
+	{
+		current = -1;
+		for( int i = 0; i < (int)programs.size( ); i++ )
+			if( programs[i].program == p )
+				current = i;
+		if( current < 0  &&  p != 0 )
+		{
+			Program entry;
+			entry.program = p;
+			programs.push_back( entry );
+			current = (int)programs.size( ) - 1;
+		}
+	}
+	if( Changes( program, p ) )
+		glUseProgram( p );
+}
+
+
+void
+GLStateCache::BindVertexArray( unsigned int vao )
+{
+	if( Changes( vertexArray, vao ) )
+		glBindVertexArray( vao );
+}
+
+
+void
+GLStateCache::ActiveTexture( unsigned int unit )
+{
+	if( Changes( activeUnit, unit - GL_TEXTURE0 ) )
+		glActiveTexture( unit );
+}
+
+
+// only GL_TEXTURE_2D bindings are shadowed; the others always go through:
+
+void
+GLStateCache::BindTexture( unsigned int target, unsigned int texture )
+{
+	if( target != GL_TEXTURE_2D  ||  activeUnit < 0  ||  activeUnit >= GLSTATE_TEXTURE_UNITS )
+	{
+		issued++;
+		glBindTexture( target, texture );
+	}
+	else if( Changes( textures[activeUnit], texture ) )
+		glBindTexture( target, texture );
+}
+
+
+// GL_ELEMENT_ARRAY_BUFFER is part of the vertex array's state, so it (and any target not
+// shadowed here) always goes through:
+
+void
+GLStateCache::BindBuffer( unsigned int target, unsigned int buffer )
+{
+	long *shadow = target == GL_ARRAY_BUFFER ? &arrayBuffer :
+			target == GL_PIXEL_PACK_BUFFER ? &packBuffer :
+			target == GL_PIXEL_UNPACK_BUFFER ? &unpackBuffer : NULL;
+	if( shadow == NULL )
+	{
+		issued++;
+		glBindBuffer( target, buffer );
+	}
+	else if( Changes( *shadow, buffer ) )
+		glBindBuffer( target, buffer );
+}
+
+
+// GL_FRAMEBUFFER binds both:
+
+void
+GLStateCache::BindFramebuffer( unsigned int target, unsigned int fbo )
+{
+	bool draw = target != GL_READ_FRAMEBUFFER  &&  drawFramebuffer != (long)fbo;
+	bool read = target != GL_DRAW_FRAMEBUFFER  &&  readFramebuffer != (long)fbo;
+	if( target != GL_READ_FRAMEBUFFER )
+		drawFramebuffer = fbo;
+	if( target != GL_DRAW_FRAMEBUFFER )
+		readFramebuffer = fbo;
+	if( draw  ||  read )
+	{
+		issued++;
+		glBindFramebuffer( draw && read ? GL_FRAMEBUFFER : draw ? GL_DRAW_FRAMEBUFFER : GL_READ_FRAMEBUFFER, fbo );
+	}
+	else
+		elided++;
+}
+
+
+void
+GLStateCache::Viewport( int x, int y, int width, int height )
+{
+	if( viewport[0] == x  &&  viewport[1] == y  &&  viewport[2] == width  &&  viewport[3] == height )
+	{
+		elided++;
+		return;
+	}
+	viewport[0] = x;
+	viewport[1] = y;
+	viewport[2] = width;
+	viewport[3] = height;
+	issued++;
+	glViewport( x, y, width, height );
+}
+
+
+// what's bound, asked of the GL only if it isn't known:
+
+unsigned int
+GLStateCache::GetProgram( )
+{
+	if( program < 0 )
+	{
+		GLint p;
+		glGetIntegerv( GL_CURRENT_PROGRAM, &p );
+		program = p;
+		current = -1;
+		for( int i = 0; i < (int)programs.size( ); i++ )
+			if( (long)programs[i].program == program )
+				current = i;
+	}
+	return (unsigned int)program;
+}
+
+
+unsigned int
+GLStateCache::GetDrawFramebuffer( )
+{
+	if( drawFramebuffer < 0 )
+	{
+		GLint fbo;
+		glGetIntegerv( GL_DRAW_FRAMEBUFFER_BINDING, &fbo );
+		drawFramebuffer = fbo;
+	}
+	return (unsigned int)drawFramebuffer;
+}
+
+
+unsigned int
+GLStateCache::GetReadFramebuffer( )
+{
+	if( readFramebuffer < 0 )
+	{
+		GLint fbo;
+		glGetIntegerv( GL_READ_FRAMEBUFFER_BINDING, &fbo );
+		readFramebuffer = fbo;
+	}
+	return (unsigned int)readFramebuffer;
+}
+
+
+void
+GLStateCache::GetViewport( int *v )
+{
+	if( viewport[2] < 0 )
+		glGetIntegerv( GL_VIEWPORT, viewport );
+	memcpy( v, viewport, sizeof(viewport) );
+}
+
+
+void
+GLStateCache::Enable( unsigned int cap )
+{
+	int *flag = Flag( cap );
+	if( flag != NULL  &&  *flag == 1 )
+	{
+		elided++;
+		return;
+	}
+	if( flag != NULL )
+		*flag = 1;
+	issued++;
+	glEnable( cap );
+}
+
+
+void
+GLStateCache::Disable( unsigned int cap )
+{
+	int *flag = Flag( cap );
+	if( flag != NULL  &&  *flag == 0 )
+	{
+		elided++;
+		return;
+	}
+	if( flag != NULL )
+		*flag = 0;
+	issued++;
+	glDisable( cap );
+}
+
+
+// true if the bound program's location loc needs setting to value. with no program known to be
+// bound, nothing is shadowed and it always does. location -1 is none: never, and not counted:
+
+bool
+GLStateCache::SetUniform( int loc, const void *value, int size )
+{
+	if( loc < 0 )
+		return false;
+	if( current < 0 )
+	{
+		issued++;
+		return true;
+	}
+	std::vector<Uniform> &uniforms = programs[current].uniforms;
+	if( loc >= (int)uniforms.size( ) )
+	{
+		Uniform unset;
+		unset.size = 0;
+		uniforms.resize( loc + 1, unset );
+	}
+	Uniform &u = uniforms[loc];
+	if( u.size == size  &&  memcmp( u.value, value, size ) == 0 )
+	{
+		elided++;
+		return false;
+	}
+	u.size = size;
+	memcpy( u.value, value, size );
+	issued++;
+	return true;
+}
+
+
+void
+GLStateCache::Uniform1f( int loc, float v )
+{
+	if( SetUniform( loc, &v, sizeof(v) ) )
+		glUniform1f( loc, v );
+}
+
+
+void
+GLStateCache::Uniform1i( int loc, int v )
+{
+	if( SetUniform( loc, &v, sizeof(v) ) )
+		glUniform1i( loc, v );
+}
+
+
+void
+GLStateCache::Uniform2f( int loc, float x, float y )
+{
+	float v[2] = { x, y };
+	if( SetUniform( loc, v, sizeof(v) ) )
+		glUniform2f( loc, x, y );
+}
+
+
+void
+GLStateCache::Uniform3f( int loc, float x, float y, float z )
+{
+	float v[3] = { x, y, z };
+	if( SetUniform( loc, v, sizeof(v) ) )
+		glUniform3f( loc, x, y, z );
+}
+
+
+void
+GLStateCache::UniformMatrix4fv( int loc, const float *m )
+{
+	if( SetUniform( loc, m, 16 * sizeof(float) ) )
+		glUniformMatrix4fv( loc, 1, GL_FALSE, m );
+}
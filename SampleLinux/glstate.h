@@ -0,0 +1,94 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <vector>
+
+
+// the GL state the renderer sets over and over, shadowed so that a call that wouldn't change
+// anything is never made:
+//
+//	bindings	the program, the vertex array, the 2D texture on each unit, the buffers
+//			bound to the targets that aren't part of a vertex array's state, the draw and
+//			read framebuffers, the viewport, and the depth test, blend and cull face enables
+//	uniforms	the last value set at each location of each program, so a value that is the
+//			same from frame to frame -- the camera, the light -- goes to the GL once
+//
+// anything that makes its own GL calls (another module, a glPush/PopAttrib) leaves the bindings
+// shadowed here wrong, so Forget( ) after it: each binding is then made again the next time
+// it's asked for. so does deleting an object that's bound. uniform values are only forgotten with their program (ForgetProgram( ), when
+// it's deleted), since only this sets the locations that are set through it.
+//
+// the Get...( )s hand back what's bound, so something that draws elsewhere can put it back
+// afterwards without a glGet -- which would wait for the GL. only a binding that isn't known is
+// asked of the GL, once.
+//
+// each call counts as issued or elided; ResetCounts( ) once a frame for per-frame numbers.
+
+const int GLSTATE_TEXTURE_UNITS = 16;
+
+
+class GLStateCache
+{
+private:
+	struct Uniform
+	{
+		int		size;			// bytes, 0 if never set
+		unsigned char	value[64];		// up to a mat4
+	};
+
+	struct Program
+	{
+		unsigned int		program;
+		std::vector<Uniform>	uniforms;	// by location
+	};
+
+	std::vector<Program>	programs;
+	int			current;		// index into programs of the bound program, -1 if unknown
+
+	long		program;			// -1 while unknown
+	long		vertexArray;
+	long		activeUnit;
+	long		textures[GLSTATE_TEXTURE_UNITS];
+	long		arrayBuffer, packBuffer, unpackBuffer;
+	long		drawFramebuffer, readFramebuffer;
+	int		viewport[4];			// width -1 while unknown
+	int		depthTest, blend, cullFace;	// -1 unknown, 0 off, 1 on
+
+	long		issued, elided;
+
+	bool	Changes( long &, long );
+	int *	Flag( unsigned int );
+	bool	SetUniform( int, const void *, int );
+
+public:
+		GLStateCache( );
+
+	void	ActiveTexture( unsigned int );
+	void	BindBuffer( unsigned int, unsigned int );
+	void	BindFramebuffer( unsigned int, unsigned int );
+	void	BindTexture( unsigned int, unsigned int );
+	void	BindVertexArray( unsigned int );
+	void	Disable( unsigned int );
+	void	Enable( unsigned int );
+	void	Forget( );
+	void	ForgetProgram( unsigned int );
+	unsigned int	GetDrawFramebuffer( );
+	long	GetElided( )			{ return elided; }
+	long	GetIssued( )			{ return issued; }
+	unsigned int	GetProgram( );
+	unsigned int	GetReadFramebuffer( );
+	void	GetViewport( int * );
+	bool	IsCurrent( unsigned int p )	{ return program == (long)p; }
+	void	ResetCounts( );
+	void	Uniform1f( int, float );
+	void	Uniform1i( int, int );
+	void	Uniform2f( int, float, float );
+	void	Uniform3f( int, float, float, float );
+	void	UniformMatrix4fv( int, const float * );
+	void	UseProgram( unsigned int );
+	void	Viewport( int, int, int, int );
+};
+
+extern GLStateCache	GlState;
+
+#endif	// GLSTATE_H
@@ -0,0 +1,211 @@
+#include "heightfield.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// a private copy of the png decoder, so the simulation links without the renderer's stb_image:
+
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include "stb_image.h"
+
+
+Heightfield::Heightfield( )
+{
+	samples = NULL;
+	map = NULL;
+	mapBytes = 0;
+	width = height = 0;
+	size = heightScale = spacing = maxHeight = 0.f;
+}
+
+
+Heightfield::~Heightfield( )
+{
+	Close( );
+}
+
+
+void
+Heightfield::Close( )
+{
+#ifndef WIN32
+	if( map != NULL )
+		munmap( map, mapBytes );
+#endif
+	map = NULL;
+	mapBytes = 0;
+	samples = NULL;
+	decoded.clear( );
+	decoded.shrink_to_fit( );
+	width = height = 0;
+}
+
+
+static bool
+EndsWith( const char *s, const char *suffix )
+{
+	size_t n = strlen( s ), m = strlen( suffix );
+	return n >= m  &&  strcmp( s + n - m, suffix ) == 0;
+}
+
+
+// the grid's longer side spans size world units, the highest sample is worldHeight above y = 0:
+
+bool
+Heightfield::Load( const char *path, float worldSize, float worldHeight )
+{
+	Close( );
+
+	if( EndsWith( path, ".r16" )  ||  EndsWith( path, ".raw" ) )
+	{
+		// raw samples, little-endian like every machine this runs on:
+
+		size_t bytes = 0;
+#ifdef WIN32
+		FILE *fp = fopen( path, "rb" );
+		if( fp != NULL )
+		{
+			_fseeki64( fp, 0, SEEK_END );
+			bytes = (size_t)_ftelli64( fp );
+			_fseeki64( fp, 0, SEEK_SET );
+			decoded.resize( bytes / 2 );
+			if( fread( decoded.data( ), 2, decoded.size( ), fp ) != decoded.size( ) )
+				decoded.clear( );
+			fclose( fp );
+		}
+		if( ! decoded.empty( ) )
+			samples = decoded.data( );
+#else
+		int fd = open( path, O_RDONLY );
+		struct stat st;
+		if( fd >= 0  &&  fstat( fd, &st ) == 0  &&  st.st_size > 0 )
+		{
+			bytes = (size_t)st.st_size;
+			void *m = mmap( NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0 );
+			if( m != MAP_FAILED )
+			{
+				map = m;
+				mapBytes = bytes;
+				samples = (const unsigned short *)m;
+			}
+		}
+		if( fd >= 0 )
+			close( fd );
+#endif
+		if( samples == NULL )
+		{
+			fprintf( stderr, "Cannot read heightmap '%s'\n", path );
+			return false;
+		}
+		int side = (int)sqrt( (double)( bytes / 2 ) );
+		while( (size_t)( side + 1 ) * ( side + 1 ) * 2 <= bytes )
+			side++;
+		if( side < 2  ||  (size_t)side * side * 2 != bytes )
+		{
+			fprintf( stderr, "'%s' is not a square raw 16-bit heightmap\n", path );
+			Close( );
+			return false;
+		}
+		width = height = side;
+	}
+	else
+	{
+		int n;
+		unsigned short *pixels = stbi_load_16( path, &width, &height, &n, 1 );
+		if( pixels == NULL  ||  width < 2  ||  height < 2 )
+		{
+			fprintf( stderr, "Cannot read heightmap '%s': %s\n", path, pixels == NULL ? stbi_failure_reason( ) : "too small" );
+			stbi_image_free( pixels );
+			width = height = 0;
+			return false;
+		}
+		decoded.assign( pixels, pixels + (size_t)width * height );
+		stbi_image_free( pixels );
+		samples = decoded.data( );
+	}
+
+	size = worldSize;
+	heightScale = worldHeight / 65535.f;
+	spacing = size / (float)( ( width > height ? width : height ) - 1 );
+
+	// the ray marches in Occludes( ) stop once they're above everything. a png's samples are
+	// all in memory already, so they give the real top; finding a mapped file's would read every
+	// page of it, so that's the highest height a sample can have:
+
+	unsigned short top = 65535;
+	if( map == NULL )
+	{
+		top = 0;
+		size_t count = (size_t)width * height;
+		for( size_t i = 0; i < count; i++ )
+			top = samples[i] > top ? samples[i] : top;
+	}
+	maxHeight = (float)top * heightScale;
+	return true;
+}
+
+
+// bilinear between the four samples around (x, z):
+
+float
+Heightfield::HeightAt( float x, float z ) const
+{
+	if( samples == NULL )
+		return 0.f;
+	float gx = ( x + 0.5f * size ) / spacing;
+	float gz = ( z + 0.5f * size ) / spacing;
+	gx = gx < 0.f ? 0.f : ( gx > (float)( width - 1 ) ? (float)( width - 1 ) : gx );
+	gz = gz < 0.f ? 0.f : ( gz > (float)( height - 1 ) ? (float)( height - 1 ) : gz );
+	int ix = (int)gx, iz = (int)gz;
+	float fx = gx - (float)ix, fz = gz - (float)iz;
+	float h00 = Sample( ix, iz ),   h10 = Sample( ix+1, iz );
+	float h01 = Sample( ix, iz+1 ), h11 = Sample( ix+1, iz+1 );
+	return ( h00 + ( h10 - h00 ) * fx ) * ( 1.f - fz ) + ( h01 + ( h11 - h01 ) * fx ) * fz;
+}
+
+
+// from central differences a sample apart:
+
+glm::vec3
+Heightfield::NormalAt( float x, float z ) const
+{
+	if( samples == NULL )
+		return glm::vec3( 0.f, 1.f, 0.f );
+	float dx = HeightAt( x + spacing, z ) - HeightAt( x - spacing, z );
+	float dz = HeightAt( x, z + spacing ) - HeightAt( x, z - spacing );
+	return glm::normalize( glm::vec3( -dx, 2.f * spacing, -dz ) );
+}
+
+
+// does the terrain get in the way of a ray from a point towards unit direction dir?
+// marches a sample spacing at a time, starting one step out so the point's own patch of
+// ground doesn't count, until the ray leaves the grid or rises above its highest sample:
+
+bool
+Heightfield::Occludes( glm::vec3 from, glm::vec3 dir ) const
+{
+	if( samples == NULL  ||  dir.y <= 0.f )
+		return false;
+	float half = 0.5f * size;
+	glm::vec3 step = dir * spacing;
+	glm::vec3 p = from + step;
+	while( p.y <= maxHeight  &&  p.x >= -half  &&  p.x <= half  &&  p.z >= -half  &&  p.z <= half )
+	{
+		if( HeightAt( p.x, p.z ) > p.y )
+			return true;
+		p += step;
+	}
+	return false;
+}
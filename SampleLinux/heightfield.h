@@ -0,0 +1,55 @@
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include <stdio.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+
+// a site's terrain, as a grid of 16-bit height samples:
+// either a 16-bit grayscale png (8-bit ones are widened) or a raw file of little-endian
+// unsigned shorts, square, named .r16 or .raw. raw files are mapped, not read, so an 8k x 8k
+// heightmap only costs the pages the panel layout and the terrain renderer actually touch.
+//
+// the grid covers x and z from -size/2 to +size/2, row 0 at -z (the way the flat terrain's
+// texture coordinates always ran), and a sample of 65535 is height units above y = 0.
+
+class Heightfield
+{
+private:
+	std::vector<unsigned short>	decoded;	// a png's samples
+	const unsigned short *		samples;	// decoded's, or the mapped file's
+	void *				map;
+	size_t				mapBytes;
+	int				width, height;		// samples
+	float				size, heightScale;
+	float				spacing;		// world units between samples
+	float				maxHeight;		// of any sample; for a mapped file, of any possible one
+
+public:
+		Heightfield( );
+		~Heightfield( );
+
+	void	Close( );
+	int	GetHeight( ) const			{ return height; }
+	float	GetMaxHeight( ) const			{ return maxHeight; }
+	float	GetSize( ) const			{ return size; }
+	float	GetSpacing( ) const			{ return spacing; }
+	int	GetWidth( ) const			{ return width; }
+	float	HeightAt( float x, float z ) const;
+	bool	IsLoaded( ) const			{ return samples != NULL; }
+	bool	Load( const char *, float size, float height );
+	glm::vec3	NormalAt( float x, float z ) const;
+	bool	Occludes( glm::vec3 from, glm::vec3 dir ) const;
+
+	// the height of sample (ix, iz), clamped to the grid:
+	float	Sample( int ix, int iz ) const
+		{
+			ix = ix < 0 ? 0 : ( ix >= width ? width - 1 : ix );
+			iz = iz < 0 ? 0 : ( iz >= height ? height - 1 : iz );
+			return (float)samples[ (size_t)iz * width + ix ] * heightScale;
+		}
+};
+
+#endif	// HEIGHTFIELD_H
@@ -0,0 +1,426 @@
+#include "image.h"
+
+#include <string.h>
+#include <vector>
+
+
+// png chunks end with a crc-32 of their type and data:
+
+static unsigned int
+Crc32( unsigned int crc, const unsigned char *data, size_t size )
+{
+	static unsigned int table[256];
+	static bool haveTable = false;
+	if( ! haveTable )
+	{
+		for( unsigned int n = 0; n < 256; n++ )
+		{
+			unsigned int c = n;
+			for( int k = 0; k < 8; k++ )
+				c = ( c & 1 ) ? 0xedb88320u ^ ( c >> 1 ) : c >> 1;
+			table[n] = c;
+		}
+		haveTable = true;
+	}
+
+	crc = ~crc;
+	for( size_t i = 0; i < size; i++ )
+		crc = table[ ( crc ^ data[i] ) & 0xff ] ^ ( crc >> 8 );
+	return ~crc;
+}
+
+
+static void
+PutBigEndian( std::vector<unsigned char> &out, unsigned int v )
+{
+	out.push_back( (unsigned char)( v >> 24 ) );
+	out.push_back( (unsigned char)( v >> 16 ) );
+	out.push_back( (unsigned char)( v >>  8 ) );
+	out.push_back( (unsigned char)( v ) );
+}
+
+
+static void
+PutChunk( FILE *fp, const char *type, const std::vector<unsigned char> &data )
+{
+	std::vector<unsigned char> chunk;
+	PutBigEndian( chunk, (unsigned int)data.size( ) );
+	chunk.insert( chunk.end( ), type, type + 4 );
+	chunk.insert( chunk.end( ), data.begin( ), data.end( ) );
+	PutBigEndian( chunk, Crc32( 0, &chunk[4], chunk.size( ) - 4 ) );
+	fwrite( chunk.data( ), 1, chunk.size( ), fp );
+}
+
+
+// each row filtered with whichever of none, sub and up leaves the smallest differences (the
+// usual heuristic), which turns the smooth gradients and flat areas of a rendered frame into
+// runs of zeros and short repeats for Deflate( ):
+
+static void
+FilterRows( const unsigned char *rgba, int width, int height, std::vector<unsigned char> &raw )
+{
+	size_t rowBytes = 4 * (size_t)width;
+	raw.resize( ( rowBytes + 1 ) * height );
+	for( int y = 0; y < height; y++ )
+	{
+		const unsigned char *row = &rgba[ y * rowBytes ];
+		const unsigned char *above = y > 0 ? row - rowBytes : NULL;
+		unsigned long cost[3] = { 0, 0, 0 };
+		for( size_t x = 0; x < rowBytes; x++ )
+		{
+			unsigned char sub = row[x] - ( x >= 4 ? row[x-4] : 0 );
+			unsigned char up = row[x] - ( above != NULL ? above[x] : 0 );
+			cost[0] += row[x] < 128 ? row[x] : 256 - row[x];
+			cost[1] += sub < 128 ? sub : 256 - sub;
+			cost[2] += up < 128 ? up : 256 - up;
+		}
+		int filter = cost[1] < cost[0] ? 1 : 0;
+		if( cost[2] < cost[filter] )
+			filter = 2;
+
+		unsigned char *out = &raw[ y * ( rowBytes + 1 ) ];
+		out[0] = (unsigned char)filter;
+		for( size_t x = 0; x < rowBytes; x++ )
+		{
+			unsigned char prior = filter == 1 ? ( x >= 4 ? row[x-4] : 0 ) : filter == 2 ? ( above != NULL ? above[x] : 0 ) : 0;
+			out[x+1] = row[x] - prior;
+		}
+	}
+}
+
+
+// deflate's bits go out least significant first, but its Huffman codes most significant first.
+// they gather in bits and go out 4 bytes at a time, into room the caller made for them:
+
+struct BitWriter
+{
+	unsigned char *		next;
+	unsigned long long	bits;
+	int			count;
+};
+
+
+static inline void
+PutBits( BitWriter &w, unsigned int value, int n )
+{
+	w.bits |= (unsigned long long)value << w.count;
+	w.count += n;
+	if( w.count >= 32 )
+	{
+		w.next[0] = (unsigned char)w.bits;
+		w.next[1] = (unsigned char)( w.bits >> 8 );
+		w.next[2] = (unsigned char)( w.bits >> 16 );
+		w.next[3] = (unsigned char)( w.bits >> 24 );
+		w.next += 4;
+		w.bits >>= 32;
+		w.count -= 32;
+	}
+}
+
+
+static unsigned int
+Reverse( unsigned int code, int n )
+{
+	unsigned int reversed = 0;
+	for( int i = 0; i < n; i++ )
+		reversed |= ( ( code >> i ) & 1 ) << ( n - 1 - i );
+	return reversed;
+}
+
+
+// a literal byte, a length code (257-285) or the end of the block (256), by the fixed table,
+// its codes reversed once up front rather than for every symbol:
+
+static unsigned short SymbolCode[288];
+static unsigned char SymbolBits[288];
+
+
+static void
+MakeSymbolCodes( )
+{
+	for( int v = 0; v < 288; v++ )
+	{
+		if( v < 144 )		{ SymbolBits[v] = 8;	SymbolCode[v] = Reverse( 0x30 + v, 8 ); }
+		else if( v < 256 )	{ SymbolBits[v] = 9;	SymbolCode[v] = Reverse( 0x190 + v - 144, 9 ); }
+		else if( v < 280 )	{ SymbolBits[v] = 7;	SymbolCode[v] = Reverse( v - 256, 7 ); }
+		else			{ SymbolBits[v] = 8;	SymbolCode[v] = Reverse( 0xc0 + v - 280, 8 ); }
+	}
+}
+
+
+static inline void
+PutSymbol( BitWriter &w, int v )
+{
+	PutBits( w, SymbolCode[v], SymbolBits[v] );
+}
+
+
+static const int LengthBase[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const int LengthExtra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const int DistanceBase[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const int DistanceExtra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+const int DEFLATE_WINDOW = 32768;
+const int DEFLATE_MAX_MATCH = 258;
+const int DEFLATE_HASH_BITS = 15;
+
+
+static inline unsigned int
+Read32( const unsigned char *p )
+{
+	unsigned int v;
+	memcpy( &v, p, 4 );
+	return v;
+}
+
+
+static inline unsigned long long
+Read64( const unsigned char *p )
+{
+	unsigned long long v;
+	memcpy( &v, p, 8 );
+	return v;
+}
+
+
+// one fixed-Huffman block of greedy LZ77 matches, each found through a hash of its first 4 bytes
+// (one candidate per hash, no chains) -- about what zlib's fastest level does, without zlib, and
+// fast enough for a capture thread to keep up with the frames:
+
+static void
+Deflate( const unsigned char *data, size_t size, std::vector<unsigned char> &out )
+{
+	// the length and distance codes, looked up instead of searched for:
+	static unsigned char lengthCode[DEFLATE_MAX_MATCH+1], distanceCode[512];
+	static bool haveTables = false;
+	if( ! haveTables )
+	{
+		for( int c = 0; c < 29; c++ )
+			for( int l = LengthBase[c]; l < LengthBase[c] + ( 1 << LengthExtra[c] )  &&  l <= DEFLATE_MAX_MATCH; l++ )
+				lengthCode[l] = (unsigned char)c;
+		lengthCode[DEFLATE_MAX_MATCH] = 28;
+		for( int c = 0; c < 30; c++ )
+			for( int d = DistanceBase[c]; d < DistanceBase[c] + ( 1 << DistanceExtra[c] ); d++ )
+			{
+				if( d <= 256 )
+					distanceCode[d-1] = (unsigned char)c;
+				else
+					distanceCode[ 256 + ( ( d-1 ) >> 7 ) ] = (unsigned char)c;
+			}
+		MakeSymbolCodes( );
+		haveTables = true;
+	}
+
+	// a literal is at most 9 bits and a match (4 bytes or more) at most 31, so the output can't
+	// be more than 9/8 of the input, plus the block header and the end code:
+	size_t start = out.size( );
+	out.resize( start + size + size/8 + 16 );
+	BitWriter w = { &out[start], 0, 0 };
+	PutBits( w, 1, 1 );		// the final block
+	PutBits( w, 1, 2 );		// fixed Huffman codes
+
+	std::vector<int> head( 1 << DEFLATE_HASH_BITS, -1 );
+	size_t i = 0;
+	while( i + 4 <= size )
+	{
+		unsigned int h = ( Read32( &data[i] ) * 2654435761u ) >> ( 32 - DEFLATE_HASH_BITS );
+		int candidate = head[h];
+		head[h] = (int)i;
+		if( candidate >= 0  &&  i - candidate <= (size_t)DEFLATE_WINDOW  &&  Read32( &data[candidate] ) == Read32( &data[i] ) )
+		{
+			int length = 4;
+			int most = size - i < DEFLATE_MAX_MATCH ? (int)( size - i ) : DEFLATE_MAX_MATCH;
+			while( length + 8 <= most  &&  Read64( &data[candidate+length] ) == Read64( &data[i+length] ) )
+				length += 8;
+			while( length < most  &&  data[candidate+length] == data[i+length] )
+				length++;
+			int distance = (int)( i - candidate );
+
+			int lc = lengthCode[length];
+			PutSymbol( w, 257 + lc );
+			if( LengthExtra[lc] > 0 )
+				PutBits( w, length - LengthBase[lc], LengthExtra[lc] );
+			int dc = distance <= 256 ? distanceCode[distance-1] : distanceCode[ 256 + ( ( distance-1 ) >> 7 ) ];
+			PutBits( w, Reverse( dc, 5 ), 5 );
+			if( DistanceExtra[dc] > 0 )
+				PutBits( w, distance - DistanceBase[dc], DistanceExtra[dc] );
+			i += length;
+		}
+		else
+			PutSymbol( w, data[i++] );
+	}
+	while( i < size )
+		PutSymbol( w, data[i++] );
+	PutSymbol( w, 256 );
+	for( ; w.count > 0; w.count -= 8 )
+	{
+		*w.next++ = (unsigned char)w.bits;
+		w.bits >>= 8;
+	}
+	out.resize( w.next - out.data( ) );
+}
+
+
+// the sums are only reduced every 5552 bytes, the most that can't overflow them:
+
+static unsigned int
+Adler32( const unsigned char *data, size_t size )
+{
+	unsigned int a = 1, b = 0;
+	while( size > 0 )
+	{
+		size_t n = size < 5552 ? size : 5552;
+		size -= n;
+		while( n-- > 0 )
+		{
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return ( b << 16 ) | a;
+}
+
+
+bool
+WritePng( const char *path, int width, int height, const unsigned char *rgba )
+{
+	FILE *fp = fopen( path, "wb" );
+	if( fp == NULL )
+	{
+		fprintf( stderr, "Cannot create png file '%s'\n", path );
+		return false;
+	}
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	fwrite( signature, 1, 8, fp );
+
+	std::vector<unsigned char> header;
+	PutBigEndian( header, width );
+	PutBigEndian( header, height );
+	header.push_back( 8 );		// bits per channel
+	header.push_back( 6 );		// rgba
+	header.push_back( 0 );		// deflate
+	header.push_back( 0 );		// adaptive filtering (none, sub or up, per row)
+	header.push_back( 0 );		// not interlaced
+	PutChunk( fp, "IHDR", header );
+
+	// the scanlines, each led by its filter type byte:
+
+	std::vector<unsigned char> raw;
+	FilterRows( rgba, width, height, raw );
+
+	// a zlib stream: its header, the deflated scanlines, and the adler-32 of them:
+
+	std::vector<unsigned char> zlib;
+	zlib.reserve( raw.size( ) / 4 + 64 );
+	zlib.push_back( 0x78 );
+	zlib.push_back( 0x01 );
+	Deflate( raw.data( ), raw.size( ), zlib );
+	PutBigEndian( zlib, Adler32( raw.data( ), raw.size( ) ) );
+	PutChunk( fp, "IDAT", zlib );
+
+	PutChunk( fp, "IEND", std::vector<unsigned char>( ) );
+
+	bool ok = ferror( fp ) == 0;
+	fclose( fp );
+	if( ! ok )
+		fprintf( stderr, "Cannot write png file '%s'\n", path );
+	return ok;
+}
+
+
+// the largest possible YIQ distance (black vs. white):
+
+const float MAX_YIQ_DELTA = 35215.f;
+
+
+static float
+YiqDelta( const unsigned char *p, const unsigned char *q )
+{
+	float r = (float)p[0] - (float)q[0];
+	float g = (float)p[1] - (float)q[1];
+	float b = (float)p[2] - (float)q[2];
+	float y = r * 0.29889531f + g * 0.58662247f + b * 0.11448223f;
+	float i = r * 0.59597799f - g * 0.27417610f - b * 0.32180189f;
+	float iq = r * 0.21147017f - g * 0.52261711f + b * 0.31114694f;
+	return 0.5053f * y*y + 0.299f * i*i + 0.1957f * iq*iq;
+}
+
+
+int
+CompareImages( const unsigned char *image1, const unsigned char *image2, int width, int height,
+		float threshold, unsigned char *diff )
+{
+	float maxDelta = MAX_YIQ_DELTA * threshold * threshold;
+	int numDifferent = 0;
+	int numPixels = width * height;
+	for( int i = 0; i < numPixels; i++ )
+	{
+		const unsigned char *p = &image1[4*i];
+		const unsigned char *q = &image2[4*i];
+		bool different = YiqDelta( p, q ) > maxDelta;
+		if( different )
+			numDifferent++;
+
+		if( diff != NULL )
+		{
+			unsigned char *d = &diff[4*i];
+			if( different )
+			{
+				d[0] = 255;
+				d[1] = d[2] = 0;
+			}
+			else
+			{
+				unsigned char gray = (unsigned char)( 191 + ( 0.299f*p[0] + 0.587f*p[1] + 0.114f*p[2] ) / 4.f );
+				d[0] = d[1] = d[2] = gray;
+			}
+			d[3] = 255;
+		}
+	}
+	return numDifferent;
+}
+
+
+void
+FlipRows( unsigned char *rgba, int width, int height )
+{
+	size_t rowBytes = 4 * (size_t)width;
+	std::vector<unsigned char> row( rowBytes );
+	for( int y = 0; y < height / 2; y++ )
+	{
+		unsigned char *top = &rgba[ y * rowBytes ];
+		unsigned char *bottom = &rgba[ ( height - 1 - y ) * rowBytes ];
+		memcpy( row.data( ), top, rowBytes );
+		memcpy( top, bottom, rowBytes );
+		memcpy( bottom, row.data( ), rowBytes );
+	}
+}
+
+
+std::vector<unsigned char>
+HalfSize( const unsigned char *rgba, int width, int height, int &newWidth, int &newHeight )
+{
+	newWidth = width > 1 ? width / 2 : 1;
+	newHeight = height > 1 ? height / 2 : 1;
+	std::vector<unsigned char> half( 4 * (size_t)newWidth * newHeight );
+	for( int y = 0; y < newHeight; y++ )
+	{
+		int y0 = 2*y < height ? 2*y : height - 1;
+		int y1 = 2*y + 1 < height ? 2*y + 1 : height - 1;
+		for( int x = 0; x < newWidth; x++ )
+		{
+			int x0 = 2*x < width ? 2*x : width - 1;
+			int x1 = 2*x + 1 < width ? 2*x + 1 : width - 1;
+			for( int c = 0; c < 4; c++ )
+			{
+				int sum = rgba[ 4 * ( (size_t)y0 * width + x0 ) + c ] + rgba[ 4 * ( (size_t)y0 * width + x1 ) + c ]
+					+ rgba[ 4 * ( (size_t)y1 * width + x0 ) + c ] + rgba[ 4 * ( (size_t)y1 * width + x1 ) + c ];
+				half[ 4 * ( (size_t)y * newWidth + x ) + c ] = (unsigned char)( ( sum + 2 ) / 4 );
+			}
+		}
+	}
+	return half;
+}
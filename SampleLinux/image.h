@@ -0,0 +1,37 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <vector>
+
+
+// rgba8 images in memory, row 0 at the top:
+// writing them as png, and comparing two of them the way a viewer would see the difference.
+
+// a png compressed by a small deflate of its own (row filters, greedy matches, fixed Huffman
+// codes -- about zlib's fastest level), so it needs no zlib. any png reader (stbi_load included)
+// reads it back:
+
+bool	WritePng( const char *, int, int, const unsigned char * );
+
+
+// the number of pixels that differ visibly, by the YIQ color distance pixelmatch uses:
+// a pixel differs when its distance is more than threshold (0. - 1.) of the largest possible one,
+// so anti-aliasing noise and tiny rasterization changes pass and a moved or recolored object doesn't.
+// if diff isn't NULL, it gets a faded gray copy of the first image with the differing pixels in red:
+//	image1, image2, width, height, threshold, diff
+
+int	CompareImages( const unsigned char *, const unsigned char *, int, int, float, unsigned char * );
+
+
+// turn an image upside down in place (glReadPixels gives row 0 at the bottom):
+
+void	FlipRows( unsigned char *, int, int );
+
+
+// the next mip level down, each pixel the mean of the 2x2 above it (the last row or column
+// of an odd size is counted twice): rgba, width, height, and the new width and height back:
+
+std::vector<unsigned char>	HalfSize( const unsigned char *, int, int, int &, int & );
+
+#endif	// IMAGE_H
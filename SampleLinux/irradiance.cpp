@@ -0,0 +1,129 @@
+#include "irradiance.h"
+
+#include <math.h>
+
+
+// extraterrestrial normal irradiance, W/m^2:
+
+const float SOLAR_CONSTANT = 1367.f;
+
+// the Perez model doesn't let the circumsolar term blow up as the sun reaches the horizon:
+
+const float MIN_COS_ZENITH = 0.087156f;		// cos(85 degrees)
+
+
+// Perez et al. 1990 "allsites composite" coefficients, one row per sky-clearness bin:
+//	F11, F12, F13, F21, F22, F23
+
+const int PEREZ_BINS = 8;
+
+const float PEREZ_EPSILON_LIMITS[PEREZ_BINS-1] = { 1.065f, 1.230f, 1.500f, 1.950f, 2.800f, 4.500f, 6.200f };
+
+const float PEREZ_COEFFS[PEREZ_BINS][6] =
+{
+	{ -0.008f,  0.588f, -0.062f, -0.060f,  0.072f, -0.022f },
+	{  0.130f,  0.683f, -0.151f, -0.019f,  0.066f, -0.029f },
+	{  0.330f,  0.487f, -0.221f,  0.055f, -0.064f, -0.026f },
+	{  0.568f,  0.187f, -0.295f,  0.109f, -0.152f, -0.014f },
+	{  0.873f, -0.392f, -0.362f,  0.226f, -0.462f,  0.001f },
+	{  1.132f, -1.237f, -0.412f,  0.288f, -0.823f,  0.056f },
+	{  1.060f, -1.600f, -0.359f,  0.264f, -1.127f,  0.131f },
+	{  0.678f, -0.327f, -0.250f,  0.156f, -1.377f,  0.251f }
+};
+
+
+// the circumsolar (F1) and horizon (F2) brightness coefficients.
+// they depend only on the sky, so they are computed once per call, not per panel:
+
+static void
+PerezBrightness( float cosZenith, const WeatherRecord &wx, float *f1, float *f2 )
+{
+	*f1 = *f2 = 0.f;
+	if( wx.dhi <= 0.f  ||  cosZenith <= 0.f )
+		return;
+
+	float zenith = acosf( cosZenith );
+	float zenithDeg = glm::degrees( zenith );
+
+	// sky clearness:
+
+	const float kappa = 1.041f;
+	float z3 = kappa * zenith * zenith * zenith;
+	float epsilon = ( ( wx.dhi + wx.dni ) / wx.dhi + z3 ) / ( 1.f + z3 );
+
+	// sky brightness, with the Kasten-Young relative air mass:
+
+	float airMass = 1.f / ( cosZenith + 0.50572f * powf( 96.07995f - zenithDeg, -1.6364f ) );
+	float delta = wx.dhi * airMass / SOLAR_CONSTANT;
+
+	int bin = 0;
+	while( bin < PEREZ_BINS-1  &&  epsilon >= PEREZ_EPSILON_LIMITS[bin] )
+		bin++;
+	const float *F = PEREZ_COEFFS[bin];
+
+	*f1 = fmaxf( 0.f, F[0] + F[1]*delta + F[2]*zenith );
+	*f2 = F[3] + F[4]*delta + F[5]*zenith;
+}
+
+
+void
+ComputePlaneOfArray( const float *anglesDeg, int numPanels, glm::vec3 sunDir, const WeatherRecord &wx,
+			int model, float albedo, PlaneOfArray *poa, const glm::vec3 *groundNormals )
+{
+	float cosZenith = sunDir.y;
+	float dni = cosZenith > 0.f ? fmaxf( wx.dni, 0.f ) : 0.f;
+	float dhi = fmaxf( wx.dhi, 0.f );
+	float ghi = fmaxf( wx.ghi, 0.f );
+
+	// the isotropic model is Perez with both brightening terms off:
+
+	float f1 = 0.f, f2 = 0.f;
+	if( model == PEREZ )
+		PerezBrightness( cosZenith, wx, &f1, &f2 );
+	float circumsolarScale = f1 / fmaxf( cosZenith, MIN_COS_ZENITH );
+
+	float sx = sunDir.x;
+	float sy = sunDir.y;
+
+	// a block at a time: the sines and cosines are libm calls, the rest is straight-line
+	// arithmetic over the block that the compiler vectorizes:
+
+	const int BLOCK = 256;
+	float cosTilt[BLOCK], sinTilt[BLOCK], cosGround[BLOCK];
+	for( int first = 0; first < numPanels; first += BLOCK )
+	{
+		int n = numPanels - first < BLOCK ? numPanels - first : BLOCK;
+		for( int k = 0; k < n; k++ )
+		{
+			float a = glm::radians( anglesDeg[first+k] );
+			cosTilt[k] = cosf( a );
+			sinTilt[k] = sinf( a );
+		}
+
+		// the panel sees the ground over the angle between its normal and the ground's:
+
+		if( groundNormals == NULL )
+			for( int k = 0; k < n; k++ )
+				cosGround[k] = cosTilt[k];
+		else
+			for( int k = 0; k < n; k++ )
+			{
+				glm::vec3 g = groundNormals[first+k];
+				cosGround[k] = -sinTilt[k]*g.x + cosTilt[k]*g.y;
+			}
+
+		float *beam = poa->beam + first;
+		float *sky = poa->sky + first;
+		float *ground = poa->ground + first;
+		for( int k = 0; k < n; k++ )
+		{
+			float cosAOI = -sinTilt[k]*sx + cosTilt[k]*sy;		// panel normal has no z
+			cosAOI = cosAOI > 0.f ? cosAOI : 0.f;
+			float s = dhi * ( ( 1.f - f1 ) * 0.5f * ( 1.f + cosTilt[k] )  +  circumsolarScale * cosAOI  +  f2 * fabsf( sinTilt[k] ) );
+
+			beam[k]   = dni * cosAOI;
+			sky[k]    = s > 0.f ? s : 0.f;
+			ground[k] = ghi * albedo * 0.5f * ( 1.f - cosGround[k] );
+		}
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef IRRADIANCE_H
+#define IRRADIANCE_H
+
+#include <stdio.h>
+
+#include <glm/glm.hpp>
+
+#include "weather.h"
+
+
+// plane-of-array irradiance:
+// transposes the horizontal/normal irradiances of a weather record onto each tilted panel,
+// split into the three parts that reach it -- beam from the sun's disk, diffuse from the sky,
+// and light reflected off the ground.
+// the sky-diffuse part comes from one of two transposition models:
+
+enum TranspositionModels
+{
+	ISOTROPIC,	// the sky is equally bright everywhere (Liu-Jordan)
+	PEREZ		// circumsolar and horizon brightening (Perez et al. 1990)
+};
+
+const float DEFAULT_ALBEDO = 0.2f;	// grass
+
+
+// W/m^2 on each panel, structure-of-arrays:
+
+struct PlaneOfArray
+{
+	float *	beam;
+	float *	sky;
+	float *	ground;
+};
+
+
+// every panel tilts about world +z by anglesDeg[i] (the tracker convention), so its normal is
+// ( -sin(angle), cos(angle), 0 ).  sunDir is a unit vector towards the sun.
+// the ground each panel sees is level, unless groundNormals gives the slope under each one.
+//	anglesDeg, numPanels, sunDir, weather, model, albedo, poa, groundNormals
+
+void	ComputePlaneOfArray( const float *, int, glm::vec3, const WeatherRecord &, int, float, PlaneOfArray *, const glm::vec3 * = NULL );
+
+#endif	// IRRADIANCE_H
@@ -0,0 +1,127 @@
+#include "ktx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+static const unsigned char KtxIdentifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+static const unsigned int KtxEndianness = 0x04030201;
+
+// the header after the identifier, in order:
+enum KtxFields
+{
+	HEADER_ENDIANNESS, HEADER_GL_TYPE, HEADER_GL_TYPE_SIZE, HEADER_GL_FORMAT,
+	HEADER_GL_INTERNAL_FORMAT, HEADER_GL_BASE_INTERNAL_FORMAT,
+	HEADER_PIXEL_WIDTH, HEADER_PIXEL_HEIGHT, HEADER_PIXEL_DEPTH,
+	HEADER_NUM_ARRAY_ELEMENTS, HEADER_NUM_FACES, HEADER_NUM_MIP_LEVELS, HEADER_KEY_VALUE_BYTES,
+	NUM_KTX_FIELDS
+};
+
+
+// the ints are written in this machine's order, and the endianness field says which that was:
+
+static unsigned int
+Swap( unsigned int v )
+{
+	return ( v >> 24 ) | ( ( v >> 8 ) & 0xff00 ) | ( ( v << 8 ) & 0xff0000 ) | ( v << 24 );
+}
+
+
+bool
+ReadKtx( const char *path, KtxImage &image )
+{
+	FILE *fp = fopen( path, "rb" );
+	if( fp == NULL )
+		return false;
+
+	unsigned char identifier[12];
+	unsigned int header[NUM_KTX_FIELDS];
+	bool ok = fread( identifier, 1, 12, fp ) == 12  &&  memcmp( identifier, KtxIdentifier, 12 ) == 0
+		&&  fread( header, sizeof(unsigned int), NUM_KTX_FIELDS, fp ) == NUM_KTX_FIELDS;
+	bool swap = ok  &&  header[HEADER_ENDIANNESS] == Swap( KtxEndianness );
+	if( swap )
+		for( int i = 0; i < NUM_KTX_FIELDS; i++ )
+			header[i] = Swap( header[i] );
+	ok = ok  &&  header[HEADER_ENDIANNESS] == KtxEndianness;
+
+	// only what texconv writes -- one 2d face, no arrays:
+	ok = ok  &&  header[HEADER_PIXEL_WIDTH] > 0  &&  header[HEADER_PIXEL_HEIGHT] > 0  &&  header[HEADER_PIXEL_DEPTH] == 0
+		&&  header[HEADER_NUM_ARRAY_ELEMENTS] == 0  &&  header[HEADER_NUM_FACES] == 1
+		&&  fseek( fp, header[HEADER_KEY_VALUE_BYTES], SEEK_CUR ) == 0;
+	if( ! ok )
+	{
+		fprintf( stderr, "'%s' is not a 2D KTX texture\n", path );
+		fclose( fp );
+		return false;
+	}
+
+	image.glType = header[HEADER_GL_TYPE];
+	image.glFormat = header[HEADER_GL_FORMAT];
+	image.glInternalFormat = header[HEADER_GL_INTERNAL_FORMAT];
+	image.glBaseInternalFormat = header[HEADER_GL_BASE_INTERNAL_FORMAT];
+	int numLevels = header[HEADER_NUM_MIP_LEVELS] > 0 ? header[HEADER_NUM_MIP_LEVELS] : 1;
+	image.levels.resize( numLevels );
+
+	int width = header[HEADER_PIXEL_WIDTH], height = header[HEADER_PIXEL_HEIGHT];
+	for( int l = 0; l < numLevels  &&  ok; l++ )
+	{
+		KtxLevel &level = image.levels[l];
+		level.width = width;
+		level.height = height;
+		unsigned int size;
+		ok = fread( &size, sizeof(size), 1, fp ) == 1;
+		if( swap )
+			size = Swap( size );
+		level.data.resize( size );
+		ok = ok  &&  fread( level.data.data( ), 1, size, fp ) == size
+			&&  fseek( fp, 3 - ( size + 3 ) % 4, SEEK_CUR ) == 0;		// mip padding
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+	fclose( fp );
+	if( ! ok )
+		fprintf( stderr, "'%s' is truncated\n", path );
+	return ok;
+}
+
+
+bool
+WriteKtx( const char *path, const KtxImage &image )
+{
+	if( image.levels.empty( ) )
+		return false;
+	FILE *fp = fopen( path, "wb" );
+	if( fp == NULL )
+	{
+		fprintf( stderr, "Cannot create '%s'\n", path );
+		return false;
+	}
+
+	unsigned int header[NUM_KTX_FIELDS] = { 0 };
+	header[HEADER_ENDIANNESS] = KtxEndianness;
+	header[HEADER_GL_TYPE] = image.glType;
+	header[HEADER_GL_TYPE_SIZE] = 1;				// bytes, for unsigned bytes and for blocks alike
+	header[HEADER_GL_FORMAT] = image.glFormat;
+	header[HEADER_GL_INTERNAL_FORMAT] = image.glInternalFormat;
+	header[HEADER_GL_BASE_INTERNAL_FORMAT] = image.glBaseInternalFormat;
+	header[HEADER_PIXEL_WIDTH] = image.levels[0].width;
+	header[HEADER_PIXEL_HEIGHT] = image.levels[0].height;
+	header[HEADER_NUM_FACES] = 1;
+	header[HEADER_NUM_MIP_LEVELS] = (unsigned int)image.levels.size( );
+
+	bool ok = fwrite( KtxIdentifier, 1, 12, fp ) == 12
+		&&  fwrite( header, sizeof(unsigned int), NUM_KTX_FIELDS, fp ) == NUM_KTX_FIELDS;
+	static const unsigned char zeros[3] = { 0, 0, 0 };
+	for( size_t l = 0; l < image.levels.size( )  &&  ok; l++ )
+	{
+		unsigned int size = (unsigned int)image.levels[l].data.size( );
+		ok = fwrite( &size, sizeof(size), 1, fp ) == 1
+			&&  fwrite( image.levels[l].data.data( ), 1, size, fp ) == size
+			&&  fwrite( zeros, 1, 3 - ( size + 3 ) % 4, fp ) == 3 - ( size + 3 ) % 4;
+	}
+	if( fclose( fp ) != 0 )
+		ok = false;
+	if( ! ok )
+		fprintf( stderr, "Cannot write '%s'\n", path );
+	return ok;
+}
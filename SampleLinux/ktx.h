@@ -0,0 +1,36 @@
+#ifndef KTX_H
+#define KTX_H
+
+#include <vector>
+
+
+// KTX 1.1 texture files -- a 2D texture, one face, every mip level, either block-compressed
+// (glFormat == 0, the blocks as glCompressedTexImage2D takes them) or uncompressed rgba8.
+// texconv writes them; TextureManager uploads them without decoding anything.
+// the rows are top row first, as stbi_load gives them.
+
+struct KtxLevel
+{
+	int				width, height;
+	std::vector<unsigned char>	data;
+};
+
+struct KtxImage
+{
+	unsigned int		glType;			// 0 if compressed
+	unsigned int		glFormat;		// 0 if compressed
+	unsigned int		glInternalFormat;
+	unsigned int		glBaseInternalFormat;
+	std::vector<KtxLevel>	levels;			// level 0 first
+};
+
+const unsigned int KTX_GL_UNSIGNED_BYTE = 0x1401;
+const unsigned int KTX_GL_RGB = 0x1907;
+const unsigned int KTX_GL_RGBA = 0x1908;
+const unsigned int KTX_GL_RGBA8 = 0x8058;
+
+
+bool	ReadKtx( const char *, KtxImage & );
+bool	WriteKtx( const char *, const KtxImage & );
+
+#endif	// KTX_H
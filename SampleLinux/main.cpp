@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fstream>
 #include <ctype.h>
 #include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <chrono>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -30,6 +34,20 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "simulation.h"
+#include "telemetry.h"
+#include "metrics.h"
+#include "offscreen.h"
+#include "image.h"
+#include "capture.h"
+#include "texturemanager.h"
+#include "virtualtexture.h"
+#include "terrain.h"
+#include "programcache.h"
+#include "glslprogram.h"
+#include "glstate.h"
+#include "compilethread.h"
+
 // Constants:
 const char *WINDOWTITLE = "OpenGL / GLUT Sample Minimal";
 const int INIT_WINDOW_SIZE = 600;
@@ -56,66 +74,158 @@ float Scale = 1.0f;
 float Xrot = 0.f, Yrot = 0.f;
 
 bool autoRotate = true;
-float Time = 0.f;
-
-// Panels:
-enum ProjectionType { ORTHO, PERSP };
-ProjectionType NowProjection = PERSP;
 
-// Panel grid positions (9 panels):
-glm::vec3 panelPositionsArr[] = {
-    glm::vec3(-2.0f, 0.5f, -2.0f),
-    glm::vec3(0.0f, 0.5f, -2.0f),
-    glm::vec3(2.0f, 0.5f, -2.0f),
-    glm::vec3(-2.0f, 0.5f, 0.0f),
-    glm::vec3(0.0f, 0.5f, 0.0f),
-    glm::vec3(2.0f, 0.5f, 0.0f),
-    glm::vec3(-2.0f, 0.5f, 2.0f),
-    glm::vec3(0.0f, 0.5f, 2.0f),
-    glm::vec3(2.0f, 0.5f, 2.0f)
+// Fixed-timestep simulation: the simulation advances in SIM_DT steps of animation time,
+// however fast or slow frames arrive. One MS_PER_CYCLE of animation is one simulated day.
+const float SIM_DT = 1.f / 60.f;
+const float MAX_FRAME_TIME = 0.25f;     // longest gap simulated after a stall
+const float SIM_SECONDS_PER_SECOND = SECONDS_PER_DAY * 1000.f / (float)MS_PER_CYCLE;
+
+// The panel field, sun, weather and trackers:
+SimConfig Config;
+Simulation Sim;
+
+// Log file, appended to as records come in:
+const char* LOG_FILE = "panel_log.txt";
+size_t LogsWritten = 0;                 // records of Sim.GetLogs() already in the file
+
+// Snapshots ('--snapshot file' restores from it at startup, then saves to it periodically):
+const char* SnapshotPath = NULL;
+SnapshotWriter Snapshots;
+const float SNAPSHOT_INTERVAL = 30.f;   // seconds
+
+// Live telemetry ('--telemetry port' or '--telemetry /path/to/socket'):
+TelemetryServer Telemetry;
+bool TelemetryOn = false;
+TelemetryFrame Frame;
+std::vector<double> LastEnergy;         // per panel, at the last published frame
+
+// Health metrics ('--metrics port' serves them), registered in registerMetrics():
+int FrameSeconds, DisplaySeconds, AssetLoadSeconds;
+int SimTicks, DrawCalls, GlCalls, GlCallsElided, LogRecordsWritten, LogBytesFlushed, AssetBytesLoaded;
+
+// Headless rendering ('--headless frames', with '--size WxH'): no window, just a throughput report:
+int HeadlessFrames = 0;
+int HeadlessWidth = INIT_WINDOW_SIZE, HeadlessHeight = INIT_WINDOW_SIZE;
+
+// Golden images ('--golden dir', also headless): fixed views of the field, each compared with
+// dir/<name>.png. A missing png is a failure; '--record' writes every view's png instead of comparing.
+struct GoldenView {
+    const char* name;
+    float dayFraction;
+    int trackingMode;
 };
-
-// For logging:
-struct PanelLog {
-    int panelID;
-    glm::vec3 position;
-    float timeStamp;
-    float sunlightStrength;
-
-    PanelLog(int id, glm::vec3 pos, float time, float strength)
-        : panelID(id), position(pos), timeStamp(time), sunlightStrength(strength) {}
+const GoldenView GOLDEN_VIEWS[] = {
+    { "sunrise-true",   0.02f, TRUE_TRACKING },
+    { "sunrise-back",   0.02f, BACKTRACKING },
+    { "morning-true",   0.10f, TRUE_TRACKING },
+    { "morning-back",   0.10f, BACKTRACKING },
+    { "noon",           0.25f, TRUE_TRACKING },
+    { "afternoon-back", 0.40f, BACKTRACKING },
+    { "night",          0.75f, TRUE_TRACKING },
 };
+const float GOLDEN_THRESHOLD = 0.1f;        // YIQ distance, as a fraction of the largest, that's a visible change
+const float GOLDEN_MAX_DIFFERENT = 0.001f;  // fraction of the pixels that may change visibly
+const char* GoldenDir = NULL;
+bool GoldenRecord = false;
+
+// Frame capture ('--capture dir', '--capture-format png|yuv'): every frame drawn, windowed or headless:
+FrameCapture Capture;
+const char* CaptureDir = NULL;
+int CaptureFormat = CAPTURE_PNG;
+
+static void registerMetrics() {
+    FrameSeconds = Metrics.Histogram("sample_frame_seconds", "Time between Animate() calls", METRICS_TIME_BUCKETS, METRICS_NUM_TIME_BUCKETS);
+    DisplaySeconds = Metrics.Histogram("sample_display_seconds", "CPU time spent in Display()", METRICS_TIME_BUCKETS, METRICS_NUM_TIME_BUCKETS);
+    AssetLoadSeconds = Metrics.Histogram("sample_asset_load_seconds", "Time to load one asset file", METRICS_TIME_BUCKETS, METRICS_NUM_TIME_BUCKETS);
+    SimTicks = Metrics.Counter("sample_sim_ticks_total", "Fixed simulation steps run");
+    DrawCalls = Metrics.Counter("sample_gl_draw_calls_total", "glDraw* calls issued");
+    GlCalls = Metrics.Counter("sample_gl_state_calls_total", "State and uniform calls made to the GL");
+    GlCallsElided = Metrics.Counter("sample_gl_state_calls_elided_total", "State and uniform calls skipped as redundant");
+    LogRecordsWritten = Metrics.Counter("sample_log_records_written_total", "Panel log records written to the log file");
+    LogBytesFlushed = Metrics.Counter("sample_log_bytes_flushed_total", "Bytes appended to the log file");
+    AssetBytesLoaded = Metrics.Counter("sample_asset_bytes_loaded_total", "Bytes of decoded asset data loaded");
+}
 
-std::vector<PanelLog> panelLogs;
+static double nowSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Panels:
+enum ProjectionType { ORTHO, PERSP };
+ProjectionType NowProjection = PERSP;
 
 float ElapsedSeconds() {
     int ms = glutGet(GLUT_ELAPSED_TIME);
     return (float)ms / 1000.f;
 }
 
-float calculateSunlightStrength(const glm::vec3& panelPos, const glm::vec3& lightPos) {
-    glm::vec3 panelNormal(0.0f, 1.0f, 0.0f);
-    glm::vec3 dirToLight = glm::normalize(lightPos - panelPos);
-    float strength = glm::dot(panelNormal, dirToLight);
-    return glm::max(strength, 0.0f);
+void logPanelPositions() {
+    Sim.RecordLog(ElapsedSeconds());
+
+    // only the records that aren't in the file yet; the file's length is the snapshot's log cursor
+    const std::vector<PanelLog>& logs = Sim.GetLogs();
+    std::ofstream logFile(LOG_FILE, std::ios::app);
+    if (logFile.is_open()) {
+        // the bytes this write adds -- the file may already hold earlier runs' records:
+        logFile.seekp(0, std::ios::end);
+        unsigned long long before = (unsigned long long)logFile.tellp();
+        size_t first = LogsWritten;
+        WritePanelLogs(logFile, logs.data() + first, (int)(logs.size() - first));
+        LogsWritten = logs.size();
+        unsigned long long cursor = (unsigned long long)logFile.tellp();
+        Metrics.Add(LogRecordsWritten, LogsWritten - first);
+        Metrics.Add(LogBytesFlushed, cursor - before);
+        Sim.SetLogCursor(cursor);
+        logFile.close();
+    }
 }
 
-void logPanelPositions(const glm::vec3& lightPos) {
-    float currentTime = ElapsedSeconds();
-    for (int i = 0; i < 9; ++i) {
-        float sunlightStrength = calculateSunlightStrength(panelPositionsArr[i], lightPos);
-        panelLogs.push_back({i + 1, panelPositionsArr[i], currentTime, sunlightStrength});
+// Restore from the snapshot file, if there is one. The log file is cut back to what had been
+// written when the snapshot was taken, so records logged after it don't appear twice:
+static void restoreSnapshot() {
+    std::vector<unsigned char> bytes;
+    if (!ReadSnapshotFile(SnapshotPath, bytes))
+        return;
+    SnapshotIn in(bytes.data(), bytes.size());
+    if (!Sim.Restore(in)) {
+        fprintf(stderr, "Snapshot '%s' is unusable, starting over\n", SnapshotPath);
+        Sim.Init(Config);
+        return;
     }
+    Config = Sim.GetConfig();
 
-    std::ofstream logFile("panel_log.txt", std::ios::app);
-    if (logFile.is_open()) {
-        for (const auto& log : panelLogs) {
-            logFile << "Panel ID: " << log.panelID << ", Time: " << log.timeStamp << "s, Position: ("
-                    << log.position.x << ", " << log.position.y << ", "
-                    << log.position.z << "), Sunlight Strength: " << log.sunlightStrength << "\n";
-        }
-        logFile.close();
+    std::error_code err;
+    unsigned long long cursor = Sim.GetLogCursor();
+    if (std::filesystem::exists(LOG_FILE, err) && std::filesystem::file_size(LOG_FILE, err) > cursor)
+        std::filesystem::resize_file(LOG_FILE, cursor, err);
+    fprintf(stderr, "Restored snapshot '%s' at day %.2f\n", SnapshotPath, Sim.GetClock() / SECONDS_PER_DAY);
+}
+
+// One frame per displayed frame, however many simulation steps it covered:
+static void publishTelemetry() {
+    int n = Sim.GetNumPanels();
+    const float* angles = Sim.GetAngles();
+    const float* strength = Sim.GetStrength();
+    const double* energy = Sim.GetEnergy();
+    LastEnergy.resize(n, 0.0);
+
+    Frame.clock = Sim.GetClock();
+    Frame.angle.assign(angles, angles + n);
+    Frame.sun.assign(strength, strength + n);
+    Frame.energyDelta.resize(n);
+    for (int i = 0; i < n; ++i) {
+        Frame.energyDelta[i] = (float)(energy[i] - LastEnergy[i]);
+        LastEnergy[i] = energy[i];
     }
+    Telemetry.Publish(Frame);
+}
+
+// Serialize now (cheap), write later (on the writer's thread):
+static void saveSnapshot() {
+    SnapshotOut out;
+    Sim.Save(out);
+    Snapshots.Submit(out.bytes);
 }
 
 // Geometry:
@@ -208,15 +318,18 @@ unsigned int cubeIndices[] = {
 // Panel Grid lines:
 std::vector<GLfloat> panelGridVertices;
 
-float SunRadius = 15.0f;
 float SunHeight = 3.0f;
 
-// Shader:
-GLuint shaderProgram;
-GLint modelLoc, viewLoc, projLoc;
+// Shader variants: the scene's shaders built with each combination of these features compiled
+// in (see shaders/scene.frag), one program each, indexed by the mask of features:
+enum SceneFeatures { F_TEXTURE = 1, F_VIRTUAL_TEXTURE = 2, NUM_SCENE_VARIANTS = 4 };
+const char* SceneFeatureNames[] = { "TEXTURE", "VIRTUAL_TEXTURE" };
+GLuint sceneProgram[NUM_SCENE_VARIANTS];
 
-// Uniforms:
-GLint brightnessLoc;
+// Uniforms, looked up once when the shader is linked instead of by name for every draw:
+enum SceneUniforms { U_MODEL, U_VIEW, U_PROJECTION, U_OBJECT_COLOR, U_BRIGHTNESS, NUM_SCENE_UNIFORMS };
+const char* SceneUniformNames[NUM_SCENE_UNIFORMS] = { "model", "view", "projection", "objectColor", "brightness" };
+GLint sceneUniforms[NUM_SCENE_VARIANTS][NUM_SCENE_UNIFORMS];
 
 // Objects:
 GLuint terrainVAO, terrainVBO;
@@ -226,85 +339,44 @@ GLuint baseVAO, baseVBO, baseEBO;
 GLuint sunVAO, sunVBO, sunEBO;
 
 // Texture:
-GLuint groundTexture;
-
-// Simple Shaders:
-static GLuint buildSimpleShaderProgram() {
-    const char* vertexShaderSource = R"(
-    #version 330 core
-    layout (location = 0) in vec3 aPos;
-    layout (location = 1) in vec2 aTexCoord;
-
-    out vec2 TexCoord;
-
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
-
-    void main(){
-        gl_Position = projection * view * model * vec4(aPos,1.0);
-        TexCoord = aTexCoord;
+TextureManager Textures;
+int GroundTexture;
+
+// Site orthophoto draped over the terrain instead of the grass, from a page file (--ortho):
+const char* OrthoPath = NULL;
+VirtualTexture Ortho;
+
+// The heightmap the simulation loaded (--heightmap), drawn as chunked LOD instead of the flat quad:
+TerrainRenderer Terrain;
+
+// Linked shader programs kept between launches (--shader-cache DIR, "off" for none):
+const char* ShaderCacheDir = "shadercache";
+
+// Simple Shaders, from shaders/scene.vert and scene.frag. Edits saved while it runs are
+// compiled and swapped in between frames (see GLSLProgram::Reload):
+GLSLPermutations SceneShader;
+
+// The variants the frames draw with -- solid, textured, and the virtual texture if there is
+// one -- built the first time through, so no frame waits for a compile:
+static void lookupSceneUniforms() {
+    for (int f = 0; f < NUM_SCENE_VARIANTS; f++) {
+        bool used = f == 0 || f == F_TEXTURE || (f == F_VIRTUAL_TEXTURE && OrthoPath != NULL);
+        GLSLProgram* variant = used ? SceneShader.Get(f) : NULL;
+        sceneProgram[f] = variant != NULL ? variant->GetProgram() : 0;
+        for (int u = 0; u < NUM_SCENE_UNIFORMS; u++)
+            sceneUniforms[f][u] = sceneProgram[f] != 0 ? glGetUniformLocation(sceneProgram[f], SceneUniformNames[u]) : -1;
     }
-    )";
-
-    const char* fragmentShaderSource = R"(
-        #version 330 core
-        in vec2 TexCoord;
-        out vec4 FragColor;
-
-        uniform vec3 objectColor;        // Color for solid objects
-        uniform sampler2D texture1;      // Texture for textured objects
-        uniform bool useTexture;         // Flag to determine if texture should be applied
-        uniform float brightness;        // Lighting brightness
-
-        void main() {
-            vec3 color;
-            if (useTexture) {
-                color = texture(texture1, TexCoord).rgb; // Use texture color
-            } else {
-                color = objectColor; // Use solid color
-            }
-
-            vec3 finalColor = color * brightness; // Apply lighting
-            FragColor = vec4(finalColor, 1.0);
-        }
-
-    )";
-
-    GLuint vertexShader=glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader,1,&vertexShaderSource,NULL);
-    glCompileShader(vertexShader);
-
-    GLint success; char infoLog[512];
-    glGetShaderiv(vertexShader,GL_COMPILE_STATUS,&success);
-    if(!success){
-        glGetShaderInfoLog(vertexShader,512,NULL,infoLog);
-        fprintf(stderr,"Vertex Shader Error: %s\n",infoLog);
-    }
-
-    GLuint fragmentShader=glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader,1,&fragmentShaderSource,NULL);
-    glCompileShader(fragmentShader);
-    glGetShaderiv(fragmentShader,GL_COMPILE_STATUS,&success);
-    if(!success){
-        glGetShaderInfoLog(fragmentShader,512,NULL,infoLog);
-        fprintf(stderr,"Fragment Shader Error: %s\n",infoLog);
-    }
-
-    GLuint program=glCreateProgram();
-    glAttachShader(program,vertexShader);
-    glAttachShader(program,fragmentShader);
-    glLinkProgram(program);
-    glGetProgramiv(program,GL_LINK_STATUS,&success);
-    if(!success){
-        glGetProgramInfoLog(program,512,NULL,infoLog);
-        fprintf(stderr,"Program Linking Error: %s\n",infoLog);
-    }
-
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    Ortho.Locate(sceneProgram[F_VIRTUAL_TEXTURE]);
+}
 
-    return program;
+// Makes a variant current, with this frame's camera and light, and returns its uniforms:
+static const GLint* useSceneVariant(int features, const glm::mat4& view, const glm::mat4& projection, float brightness) {
+    const GLint* u = sceneUniforms[features];
+    GlState.UseProgram(sceneProgram[features]);
+    GlState.UniformMatrix4fv(u[U_VIEW], glm::value_ptr(view));
+    GlState.UniformMatrix4fv(u[U_PROJECTION], glm::value_ptr(projection));
+    GlState.Uniform1f(u[U_BRIGHTNESS], brightness);
+    return u;
 }
 
 static void buildPanelGrid() {
@@ -378,40 +450,42 @@ static void setupObjects() {
     glEnableVertexAttribArray(0);
 }
 
-static float computePanelRotation(const glm::vec3& panelPos, const glm::vec3& lightPos) {
-    glm::vec3 panelNormal(0.0f,1.0f,0.0f);
-    glm::vec3 dirToLight = glm::normalize(lightPos - panelPos);
-
-    float dotVal = glm::dot(panelNormal, dirToLight);
-    dotVal = glm::clamp(dotVal,-1.0f,1.0f);
-    float angleRad = acos(dotVal);
-    float angleDeg = glm::degrees(angleRad);
-    if(angleDeg > 75.0f) angleDeg=75.0f;
-
-    if((lightPos.x - panelPos.x) > 0.0f) {
-        angleDeg = -angleDeg;
-    }
-
-    return angleDeg;
-}
-
 
 void Animate() {
     static float lastLogTime = 0.0f;
+    static float lastSnapshotTime = 0.0f;
+    static float lastFrameTime = 0.0f;
+    static float accumulator = 0.0f;
+    static double lastFrameStart = 0.0;
     float currentTime = ElapsedSeconds();
 
+    double frameStart = nowSeconds();
+    if (lastFrameStart > 0.0)
+        Metrics.Observe(FrameSeconds, frameStart - lastFrameStart);
+    lastFrameStart = frameStart;
+
+    float frameTime = currentTime - lastFrameTime;
+    lastFrameTime = currentTime;
+    accumulator += (frameTime < MAX_FRAME_TIME) ? frameTime : MAX_FRAME_TIME;
+    int steps = 0;
+    while (accumulator >= SIM_DT) {
+        Sim.Step(SIM_DT * SIM_SECONDS_PER_SECOND, autoRotate);
+        accumulator -= SIM_DT;
+        ++steps;
+    }
+    Metrics.Add(SimTicks, steps);
+    if (TelemetryOn && steps > 0)
+        publishTelemetry();
+
     // Log every 2 seconds
     if (currentTime - lastLogTime > 2.0f) {
-        float angleRad = Time * 2.0f * M_PI;
-        glm::vec3 lightPos(cos(angleRad)*SunRadius, sin(angleRad)*SunRadius, 0.0f);
-        logPanelPositions(lightPos);
+        logPanelPositions();
         lastLogTime = currentTime;
     }
 
-    if (autoRotate) {
-        int ms = glutGet(GLUT_ELAPSED_TIME);
-        ms %= MS_PER_CYCLE;
-        Time = (float)ms / (float)MS_PER_CYCLE;
+    if (SnapshotPath != NULL && currentTime - lastSnapshotTime > SNAPSHOT_INTERVAL) {
+        saveSnapshot();
+        lastSnapshotTime = currentTime;
     }
 
     glutSetWindow(MainWindow);
@@ -419,7 +493,7 @@ void Animate() {
 }
 
 void DisplayLogsOnScreen() {
-    glDisable(GL_DEPTH_TEST);
+    GlState.Disable(GL_DEPTH_TEST);
 
     glMatrixMode(GL_PROJECTION);
     glPushMatrix();
@@ -436,10 +510,12 @@ void DisplayLogsOnScreen() {
     float startY = 4.5f;
     char buffer[256];
 
+    const std::vector<PanelLog>& panelLogs = Sim.GetLogs();
     for (size_t i = 0; i < panelLogs.size() && i < 10; ++i) {
-        snprintf(buffer, sizeof(buffer), "Panel ID: %d, Time: %.2fs, Pos:(%.2f, %.2f, %.2f), Sunlight: %.2f",
+        snprintf(buffer, sizeof(buffer), "Panel ID: %d, Time: %.2fs, Pos:(%.2f, %.2f, %.2f), Sunlight: %.2f, Shaded: %.0f%%, Error: %.1f",
                  panelLogs[i].panelID, panelLogs[i].timeStamp, panelLogs[i].position.x,
-                 panelLogs[i].position.y, panelLogs[i].position.z, panelLogs[i].sunlightStrength);
+                 panelLogs[i].position.y, panelLogs[i].position.z, panelLogs[i].sunlightStrength,
+                 100.f * panelLogs[i].shadedFraction, panelLogs[i].trackingError);
 
         glRasterPos2f(startX, startY - (i * 0.5f));
         const char* txt = buffer;
@@ -453,33 +529,42 @@ void DisplayLogsOnScreen() {
     glMatrixMode(GL_PROJECTION);
     glPopMatrix();
 
-    glEnable(GL_DEPTH_TEST);
+    GlState.Enable(GL_DEPTH_TEST);
 }
 
-void Display() {
-    glutSetWindow(MainWindow);
-    glDrawBuffer(GL_BACK);
+// The heightmap's chunks when there is one, the flat quad otherwise. Returns the draw calls:
+static int drawTerrain() {
+    if (Terrain.IsOpen())
+        return Terrain.Draw();
+    GlState.BindVertexArray(terrainVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    return 1;
+}
+
+// Draws the scene into the current draw buffer and returns the number of draw calls.
+// The log overlay is GLUT bitmap text, so the headless mode leaves it out.
+// State and uniforms go through GlState, whose counts are then this frame's:
+static int drawScene(GLsizei vx, GLsizei vy, bool overlay) {
+    int draws = 0;
+    GlState.Forget();                   // texture streaming and capture bind things between frames
+    GlState.ResetCounts();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_DEPTH_TEST);
+    GlState.Enable(GL_DEPTH_TEST);
 
-    GLsizei vx = glutGet(GLUT_WINDOW_WIDTH);
-    GLsizei vy = glutGet(GLUT_WINDOW_HEIGHT);
     GLsizei v = vx < vy ? vx : vy;
     GLint xl = (vx - v)/2;
     GLint yb = (vy - v)/2;
-    glViewport(xl,yb,v,v);
+    GlState.BindFramebuffer(GL_FRAMEBUFFER, 0);     // the window's, or the pbuffer's
+    GlState.Viewport(xl,yb,v,v);
 
     // Compute sun pos:
-    float angleRad = Time * 2.0f * M_PI;
-    glm::vec3 lightPos(cos(angleRad)*SunRadius, sin(angleRad)*SunRadius, 0.0f);
+    float angleRad = Sim.GetDayFraction() * 2.0f * M_PI;
+    glm::vec3 lightPos = Sim.GetSunPosition();
 
     // Compute brightness: sun above horizon => brightness=1, else=0.3
     float elevation = sin(angleRad);
     float brightness = (elevation > 0.0f) ? 1.0f : 0.3f;
 
-    glUseProgram(shaderProgram);
-    glUniform1f(brightnessLoc, brightness);
-
     // Projection:
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -509,58 +594,104 @@ void Display() {
     else
         projection = glm::perspective(glm::radians(70.f),1.f,0.1f,1000.f);
 
-    GLint viewLoc = glGetUniformLocation(shaderProgram,"view");
-    GLint projLoc = glGetUniformLocation(shaderProgram,"projection");
-    GLint modelLoc = glGetUniformLocation(shaderProgram,"model");
-    glUniformMatrix4fv(viewLoc,1,GL_FALSE,glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc,1,GL_FALSE,glm::value_ptr(projection));
-
-    for (int i = 0; i < 9; i++) {
+    const float* panelAngles = Sim.GetAngles();
+    const glm::vec3* panelPositions = Sim.GetPositions();
+    const glm::vec3 pivotOffset(0.0f, Config.pivotHeight, 0.0f);
+
+    // Draws are grouped by shader variant, solid-colored first and then the textured ones, so the
+    // program changes once or twice a frame however many panels there are:
+    const GLint* u = useSceneVariant(0, view, projection, brightness);
+    GLint modelLoc = u[U_MODEL];
+
+    // Within the variant, by shape -- every base, then every panel, then every grid -- so only the
+    // model matrix changes from one draw to the next. The color and vertex array set again for
+    // each panel go no further than GlState:
+    static std::vector<glm::mat4> panelModels;
+    panelModels.resize(Sim.GetNumPanels());
+    for (int i = 0; i < Sim.GetNumPanels(); i++) {
         // Draw base (solid color)
-        glUniform1i(glGetUniformLocation(shaderProgram, "useTexture"), GL_FALSE);
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 0.1f, 0.1f, 0.1f); // Dark gray
+        GlState.Uniform3f(u[U_OBJECT_COLOR], 0.1f, 0.1f, 0.1f); // Dark gray
         glm::mat4 baseModel = glm::mat4(1.0f);
-        baseModel = glm::translate(baseModel, glm::vec3(panelPositionsArr[i].x, 0.0f, panelPositionsArr[i].z - 0.5f));
+        baseModel = glm::translate(baseModel, glm::vec3(panelPositions[i].x, panelPositions[i].y - Config.baseHeight, panelPositions[i].z - 0.5f));
         baseModel = glm::translate(baseModel, glm::vec3(-0.0f, 0.0f, 1.1f));
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(baseModel));
-        glBindVertexArray(baseVAO);
+        GlState.UniformMatrix4fv(modelLoc, glm::value_ptr(baseModel));
+        GlState.BindVertexArray(baseVAO);
         glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
-
+        ++draws;
+    }
+    for (int i = 0; i < Sim.GetNumPanels(); i++) {
         // Draw panel (solid color)
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 0.2f, 0.2f, 0.2f); // Slightly lighter gray
-        float angleDeg = computePanelRotation(panelPositionsArr[i], lightPos);
-        glm::mat4 panelModel = glm::translate(glm::mat4(1.0f), panelPositionsArr[i]);
-        panelModel = glm::translate(panelModel, glm::vec3(0.0f, 0.6f, 0.0f)); 
+        GlState.Uniform3f(u[U_OBJECT_COLOR], 0.2f, 0.2f, 0.2f); // Slightly lighter gray
+        float angleDeg = panelAngles[i];
+        glm::mat4& panelModel = panelModels[i];
+        panelModel = glm::translate(glm::mat4(1.0f), panelPositions[i]);
+        panelModel = glm::translate(panelModel, pivotOffset);
         panelModel = glm::rotate(panelModel, glm::radians(angleDeg), glm::vec3(0.f, 0.f, 1.f));
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(panelModel));
-        glBindVertexArray(panelVAO);
+        GlState.UniformMatrix4fv(modelLoc, glm::value_ptr(panelModel));
+        GlState.BindVertexArray(panelVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
-
+        ++draws;
+    }
+    for (int i = 0; i < Sim.GetNumPanels(); i++) {
         // Draw grid (black lines on top of the panel)
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 0.0f, 0.0f, 0.0f); // Black
-        glBindVertexArray(panelGridVAO);
+        GlState.Uniform3f(u[U_OBJECT_COLOR], 0.0f, 0.0f, 0.0f); // Black
+        GlState.UniformMatrix4fv(modelLoc, glm::value_ptr(panelModels[i]));
+        GlState.BindVertexArray(panelGridVAO);
         glDrawArrays(GL_LINES, 0, (GLsizei)(panelGridVertices.size() / 3));
+        ++draws;
     }
 
+    // Sun (textured, like the ground):
+    u = useSceneVariant(F_TEXTURE, view, projection, brightness);
+    GlState.ActiveTexture(GL_TEXTURE0);
+    GlState.BindTexture(GL_TEXTURE_2D, Textures.Get(GroundTexture));
+    glm::mat4 sunModel=glm::mat4(1.0f);
+    sunModel=glm::translate(sunModel,lightPos);
+    GlState.UniformMatrix4fv(u[U_MODEL], glm::value_ptr(sunModel));
+    GlState.BindVertexArray(sunVAO);
+    glDrawElements(GL_TRIANGLES,36,GL_UNSIGNED_INT,0);
+    ++draws;
+
     // Draw terrain (textured)
-    glUniform1i(glGetUniformLocation(shaderProgram, "useTexture"), GL_TRUE);
-    glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 0.0f, 0.0f, 0.0f); // Unused when texture is enabled
     glm::mat4 terrainModel = glm::mat4(1.0f);
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(terrainModel));
-    glBindVertexArray(terrainVAO);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    Terrain.Update(projection, view, v);
+    if (Ortho.IsOpen()) {
+        // Which tiles the terrain needs, drawn small into the feedback buffer:
+        Ortho.Update();
+        Ortho.BeginFeedback(v, v, glm::value_ptr(projection * view * terrainModel));
+        draws += drawTerrain();
+        Ortho.EndFeedback();
+        u = useSceneVariant(F_VIRTUAL_TEXTURE, view, projection, brightness);
+        Ortho.Bind(1, 2);
+    }
+    GlState.UniformMatrix4fv(u[U_MODEL], glm::value_ptr(terrainModel));
+    draws += drawTerrain();
 
-    DisplayLogsOnScreen();
+    if (overlay)
+        DisplayLogsOnScreen();
+    return draws;
+}
 
-    // Sun:
-    glm::mat4 sunModel=glm::mat4(1.0f);
-    sunModel=glm::translate(sunModel,lightPos);
-    glUniformMatrix4fv(modelLoc,1,GL_FALSE,glm::value_ptr(sunModel));
-    glBindVertexArray(sunVAO);
-    glDrawElements(GL_TRIANGLES,36,GL_UNSIGNED_INT,0);
+void Display() {
+    double displayStart = nowSeconds();
+    glutSetWindow(MainWindow);
+    glDrawBuffer(GL_BACK);
+    GLsizei vx = glutGet(GLUT_WINDOW_WIDTH);
+    GLsizei vy = glutGet(GLUT_WINDOW_HEIGHT);
+    Textures.Update();
+    if (SceneShader.Reload())
+        lookupSceneUniforms();
+    int draws = drawScene(vx, vy, true);
+    if (CaptureDir != NULL)
+        Capture.Grab(vx, vy);
 
     glutSwapBuffers();
     glFlush();
+
+    Metrics.Add(DrawCalls, draws);
+    Metrics.Add(GlCalls, GlState.GetIssued());
+    Metrics.Add(GlCallsElided, GlState.GetElided());
+    Metrics.Observe(DisplaySeconds, nowSeconds() - displayStart);
 }
 
 void Reset() {
@@ -581,25 +712,49 @@ void Keyboard(unsigned char c, int x, int y) {
             // set Perspective
             break;
         case '1':
-            Time = 0.0f;
+            Sim.SetDayFraction(0.0f);
             autoRotate=false;
             break;
         case '2':
-            Time = 0.25f;
+            Sim.SetDayFraction(0.25f);
             autoRotate=false;
             break;
         case '3':
-            Time = 0.5f;
+            Sim.SetDayFraction(0.5f);
             autoRotate=false;
             break;
         case 'a':
         case 'A':
             autoRotate=true;
             break;
+        case 'm':
+        case 'M':
+            Config.skyModel = (Config.skyModel == PEREZ) ? ISOTROPIC : PEREZ;
+            Sim.SetSkyModel(Config.skyModel);
+            fprintf(stderr, "Sky diffuse model: %s\n", Config.skyModel == PEREZ ? "Perez" : "isotropic");
+            break;
+        case 'b':
+        case 'B':
+            Config.trackingMode = (Config.trackingMode == BACKTRACKING) ? TRUE_TRACKING : BACKTRACKING;
+            Sim.SetTrackingMode(Config.trackingMode);
+            fprintf(stderr, "Tracking mode: %s\n", Config.trackingMode == BACKTRACKING ? "backtracking" : "true tracking");
+            break;
         case 'q':
         case 'Q':
         case ESCAPE:
+            if (SnapshotPath != NULL) {
+                saveSnapshot();
+                Snapshots.Stop();
+            }
+            Telemetry.Stop();
             glutSetWindow(MainWindow);
+            Capture.Stop();
+            Textures.Stop();
+            Ortho.PrintStats();
+            Ortho.Close();
+            Terrain.PrintStats();
+            Terrain.Close();
+            Programs.PrintStats();
             glFinish();
             glutDestroyWindow(MainWindow);
             exit(0);
@@ -703,7 +858,222 @@ void InitGraphics() {
     }
 }
 
+// Shaders, buffers and the ground texture, once there is a current context:
+static void initScene() {
+    SceneShader.Create(SceneFeatureNames, 2, (char*)"shaders/scene.vert", (char*)"shaders/scene.frag");
+    lookupSceneUniforms();
+
+    buildPanelGrid();
+    setupObjects();
+
+    // decoded in the background; the ground is grass-green until the texture is up.
+    // grass.ktx, if texconv has made it, is already block-compressed with its mipmaps:
+    Textures.SetMetrics(AssetLoadSeconds, AssetBytesLoaded);
+    Textures.Start();
+    const char* groundPath = std::filesystem::exists("grass.ktx") ? "grass.ktx" : "grass.jpg";
+    GroundTexture = Textures.Load(groundPath, 0x4c7a2eff);
+
+    if (OrthoPath != NULL)
+        Ortho.Open(OrthoPath);
+    if (Sim.GetTerrain().IsLoaded())
+        Terrain.Open(&Sim.GetTerrain());
+}
+
+// Renders HeadlessFrames frames offscreen, advancing the simulation a step per frame, and prints
+// one line of results: frames/sec, draw calls per frame and the CPU time spent submitting a frame
+// (drawScene() up to the glFinish). Needs no window or display, so it runs in CI on llvmpipe:
+static bool initOffscreen(OffscreenContext& offscreen) {
+    if (!offscreen.Create(HeadlessWidth, HeadlessHeight))
+        return false;
+
+    // GLEW built for GLX may report that there's no GLX display; the GL entry points are loaded by then:
+    glewInit();
+    if (glGenVertexArrays == NULL) {
+        fprintf(stderr, "glewInit could not load the OpenGL 3 entry points\n");
+        return false;
+    }
+
+    glClearColor(0.,0.,0.,1.);
+    initScene();
+    Textures.WaitForAll();              // every frame measured or compared has its textures
+    glFinish();
+    return true;
+}
+
+static int runHeadless() {
+    OffscreenContext offscreen;
+    if (!initOffscreen(offscreen))
+        return 1;
+    fprintf(stderr, "Rendering %d frames of %d panels at %dx%d on %s\n", HeadlessFrames, Sim.GetNumPanels(),
+            HeadlessWidth, HeadlessHeight, (const char*)glGetString(GL_RENDERER));
+
+    std::vector<double> submit(HeadlessFrames);
+    long long draws = 0, glCalls = 0, glElided = 0;
+    double start = nowSeconds();
+    for (int f = 0; f < HeadlessFrames; ++f) {
+        Sim.Step(SIM_DT*SIM_SECONDS_PER_SECOND, true);
+        double submitStart = nowSeconds();
+        int frameDraws = drawScene(HeadlessWidth, HeadlessHeight, false);
+        if (CaptureDir != NULL)
+            Capture.Grab(HeadlessWidth, HeadlessHeight);
+        submit[f] = nowSeconds() - submitStart;
+        glFinish();                     // stands in for the swap: the frame is done
+        draws += frameDraws;
+        glCalls += GlState.GetIssued();
+        glElided += GlState.GetElided();
+        Metrics.Add(DrawCalls, frameDraws);
+        Metrics.Add(GlCalls, GlState.GetIssued());
+        Metrics.Add(GlCallsElided, GlState.GetElided());
+    }
+    double seconds = nowSeconds() - start;
+    Capture.Stop();
+    Textures.Stop();
+    Ortho.PrintStats();
+    Ortho.Close();
+    Terrain.PrintStats();
+    Terrain.Close();
+    Programs.PrintStats();
+
+    double mean = 0.;
+    for (double s : submit)
+        mean += s;
+    mean /= HeadlessFrames;
+    std::sort(submit.begin(), submit.end());
+    printf("frames=%d width=%d height=%d panels=%d seconds=%.3f fps=%.2f draw_calls_per_frame=%.1f "
+           "gl_calls_per_frame=%.1f gl_calls_elided_per_frame=%.1f "
+           "cpu_submit_ms_mean=%.3f cpu_submit_ms_p50=%.3f cpu_submit_ms_p95=%.3f\n",
+           HeadlessFrames, HeadlessWidth, HeadlessHeight, Sim.GetNumPanels(), seconds, HeadlessFrames / seconds,
+           (double)draws / HeadlessFrames, (double)glCalls / HeadlessFrames, (double)glElided / HeadlessFrames, 1000. * mean, 1000. * submit[HeadlessFrames / 2],
+           1000. * submit[(HeadlessFrames * 95) / 100]);
+    return 0;
+}
+
+// Renders each of the GOLDEN_VIEWS offscreen and compares it with its golden png. A view that differs
+// gets <name>.actual.png and <name>.diff.png (the differing pixels in red) next to the golden one.
+// Returns non-zero if any view differs, so a CI step can run it after a change to the draw path:
+static int runGolden(const char* dir) {
+    OffscreenContext offscreen;
+    if (!initOffscreen(offscreen))
+        return 1;
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+
+    int w = HeadlessWidth, h = HeadlessHeight;
+    std::vector<unsigned char> pixels(4 * w * h), diff(4 * w * h);
+    int failures = 0;
+    for (const GoldenView& view : GOLDEN_VIEWS) {
+        SimConfig config = Config;
+        config.trackingMode = view.trackingMode;
+        if (!Sim.Init(config))
+            return 1;
+        Sim.SetDayFraction(view.dayFraction);
+        Sim.Step(SECONDS_PER_DAY, false);     // long enough for every tracker to reach its target
+
+        drawScene(w, h, false);
+        glFinish();
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        FlipRows(pixels.data(), w, h);
+
+        std::string base = std::string(dir) + "/" + view.name;
+        std::string golden = base + ".png";
+        int gw, gh, gn;
+        if (GoldenRecord) {
+            if (!WritePng(golden.c_str(), w, h, pixels.data()))
+                return 1;
+            fprintf(stderr, "%-16s recorded %s\n", view.name, golden.c_str());
+            continue;
+        }
+        unsigned char* expected = stbi_load(golden.c_str(), &gw, &gh, &gn, 4);
+        if (expected == NULL) {
+            fprintf(stderr, "%-16s FAILED: no %s (run with --record to make it)\n", view.name, golden.c_str());
+            failures++;
+            continue;
+        }
+        if (gw != w || gh != h) {
+            fprintf(stderr, "%-16s FAILED: %s is %dx%d, the render is %dx%d\n", view.name, golden.c_str(), gw, gh, w, h);
+            stbi_image_free(expected);
+            failures++;
+            continue;
+        }
+
+        int different = CompareImages(expected, pixels.data(), w, h, GOLDEN_THRESHOLD, diff.data());
+        stbi_image_free(expected);
+        if (different > GOLDEN_MAX_DIFFERENT * w * h) {
+            WritePng((base + ".actual.png").c_str(), w, h, pixels.data());
+            WritePng((base + ".diff.png").c_str(), w, h, diff.data());
+            fprintf(stderr, "%-16s FAILED: %d pixels differ, see %s.diff.png\n", view.name, different, base.c_str());
+            failures++;
+        } else {
+            std::filesystem::remove(base + ".actual.png", ec);
+            std::filesystem::remove(base + ".diff.png", ec);
+            fprintf(stderr, "%-16s ok (%d pixels differ)\n", view.name, different);
+        }
+    }
+    return failures > 0 ? 1 : 0;
+}
+
 int main(int argc,char* argv[]) {
+    registerMetrics();
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--weather") == 0 && i+1 < argc) {
+            Config.weatherPath = argv[++i];
+        } else if (strcmp(argv[i], "--telemetry") == 0 && i+1 < argc) {
+            TelemetryOn = Telemetry.Start(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics") == 0 && i+1 < argc) {
+            Metrics.Start(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i+1 < argc) {
+            SnapshotPath = argv[++i];
+        } else if (strcmp(argv[i], "--headless") == 0 && i+1 < argc) {
+            HeadlessFrames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--golden") == 0 && i+1 < argc) {
+            GoldenDir = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0) {
+            GoldenRecord = true;
+        } else if (strcmp(argv[i], "--heightmap") == 0 && i+1 < argc) {
+            Config.heightmapPath = argv[++i];
+        } else if (strcmp(argv[i], "--terrain-size") == 0 && i+1 < argc) {
+            Config.terrainSize = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--terrain-height") == 0 && i+1 < argc) {
+            Config.terrainHeight = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ortho") == 0 && i+1 < argc) {
+            OrthoPath = argv[++i];
+        } else if (strcmp(argv[i], "--shader-cache") == 0 && i+1 < argc) {
+            ShaderCacheDir = strcmp(argv[++i], "off") == 0 ? NULL : argv[i];
+        } else if (strcmp(argv[i], "--capture") == 0 && i+1 < argc) {
+            CaptureDir = argv[++i];
+        } else if (strcmp(argv[i], "--capture-format") == 0 && i+1 < argc) {
+            CaptureFormat = strcmp(argv[++i], "yuv") == 0 ? CAPTURE_YUV : CAPTURE_PNG;
+        } else if (strcmp(argv[i], "--size") == 0 && i+1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &HeadlessWidth, &HeadlessHeight) != 2 || HeadlessWidth <= 0 || HeadlessHeight <= 0) {
+                fprintf(stderr, "--size wants WIDTHxHEIGHT\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--panels") == 0 && i+1 < argc) {
+            int panels = atoi(argv[++i]);
+            Config.numRows = std::max(1, (int)sqrtf((float)panels));
+            Config.panelsPerRow = std::max(1, panels / Config.numRows);
+        } else if (strcmp(argv[i], "--convert-weather") == 0 && i+2 < argc) {
+            return WeatherSeries::ConvertCsvToBinary(argv[i+1], argv[i+2]) ? 0 : 1;
+        }
+    }
+    if (!Sim.Init(Config))
+        return 1;
+    Programs.SetDirectory(ShaderCacheDir);
+    if (SnapshotPath != NULL) {
+        restoreSnapshot();
+        Snapshots.Start(SnapshotPath);
+    }
+    if (Config.weatherPath != NULL)
+        fprintf(stderr, "Streaming weather from %s\n", Config.weatherPath);
+    if (GoldenDir != NULL)
+        return runGolden(GoldenDir);
+    if (CaptureDir != NULL && !Capture.Start(CaptureDir, CaptureFormat))
+        return 1;
+    if (HeadlessFrames > 0)
+        return runHeadless();
+
+    CompileThread::InitThreads();       // before the window's display is opened
     glutInit(&argc,argv);
     InitGraphics();
     Reset();
@@ -711,29 +1081,8 @@ int main(int argc,char* argv[]) {
     // No menus now
     //InitMenus();
 
-    shaderProgram=buildSimpleShaderProgram();
-    glUseProgram(shaderProgram);
-    brightnessLoc=glGetUniformLocation(shaderProgram,"brightness");
-    glUniform1f(brightnessLoc,1.0f);
-
-    buildPanelGrid();
-    setupObjects();
-
-    int width, height, nrChannels;
-    unsigned char* data = stbi_load("grass.jpg",&width,&height,&nrChannels,0);
-    if(data) {
-        glGenTextures(1,&groundTexture);
-        glBindTexture(GL_TEXTURE_2D,groundTexture);
-        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D,0,GL_RGB,width,height,0,GL_RGB,GL_UNSIGNED_BYTE,data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        stbi_image_free(data);
-    } else {
-        fprintf(stderr,"Failed to load texture\n");
-    }
+    initScene();
+    SceneShader.Watch();
 
     glutSetWindow(MainWindow);
     glutMainLoop();
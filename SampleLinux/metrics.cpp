@@ -0,0 +1,265 @@
+#include "metrics.h"
+
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+
+MetricsRegistry	Metrics;
+
+const double	METRICS_TIME_BUCKETS[ ] = { .0001, .00025, .0005, .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1. };
+const int	METRICS_NUM_TIME_BUCKETS = sizeof(METRICS_TIME_BUCKETS) / sizeof(METRICS_TIME_BUCKETS[0]);
+
+
+// the calling thread's shard (one registry per program, so one pointer per thread):
+
+static thread_local void *	ThreadShard = NULL;
+
+
+MetricsRegistry::MetricsRegistry( )
+{
+	numSlots = 0;
+	numHistograms = 0;
+	listenFd = -1;
+	quit = false;
+}
+
+
+MetricsRegistry::~MetricsRegistry( )
+{
+	Stop( );
+	for( int i = 0; i < (int)shards.size( ); i++ )
+		delete shards[i];
+}
+
+
+int
+MetricsRegistry::Counter( const char *name, const char *help )
+{
+	if( numSlots + 1 > MAX_METRIC_SLOTS )
+	{
+		fprintf( stderr, "No room for metric '%s'\n", name );
+		return -1;
+	}
+	Metric m;
+	m.name = name;
+	m.help = help;
+	m.isHistogram = false;
+	m.slot = numSlots++;
+	m.histogram = -1;
+	metrics.push_back( m );
+	return (int)metrics.size( ) - 1;
+}
+
+
+int
+MetricsRegistry::Histogram( const char *name, const char *help, const double *bounds, int numBounds )
+{
+	if( numSlots + numBounds + 1 > MAX_METRIC_SLOTS  ||  numHistograms >= MAX_HISTOGRAMS )
+	{
+		fprintf( stderr, "No room for metric '%s'\n", name );
+		return -1;
+	}
+	Metric m;
+	m.name = name;
+	m.help = help;
+	m.isHistogram = true;
+	m.slot = numSlots;
+	m.histogram = numHistograms++;
+	m.bounds.assign( bounds, bounds + numBounds );
+	numSlots += numBounds + 1;
+	metrics.push_back( m );
+	return (int)metrics.size( ) - 1;
+}
+
+
+MetricsRegistry::Shard *
+MetricsRegistry::MyShard( )
+{
+	if( ThreadShard == NULL )
+	{
+		Shard *s = new Shard;
+		for( int i = 0; i < MAX_METRIC_SLOTS; i++ )
+			s->slots[i].store( 0, std::memory_order_relaxed );
+		for( int i = 0; i < MAX_HISTOGRAMS; i++ )
+			s->sums[i].store( 0., std::memory_order_relaxed );
+		std::lock_guard<std::mutex> guard( shardLock );
+		shards.push_back( s );
+		ThreadShard = s;
+	}
+	return (Shard *)ThreadShard;
+}
+
+
+// this thread is the only writer of its shard, so a plain load + store is enough --
+// the atomics are just so Expose( ) on another thread reads whole values:
+
+void
+MetricsRegistry::Add( int counter, unsigned long long n )
+{
+	if( counter < 0 )
+		return;
+	std::atomic<unsigned long long> &slot = MyShard( )->slots[ metrics[counter].slot ];
+	slot.store( slot.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+}
+
+
+void
+MetricsRegistry::Observe( int histogram, double value )
+{
+	if( histogram < 0 )
+		return;
+	const Metric &m = metrics[histogram];
+	int b = 0;
+	int numBounds = (int)m.bounds.size( );
+	while( b < numBounds  &&  value > m.bounds[b] )
+		b++;
+
+	Shard *s = MyShard( );
+	std::atomic<unsigned long long> &slot = s->slots[ m.slot + b ];
+	slot.store( slot.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+	std::atomic<double> &sum = s->sums[ m.histogram ];
+	sum.store( sum.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed );
+}
+
+
+// the Prometheus text format, summed over the shards:
+
+void
+MetricsRegistry::Expose( std::string &text )
+{
+	std::lock_guard<std::mutex> guard( shardLock );
+	text.clear( );
+	char line[256];
+	for( int i = 0; i < (int)metrics.size( ); i++ )
+	{
+		const Metric &m = metrics[i];
+		snprintf( line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", m.name.c_str( ), m.help.c_str( ),
+				m.name.c_str( ), m.isHistogram ? "histogram" : "counter" );
+		text += line;
+
+		if( ! m.isHistogram )
+		{
+			unsigned long long v = 0;
+			for( int s = 0; s < (int)shards.size( ); s++ )
+				v += shards[s]->slots[m.slot].load( std::memory_order_relaxed );
+			snprintf( line, sizeof(line), "%s %llu\n", m.name.c_str( ), v );
+			text += line;
+			continue;
+		}
+
+		// buckets are cumulative in the exposition:
+
+		unsigned long long cumulative = 0;
+		double sum = 0.;
+		int numBounds = (int)m.bounds.size( );
+		for( int b = 0; b <= numBounds; b++ )
+		{
+			for( int s = 0; s < (int)shards.size( ); s++ )
+				cumulative += shards[s]->slots[m.slot + b].load( std::memory_order_relaxed );
+			if( b < numBounds )
+				snprintf( line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", m.name.c_str( ), m.bounds[b], cumulative );
+			else
+				snprintf( line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", m.name.c_str( ), cumulative );
+			text += line;
+		}
+		for( int s = 0; s < (int)shards.size( ); s++ )
+			sum += shards[s]->sums[m.histogram].load( std::memory_order_relaxed );
+		snprintf( line, sizeof(line), "%s_sum %.9g\n%s_count %llu\n", m.name.c_str( ), sum, m.name.c_str( ), cumulative );
+		text += line;
+	}
+}
+
+
+#ifdef WIN32
+
+bool	MetricsRegistry::Start( int )	{ fprintf( stderr, "Metrics serving isn't available on this platform\n" ); return false; }
+void	MetricsRegistry::Stop( )	{ }
+void	MetricsRegistry::Serve( )	{ }
+
+#else
+
+// serve the exposition on 127.0.0.1:port, whatever the request path:
+
+bool
+MetricsRegistry::Start( int port )
+{
+	Stop( );
+	struct sockaddr_in sin;
+	memset( &sin, 0, sizeof(sin) );
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons( (unsigned short)port );
+	sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+	listenFd = socket( AF_INET, SOCK_STREAM, 0 );
+	int on = 1;
+	if( listenFd >= 0 )
+		setsockopt( listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+	if( listenFd < 0  ||  bind( listenFd, (struct sockaddr *)&sin, sizeof(sin) ) != 0  ||  listen( listenFd, 8 ) != 0 )
+	{
+		fprintf( stderr, "Cannot serve metrics on port %d: %s\n", port, strerror( errno ) );
+		if( listenFd >= 0 )
+			close( listenFd );
+		listenFd = -1;
+		return false;
+	}
+
+	quit = false;
+	server = std::thread( &MetricsRegistry::Serve, this );
+	fprintf( stderr, "Metrics on http://127.0.0.1:%d/metrics\n", port );
+	return true;
+}
+
+
+void
+MetricsRegistry::Stop( )
+{
+	if( server.joinable( ) )
+	{
+		quit = true;
+		server.join( );
+	}
+	if( listenFd >= 0 )
+		close( listenFd );
+	listenFd = -1;
+}
+
+
+void
+MetricsRegistry::Serve( )
+{
+	std::string body;
+	char request[1024];
+	while( ! quit )
+	{
+		struct pollfd pfd = { listenFd, POLLIN, 0 };
+		if( poll( &pfd, 1, 200 ) <= 0 )
+			continue;
+		int fd = accept( listenFd, NULL, NULL );
+		if( fd < 0 )
+			continue;
+
+		// one request per connection; a scraper's request fits in one read:
+
+		struct pollfd cfd = { fd, POLLIN, 0 };
+		if( poll( &cfd, 1, 1000 ) > 0 )
+			recv( fd, request, sizeof(request), 0 );
+
+		Expose( body );
+		char header[128];
+		int len = snprintf( header, sizeof(header),
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", (int)body.size( ) );
+		send( fd, header, len, MSG_NOSIGNAL );
+		send( fd, body.data( ), body.size( ), MSG_NOSIGNAL );
+		close( fd );
+	}
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// counters and histograms for watching the simulation and the renderer,
+// exposed in the Prometheus text format over HTTP on localhost:
+//	curl http://127.0.0.1:9100/metrics
+//
+// every thread that records a value gets its own shard of slots, and only that thread writes
+// to it, so recording is a relaxed load + store on thread-local memory: no locks, no shared
+// cache lines. reading (Expose) sums the slots over all the shards.
+// metrics are registered once, up front, and referred to by the int handle that comes back.
+
+const int MAX_METRIC_SLOTS = 256;	// counters take 1 slot, histograms 1 per bucket
+const int MAX_HISTOGRAMS = 32;
+
+
+class MetricsRegistry
+{
+private:
+	struct Metric
+	{
+		std::string		name;
+		std::string		help;
+		bool			isHistogram;
+		int			slot;		// first slot
+		int			histogram;	// index into the shard's sums
+		std::vector<double>	bounds;		// bucket upper bounds, +Inf implied
+	};
+
+	struct Shard
+	{
+		std::atomic<unsigned long long>	slots[MAX_METRIC_SLOTS];
+		std::atomic<double>		sums[MAX_HISTOGRAMS];
+	};
+
+	std::vector<Metric>	metrics;
+	int			numSlots;
+	int			numHistograms;
+
+	std::mutex		shardLock;	// only taken when a thread records its first value, and by Expose( )
+	std::vector<Shard *>	shards;
+
+	int			listenFd;
+	std::thread		server;
+	std::atomic<bool>	quit;
+
+	Shard *	MyShard( );
+	void	Serve( );
+
+public:
+		MetricsRegistry( );
+		~MetricsRegistry( );
+
+	int	Counter( const char *, const char * );
+	int	Histogram( const char *, const char *, const double *, int );
+
+	void	Add( int, unsigned long long = 1 );
+	void	Observe( int, double );
+
+	void	Expose( std::string & );
+	bool	Start( int );
+	void	Stop( );
+};
+
+
+extern MetricsRegistry	Metrics;
+
+// bucket bounds for timings, in seconds (100us .. 1s):
+
+extern const double	METRICS_TIME_BUCKETS[ ];
+extern const int	METRICS_NUM_TIME_BUCKETS;
+
+#endif	// METRICS_H
@@ -0,0 +1,137 @@
+#include "offscreen.h"
+
+#include <string.h>
+
+#ifndef WIN32
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+
+OffscreenContext::OffscreenContext( )
+{
+	display = surface = context = NULL;
+	width = height = 0;
+}
+
+
+OffscreenContext::~OffscreenContext( )
+{
+	Destroy( );
+}
+
+
+int
+OffscreenContext::GetHeight( )
+{
+	return height;
+}
+
+
+int
+OffscreenContext::GetWidth( )
+{
+	return width;
+}
+
+
+#ifdef WIN32
+
+bool
+OffscreenContext::Create( int, int )
+{
+	fprintf( stderr, "Offscreen rendering isn't available on this platform\n" );
+	return false;
+}
+
+void	OffscreenContext::Destroy( )		{ }
+
+#else
+
+// the default display, or, when that needs an X server that isn't there, Mesa's surfaceless one:
+
+static EGLDisplay
+OpenDisplay( )
+{
+	EGLDisplay dpy = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+	if( dpy != EGL_NO_DISPLAY  &&  eglInitialize( dpy, NULL, NULL ) )
+		return dpy;
+
+	const char *extensions = eglQueryString( EGL_NO_DISPLAY, EGL_EXTENSIONS );
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+	if( extensions == NULL  ||  strstr( extensions, "EGL_MESA_platform_surfaceless" ) == NULL  ||  getPlatformDisplay == NULL )
+		return EGL_NO_DISPLAY;
+
+	dpy = getPlatformDisplay( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+	if( dpy != EGL_NO_DISPLAY  &&  eglInitialize( dpy, NULL, NULL ) )
+		return dpy;
+	return EGL_NO_DISPLAY;
+}
+
+
+bool
+OffscreenContext::Create( int w, int h )
+{
+	Destroy( );
+
+	display = OpenDisplay( );
+	if( display == EGL_NO_DISPLAY )
+	{
+		fprintf( stderr, "Cannot open an EGL display\n" );
+		return false;
+	}
+
+	const EGLint configAttribs[ ] =
+	{
+		EGL_SURFACE_TYPE,	EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE,	EGL_OPENGL_BIT,
+		EGL_RED_SIZE,		8,
+		EGL_GREEN_SIZE,		8,
+		EGL_BLUE_SIZE,		8,
+		EGL_ALPHA_SIZE,		8,
+		EGL_DEPTH_SIZE,		24,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	if( ! eglChooseConfig( display, configAttribs, &config, 1, &numConfigs )  ||  numConfigs < 1 )
+	{
+		fprintf( stderr, "No EGL config for an RGBA8 + depth pbuffer\n" );
+		Destroy( );
+		return false;
+	}
+
+	const EGLint surfaceAttribs[ ] = { EGL_WIDTH, w, EGL_HEIGHT, h, EGL_NONE };
+	surface = eglCreatePbufferSurface( display, config, surfaceAttribs );
+	eglBindAPI( EGL_OPENGL_API );
+	context = eglCreateContext( display, config, EGL_NO_CONTEXT, NULL );
+	if( surface == EGL_NO_SURFACE  ||  context == EGL_NO_CONTEXT  ||  ! eglMakeCurrent( display, surface, surface, context ) )
+	{
+		fprintf( stderr, "Cannot create a %dx%d offscreen context: EGL error 0x%x\n", w, h, eglGetError( ) );
+		Destroy( );
+		return false;
+	}
+
+	width = w;
+	height = h;
+	return true;
+}
+
+
+void
+OffscreenContext::Destroy( )
+{
+	if( display == NULL )
+		return;
+	eglMakeCurrent( display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+	if( context != NULL )
+		eglDestroyContext( display, context );
+	if( surface != NULL )
+		eglDestroySurface( display, surface );
+	eglTerminate( display );
+	display = surface = context = NULL;
+	width = height = 0;
+}
+
+#endif
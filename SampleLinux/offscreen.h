@@ -0,0 +1,32 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <stdio.h>
+
+
+// an OpenGL context with nothing on the screen, for rendering without a window or a display:
+// an EGL pbuffer of the given size, made current on the calling thread.
+// with no X server, EGL's Mesa surfaceless platform is used, so this runs on llvmpipe
+// on a machine with no GPU (in CI, say). the context is a compatibility profile,
+// like the one glutCreateWindow gives, so the same drawing code works in both.
+// the pbuffer is single-buffered: what was drawn is there to glReadPixels after glFinish.
+
+class OffscreenContext
+{
+private:
+	void *	display;		// EGLDisplay
+	void *	surface;		// EGLSurface
+	void *	context;		// EGLContext
+	int	width, height;
+
+public:
+		OffscreenContext( );
+		~OffscreenContext( );
+
+	bool	Create( int, int );
+	void	Destroy( );
+	int	GetHeight( );
+	int	GetWidth( );
+};
+
+#endif	// OFFSCREEN_H
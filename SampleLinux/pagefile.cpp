@@ -0,0 +1,210 @@
+#include "pagefile.h"
+
+#include <string.h>
+
+#include "blockcompress.h"
+#include "image.h"
+
+
+static const char PageMagic[4] = { 'V', 'T', 'P', 'F' };
+static const unsigned int PageVersion = 1;
+
+enum PageFields
+{
+	PAGE_VERSION, PAGE_WIDTH, PAGE_HEIGHT, PAGE_TILE, PAGE_BORDER_TEXELS, PAGE_LEVELS, PAGE_FORMAT,
+	NUM_PAGE_FIELDS
+};
+
+static const long long PageHeaderBytes = 4 + NUM_PAGE_FIELDS * sizeof(int);
+
+
+// the level count: halve until the whole image fits in one tile:
+
+static int
+LevelsFor( int width, int height )
+{
+	int levels = 1;
+	while( width > PAGE_TILE_SIZE  ||  height > PAGE_TILE_SIZE )
+	{
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		levels++;
+	}
+	return levels;
+}
+
+
+PageFile::PageFile( )
+{
+	fp = NULL;
+	width = height = 0;
+	numLevels = 0;
+	format = PAGE_RGBA;
+}
+
+
+PageFile::~PageFile( )
+{
+	Close( );
+}
+
+
+void
+PageFile::Close( )
+{
+	if( fp != NULL )
+		fclose( fp );
+	fp = NULL;
+}
+
+
+size_t
+PageFile::TileBytes( int format )
+{
+	return format == PAGE_RGBA ? 4 * (size_t)PAGE_SIZE * PAGE_SIZE : BlockCompressedSize( format, PAGE_SIZE, PAGE_SIZE );
+}
+
+
+size_t
+PageFile::TileBytes( )
+{
+	return TileBytes( format );
+}
+
+
+int
+PageFile::GetTilesX( int level )
+{
+	int w = width >> level;
+	return ( ( w > 0 ? w : 1 ) + PAGE_TILE_SIZE - 1 ) / PAGE_TILE_SIZE;
+}
+
+
+int
+PageFile::GetTilesY( int level )
+{
+	int h = height >> level;
+	return ( ( h > 0 ? h : 1 ) + PAGE_TILE_SIZE - 1 ) / PAGE_TILE_SIZE;
+}
+
+
+bool
+PageFile::Open( const char *path )
+{
+	Close( );
+	fp = fopen( path, "rb" );
+	if( fp == NULL )
+	{
+		fprintf( stderr, "Cannot open page file '%s'\n", path );
+		return false;
+	}
+
+	char magic[4];
+	int header[NUM_PAGE_FIELDS];
+	bool ok = fread( magic, 1, 4, fp ) == 4  &&  memcmp( magic, PageMagic, 4 ) == 0
+		&&  fread( header, sizeof(int), NUM_PAGE_FIELDS, fp ) == NUM_PAGE_FIELDS
+		&&  header[PAGE_VERSION] == (int)PageVersion  &&  header[PAGE_TILE] == PAGE_TILE_SIZE
+		&&  header[PAGE_BORDER_TEXELS] == PAGE_BORDER  &&  header[PAGE_WIDTH] > 0  &&  header[PAGE_HEIGHT] > 0
+		&&  header[PAGE_LEVELS] == LevelsFor( header[PAGE_WIDTH], header[PAGE_HEIGHT] );
+	if( ! ok )
+	{
+		fprintf( stderr, "'%s' is not a page file this program can read\n", path );
+		Close( );
+		return false;
+	}
+
+	width = header[PAGE_WIDTH];
+	height = header[PAGE_HEIGHT];
+	numLevels = header[PAGE_LEVELS];
+	format = header[PAGE_FORMAT];
+	levelStart.resize( numLevels );
+	long long tiles = 0;
+	for( int l = 0; l < numLevels; l++ )
+	{
+		levelStart[l] = tiles;
+		tiles += (long long)GetTilesX( l ) * GetTilesY( l );
+	}
+	return true;
+}
+
+
+// one tile, into TileBytes( ) of out. only one thread at a time may read:
+
+bool
+PageFile::ReadTile( int level, int x, int y, unsigned char *out )
+{
+	if( fp == NULL  ||  level < 0  ||  level >= numLevels  ||  x < 0  ||  x >= GetTilesX( level )  ||  y < 0  ||  y >= GetTilesY( level ) )
+		return false;
+	size_t bytes = TileBytes( );
+	long long offset = PageHeaderBytes + ( levelStart[level] + (long long)y * GetTilesX( level ) + x ) * (long long)bytes;
+#ifdef WIN32
+	bool ok = _fseeki64( fp, offset, SEEK_SET ) == 0;
+#else
+	bool ok = fseeko( fp, (off_t)offset, SEEK_SET ) == 0;
+#endif
+	return ok  &&  fread( out, 1, bytes, fp ) == bytes;
+}
+
+
+// cut an rgba8 image, top row first, into a page file of all its levels:
+
+bool
+PageFile::Write( const char *path, int format, const unsigned char *rgba, int width, int height )
+{
+	FILE *out = fopen( path, "wb" );
+	if( out == NULL )
+	{
+		fprintf( stderr, "Cannot create '%s'\n", path );
+		return false;
+	}
+
+	int numLevels = LevelsFor( width, height );
+	int header[NUM_PAGE_FIELDS];
+	header[PAGE_VERSION] = PageVersion;
+	header[PAGE_WIDTH] = width;
+	header[PAGE_HEIGHT] = height;
+	header[PAGE_TILE] = PAGE_TILE_SIZE;
+	header[PAGE_BORDER_TEXELS] = PAGE_BORDER;
+	header[PAGE_LEVELS] = numLevels;
+	header[PAGE_FORMAT] = format;
+	bool ok = fwrite( PageMagic, 1, 4, out ) == 4  &&  fwrite( header, sizeof(int), NUM_PAGE_FIELDS, out ) == NUM_PAGE_FIELDS;
+
+	std::vector<unsigned char> level( rgba, rgba + 4 * (size_t)width * height );
+	std::vector<unsigned char> page( 4 * (size_t)PAGE_SIZE * PAGE_SIZE );
+	std::vector<unsigned char> blocks( TileBytes( format ) );
+	int w = width, h = height;
+	for( int l = 0; l < numLevels  &&  ok; l++ )
+	{
+		int tilesX = ( w + PAGE_TILE_SIZE - 1 ) / PAGE_TILE_SIZE;
+		int tilesY = ( h + PAGE_TILE_SIZE - 1 ) / PAGE_TILE_SIZE;
+		for( int ty = 0; ty < tilesY  &&  ok; ty++ )
+			for( int tx = 0; tx < tilesX  &&  ok; tx++ )
+			{
+				for( int y = 0; y < PAGE_SIZE; y++ )
+				{
+					int sy = ty * PAGE_TILE_SIZE - PAGE_BORDER + y;
+					sy = sy < 0 ? 0 : ( sy >= h ? h - 1 : sy );
+					for( int x = 0; x < PAGE_SIZE; x++ )
+					{
+						int sx = tx * PAGE_TILE_SIZE - PAGE_BORDER + x;
+						sx = sx < 0 ? 0 : ( sx >= w ? w - 1 : sx );
+						memcpy( &page[ 4 * ( y * PAGE_SIZE + x ) ], &level[ 4 * ( (size_t)sy * w + sx ) ], 4 );
+					}
+				}
+				if( format == PAGE_RGBA )
+					ok = fwrite( page.data( ), 1, page.size( ), out ) == page.size( );
+				else
+				{
+					CompressBlocks( format, page.data( ), PAGE_SIZE, PAGE_SIZE, blocks.data( ) );
+					ok = fwrite( blocks.data( ), 1, blocks.size( ), out ) == blocks.size( );
+				}
+			}
+		if( l + 1 < numLevels )
+			level = HalfSize( level.data( ), w, h, w, h );
+	}
+	if( fclose( out ) != 0 )
+		ok = false;
+	if( ! ok )
+		fprintf( stderr, "Cannot write '%s'\n", path );
+	return ok;
+}
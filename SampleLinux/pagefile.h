@@ -0,0 +1,55 @@
+#ifndef PAGEFILE_H
+#define PAGEFILE_H
+
+#include <stdio.h>
+#include <vector>
+
+
+// page files: a virtual texture cut into tiles, for every mip level down to one that fits
+// in a single tile, each tile stored ready to copy into the atlas.
+//
+// a tile is PAGE_TILE_SIZE texels square plus a PAGE_BORDER of its neighbors' texels on each
+// side (clamped at the image's edges), so bilinear filtering in the atlas never reaches into
+// an unrelated page; the whole page is 132 texels, a multiple of the 4x4 compression blocks.
+// the tiles are either rgba8 or compressed with one of the BLOCK_ formats, all the same size,
+// stored level 0 first and row by row within a level -- so where a tile is follows from its
+// level and position, and there's no table of offsets:
+//
+//	header:		"VTPF", version, width, height, tileSize, border, numLevels, format
+//	tiles:		level 0 (0,0) (1,0) ... level 1 ... up to the 1x1-tile level
+
+const int PAGE_TILE_SIZE = 128;
+const int PAGE_BORDER = 2;
+const int PAGE_SIZE = PAGE_TILE_SIZE + 2*PAGE_BORDER;
+const int PAGE_RGBA = -1;				// the format of uncompressed tiles
+
+
+class PageFile
+{
+private:
+	FILE *		fp;
+	int		width, height;
+	int		numLevels;
+	int		format;
+	std::vector<long long>	levelStart;		// tile index of each level's first tile
+
+public:
+		PageFile( );
+		~PageFile( );
+
+	void	Close( );
+	int	GetFormat( )				{ return format; }
+	int	GetHeight( )				{ return height; }
+	int	GetNumLevels( )				{ return numLevels; }
+	int	GetTilesX( int level );
+	int	GetTilesY( int level );
+	int	GetWidth( )				{ return width; }
+	bool	Open( const char * );
+	bool	ReadTile( int level, int x, int y, unsigned char * );
+	size_t	TileBytes( );
+
+	static size_t	TileBytes( int format );
+	static bool	Write( const char *, int format, const unsigned char *rgba, int width, int height );
+};
+
+#endif	// PAGEFILE_H
@@ -0,0 +1,263 @@
+#include "programcache.h"
+
+#include <string.h>
+#include <filesystem>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include "glew.h"
+#include <GL/gl.h>
+#endif
+
+
+ProgramCache	Programs;
+
+static const char ProgramMagic[4] = { 'P', 'B', 'I', 'N' };
+static const unsigned int ProgramVersion = 1;
+
+
+ProgramCache::ProgramCache( )
+{
+	checked = supported = false;
+	loads = compiles = rejected = 0;
+}
+
+
+// NULL or "" turns the cache off:
+
+void
+ProgramCache::SetDirectory( const char *dir )
+{
+	directory = dir != NULL ? dir : "";
+}
+
+
+unsigned long long
+ProgramCache::Hash( const void *data, size_t length, unsigned long long key )
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for( size_t i = 0; i < length; i++ )
+		key = ( key ^ p[i] ) * 1099511628211ull;
+	return key;
+}
+
+
+// everything that goes into compiling the program. a stage's strings are hashed with a 0
+// after each, so moving text from one string to the next makes a different key:
+
+unsigned long long
+ProgramCache::Key( const ShaderStage *stages, int numStages )
+{
+	unsigned long long key = PROGRAM_KEY_START;
+	for( int s = 0; s < numStages; s++ )
+	{
+		key = Hash( &stages[s].type, sizeof(stages[s].type), key );
+		for( int i = 0; i < stages[s].numSources; i++ )
+			key = Hash( stages[s].sources[i], strlen( stages[s].sources[i] ) + 1, key );
+	}
+	return key;
+}
+
+
+// with the GL context current -- the first time, it asks the GL who it is:
+
+bool
+ProgramCache::Supported( )
+{
+	if( ! checked )
+	{
+		checked = true;
+		GLint formats = 0;
+		glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &formats );
+		supported = formats > 0;
+		const char *strings[3] = { (const char *)glGetString( GL_VENDOR ), (const char *)glGetString( GL_RENDERER ),
+						(const char *)glGetString( GL_VERSION ) };
+		for( int i = 0; i < 3; i++ )
+		{
+			driver += strings[i] != NULL ? strings[i] : "";
+			driver += '\n';
+		}
+	}
+	return supported;
+}
+
+
+std::string
+ProgramCache::PathFor( const char *label, unsigned long long key )
+{
+	key = Hash( driver.data( ), driver.size( ), key );
+	char name[64];
+	snprintf( name, sizeof(name), "-%016llx.bin", key );
+	return directory + "/" + label + name;
+}
+
+
+// the linked program, or 0 if it has to be built from source:
+
+unsigned int
+ProgramCache::Load( const char *label, unsigned long long key )
+{
+	if( directory.empty( )  ||  ! Supported( ) )
+		return 0;
+
+	std::string path = PathFor( label, key );
+	FILE *fp = fopen( path.c_str( ), "rb" );
+	if( fp == NULL )
+		return 0;
+	char magic[4];
+	unsigned int header[3];			// version, binary format, length
+	std::vector<char> binary;
+	bool ok = fread( magic, 1, 4, fp ) == 4  &&  memcmp( magic, ProgramMagic, 4 ) == 0
+		&&  fread( header, sizeof(unsigned int), 3, fp ) == 3  &&  header[0] == ProgramVersion  &&  header[2] > 0;
+
+	// a truncated or corrupt file's length could be anything: no more than the file has left
+	// is allocated for it:
+	if( ok )
+	{
+		long start = ftell( fp );
+		ok = start >= 0  &&  fseek( fp, 0, SEEK_END ) == 0;
+		long end = ok ? ftell( fp ) : -1;
+		ok = ok  &&  end >= start  &&  (unsigned long)( end - start ) >= header[2]  &&  fseek( fp, start, SEEK_SET ) == 0;
+	}
+	if( ok )
+	{
+		binary.resize( header[2] );
+		ok = fread( binary.data( ), 1, binary.size( ), fp ) == binary.size( );
+	}
+	fclose( fp );
+	if( ! ok )
+		return 0;
+
+	GLuint program = glCreateProgram( );
+	glProgramBinary( program, header[1], binary.data( ), (GLsizei)binary.size( ) );
+	GLint linked = GL_FALSE;
+	glGetProgramiv( program, GL_LINK_STATUS, &linked );
+	if( linked != GL_TRUE )
+	{
+		glDeleteProgram( program );
+		rejected++;
+		return 0;
+	}
+	loads++;
+	return program;
+}
+
+
+// before glLinkProgram, so the GL keeps the binary around for Save( ):
+
+void
+ProgramCache::PrepareToLink( unsigned int program )
+{
+	if( ! directory.empty( )  &&  Supported( ) )
+		glProgramParameteri( program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
+}
+
+
+// after a successful link. written to a temporary file and renamed, so a launch that's
+// reading the cache at the same time never sees half a binary:
+
+void
+ProgramCache::Save( const char *label, unsigned long long key, unsigned int program )
+{
+	compiles++;
+	if( directory.empty( )  ||  ! Supported( ) )
+		return;
+
+	GLint length = 0;
+	glGetProgramiv( program, GL_PROGRAM_BINARY_LENGTH, &length );
+	if( length <= 0 )
+		return;
+	std::vector<char> binary( length );
+	GLenum format = 0;
+	GLsizei written = 0;
+	glGetProgramBinary( program, length, &written, &format, binary.data( ) );
+	if( written <= 0 )
+		return;
+
+	std::error_code ec;
+	std::filesystem::create_directories( directory, ec );
+	std::string path = PathFor( label, key );
+	std::string tmp = path + ".tmp";
+	FILE *fp = fopen( tmp.c_str( ), "wb" );
+	if( fp == NULL )
+	{
+		fprintf( stderr, "Cannot write to the shader cache '%s'\n", directory.c_str( ) );
+		directory.clear( );		// once is enough
+		return;
+	}
+	unsigned int header[3] = { ProgramVersion, format, (unsigned int)written };
+	bool ok = fwrite( ProgramMagic, 1, 4, fp ) == 4  &&  fwrite( header, sizeof(unsigned int), 3, fp ) == 3
+		&&  fwrite( binary.data( ), 1, written, fp ) == (size_t)written;
+	ok = fclose( fp ) == 0  &&  ok;
+#ifdef WIN32
+	remove( path.c_str( ) );		// rename( ) won't replace an existing file on Windows
+#endif
+	if( ! ok  ||  rename( tmp.c_str( ), path.c_str( ) ) != 0 )
+		remove( tmp.c_str( ) );
+}
+
+
+// the whole thing for a program built from strings: load it, or compile, link and save it.
+// 0 (and the errors on stderr) if it doesn't compile or link:
+
+unsigned int
+ProgramCache::Build( const char *label, const ShaderStage *stages, int numStages )
+{
+	unsigned long long key = Key( stages, numStages );
+	GLuint program = Load( label, key );
+	if( program != 0 )
+		return program;
+
+	program = glCreateProgram( );
+	char infoLog[512];
+	GLint success;
+	bool compiled = true;
+	for( int s = 0; s < numStages; s++ )
+	{
+		GLuint shader = glCreateShader( stages[s].type );
+		glShaderSource( shader, stages[s].numSources, stages[s].sources, NULL );
+		glCompileShader( shader );
+		glGetShaderiv( shader, GL_COMPILE_STATUS, &success );
+		if( ! success )
+		{
+			glGetShaderInfoLog( shader, sizeof(infoLog), NULL, infoLog );
+			fprintf( stderr, "%s shader error: %s\n", label, infoLog );
+			compiled = false;
+		}
+		glAttachShader( program, shader );
+		glDeleteShader( shader );
+	}
+	PrepareToLink( program );
+	glLinkProgram( program );
+	glGetProgramiv( program, GL_LINK_STATUS, &success );
+	if( ! success )
+	{
+		if( compiled )
+		{
+			glGetProgramInfoLog( program, sizeof(infoLog), NULL, infoLog );
+			fprintf( stderr, "%s program error: %s\n", label, infoLog );
+		}
+		glDeleteProgram( program );
+		return 0;
+	}
+	Save( label, key, program );
+	return program;
+}
+
+
+void
+ProgramCache::PrintStats( )
+{
+	if( directory.empty( )  ||  ! checked )
+		return;
+	if( ! supported )
+		fprintf( stderr, "Shader cache: the GL has no program binary formats, every program was compiled\n" );
+	else
+		fprintf( stderr, "Shader cache: %ld programs loaded, %ld compiled, %ld binaries rejected\n", loads, compiles, rejected );
+}
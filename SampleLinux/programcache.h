@@ -0,0 +1,60 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <stdio.h>
+#include <string>
+
+
+// linked shader programs, kept on disk with glGetProgramBinary so the next launch loads them
+// with glProgramBinary instead of compiling and linking from source:
+//
+//	key		a 64-bit FNV-1a hash of every stage's type and source strings (so the #defines
+//			that pick a variant are part of it) and of the GL's vendor, renderer and version
+//			strings -- a new driver is a different key, not a program it can't take
+//	files		<directory>/<label>-<key>.bin: "PBIN", version, binary format, length, binary
+//	misses		no file, an unreadable one, or a binary the GL turns down (drivers may, even
+//			for their own) all mean compile from source, and save what gets linked
+//
+// nothing is cached when there is no directory, or when the GL has no program binary formats.
+
+const unsigned long long PROGRAM_KEY_START = 14695981039346656037ull;	// FNV-1a offset basis
+
+
+// one shader stage: its type (GL_VERTEX_SHADER, ...) and the strings glShaderSource gets:
+
+struct ShaderStage
+{
+	unsigned int		type;
+	const char * const *	sources;
+	int			numSources;
+};
+
+
+class ProgramCache
+{
+private:
+	std::string	directory;		// empty when off
+	std::string	driver;
+	bool		checked, supported;
+	long		loads, compiles, rejected;
+
+	std::string	PathFor( const char *, unsigned long long );
+	bool		Supported( );
+
+public:
+		ProgramCache( );
+
+	unsigned int	Build( const char *label, const ShaderStage *, int numStages );
+	unsigned int	Load( const char *label, unsigned long long key );
+	void		PrepareToLink( unsigned int program );
+	void		PrintStats( );
+	void		Save( const char *label, unsigned long long key, unsigned int program );
+	void		SetDirectory( const char * );
+
+	static unsigned long long	Hash( const void *, size_t, unsigned long long key = PROGRAM_KEY_START );
+	static unsigned long long	Key( const ShaderStage *, int numStages );
+};
+
+extern ProgramCache	Programs;
+
+#endif	// PROGRAMCACHE_H
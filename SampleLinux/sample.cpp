@@ -30,6 +30,7 @@
 #endif
 
 #include "glut.h"
+#include "glstate.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -177,15 +178,47 @@ bool autoRotate = true; // true means animate automatically
 
 // For shadow mapping
 GLuint depthMapFBO;
-GLuint depthMap;
-const unsigned int SHADOW_WIDTH = 1024, SHADOW_HEIGHT = 1024;
+GLuint depthMap;                // single map fitted to the whole panel field
+const unsigned int SHADOW_WIDTH = 2048, SHADOW_HEIGHT = 2048;
+
+// Cascaded shadow maps: the view frustum (out to SHADOW_DISTANCE) is split into
+// NumCascades slices, each rendered into one layer of a depth texture array.
+// NumCascades == 1 means "use the single field-fitted map":
+const int   MAX_CASCADES = 4;
+const float SHADOW_DISTANCE = 40.f;
+const float CASCADE_SPLIT_LAMBDA = 0.75f;  // 0. = uniform splits, 1. = logarithmic
+const int DEFAULT_CASCADES = 3;
+int     NumCascades;            // 1, 2, 3, or 4
+bool    CanDoCascades;          // false if the depth array can't be rendered to
+GLuint  cascadeDepthMaps;       // GL_TEXTURE_2D_ARRAY, MAX_CASCADES layers
+glm::mat4 cascadeMatrices[MAX_CASCADES];
+float   cascadeSplits[MAX_CASCADES];    // far view distance of each cascade
+
+// texture units used by the main shader:
+const int GROUND_TEXTURE_UNIT  = 0;
+const int SHADOW_TEXTURE_UNIT  = 1;
+const int CASCADE_TEXTURE_UNIT = 2;
 
 // We'll have a separate shader program for depth pass
 GLuint depthShaderProgram;
+GLint  depthLightSpaceLoc, depthModelLoc;
 
 // Matrices for light's perspective
 glm::mat4 lightSpaceMatrix;
 
+// GPU timing of the depth pass (printed when DebugOn). Two queries, alternating frames, so the
+// one read back is from a frame the GPU has had time to finish:
+GLuint depthPassQueries[2];
+bool   depthPassQueryPending[2] = { false, false };
+int    depthPassQueryNext = 0;
+
+// Per-instance model matrices for the instanced panel/base draws.
+// The mat4 takes attribute locations 3,4,5,6 in both the depth and main shaders:
+const GLuint INSTANCE_MODEL_LOC = 3;
+GLuint panelInstanceVBO, baseInstanceVBO;
+std::vector<glm::mat4> panelInstanceModels;
+std::vector<glm::mat4> baseInstanceModels;
+
 int CurrentPanelPosition = PANEL_POS_1;
 
 // NEW: We'll simulate the sun as a light that orbits around the Y-axis.
@@ -198,6 +231,8 @@ GLuint depth_vs;
 GLuint depth_fs;
 GLuint shaderProgram;
 GLint modelLoc, viewLoc, projLoc, objectColorLoc, lightColorLoc;
+GLint lightDirLoc, lightSpaceLoc, useTextureLoc, shadowsOnLoc, emissiveLoc;
+GLint numCascadesLoc, cascadeMatricesLoc, cascadeSplitsLoc;
 
 // VAOs and VBOs:
 GLuint terrainVAO, terrainVBO;
@@ -293,23 +328,36 @@ unsigned int cubeIndices[] = {
 const char* depth_vs_source = R"(
 #version 330 core
 layout (location = 0) in vec3 aPos;
+layout (location = 3) in mat4 aInstanceModel;
 
 uniform mat4 lightSpaceMatrix;
 uniform mat4 model;
 
 void main() {
-    gl_Position = lightSpaceMatrix * model * vec4(aPos, 1.0);
+    gl_Position = lightSpaceMatrix * model * aInstanceModel * vec4(aPos, 1.0);
+}
+
+)";
+
+// depth-only pass: nothing to write, the rasterizer fills in the depth
+const char* depth_fs_source = R"(
+#version 330 core
+
+void main() {
 }
 
 )";
-GLuconst char* depth_fs_source
 
 const char* vertexShaderSource = R"(
 #version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aTexCoord;
+layout (location = 3) in mat4 aInstanceModel;   // identity for non-instanced draws
 
 out vec2 TexCoord;
+out vec3 FragPos;
+out vec4 FragPosLightSpace;
+out float ViewDepth;
 
 uniform mat4 lightSpaceMatrix;
 uniform mat4 model;
@@ -317,7 +365,12 @@ uniform mat4 view;
 uniform mat4 projection;
 
 void main(){
-    gl_Position = lightSpaceMatrix * model * vec4(aPos, 1.0);
+    vec4 worldPos = model * aInstanceModel * vec4(aPos, 1.0);
+    FragPos = worldPos.xyz;
+    FragPosLightSpace = lightSpaceMatrix * worldPos;
+    vec4 viewPos = view * worldPos;
+    ViewDepth = -viewPos.z;
+    gl_Position = projection * viewPos;
     TexCoord = aTexCoord;
 }
 
@@ -328,32 +381,86 @@ const char* fragmentShaderSource = R"(
 out vec4 FragColor;
 
 in vec2 TexCoord;
+in vec3 FragPos;
 in vec4 FragPosLightSpace;
-
-uniform sampler2D shadowMap;
-uniform vec3 lightDir;
+in float ViewDepth;
+
+uniform sampler2D texture1;
+uniform sampler2D shadowMap;            // single field-fitted map
+uniform sampler2DArray cascadeMaps;     // one layer per cascade
+uniform int numCascades;                // 1 means use shadowMap
+uniform mat4 cascadeMatrices[4];
+uniform float cascadeSplits[4];
+uniform vec3 lightDir;          // unit vector towards the sun
 uniform vec3 objectColor;
 uniform vec3 lightColor;
+uniform bool useTexture;
+uniform bool shadowsOn;
+uniform bool emissive;          // the sun itself is not lit
 
-float ShadowCalculation(vec4 fragPosLightSpace) {
+// 3x3 PCF of a light-space position against one depth map (layer < 0 means shadowMap)
+float PCF(vec4 fragPosLightSpace, int layer, float bias) {
     // Transform to normalized device coordinates
     vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
     projCoords = projCoords * 0.5 + 0.5; // Transform to [0, 1]
 
-    // Sample the shadow map
-    float closestDepth = texture(shadowMap, projCoords.xy).r;
+    // Outside the light frustum means nothing can be casting onto us
+    if (projCoords.z > 1.0 || projCoords.x < 0.0 || projCoords.x > 1.0 || projCoords.y < 0.0 || projCoords.y > 1.0)
+        return 0.0;
+
     float currentDepth = projCoords.z;
+    vec2 texelSize = layer < 0 ? 1.0 / vec2(textureSize(shadowMap, 0)) : 1.0 / vec2(textureSize(cascadeMaps, 0).xy);
+
+    float shadow = 0.0;
+    for (int x = -1; x <= 1; ++x) {
+        for (int y = -1; y <= 1; ++y) {
+            vec2 uv = projCoords.xy + vec2(x, y) * texelSize;
+            float closestDepth = layer < 0 ? texture(shadowMap, uv).r : texture(cascadeMaps, vec3(uv, float(layer))).r;
+            shadow += currentDepth - bias > closestDepth ? 1.0 : 0.0;
+        }
+    }
+    return shadow / 9.0;
+}
+
+float ShadowCalculation(vec4 fragPosLightSpace, vec3 normal) {
+    // Slope-scaled bias to avoid acne on the tilted panels
+    float bias = max(0.0025 * (1.0 - dot(normal, lightDir)), 0.0005);
+
+    if (numCascades <= 1)
+        return PCF(fragPosLightSpace, -1, bias);
+
+    // pick the first cascade whose slice contains this fragment
+    int layer = numCascades;
+    for (int i = 0; i < numCascades; ++i) {
+        if (ViewDepth <= cascadeSplits[i]) {
+            layer = i;
+            break;
+        }
+    }
+    if (layer >= numCascades)
+        return 0.0;     // beyond the shadow distance
 
-    // Check if in shadow
-    float shadow = currentDepth > closestDepth + 0.005 ? 1.0 : 0.0; // Add bias to avoid artifacts
-    return shadow;
+    // farther cascades cover more world per texel, so scale the bias along
+    bias *= 1.0 + float(layer);
+    return PCF(cascadeMatrices[layer] * vec4(FragPos, 1.0), layer, bias);
 }
 
 void main() {
-    float shadow = ShadowCalculation(FragPosLightSpace);
+    vec3 color = useTexture ? texture(texture1, TexCoord).rgb : objectColor;
+    if (emissive) {
+        FragColor = vec4(color, 1.0);
+        return;
+    }
+
+    // Flat face normal, facing the light side so single-sided panels light from both faces
+    vec3 normal = normalize(cross(dFdx(FragPos), dFdy(FragPos)));
+    if (dot(normal, lightDir) < 0.0)
+        normal = -normal;
 
-    vec3 ambient = 0.3 * objectColor;
-    vec3 diffuse = max(dot(lightDir, normalize(FragPosLightSpace.xyz)), 0.0) * lightColor * objectColor;
+    float shadow = shadowsOn ? ShadowCalculation(FragPosLightSpace, normal) : 0.0;
+
+    vec3 ambient = 0.3 * color;
+    vec3 diffuse = max(dot(normal, lightDir), 0.0) * lightColor * color;
     vec3 result = ambient + (1.0 - shadow) * diffuse;
     FragColor = vec4(result, 1.0);
 }
@@ -370,6 +477,8 @@ void    DoDepthMenu( int );
 void    DoDebugMenu( int );
 void    DoMainMenu( int );
 void    DoProjectMenu( int );
+void    DoShadowsMenu( int );
+void    DoCascadesMenu( int );
 void    DoRasterString( float, float, float, char * );
 void    DoStrokeString( float, float, float, float, char * );
 float   ElapsedSeconds( );
@@ -390,6 +499,7 @@ float   Unit(float[3], float[3]);
 float   Unit(float[3]);
 static void buildShaderProgram();
 static void setupObjects();
+static void setupShadowMap();
 
 
 float*  Array3(float a,float b,float c);
@@ -501,6 +611,7 @@ main(int argc,char* argv[])
     buildShaderProgram();
     buildPanelGrid();
 	setupObjects(); // after building the panel grid
+    setupShadowMap();
 
     int width, height, nrChannels;
     unsigned char* data = stbi_load("grass.jpg", &width, &height, &nrChannels, 0);
@@ -532,44 +643,43 @@ main(int argc,char* argv[])
 
 
 
-static void buildShaderProgram() {
-    GLint textureLoc = glGetUniformLocation(shaderProgram, "texture1");
-    glUseProgram(shaderProgram);
-    glUniform1i(textureLoc, 0); // texture unit 0
-
-
-    GLuint vertexShader=glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader,1,&vertexShaderSource,NULL);
-    glCompileShader(vertexShader);
+static GLuint compileShader(GLenum type, const char* source, const char* what) {
+    GLuint shader=glCreateShader(type);
+    glShaderSource(shader,1,&source,NULL);
+    glCompileShader(shader);
 
     GLint success; char infoLog[512];
-    glGetShaderiv(vertexShader,GL_COMPILE_STATUS,&success);
+    glGetShaderiv(shader,GL_COMPILE_STATUS,&success);
     if(!success){
-        glGetShaderInfoLog(vertexShader,512,NULL,infoLog);
-        fprintf(stderr,"Vertex Shader Error: %s\n",infoLog);
+        glGetShaderInfoLog(shader,512,NULL,infoLog);
+        fprintf(stderr,"%s Shader Error: %s\n",what,infoLog);
     }
+    return shader;
+}
 
-    GLuint fragmentShader=glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader,1,&fragmentShaderSource,NULL);
-    glCompileShader(fragmentShader);
-    glGetShaderiv(fragmentShader,GL_COMPILE_STATUS,&success);
-    if(!success){
-        glGetShaderInfoLog(fragmentShader,512,NULL,infoLog);
-        fprintf(stderr,"Fragment Shader Error: %s\n",infoLog);
-    }
+static GLuint linkProgram(GLuint vertexShader, GLuint fragmentShader) {
+    GLuint program=glCreateProgram();
+    glAttachShader(program,vertexShader);
+    glAttachShader(program,fragmentShader);
+    glLinkProgram(program);
 
-    shaderProgram=glCreateProgram();
-    glAttachShader(shaderProgram,vertexShader);
-    glAttachShader(shaderProgram,fragmentShader);
-    glLinkProgram(shaderProgram);
-    glGetProgramiv(shaderProgram,GL_LINK_STATUS,&success);
+    GLint success; char infoLog[512];
+    glGetProgramiv(program,GL_LINK_STATUS,&success);
     if(!success){
-        glGetProgramInfoLog(shaderProgram,512,NULL,infoLog);
+        glGetProgramInfoLog(program,512,NULL,infoLog);
         fprintf(stderr,"Program Linking Error: %s\n",infoLog);
     }
 
     glDeleteShader(vertexShader);
     glDeleteShader(fragmentShader);
+    return program;
+}
+
+static void buildShaderProgram() {
+    // main lighting program:
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexShaderSource, "Vertex");
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSource, "Fragment");
+    shaderProgram = linkProgram(vertexShader, fragmentShader);
 
     // Get uniform locations:
     modelLoc = glGetUniformLocation(shaderProgram,"model");
@@ -577,6 +687,294 @@ static void buildShaderProgram() {
     projLoc = glGetUniformLocation(shaderProgram,"projection");
     objectColorLoc = glGetUniformLocation(shaderProgram,"objectColor");
     lightColorLoc = glGetUniformLocation(shaderProgram,"lightColor");
+    lightDirLoc = glGetUniformLocation(shaderProgram,"lightDir");
+    lightSpaceLoc = glGetUniformLocation(shaderProgram,"lightSpaceMatrix");
+    useTextureLoc = glGetUniformLocation(shaderProgram,"useTexture");
+    shadowsOnLoc = glGetUniformLocation(shaderProgram,"shadowsOn");
+    emissiveLoc = glGetUniformLocation(shaderProgram,"emissive");
+
+    glUseProgram(shaderProgram);
+    glUniform1i(glGetUniformLocation(shaderProgram, "texture1"), GROUND_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(shaderProgram, "shadowMap"), SHADOW_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(shaderProgram, "cascadeMaps"), CASCADE_TEXTURE_UNIT);
+    numCascadesLoc = glGetUniformLocation(shaderProgram,"numCascades");
+    cascadeMatricesLoc = glGetUniformLocation(shaderProgram,"cascadeMatrices");
+    cascadeSplitsLoc = glGetUniformLocation(shaderProgram,"cascadeSplits");
+    glUniform1i(emissiveLoc, GL_FALSE);
+
+    // depth-only program for the shadow pass:
+    depth_vs = compileShader(GL_VERTEX_SHADER, depth_vs_source, "Depth Vertex");
+    depth_fs = compileShader(GL_FRAGMENT_SHADER, depth_fs_source, "Depth Fragment");
+    depthShaderProgram = linkProgram(depth_vs, depth_fs);
+    depthLightSpaceLoc = glGetUniformLocation(depthShaderProgram,"lightSpaceMatrix");
+    depthModelLoc = glGetUniformLocation(depthShaderProgram,"model");
+
+    // Non-instanced draws (terrain, sun) leave the instance attribute array disabled,
+    // so its current value must be the identity:
+    for(int c = 0; c < 4; c++)
+        glVertexAttrib4f(INSTANCE_MODEL_LOC + c, c==0, c==1, c==2, c==3);
+}
+
+// Shadow map depth texture + FBO:
+static void setupShadowMap()
+{
+    glGenTextures(1, &depthMap);
+    glBindTexture(GL_TEXTURE_2D, depthMap);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenFramebuffers(1, &depthMapFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Shadow map framebuffer is not complete\n");
+
+    // cascade layers live in a depth texture array; if we can't render into one
+    // (some software/old drivers), stay on the single map:
+    glGenTextures(1, &cascadeDepthMaps);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, cascadeDepthMaps);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, SHADOW_WIDTH, SHADOW_HEIGHT, MAX_CASCADES, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    while( glGetError() != GL_NO_ERROR )
+        ;
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cascadeDepthMaps, 0, 0);
+    CanDoCascades = glGetError() == GL_NO_ERROR  &&  glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    if( ! CanDoCascades )
+        fprintf(stderr, "Cannot render to a depth texture array -- using a single shadow map\n");
+    NumCascades = CanDoCascades ? DEFAULT_CASCADES : 1;
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenQueries(2, depthPassQueries);
+}
+
+// Point the mat4 instance attribute (4 consecutive vec4 locations) of a VAO at an instance buffer:
+static void attachInstanceModels(GLuint vao, GLuint instanceVBO)
+{
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    for(int c = 0; c < 4; c++){
+        glVertexAttribPointer(INSTANCE_MODEL_LOC + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(c*sizeof(glm::vec4)));
+        glEnableVertexAttribArray(INSTANCE_MODEL_LOC + c);
+        glVertexAttribDivisor(INSTANCE_MODEL_LOC + c, 1);
+    }
+    glBindVertexArray(0);
+}
+
+static int numPanels()
+{
+    return (int)(sizeof(panelPositionsArr) / sizeof(panelPositionsArr[0]));
+}
+
+// Rebuild the per-panel model matrices for the current sun position and stream them to the GPU.
+// Both the depth pass and the main pass draw from these buffers.
+static void updateInstanceModels(const glm::vec3& lightPos)
+{
+    int n = numPanels();
+    panelInstanceModels.resize(n);
+    baseInstanceModels.resize(n);
+    for(int i = 0; i < n; i++){
+        // base post runs from the ground up to the panel pivot:
+        baseInstanceModels[i] = glm::translate(glm::mat4(1.0f), panelPositionsArr[i]);
+
+        float angleDeg = computePanelRotation(panelPositionsArr[i], lightPos);
+        glm::mat4 panelModel = glm::translate(glm::mat4(1.0f), panelPositionsArr[i]);
+        panelInstanceModels[i] = glm::rotate(panelModel, glm::radians(angleDeg), glm::vec3(0.0f,0.0f,1.0f));
+    }
+
+    // orphan and refill so we never wait on last frame's draws:
+    glBindBuffer(GL_ARRAY_BUFFER, panelInstanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, n*sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, n*sizeof(glm::mat4), panelInstanceModels.data());
+    glBindBuffer(GL_ARRAY_BUFFER, baseInstanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, n*sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, n*sizeof(glm::mat4), baseInstanceModels.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Fit an orthographic light frustum tightly around the panel field.
+// x/y (and near) bound the casters (panels + bases); far is pushed out to the ground
+// under them so the terrain still receives their shadows.
+static glm::mat4 computeLightSpaceMatrix(const glm::vec3& lightDir)
+{
+    int n = numPanels();
+    glm::vec3 casterMin( 1.e+37f), casterMax(-1.e+37f);
+    for(int i = 0; i < n; i++){
+        // a panel swings +-0.5 about its pivot in x/y and runs 0..1 in z; the base reaches the ground:
+        glm::vec3 p = panelPositionsArr[i];
+        casterMin = glm::min(casterMin, glm::vec3(p.x - 0.5f, 0.0f, p.z));
+        casterMax = glm::max(casterMax, glm::vec3(p.x + 0.5f, p.y + 0.5f, p.z + 1.0f));
+    }
+    glm::vec3 center = 0.5f * (casterMin + casterMax);
+
+    glm::vec3 up = fabs(lightDir.y) > 0.99f ? glm::vec3(0.f,0.f,1.f) : glm::vec3(0.f,1.f,0.f);
+    glm::mat4 lightView = glm::lookAt(center + lightDir, center, up);
+
+    glm::vec3 lsMin( 1.e+37f), lsMax(-1.e+37f);
+    for(int c = 0; c < 8; c++){
+        glm::vec3 corner((c&1) ? casterMax.x : casterMin.x, (c&2) ? casterMax.y : casterMin.y, (c&4) ? casterMax.z : casterMin.z);
+        glm::vec3 ls = glm::vec3(lightView * glm::vec4(corner, 1.0f));
+        lsMin = glm::min(lsMin, ls);
+        lsMax = glm::max(lsMax, ls);
+    }
+
+    // receivers: the ground quad corners only extend the far plane
+    float farZ = lsMin.z;
+    for(int c = 0; c < 4; c++){
+        glm::vec3 corner((c&1) ? 5.0f : -5.0f, 0.0f, (c&2) ? 5.0f : -5.0f);
+        farZ = glm::min(farZ, (lightView * glm::vec4(corner, 1.0f)).z);
+    }
+
+    // view space looks down -z, so near/far are the negated z extents:
+    glm::mat4 lightProjection = glm::ortho(lsMin.x, lsMax.x, lsMin.y, lsMax.y, -lsMax.z - 0.01f, -farZ + 0.01f);
+    return lightProjection * lightView;
+}
+
+// Split the camera frustum (out to SHADOW_DISTANCE) into NumCascades slices and fit a
+// light matrix to each. Each slice is bounded by a sphere so the ortho box keeps the same
+// size as the camera turns, and the box origin is snapped to whole shadow-map texels,
+// which together keep the shadow edges from shimmering.
+static void computeCascadeMatrices(const glm::vec3& lightDir, const glm::mat4& view)
+{
+    const float nearDist = 0.1f;
+    const float farDist  = SHADOW_DISTANCE;
+
+    // casters can sit outside a slice but still between it and the sun, so the
+    // near plane is pulled back to cover the whole field:
+    int n = numPanels();
+    glm::vec3 casterMin( 1.e+37f), casterMax(-1.e+37f);
+    for(int i = 0; i < n; i++){
+        glm::vec3 p = panelPositionsArr[i];
+        casterMin = glm::min(casterMin, glm::vec3(p.x - 0.5f, 0.0f, p.z));
+        casterMax = glm::max(casterMax, glm::vec3(p.x + 0.5f, p.y + 0.5f, p.z + 1.0f));
+    }
+
+    glm::vec3 up = fabs(lightDir.y) > 0.99f ? glm::vec3(0.f,0.f,1.f) : glm::vec3(0.f,1.f,0.f);
+    glm::mat4 invView = glm::inverse(view);
+
+    float sliceNear = nearDist;
+    for(int c = 0; c < NumCascades; c++){
+        // practical split scheme: blend of logarithmic and uniform
+        float f = (float)(c+1) / (float)NumCascades;
+        float logSplit = nearDist * powf(farDist/nearDist, f);
+        float uniSplit = nearDist + (farDist - nearDist) * f;
+        float sliceFar = CASCADE_SPLIT_LAMBDA * logSplit + (1.f - CASCADE_SPLIT_LAMBDA) * uniSplit;
+        cascadeSplits[c] = sliceFar;
+
+        glm::mat4 sliceProjection;
+        if(NowProjection==ORTHO)
+            sliceProjection = glm::ortho(-2.f,2.f,-2.f,2.f,sliceNear,sliceFar);
+        else
+            sliceProjection = glm::perspective(glm::radians(70.f),1.f,sliceNear,sliceFar);
+        glm::mat4 invSlice = invView * glm::inverse(sliceProjection);
+
+        glm::vec3 corners[8];
+        glm::vec3 center(0.f);
+        for(int k = 0; k < 8; k++){
+            glm::vec4 ndc((k&1) ? 1.f : -1.f, (k&2) ? 1.f : -1.f, (k&4) ? 1.f : -1.f, 1.f);
+            glm::vec4 w = invSlice * ndc;
+            corners[k] = glm::vec3(w) / w.w;
+            center += corners[k];
+        }
+        center /= 8.f;
+
+        float radius = 0.f;
+        for(int k = 0; k < 8; k++)
+            radius = glm::max(radius, glm::length(corners[k] - center));
+        radius = ceilf(radius * 16.f) / 16.f;     // quantize so the size doesn't jitter
+
+        glm::mat4 lightView = glm::lookAt(center + lightDir, center, up);
+
+        float centerZ = (lightView * glm::vec4(center, 1.0f)).z;
+        float zMin = centerZ - radius, zMax = centerZ + radius;
+        for(int k = 0; k < 8; k++){
+            glm::vec3 corner((k&1) ? casterMax.x : casterMin.x, (k&2) ? casterMax.y : casterMin.y, (k&4) ? casterMax.z : casterMin.z);
+            zMax = glm::max(zMax, (lightView * glm::vec4(corner, 1.0f)).z);
+        }
+        glm::mat4 lightProjection = glm::ortho(-radius, radius, -radius, radius, -zMax - 0.01f, -zMin + 0.01f);
+
+        // snap the world origin to a texel so the map only moves in whole texels:
+        glm::mat4 m = lightProjection * lightView;
+        glm::vec4 origin = m * glm::vec4(0.f, 0.f, 0.f, 1.f);
+        origin *= (float)SHADOW_WIDTH / 2.f;
+        glm::vec4 offset = glm::round(origin) - origin;
+        offset *= 2.f / (float)SHADOW_WIDTH;
+        lightProjection[3][0] += offset.x;
+        lightProjection[3][1] += offset.y;
+
+        cascadeMatrices[c] = lightProjection * lightView;
+        sliceNear = sliceFar;
+    }
+}
+
+// Depth-only render of the panels and bases from the sun into one shadow map / cascade layer.
+static void renderDepthMap(const glm::mat4& matrix, int layer)
+{
+    int n = numPanels();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
+    if(layer < 0)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
+    else
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cascadeDepthMaps, 0, layer);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    GlState.UniformMatrix4fv(depthLightSpaceLoc,glm::value_ptr(matrix));
+
+    GlState.BindVertexArray(baseVAO);
+    glDrawElementsInstanced(GL_TRIANGLES,36,GL_UNSIGNED_INT,0,n);
+    GlState.BindVertexArray(panelVAO);
+    glDrawArraysInstanced(GL_TRIANGLES,0,6,n);
+}
+
+// The whole shadow pass: the single map, or one depth render per cascade.
+static void renderDepthPass()
+{
+    // Only results the GPU already has: asking for one that isn't there yet waits for it.
+    // The older query first, since it's the one about to be reused:
+    for(int k = 0; k < 2 && DebugOn != 0; k++){
+        int q = (depthPassQueryNext + k) % 2;
+        GLuint available = 0;
+        if(depthPassQueryPending[q])
+            glGetQueryObjectuiv(depthPassQueries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+        if(available){
+            GLuint64 ns;
+            glGetQueryObjectui64v(depthPassQueries[q], GL_QUERY_RESULT, &ns);
+            depthPassQueryPending[q] = false;
+            fprintf(stderr, "Depth pass: %.3f ms for %d panels, %d cascade(s)\n", (double)ns / 1.0e6, numPanels(), NumCascades);
+        }
+    }
+    int query = depthPassQueryNext;
+    depthPassQueryNext = 1 - depthPassQueryNext;
+    glBeginQuery(GL_TIME_ELAPSED, depthPassQueries[query]);
+
+    glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(1.1f, 4.0f);
+
+    GlState.UseProgram(depthShaderProgram);
+    GlState.UniformMatrix4fv(depthModelLoc,glm::value_ptr(glm::mat4(1.0f)));
+
+    if(NumCascades <= 1)
+        renderDepthMap(lightSpaceMatrix, -1);
+    else
+        for(int c = 0; c < NumCascades; c++)
+            renderDepthMap(cascadeMatrices[c], c);
+
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glEndQuery(GL_TIME_ELAPSED);
+    depthPassQueryPending[query] = true;
 }
 
 // Create VAOs/VBOs for objects:
@@ -639,6 +1037,12 @@ static void setupObjects()
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void*)0);
 	glEnableVertexAttribArray(0);
 
+    // per-instance model matrices (panels and their grid lines share one buffer):
+    glGenBuffers(1, &panelInstanceVBO);
+    glGenBuffers(1, &baseInstanceVBO);
+    attachInstanceModels(panelVAO, panelInstanceVBO);
+    attachInstanceModels(panelGridVAO, panelInstanceVBO);
+    attachInstanceModels(baseVAO, baseInstanceVBO);
 }
 
 void Animate() {
@@ -666,7 +1070,7 @@ void Animate() {
 
 void DisplayLogsOnScreen() {
     // Disable depth testing to draw text over everything
-    glDisable(GL_DEPTH_TEST);
+    GlState.Disable(GL_DEPTH_TEST);
 
     // Set up orthographic projection to align with the map's visible area
     glMatrixMode(GL_PROJECTION);
@@ -704,7 +1108,7 @@ void DisplayLogsOnScreen() {
     glPopMatrix();
 
     // Re-enable depth testing
-    glEnable(GL_DEPTH_TEST);
+    GlState.Enable(GL_DEPTH_TEST);
 }
 
 void
@@ -713,13 +1117,48 @@ Display()
     if (DebugOn != 0)
         fprintf(stderr, "Starting Display.\n");
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, groundTexture);
-
     glutSetWindow( MainWindow );
+
+    // State and uniforms go through GlState, which drops whatever didn't change since it was last set:
+    GlState.Forget( );
+    GlState.ResetCounts( );
+
+    // Compute sun position:
+	float angle = Time * 2.0f * M_PI;
+	float radAngle = angle;
+	glm::vec3 lightPos(cos(radAngle)*SunRadius, sin(radAngle)*SunRadius, 0.0f);
+    glm::vec3 lightDir = glm::normalize(lightPos);
+
+    // Panel/base instance matrices feed both passes:
+    updateInstanceModels(lightPos);
+
+    // Camera (the shadow cascades are split along its frustum):
+    glm::mat4 view = glm::lookAt(glm::vec3(0.f,2.f,6.f),
+                                 glm::vec3(0.f,0.f,0.f),
+                                 glm::vec3(0.f,1.f,0.f));
+
+    // Shadow pass (only while the sun is up):
+    bool sunUp = lightPos.y > 0.0f;
+    if( ShadowsOn != 0 && sunUp )
+    {
+        if( NumCascades <= 1 )
+            lightSpaceMatrix = computeLightSpaceMatrix(lightDir);
+        else
+            computeCascadeMatrices(lightDir, view);
+        renderDepthPass();
+    }
+    GlState.UseProgram( 0 );
+
+    GlState.ActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    GlState.BindTexture(GL_TEXTURE_2D, depthMap);
+    GlState.ActiveTexture(GL_TEXTURE0 + CASCADE_TEXTURE_UNIT);
+    GlState.BindTexture(GL_TEXTURE_2D_ARRAY, cascadeDepthMaps);
+    GlState.ActiveTexture(GL_TEXTURE0 + GROUND_TEXTURE_UNIT);
+    GlState.BindTexture(GL_TEXTURE_2D, groundTexture);
+
     glDrawBuffer( GL_BACK );
     glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
-    glEnable( GL_DEPTH_TEST );
+    GlState.Enable( GL_DEPTH_TEST );
 
     glShadeModel( GL_FLAT );
 
@@ -765,18 +1204,10 @@ Display()
     }
     glEnable(GL_NORMALIZE);
 
-    // Compute sun position:
-	float angle = Time * 2.0f * M_PI;
-	float radAngle = angle;
-	glm::vec3 lightPos(cos(radAngle)*SunRadius, sin(radAngle)*SunRadius, 0.0f);
-
     // Use modern pipeline for drawing terrain, panel, etc.:
-    glUseProgram(shaderProgram);
+    GlState.UseProgram(shaderProgram);
 
     // Set up camera via glm:
-    glm::mat4 view = glm::lookAt(glm::vec3(0.f,2.f,6.f),
-                                 glm::vec3(0.f,0.f,0.f),
-                                 glm::vec3(0.f,1.f,0.f));
     glm::mat4 projection;
     if(NowProjection==ORTHO){
         projection = glm::ortho(-2.f,2.f,-2.f,2.f,0.1f,1000.f);
@@ -784,56 +1215,44 @@ Display()
         projection = glm::perspective(glm::radians(70.f),1.f,0.1f,1000.f);
     }
 
-    glUniformMatrix4fv(viewLoc,1,GL_FALSE,glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc,1,GL_FALSE,glm::value_ptr(projection));
+    GlState.UniformMatrix4fv(viewLoc,glm::value_ptr(view));
+    GlState.UniformMatrix4fv(projLoc,glm::value_ptr(projection));
 
-    glUniform3f(lightColorLoc,1.0f,1.0f,0.8f);
+    GlState.Uniform3f(lightColorLoc,1.0f,1.0f,0.8f);
+    GlState.Uniform3f(lightDirLoc,lightDir.x,lightDir.y,lightDir.z);
+    GlState.UniformMatrix4fv(lightSpaceLoc,glm::value_ptr(lightSpaceMatrix));
+    GlState.Uniform1i(numCascadesLoc, NumCascades);
+    glUniformMatrix4fv(cascadeMatricesLoc,MAX_CASCADES,GL_FALSE,glm::value_ptr(cascadeMatrices[0]));
+    glUniform1fv(cascadeSplitsLoc,MAX_CASCADES,cascadeSplits);
+    GlState.Uniform1i(shadowsOnLoc, ShadowsOn != 0 && sunUp);
 
     
     // For terrain (textured ground):
-    glUniform1i(glGetUniformLocation(shaderProgram, "useTexture"), GL_TRUE);
+    GlState.Uniform1i(useTextureLoc, GL_TRUE);
 
     // Draw terrain
     glm::mat4 model=glm::mat4(1.0f);
-    glUniform3f(objectColorLoc,0.2f,0.6f,0.2f);
-    glUniformMatrix4fv(modelLoc,1,GL_FALSE,glm::value_ptr(model));
-    glBindVertexArray(terrainVAO);
+    GlState.Uniform3f(objectColorLoc,0.2f,0.6f,0.2f);
+    GlState.UniformMatrix4fv(modelLoc,glm::value_ptr(model));
+    GlState.BindVertexArray(terrainVAO);
     glDrawArrays(GL_TRIANGLES,0,6);
 
 
-	// Draw bases and panels for all 9 panels:
-    glUniform1i(glGetUniformLocation(shaderProgram, "useTexture"), GL_FALSE);
-
-
-	glUniform3f(objectColorLoc,0.1f,0.1f,0.1f);
-	for(int i=0; i<9; i++){
-		// Draw the base
-		glm::mat4 baseModel=glm::mat4(1.0f);
-		baseModel=glm::translate(baseModel, glm::vec3(panelPositionsArr[i].x, 0.0f, panelPositionsArr[i].z));
-		glUniformMatrix4fv(modelLoc,1,GL_FALSE,glm::value_ptr(baseModel));
-		glBindVertexArray(baseVAO);
-		glDrawElements(GL_TRIANGLES,36,GL_UNSIGNED_INT,0);
+	// Draw bases, panels and panel grids, one instanced draw each:
+    GlState.Uniform1i(useTextureLoc, GL_FALSE);
+    int n = numPanels();
 
-		// Compute panel rotation
-		float angleDeg=computePanelRotation(panelPositionsArr[i], lightPos);
+	GlState.Uniform3f(objectColorLoc,0.1f,0.1f,0.1f);
+	GlState.BindVertexArray(baseVAO);
+	glDrawElementsInstanced(GL_TRIANGLES,36,GL_UNSIGNED_INT,0,n);
 
-		// Draw panel
-		glm::mat4 panelModel=glm::mat4(1.0f);
-		panelModel=glm::translate(panelModel, panelPositionsArr[i]);
-		panelModel=glm::rotate(panelModel, glm::radians(angleDeg), glm::vec3(0.0f,0.0f,1.0f));
-		glUniform3f(objectColorLoc,0.2f,0.2f,0.5f);
-		glUniformMatrix4fv(modelLoc,1,GL_FALSE,glm::value_ptr(panelModel));
-		glBindVertexArray(panelVAO);
-		glDrawArrays(GL_TRIANGLES,0,6);
+	GlState.Uniform3f(objectColorLoc,0.2f,0.2f,0.5f);
+	GlState.BindVertexArray(panelVAO);
+	glDrawArraysInstanced(GL_TRIANGLES,0,6,n);
 
-		// Draw the grid on top of the panel
-		glUniform3f(objectColorLoc, 0.0f, 0.0f, 0.0f); // black lines
-		// Same panelModel, so no changes needed to model matrix:
-		glUniformMatrix4fv(modelLoc,1,GL_FALSE,glm::value_ptr(panelModel));
-		glBindVertexArray(panelGridVAO);
-		glDrawArrays(GL_LINES, 0, (GLsizei)(panelGridVertices.size()/3));
-
-	}
+	GlState.Uniform3f(objectColorLoc, 0.0f, 0.0f, 0.0f); // black lines
+	GlState.BindVertexArray(panelGridVAO);
+	glDrawArraysInstanced(GL_LINES, 0, (GLsizei)(panelGridVertices.size()/3), n);
 
     DisplayLogsOnScreen();
 
@@ -841,12 +1260,17 @@ Display()
     {
         glm::mat4 sunModel=glm::mat4(1.0f);
         sunModel=glm::translate(sunModel,lightPos);
-        glUniform3f(objectColorLoc,1.0f,1.0f,0.0f);
-        glUniformMatrix4fv(modelLoc,1,GL_FALSE,glm::value_ptr(sunModel));
-        glBindVertexArray(sunVAO);
+        GlState.Uniform3f(objectColorLoc,1.0f,1.0f,0.0f);
+        GlState.Uniform1i(emissiveLoc, GL_TRUE);
+        GlState.UniformMatrix4fv(modelLoc,glm::value_ptr(sunModel));
+        GlState.BindVertexArray(sunVAO);
         glDrawElements(GL_TRIANGLES,36,GL_UNSIGNED_INT,0);
+        GlState.Uniform1i(emissiveLoc, GL_FALSE);
     }
 
+    if (DebugOn != 0)
+        fprintf(stderr, "GL state: %ld calls made, %ld redundant ones skipped\n", GlState.GetIssued(), GlState.GetElided());
+
     // Swap buffers:
     glutSwapBuffers();
     glFlush();
@@ -935,6 +1359,22 @@ DoProjectMenu( int id )
     glutPostRedisplay( );
 }
 
+void
+DoShadowsMenu( int id )
+{
+    ShadowsOn = id;
+    glutSetWindow( MainWindow );
+    glutPostRedisplay( );
+}
+
+void
+DoCascadesMenu( int id )
+{
+    NumCascades = CanDoCascades ? id : 1;
+    glutSetWindow( MainWindow );
+    glutPostRedisplay( );
+}
+
 void
 DoRasterString( float x, float y, float z, char *s )
 {
@@ -988,6 +1428,16 @@ InitMenus( )
     glutAddMenuEntry( "Off",  0 );
     glutAddMenuEntry( "On",   1 );
 
+    int shadowsmenu = glutCreateMenu( DoShadowsMenu );
+    glutAddMenuEntry( "Off",  0 );
+    glutAddMenuEntry( "On",   1 );
+
+    int cascadesmenu = glutCreateMenu( DoCascadesMenu );
+    glutAddMenuEntry( "Single Map",  1 );
+    glutAddMenuEntry( "2 Cascades",  2 );
+    glutAddMenuEntry( "3 Cascades",  3 );
+    glutAddMenuEntry( "4 Cascades",  4 );
+
 #ifdef DEMO_DEPTH_BUFFER
     int depthbuffermenu = glutCreateMenu( DoDepthBufferMenu );
     glutAddMenuEntry( "Off",  0 );
@@ -1014,6 +1464,8 @@ InitMenus( )
     glutAddSubMenu(   "Depth Fighting",depthfightingmenu);
 #endif
     glutAddSubMenu(   "Depth Cue",     depthcuemenu);
+    glutAddSubMenu(   "Shadows",       shadowsmenu);
+    glutAddSubMenu(   "Shadow Cascades", cascadesmenu);
     glutAddSubMenu(   "Projection",    projmenu );
     glutAddMenuEntry( "Reset",         RESET );
     glutAddMenuEntry( "Quit",          QUIT );
@@ -1125,6 +1577,11 @@ Keyboard( unsigned char c, int x, int y )
             autoRotate = true;
             break;
 
+        case 's':
+        case 'S':
+            ShadowsOn = ! ShadowsOn;
+            break;
+
         case 'q':
         case 'Q':
         case ESCAPE:
@@ -1221,7 +1678,8 @@ Reset( )
     DepthFightingOn = 0;
     DepthCueOn = 0;
     Scale  = 1.0;
-    ShadowsOn = 0;
+    ShadowsOn = 1;
+    NumCascades = CanDoCascades ? DEFAULT_CASCADES : 1;
     NowColor = YELLOW;
     NowProjection = PERSP;
     Xrot = Yrot = 0.;
@@ -0,0 +1,47 @@
+#version 330 core
+
+// Built once for each combination of features a draw uses (see GLSLPermutations), each one
+// defined to 1 or 0 -- so no fragment tests a flag, and a variant that doesn't use the virtual
+// texture doesn't pay for its lookup:
+//   TEXTURE          color from texture1
+//   VIRTUAL_TEXTURE  color from the virtual texture (see virtualtexture.h) instead
+// and objectColor when neither.
+
+in vec2 TexCoord;
+out vec4 FragColor;
+
+uniform vec3 objectColor;        // Color for solid objects
+uniform sampler2D texture1;      // Texture for textured objects
+uniform float brightness;        // Lighting brightness
+
+#if VIRTUAL_TEXTURE
+uniform sampler2D vtAtlas;
+uniform usampler2D vtIndirection;
+uniform vec2 vtSize;
+uniform float vtTileSize, vtBorder, vtAtlasSize, vtMaxLevel;
+
+// The indirection texel for this texel's tile at the level it wants says which atlas page
+// to sample, and the level that page holds -- its own, or a coarser stand-in:
+vec3 virtualColor(vec2 uv) {
+    vec2 texel = clamp(uv, 0., 1.) * vtSize;
+    vec2 dx = dFdx(texel), dy = dFdy(texel);
+    float lod = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy)))), 0., vtMaxLevel);
+    uvec4 page = texelFetch(vtIndirection, ivec2(min(texel, vtSize - 1.) / (vtTileSize * exp2(lod))), int(lod));
+    vec2 inPage = mod(texel / exp2(float(page.b)), vtTileSize);
+    vec2 atlas = vec2(page.rg) * (vtTileSize + 2. * vtBorder) + vtBorder + inPage;
+    return texture(vtAtlas, atlas / vtAtlasSize).rgb;
+}
+#endif
+
+void main() {
+#if VIRTUAL_TEXTURE
+    vec3 color = virtualColor(TexCoord);
+#elif TEXTURE
+    vec3 color = texture(texture1, TexCoord).rgb; // Use texture color
+#else
+    vec3 color = objectColor; // Use solid color
+#endif
+
+    vec3 finalColor = color * brightness; // Apply lighting
+    FragColor = vec4(finalColor, 1.0);
+}
@@ -0,0 +1,374 @@
+#include "shading.h"
+
+#include <math.h>
+
+
+// below this many panels, waking threads costs more than it saves:
+
+const int PANELS_PER_THREAD = 64;
+
+// the most sample points per panel (samplesPerSide^2):
+
+const int MAX_SAMPLES_PER_SIDE = 16;
+const int MAX_SAMPLES = MAX_SAMPLES_PER_SIDE * MAX_SAMPLES_PER_SIDE;
+
+// ray offset off the surface, so a panel doesn't block itself:
+
+const float SURFACE_EPS = 1.e-4f;
+
+
+ShadingEngine::ShadingEngine( )
+{
+	samplesPerSide = 4;
+	numThreads = 0;
+	maxTop = 0.f;
+	cellSize = 1.f;
+	gridX0 = gridZ0 = 0.f;
+	gridNX = gridNZ = 0;
+	poolGeneration = 0;
+	poolActive = poolBusy = 0;
+	poolQuit = false;
+	jobPanels = jobChunk = 0;
+	jobShaded = NULL;
+}
+
+
+ShadingEngine::~ShadingEngine( )
+{
+	{
+		std::lock_guard<std::mutex> guard( poolLock );
+		poolQuit = true;
+	}
+	poolWake.notify_all( );
+	for( int t = 0; t < (int)pool.size( ); t++ )
+		pool[t].join( );
+}
+
+
+int
+ShadingEngine::GetNumThreads( )
+{
+	return numThreads;
+}
+
+
+int
+ShadingEngine::GetSamplesPerSide( )
+{
+	return samplesPerSide;
+}
+
+
+// 0 means use all the hardware threads:
+
+void
+ShadingEngine::SetNumThreads( int n )
+{
+	numThreads = n < 0 ? 0 : n;
+}
+
+
+void
+ShadingEngine::SetSamplesPerSide( int n )
+{
+	if( n < 1 )			n = 1;
+	if( n > MAX_SAMPLES_PER_SIDE )	n = MAX_SAMPLES_PER_SIDE;
+	samplesPerSide = n;
+}
+
+
+// turn the panel pivots + tilt angles into quads and bin them into the x-z grid:
+
+void
+ShadingEngine::BuildGrid( const glm::vec3 *pivots, const float *anglesDeg, int numPanels )
+{
+	ox.resize( numPanels );		oy.resize( numPanels );		oz.resize( numPanels );
+	ux.resize( numPanels );		uy.resize( numPanels );
+	nx.resize( numPanels );		ny.resize( numPanels );
+
+	float xmin =  1.e+37f, xmax = -1.e+37f;
+	float zmin =  1.e+37f, zmax = -1.e+37f;
+	maxTop = -1.e+37f;
+	for( int i = 0; i < numPanels; i++ )
+	{
+		float a = glm::radians( anglesDeg[i] );
+		float c = cosf( a );
+		float s = sinf( a );
+		ox[i] = pivots[i].x;	oy[i] = pivots[i].y;	oz[i] = pivots[i].z;
+		ux[i] = c;		uy[i] = s;
+		nx[i] = -s;		ny[i] = c;
+
+		float hx = PANEL_HALF_WIDTH * fabsf( c );
+		float hy = PANEL_HALF_WIDTH * fabsf( s );
+		if( ox[i] - hx < xmin )		xmin = ox[i] - hx;
+		if( ox[i] + hx > xmax )		xmax = ox[i] + hx;
+		if( oz[i] < zmin )		zmin = oz[i];
+		if( oz[i] + PANEL_LENGTH > zmax )	zmax = oz[i] + PANEL_LENGTH;
+		if( oy[i] + hy > maxTop )	maxTop = oy[i] + hy;
+	}
+
+	// cells at least as big as a panel, so one ring of neighbors covers a panel's footprint:
+
+	cellSize = 2.f * PANEL_HALF_WIDTH > PANEL_LENGTH ? 2.f * PANEL_HALF_WIDTH : PANEL_LENGTH;
+	gridX0 = xmin;
+	gridZ0 = zmin;
+	gridNX = 1 + (int)( ( xmax - xmin ) / cellSize );
+	gridNZ = 1 + (int)( ( zmax - zmin ) / cellSize );
+
+	// count, prefix-sum, fill:
+
+	int numCells = gridNX * gridNZ;
+	cellStart.assign( numCells + 1, 0 );
+	for( int pass = 0; pass < 2; pass++ )
+	{
+		std::vector<int> fill;
+		if( pass == 1 )
+		{
+			for( int c = 0; c < numCells; c++ )
+				cellStart[c+1] += cellStart[c];
+			cellItems.resize( cellStart[numCells] );
+			fill.assign( cellStart.begin( ), cellStart.end( ) - 1 );
+		}
+
+		for( int i = 0; i < numPanels; i++ )
+		{
+			float hx = PANEL_HALF_WIDTH * fabsf( ux[i] );
+			int i0 = (int)( ( ox[i] - hx - gridX0 ) / cellSize );
+			int i1 = (int)( ( ox[i] + hx - gridX0 ) / cellSize );
+			int k0 = (int)( ( oz[i] - gridZ0 ) / cellSize );
+			int k1 = (int)( ( oz[i] + PANEL_LENGTH - gridZ0 ) / cellSize );
+			if( i1 >= gridNX )	i1 = gridNX - 1;
+			if( k1 >= gridNZ )	k1 = gridNZ - 1;
+			for( int k = k0; k <= k1; k++ )
+			{
+				for( int j = i0; j <= i1; j++ )
+				{
+					int cell = k*gridNX + j;
+					if( pass == 0 )
+						cellStart[cell+1]++;
+					else
+						cellItems[ fill[cell]++ ] = i;
+				}
+			}
+		}
+	}
+}
+
+
+// shade panels [first,last):
+
+void
+ShadingEngine::ShadePanels( int first, int last, glm::vec3 d, float *shaded )
+{
+	int numPanels = (int)ox.size( );
+	int n = samplesPerSide;
+	int numSamples = n * n;
+
+	// sample points and their "blocked" flags, structure-of-arrays so the
+	// per-blocker loop below vectorizes:
+
+	float px[MAX_SAMPLES], py[MAX_SAMPLES], pz[MAX_SAMPLES];
+	float blocked[MAX_SAMPLES];
+
+	// candidate list, de-duplicated with a per-panel stamp:
+
+	std::vector<int> stamp( numPanels, -1 );
+	std::vector<int> candidates;
+
+	float dxz = sqrtf( d.x*d.x + d.z*d.z );
+
+	for( int i = first; i < last; i++ )
+	{
+		// the sun is down -- nothing is lit:
+
+		if( d.y <= 0.f )
+		{
+			shaded[i] = 1.f;
+			continue;
+		}
+
+		// sample points at the centers of an n x n subdivision of the quad,
+		// nudged off the surface towards the sun:
+
+		float side = ( nx[i]*d.x + ny[i]*d.y ) >= 0.f ? SURFACE_EPS : -SURFACE_EPS;
+		float lowest = oy[i];
+		for( int a = 0; a < n; a++ )
+		{
+			float t = PANEL_LENGTH * ( (float)a + 0.5f ) / (float)n;
+			for( int b = 0; b < n; b++ )
+			{
+				float s = 2.f * PANEL_HALF_WIDTH * ( ( (float)b + 0.5f ) / (float)n - 0.5f );
+				int k = a*n + b;
+				px[k] = ox[i] + s*ux[i] + side*nx[i];
+				py[k] = oy[i] + s*uy[i] + side*ny[i];
+				pz[k] = oz[i] + t;
+				blocked[k] = 0.f;
+				if( py[k] < lowest )
+					lowest = py[k];
+			}
+		}
+
+		// walk the grid along the sun ray from the panel center until the ray from its lowest
+		// sample point is higher than anything in the field -- with a low sun, the lower half
+		// of a tilted panel sees blockers much further off than its pivot does. the 3x3
+		// neighborhood of each cell is gathered:
+
+		candidates.clear( );
+		float cx = ox[i];
+		float cz = oz[i] + 0.5f * PANEL_LENGTH;
+		float reach = ( maxTop - lowest ) / d.y * dxz + cellSize;
+		if( reach < cellSize )
+			reach = cellSize;
+		float step = 0.5f * cellSize;
+		int lastCell = -1;
+		for( float travel = 0.f; travel <= reach; travel += step )
+		{
+			float wx = cx, wz = cz;
+			if( dxz > 0.f )
+			{
+				wx += travel * d.x / dxz;
+				wz += travel * d.z / dxz;
+			}
+			int ci = (int)floorf( ( wx - gridX0 ) / cellSize );
+			int ck = (int)floorf( ( wz - gridZ0 ) / cellSize );
+			int cell = ck*gridNX + ci;
+			if( cell == lastCell )
+				continue;
+			lastCell = cell;
+
+			for( int k = ck-1; k <= ck+1; k++ )
+			{
+				if( k < 0  ||  k >= gridNZ )
+					continue;
+				for( int j = ci-1; j <= ci+1; j++ )
+				{
+					if( j < 0  ||  j >= gridNX )
+						continue;
+					int c = k*gridNX + j;
+					for( int e = cellStart[c]; e < cellStart[c+1]; e++ )
+					{
+						int p = cellItems[e];
+						if( p != i  &&  stamp[p] != i )
+						{
+							stamp[p] = i;
+							candidates.push_back( p );
+						}
+					}
+				}
+			}
+			if( dxz <= 0.f )
+				break;		// sun straight overhead: only the panel's own neighborhood matters
+		}
+
+		// intersect all the sample rays with each candidate quad:
+
+		for( int c = 0; c < (int)candidates.size( ); c++ )
+		{
+			int p = candidates[c];
+			float denom = nx[p]*d.x + ny[p]*d.y;		// candidate normal has no z
+			if( fabsf( denom ) < 1.e-6f )
+				continue;
+			float invDenom = 1.f / denom;
+			float qx = ox[p], qy = oy[p], qz = oz[p];
+			float qnx = nx[p], qny = ny[p];
+			float qux = ux[p], quy = uy[p];
+
+			for( int k = 0; k < numSamples; k++ )
+			{
+				float t  = ( qnx*( qx - px[k] ) + qny*( qy - py[k] ) ) * invDenom;
+				float rx = px[k] + t*d.x - qx;
+				float ry = py[k] + t*d.y - qy;
+				float rz = pz[k] + t*d.z - qz;
+				float s  = rx*qux + ry*quy;
+				float hit = ( t > 0.f  &&  fabsf( s ) <= PANEL_HALF_WIDTH  &&  rz >= 0.f  &&  rz <= PANEL_LENGTH ) ? 1.f : 0.f;
+				blocked[k] = blocked[k] > hit ? blocked[k] : hit;
+			}
+		}
+
+		float sum = 0.f;
+		for( int k = 0; k < numSamples; k++ )
+			sum += blocked[k];
+		shaded[i] = sum / (float)numSamples;
+	}
+}
+
+
+// pivots:     where each panel's rotation axis starts (world coordinates)
+// anglesDeg:  each panel's tilt about +z, as returned by ComputePanelRotations( )
+// sunDir:     unit vector towards the sun
+// shaded:     filled with each panel's shaded fraction, 0. (fully lit) to 1. (fully shaded)
+
+void
+ShadingEngine::Compute( const glm::vec3 *pivots, const float *anglesDeg, int numPanels, glm::vec3 sunDir, float *shaded )
+{
+	if( numPanels <= 0 )
+		return;
+
+	BuildGrid( pivots, anglesDeg, numPanels );
+	glm::vec3 d = glm::normalize( sunDir );
+
+	int nthreads = numThreads > 0 ? numThreads : (int)std::thread::hardware_concurrency( );
+	int maxUseful = ( numPanels + PANELS_PER_THREAD - 1 ) / PANELS_PER_THREAD;
+	if( nthreads > maxUseful )	nthreads = maxUseful;
+	if( nthreads < 1 )		nthreads = 1;
+
+	if( nthreads == 1 )
+	{
+		ShadePanels( 0, numPanels, d, shaded );
+		return;
+	}
+
+	int chunk = ( numPanels + nthreads - 1 ) / nthreads;
+	int numChunks = ( numPanels + chunk - 1 ) / chunk;
+	{
+		std::lock_guard<std::mutex> guard( poolLock );
+		while( (int)pool.size( ) < numChunks - 1 )
+			pool.push_back( std::thread( &ShadingEngine::Worker, this, (int)pool.size( ) ) );
+		jobPanels = numPanels;
+		jobChunk = chunk;
+		jobSun = d;
+		jobShaded = shaded;
+		poolActive = poolBusy = numChunks - 1;
+		poolGeneration++;
+	}
+	poolWake.notify_all( );
+
+	ShadePanels( 0, chunk, d, shaded );
+
+	std::unique_lock<std::mutex> guard( poolLock );
+	poolDone.wait( guard, [this] { return poolBusy == 0; } );
+}
+
+
+// pool thread i: once for each Compute( ), the chunk after the i-th, if there is one:
+
+void
+ShadingEngine::Worker( int i )
+{
+	long seen = 0;
+	for( ; ; )
+	{
+		int first, last;
+		glm::vec3 d;
+		float *shaded;
+		{
+			std::unique_lock<std::mutex> guard( poolLock );
+			poolWake.wait( guard, [this, seen] { return poolQuit  ||  poolGeneration != seen; } );
+			if( poolQuit )
+				return;
+			seen = poolGeneration;
+			if( i >= poolActive )
+				continue;
+			first = ( i + 1 ) * jobChunk;
+			last = first + jobChunk < jobPanels ? first + jobChunk : jobPanels;
+			d = jobSun;
+			shaded = jobShaded;
+		}
+
+		ShadePanels( first, last, d, shaded );
+
+		std::lock_guard<std::mutex> guard( poolLock );
+		if( --poolBusy == 0 )
+			poolDone.notify_one( );
+	}
+}
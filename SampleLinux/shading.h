@@ -0,0 +1,76 @@
+#ifndef SHADING_H
+#define SHADING_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+
+// panel geometry, as drawn in main.cpp:
+// a quad in the pivot's local x-z plane, x from -PANEL_HALF_WIDTH to +PANEL_HALF_WIDTH
+// and z from 0. to PANEL_LENGTH, tilted about the local z axis by the panel's rotation angle
+
+const float PANEL_HALF_WIDTH = 0.5f;
+const float PANEL_LENGTH     = 1.0f;
+
+
+// ray-cast inter-row shading:
+// for each panel, an NxN set of points on its surface shoots a ray towards the sun,
+// and the fraction of those rays blocked by other panels is the panel's shaded fraction.
+// candidate blockers come from a uniform grid over the field's x-z footprint, walked
+// along the sun direction, so the cost per panel only depends on its neighborhood.
+// the threads are started the first time a Compute( ) wants them and sleep between calls,
+// so a simulation step doesn't pay for creating them.
+
+class ShadingEngine
+{
+private:
+	int			samplesPerSide;
+	int			numThreads;
+
+	// the current panel quads, structure-of-arrays:
+	std::vector<float>	ox, oy, oz;		// pivot
+	std::vector<float>	ux, uy;			// tilted local x axis (local z axis is always world +z)
+	std::vector<float>	nx, ny;			// surface normal
+	float			maxTop;			// highest point of any panel
+
+	// the x-z grid, compressed-row: the panels in cell c are cellItems[ cellStart[c] .. cellStart[c+1]-1 ]
+	float			gridX0, gridZ0;
+	float			cellSize;
+	int			gridNX, gridNZ;
+	std::vector<int>	cellStart;
+	std::vector<int>	cellItems;
+
+	// the worker pool: Compute( ) shades the first chunk itself, and worker i the chunk after i's:
+	std::vector<std::thread>	pool;
+	std::mutex			poolLock;		// guards the rest of these
+	std::condition_variable		poolWake;		// a new Compute( ), or quit
+	std::condition_variable		poolDone;		// the last busy worker finished
+	long				poolGeneration;		// counts the Compute( )s handed to the pool
+	int				poolActive;		// workers with a chunk this time
+	int				poolBusy;		// of those, still shading
+	bool				poolQuit;
+	int				jobPanels, jobChunk;
+	glm::vec3			jobSun;
+	float *				jobShaded;
+
+	void	BuildGrid( const glm::vec3 *, const float *, int );
+	void	ShadePanels( int, int, glm::vec3, float * );
+	void	Worker( int );
+
+public:
+		ShadingEngine( );
+		~ShadingEngine( );
+
+	void	Compute( const glm::vec3 *, const float *, int, glm::vec3, float * );
+	int	GetNumThreads( );
+	int	GetSamplesPerSide( );
+	void	SetNumThreads( int );
+	void	SetSamplesPerSide( int );
+};
+
+#endif	// SHADING_H
@@ -0,0 +1,487 @@
+#include "simulation.h"
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <string.h>
+
+
+// the defaults are the field main.cpp has always shown: 3 rows of 3, 2 units apart:
+
+SimConfig::SimConfig( )
+{
+	numRows = 3;
+	panelsPerRow = 3;
+	rowPitch = 2.f;
+	panelSpacing = 2.f;
+	baseHeight = 0.5f;
+	pivotHeight = 0.6f;
+	trackingMode = TRUE_TRACKING;
+	maxTilt = DEFAULT_MAX_TILT;
+	maxRate = DEFAULT_MAX_RATE;
+	deadband = DEFAULT_DEADBAND;
+	skyModel = PEREZ;
+	albedo = DEFAULT_ALBEDO;
+	sunRadius = 15.f;
+	weatherPath = NULL;
+	heightmapPath = NULL;
+	terrainSize = 10.f;
+	terrainHeight = 1.f;
+	shadingThreads = 0;
+}
+
+
+Simulation::Simulation( )
+{
+	clock = 0.;
+	dayFraction = 0.f;
+	logCursor = 0;
+	currentWeather.time = 0.;
+	currentWeather.ghi = currentWeather.dni = currentWeather.dhi = 0.f;
+	currentWeather.cloud = 0.f;
+}
+
+
+// lay out the panels, row-major along z so panel IDs go across the rows:
+
+void
+Simulation::BuildField( )
+{
+	int n = config.numRows * config.panelsPerRow;
+	positions.resize( n );
+	pivots.resize( n );
+	float x0 = -0.5f * config.rowPitch * (float)( config.numRows - 1 );
+	float z0 = -0.5f * config.panelSpacing * (float)( config.panelsPerRow - 1 );
+	for( int p = 0; p < config.panelsPerRow; p++ )
+	{
+		for( int r = 0; r < config.numRows; r++ )
+		{
+			int i = p*config.numRows + r;
+			float x = x0 + (float)r * config.rowPitch, z = z0 + (float)p * config.panelSpacing;
+			positions[i] = glm::vec3( x, terrain.HeightAt( x, z ) + config.baseHeight, z );
+			pivots[i] = positions[i] + glm::vec3( 0.f, config.pivotHeight, 0.f );
+		}
+	}
+
+	groundNormals.clear( );
+	if( terrain.IsLoaded( ) )
+	{
+		groundNormals.resize( n );
+		for( int i = 0; i < n; i++ )
+			groundNormals[i] = terrain.NormalAt( positions[i].x, positions[i].z );
+	}
+
+	rowCoverage.resize( n );
+	ComputeRowCoverage( positions.data( ), n, 2.f * PANEL_HALF_WIDTH, rowCoverage.data( ) );
+
+	targets.assign( n, 0.f );
+	shaded.assign( n, 0.f );
+	strength.assign( n, 0.f );
+	beam.assign( n, 0.f );
+	sky.assign( n, 0.f );
+	ground.assign( n, 0.f );
+	energy.assign( n, 0. );
+}
+
+
+bool
+Simulation::Init( const SimConfig &c )
+{
+	// the heightmap can be big, so it's only loaded again if it or its placement changed:
+
+	std::string newHeightmap = c.heightmapPath != NULL ? c.heightmapPath : "";
+	bool reloadTerrain = newHeightmap != heightmapPath  ||  c.terrainSize != config.terrainSize  ||  c.terrainHeight != config.terrainHeight
+				||  ( ! newHeightmap.empty( )  &&  ! terrain.IsLoaded( ) );
+
+	config = c;
+	weatherPath = c.weatherPath != NULL ? c.weatherPath : "";
+	config.weatherPath = c.weatherPath != NULL ? weatherPath.c_str( ) : NULL;
+	clock = 0.;
+	dayFraction = 0.f;
+	logs.clear( );
+	logCursor = 0;
+
+	weather.Close( );
+	if( config.weatherPath != NULL  &&  ! weather.Open( config.weatherPath ) )
+		return false;
+
+	if( reloadTerrain )
+	{
+		terrain.Close( );
+		heightmapPath = newHeightmap;
+		if( ! heightmapPath.empty( )  &&  ! terrain.Load( heightmapPath.c_str( ), config.terrainSize, config.terrainHeight ) )
+		{
+			heightmapPath.clear( );
+			return false;
+		}
+	}
+	config.heightmapPath = heightmapPath.empty( ) ? NULL : heightmapPath.c_str( );
+
+	shading.SetNumThreads( config.shadingThreads );
+	BuildField( );
+	SampleWeather( );
+
+	// start the panels where they should be, at rest:
+
+	int n = GetNumPanels( );
+	ComputePanelRotations( positions.data( ), n, GetSunPosition( ), config.trackingMode, config.maxTilt,
+				rowCoverage.data( ), targets.data( ) );
+	actuators.Init( n, targets.data( ), config.maxRate, config.deadband );
+	UpdateSunlight( );
+	return true;
+}
+
+
+void
+Simulation::SampleWeather( )
+{
+	glm::vec3 sunDir = glm::normalize( GetSunPosition( ) );
+	weather.Sample( clock + SUNRISE_SECONDS, sunDir.y, &currentWeather );
+}
+
+
+// one tick of dt simulated seconds: move the sun (unless the clock is held), retarget the
+// trackers, slew them, and bank the energy collected over the tick:
+
+void
+Simulation::Step( float dt, bool advanceClock )
+{
+	if( advanceClock )
+	{
+		clock += dt;
+		dayFraction = (float)fmod( clock / SECONDS_PER_DAY, 1. );
+	}
+	SampleWeather( );
+
+	int n = GetNumPanels( );
+	ComputePanelRotations( positions.data( ), n, GetSunPosition( ), config.trackingMode, config.maxTilt,
+				rowCoverage.data( ), targets.data( ) );
+	actuators.SetTargets( targets.data( ) );
+	actuators.Step( dt );
+
+	UpdateSunlight( );
+	if( advanceClock )
+	{
+		double kwh = ( REFERENCE_IRRADIANCE / 1000. ) * ( dt / 3600. );
+		for( int i = 0; i < n; i++ )
+			energy[i] += strength[i] * kwh;
+	}
+}
+
+
+// plane-of-array irradiance on every panel at its actual tilt, relative to REFERENCE_IRRADIANCE.
+// inter-row shading only blocks the beam: the panel still sees the sky and the ground.
+
+void
+Simulation::UpdateSunlight( )
+{
+	int n = GetNumPanels( );
+	const float *angles = actuators.GetAngles( );
+	glm::vec3 sunDir = glm::normalize( GetSunPosition( ) );
+
+	// the sun is far enough away to treat as directional from the field center:
+
+	shading.Compute( pivots.data( ), angles, n, sunDir, shaded.data( ) );
+
+	// a hill between a panel and the sun shades all of it:
+
+	if( terrain.IsLoaded( ) )
+		for( int i = 0; i < n; i++ )
+			if( shaded[i] < 1.f  &&  terrain.Occludes( pivots[i], sunDir ) )
+				shaded[i] = 1.f;
+
+	PlaneOfArray poa = { beam.data( ), sky.data( ), ground.data( ) };
+	ComputePlaneOfArray( angles, n, sunDir, currentWeather, config.skyModel, config.albedo, &poa,
+				groundNormals.empty( ) ? NULL : groundNormals.data( ) );
+	for( int i = 0; i < n; i++ )
+		strength[i] = ( beam[i] * ( 1.f - shaded[i] ) + sky[i] + ground[i] ) / REFERENCE_IRRADIANCE;
+}
+
+
+// append a log record for every panel, stamped with timeStamp:
+
+void
+Simulation::RecordLog( float timeStamp )
+{
+	int n = GetNumPanels( );
+	std::vector<float> errors( n );
+	actuators.GetTrackingErrors( errors.data( ) );
+	for( int i = 0; i < n; i++ )
+		logs.push_back( PanelLog( i+1, positions[i], timeStamp, strength[i], shaded[i], errors[i] ) );
+}
+
+
+void
+WritePanelLogs( std::ostream &out, const PanelLog *logs, int numLogs )
+{
+	for( int i = 0; i < numLogs; i++ )
+	{
+		const PanelLog &log = logs[i];
+		out << "Panel ID: " << log.panelID << ", Time: " << log.timeStamp << "s, Position: ("
+			<< log.position.x << ", " << log.position.y << ", "
+			<< log.position.z << "), Sunlight Strength: " << log.sunlightStrength
+			<< ", Shaded Fraction: " << log.shadedFraction
+			<< ", Tracking Error: " << log.trackingError << "\n";
+	}
+}
+
+
+// snapshots:
+// the config is enough to rebuild the field, the weather stream re-finds its place from the clock,
+// and the rest is the state that evolves: the clock, the actuators, the energy and the log cursor.
+// the log records themselves are already in the owner's log file.
+
+const char		SNAPSHOT_MAGIC[4] = { 'S', 'N', 'A', 'P' };
+const unsigned int	SNAPSHOT_VERSION = 2;
+
+
+void
+Simulation::Save( SnapshotOut &out )
+{
+	out.Put( SNAPSHOT_MAGIC, 4 );
+	out.Put( SNAPSHOT_VERSION );
+
+	out.Put( config.numRows );
+	out.Put( config.panelsPerRow );
+	out.Put( config.rowPitch );
+	out.Put( config.panelSpacing );
+	out.Put( config.baseHeight );
+	out.Put( config.pivotHeight );
+	out.Put( config.trackingMode );
+	out.Put( config.maxTilt );
+	out.Put( config.maxRate );
+	out.Put( config.deadband );
+	out.Put( config.skyModel );
+	out.Put( config.albedo );
+	out.Put( config.sunRadius );
+	out.PutString( weatherPath );
+	out.PutString( heightmapPath );
+	out.Put( config.terrainSize );
+	out.Put( config.terrainHeight );
+
+	out.Put( clock );
+	out.Put( dayFraction );
+	actuators.Save( out );
+	out.PutDoubles( energy );
+	out.Put( logCursor );
+}
+
+
+// false if the snapshot is damaged or from another version -- the simulation is then unchanged.
+// also false if the weather or heightmap file it names can't be loaded any more, but by then
+// Init( ) has replaced the field, so the caller has to Init( ) it again:
+
+bool
+Simulation::Restore( SnapshotIn &in )
+{
+	char magic[4];
+	unsigned int version = 0;
+	if( ! in.Get( magic, 4 )  ||  memcmp( magic, SNAPSHOT_MAGIC, 4 ) != 0  ||  ! in.Get( version )  ||  version != SNAPSHOT_VERSION )
+		return false;
+
+	SimConfig c;
+	std::string path, heightmap;
+	in.Get( c.numRows );
+	in.Get( c.panelsPerRow );
+	in.Get( c.rowPitch );
+	in.Get( c.panelSpacing );
+	in.Get( c.baseHeight );
+	in.Get( c.pivotHeight );
+	in.Get( c.trackingMode );
+	in.Get( c.maxTilt );
+	in.Get( c.maxRate );
+	in.Get( c.deadband );
+	in.Get( c.skyModel );
+	in.Get( c.albedo );
+	in.Get( c.sunRadius );
+	in.GetString( path );
+	in.GetString( heightmap );
+	in.Get( c.terrainSize );
+	in.Get( c.terrainHeight );
+	c.shadingThreads = config.shadingThreads;		// this process's choice, not the field's
+
+	double savedClock = 0.;
+	float savedDayFraction = 0.f;
+	TrackerActuators savedActuators;
+	std::vector<double> savedEnergy;
+	unsigned long long savedCursor = 0;
+	in.Get( savedClock );
+	in.Get( savedDayFraction );
+	bool actuatorsOk = savedActuators.Restore( in );
+	in.GetDoubles( savedEnergy );
+	in.Get( savedCursor );
+
+	int n = c.numRows * c.panelsPerRow;
+	if( ! in.IsOk( )  ||  ! actuatorsOk  ||  savedActuators.GetNumPanels( ) != n  ||  (int)savedEnergy.size( ) != n )
+		return false;
+
+	c.weatherPath = path.empty( ) ? NULL : path.c_str( );
+	c.heightmapPath = heightmap.empty( ) ? NULL : heightmap.c_str( );
+	if( ! Init( c ) )
+		return false;
+	clock = savedClock;
+	dayFraction = savedDayFraction;
+	actuators = savedActuators;
+	energy = savedEnergy;
+	logCursor = savedCursor;
+	SampleWeather( );
+	UpdateSunlight( );
+	return true;
+}
+
+
+const float *
+Simulation::GetAngles( )
+{
+	return actuators.GetAngles( );
+}
+
+
+double
+Simulation::GetClock( )
+{
+	return clock;
+}
+
+
+const SimConfig &
+Simulation::GetConfig( )
+{
+	return config;
+}
+
+
+float
+Simulation::GetDayFraction( )
+{
+	return dayFraction;
+}
+
+
+const double *
+Simulation::GetEnergy( )
+{
+	return energy.data( );
+}
+
+
+unsigned long long
+Simulation::GetLogCursor( )
+{
+	return logCursor;
+}
+
+
+const std::vector<PanelLog> &
+Simulation::GetLogs( )
+{
+	return logs;
+}
+
+
+float
+Simulation::GetMeanGroundCoverage( )
+{
+	int n = GetNumPanels( );
+	if( n == 0 )
+		return 0.f;
+	float sum = 0.f;
+	for( int i = 0; i < n; i++ )
+		sum += rowCoverage[i];
+	return sum / (float)n;
+}
+
+
+int
+Simulation::GetNumPanels( )
+{
+	return (int)positions.size( );
+}
+
+
+const glm::vec3 *
+Simulation::GetPivots( )
+{
+	return pivots.data( );
+}
+
+
+const glm::vec3 *
+Simulation::GetPositions( )
+{
+	return positions.data( );
+}
+
+
+const float *
+Simulation::GetShaded( )
+{
+	return shaded.data( );
+}
+
+
+const float *
+Simulation::GetStrength( )
+{
+	return strength.data( );
+}
+
+
+// the sun circles in the x-y plane, rising at +x:
+
+glm::vec3
+Simulation::GetSunPosition( )
+{
+	float angleRad = dayFraction * 2.f * (float)M_PI;
+	return glm::vec3( cosf( angleRad ) * config.sunRadius, sinf( angleRad ) * config.sunRadius, 0.f );
+}
+
+
+const Heightfield &
+Simulation::GetTerrain( )
+{
+	return terrain;
+}
+
+
+// kWh per m^2 of panel, summed over the field:
+
+double
+Simulation::GetTotalEnergy( )
+{
+	double sum = 0.;
+	for( int i = 0; i < (int)energy.size( ); i++ )
+		sum += energy[i];
+	return sum;
+}
+
+
+// jump to a time of day, keeping the day number:
+
+void
+Simulation::SetDayFraction( float f )
+{
+	f = f - floorf( f );
+	clock = floor( clock / SECONDS_PER_DAY ) * SECONDS_PER_DAY + f * SECONDS_PER_DAY;
+	dayFraction = f;
+}
+
+
+void
+Simulation::SetLogCursor( unsigned long long cursor )
+{
+	logCursor = cursor;
+}
+
+
+void
+Simulation::SetSkyModel( int model )
+{
+	config.skyModel = model;
+}
+
+
+void
+Simulation::SetTrackingMode( int mode )
+{
+	config.trackingMode = mode;
+}
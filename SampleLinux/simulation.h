@@ -0,0 +1,148 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <stdio.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "heightfield.h"
+#include "shading.h"
+#include "tracker.h"
+#include "weather.h"
+#include "irradiance.h"
+#include "snapshot.h"
+
+
+// one simulation of a tracker field: the panel layout, the sun, the weather, the actuators
+// and the energy the panels have collected.
+// everything lives in the Simulation object, so any number of them can run side by side
+// (one per thread in the batch runner, one for the interactive window in main.cpp).
+
+const float SECONDS_PER_DAY = 86400.f;
+const float SUNRISE_SECONDS = 6.f * 3600.f;	// day fraction 0. is sunrise, 6:00 into the weather series' day
+const float REFERENCE_IRRADIANCE = 1000.f;	// W/m^2 that counts as sunlight strength 1
+
+
+// the parameters of one simulation.
+// the field is numRows rows along x (each row shares a tracker axis parallel to z),
+// panelsPerRow panels along z, centered on the origin.
+// on a heightmap the panels stand baseHeight above the ground under them, and the
+// terrain can hide the sun from them:
+
+struct SimConfig
+{
+	int		numRows;
+	int		panelsPerRow;
+	float		rowPitch;		// x distance between rows
+	float		panelSpacing;		// z distance between panels in a row
+	float		baseHeight;		// y of each panel's base position
+	float		pivotHeight;		// the rotation axis, above the base position
+	int		trackingMode;		// TRUE_TRACKING or BACKTRACKING
+	float		maxTilt;		// degrees
+	float		maxRate;		// degrees per simulated second
+	float		deadband;		// degrees
+	int		skyModel;		// ISOTROPIC or PEREZ
+	float		albedo;
+	float		sunRadius;		// how far away the sun is drawn
+	const char *	weatherPath;		// NULL for a clear sky
+	const char *	heightmapPath;		// NULL for flat ground at y = 0
+	float		terrainSize;		// x and z extent of the heightmap
+	float		terrainHeight;		// y of its highest possible sample
+	int		shadingThreads;		// for the shading rays, 0 for every hardware thread
+
+		SimConfig( );
+};
+
+
+// what the log records about a panel:
+
+struct PanelLog
+{
+	int		panelID;
+	glm::vec3	position;
+	float		timeStamp;
+	float		sunlightStrength;
+	float		shadedFraction;
+	float		trackingError;		// target - actual tilt, degrees
+
+	PanelLog( int id, glm::vec3 pos, float time, float strength, float shaded, float error )
+		: panelID(id), position(pos), timeStamp(time), sunlightStrength(strength), shadedFraction(shaded), trackingError(error) { }
+};
+
+// append log records to a log file, one line per record:
+
+void	WritePanelLogs( std::ostream &, const PanelLog *, int );
+
+
+class Simulation
+{
+private:
+	SimConfig		config;
+	std::string		weatherPath;		// config.weatherPath points here
+	std::string		heightmapPath;		// and config.heightmapPath here
+	Heightfield		terrain;
+
+	// the field:
+	std::vector<glm::vec3>	positions;
+	std::vector<glm::vec3>	pivots;
+	std::vector<float>	rowCoverage;		// ground coverage ratio of each panel's row
+	std::vector<glm::vec3>	groundNormals;		// under each panel, empty on flat ground
+	TrackerActuators	actuators;
+	ShadingEngine		shading;
+
+	// the clock and the sky:
+	double			clock;			// simulated seconds since the start
+	float			dayFraction;		// 0. = sunrise, .25 = noon, .5 = sunset
+	WeatherSeries		weather;
+	WeatherRecord		currentWeather;
+
+	// per-panel results of the last UpdateSunlight( ):
+	std::vector<float>	targets;
+	std::vector<float>	shaded;
+	std::vector<float>	strength;
+	std::vector<float>	beam, sky, ground;
+	std::vector<double>	energy;			// kWh per m^2 of panel since the start
+
+	std::vector<PanelLog>	logs;
+	unsigned long long	logCursor;		// how much of the log the owner has written out
+
+	void	BuildField( );
+	void	SampleWeather( );
+
+public:
+		Simulation( );
+
+	bool	Init( const SimConfig & );
+	void	Step( float, bool );
+	void	UpdateSunlight( );
+	void	RecordLog( float );
+	bool	Restore( SnapshotIn & );
+	void	Save( SnapshotOut & );
+
+	const float *			GetAngles( );
+	double				GetClock( );
+	const SimConfig &		GetConfig( );
+	float				GetDayFraction( );
+	const double *			GetEnergy( );
+	unsigned long long		GetLogCursor( );
+	const std::vector<PanelLog> &	GetLogs( );
+	int				GetNumPanels( );
+	const glm::vec3 *		GetPivots( );
+	const glm::vec3 *		GetPositions( );
+	const float *			GetShaded( );
+	const float *			GetStrength( );
+	glm::vec3			GetSunPosition( );
+	const Heightfield &		GetTerrain( );
+	double				GetTotalEnergy( );
+	float				GetMeanGroundCoverage( );
+
+	void	SetDayFraction( float );
+	void	SetLogCursor( unsigned long long );
+	void	SetSkyModel( int );
+	void	SetTrackingMode( int );
+};
+
+#endif	// SIMULATION_H
@@ -0,0 +1,228 @@
+#include "snapshot.h"
+
+#include <string.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+
+void
+SnapshotOut::Put( const void *data, size_t size )
+{
+	const unsigned char *p = (const unsigned char *)data;
+	bytes.insert( bytes.end( ), p, p + size );
+}
+
+
+void
+SnapshotOut::PutFloats( const std::vector<float> &v )
+{
+	unsigned int n = (unsigned int)v.size( );
+	Put( n );
+	Put( v.data( ), n * sizeof(float) );
+}
+
+
+void
+SnapshotOut::PutDoubles( const std::vector<double> &v )
+{
+	unsigned int n = (unsigned int)v.size( );
+	Put( n );
+	Put( v.data( ), n * sizeof(double) );
+}
+
+
+void
+SnapshotOut::PutString( const std::string &s )
+{
+	unsigned int n = (unsigned int)s.size( );
+	Put( n );
+	Put( s.data( ), n );
+}
+
+
+SnapshotIn::SnapshotIn( const unsigned char *data, size_t size )
+{
+	cp = data;
+	left = size;
+	ok = true;
+}
+
+
+// once a read runs off the end, every read after it fails too:
+
+bool
+SnapshotIn::Get( void *data, size_t size )
+{
+	if( ! ok  ||  size > left )
+	{
+		ok = false;
+		return false;
+	}
+	memcpy( data, cp, size );
+	cp += size;
+	left -= size;
+	return true;
+}
+
+
+bool
+SnapshotIn::GetFloats( std::vector<float> &v )
+{
+	unsigned int n;
+	if( ! Get( n )  ||  n * sizeof(float) > left )
+		return ok = false;
+	v.resize( n );
+	return Get( v.data( ), n * sizeof(float) );
+}
+
+
+bool
+SnapshotIn::GetDoubles( std::vector<double> &v )
+{
+	unsigned int n;
+	if( ! Get( n )  ||  n * sizeof(double) > left )
+		return ok = false;
+	v.resize( n );
+	return Get( v.data( ), n * sizeof(double) );
+}
+
+
+bool
+SnapshotIn::GetString( std::string &s )
+{
+	unsigned int n;
+	if( ! Get( n )  ||  n > left )
+		return ok = false;
+	s.assign( (const char *)cp, n );
+	cp += n;
+	left -= n;
+	return true;
+}
+
+
+bool
+SnapshotIn::IsOk( )
+{
+	return ok;
+}
+
+
+SnapshotWriter::SnapshotWriter( )
+{
+	hasPending = false;
+	quit = false;
+}
+
+
+SnapshotWriter::~SnapshotWriter( )
+{
+	Stop( );
+}
+
+
+void
+SnapshotWriter::Start( const char *snapshotPath )
+{
+	Stop( );
+	path = snapshotPath;
+	quit = false;
+	worker = std::thread( &SnapshotWriter::Run, this );
+}
+
+
+// write whatever is still pending, then let the thread finish:
+
+void
+SnapshotWriter::Stop( )
+{
+	if( ! worker.joinable( ) )
+		return;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_one( );
+	worker.join( );
+}
+
+
+// hand a snapshot to the writer. the bytes are swapped out of the caller's vector,
+// so the tick thread never copies or waits on the disk:
+
+void
+SnapshotWriter::Submit( std::vector<unsigned char> &bytes )
+{
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		pending.swap( bytes );
+		hasPending = true;
+	}
+	wake.notify_one( );
+	bytes.clear( );
+}
+
+
+void
+SnapshotWriter::Run( )
+{
+	std::vector<unsigned char> writing;
+	for( ; ; )
+	{
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [this]( ) { return hasPending || quit; } );
+			if( ! hasPending )
+				return;		// quitting with nothing left to write
+			writing.swap( pending );
+			hasPending = false;
+		}
+		WriteFile( writing );
+	}
+}
+
+
+bool
+SnapshotWriter::WriteFile( const std::vector<unsigned char> &bytes )
+{
+	std::string tmp = path + ".tmp";
+	FILE *fp = fopen( tmp.c_str( ), "wb" );
+	if( fp == NULL )
+	{
+		fprintf( stderr, "Cannot create snapshot file '%s'\n", tmp.c_str( ) );
+		return false;
+	}
+	bool ok = fwrite( bytes.data( ), 1, bytes.size( ), fp ) == bytes.size( );
+	ok = fflush( fp ) == 0  &&  ok;
+#ifndef WIN32
+	ok = fsync( fileno( fp ) ) == 0  &&  ok;
+#endif
+	fclose( fp );
+
+#ifdef WIN32
+	remove( path.c_str( ) );		// rename( ) won't replace an existing file on Windows
+#endif
+	if( ! ok  ||  rename( tmp.c_str( ), path.c_str( ) ) != 0 )
+	{
+		fprintf( stderr, "Cannot write snapshot file '%s'\n", path.c_str( ) );
+		return false;
+	}
+	return true;
+}
+
+
+bool
+ReadSnapshotFile( const char *path, std::vector<unsigned char> &bytes )
+{
+	FILE *fp = fopen( path, "rb" );
+	if( fp == NULL )
+		return false;
+	fseek( fp, 0, SEEK_END );
+	long size = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	bytes.resize( size > 0 ? size : 0 );
+	bool ok = size > 0  &&  fread( bytes.data( ), 1, size, fp ) == (size_t)size;
+	fclose( fp );
+	return ok;
+}
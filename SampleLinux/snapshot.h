@@ -0,0 +1,83 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// simulation snapshots:
+// the simulation serializes itself into a SnapshotOut in memory (cheap, on the tick thread),
+// and a SnapshotWriter puts those bytes on disk from its own thread, so a slow disk never
+// stalls the simulation. a SnapshotIn reads them back.
+// the bytes are raw native-endian values: a snapshot is for resuming on the same machine.
+
+class SnapshotOut
+{
+public:
+	std::vector<unsigned char>	bytes;
+
+	void	Put( const void *, size_t );
+	void	PutFloats( const std::vector<float> & );
+	void	PutDoubles( const std::vector<double> & );
+	void	PutString( const std::string & );
+
+	template <class T> void	Put( const T &v )	{ Put( &v, sizeof(T) ); }
+};
+
+
+class SnapshotIn
+{
+private:
+	const unsigned char *	cp;
+	size_t			left;
+	bool			ok;
+
+public:
+		SnapshotIn( const unsigned char *, size_t );
+
+	bool	Get( void *, size_t );
+	bool	GetFloats( std::vector<float> & );
+	bool	GetDoubles( std::vector<double> & );
+	bool	GetString( std::string & );
+	bool	IsOk( );
+
+	template <class T> bool	Get( T &v )		{ return Get( &v, sizeof(T) ); }
+};
+
+
+// writes the most recently submitted snapshot in the background.
+// if a new one arrives before the last was written, the older one is dropped.
+// the file is replaced atomically (write to path.tmp, then rename), so a crash while writing
+// leaves the previous snapshot intact.
+
+class SnapshotWriter
+{
+private:
+	std::string			path;
+	std::thread			worker;
+	std::mutex			lock;
+	std::condition_variable		wake;
+	std::vector<unsigned char>	pending;
+	bool				hasPending;
+	bool				quit;
+
+	void	Run( );
+	bool	WriteFile( const std::vector<unsigned char> & );
+
+public:
+		SnapshotWriter( );
+		~SnapshotWriter( );
+
+	void	Start( const char * );
+	void	Stop( );
+	void	Submit( std::vector<unsigned char> & );
+};
+
+
+bool	ReadSnapshotFile( const char *, std::vector<unsigned char> & );
+
+#endif	// SNAPSHOT_H
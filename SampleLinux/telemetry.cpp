@@ -0,0 +1,296 @@
+#include "telemetry.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+
+// how long the server thread sleeps when nothing is happening, milliseconds:
+
+const int POLL_TIMEOUT = 100;
+
+
+TelemetryServer::TelemetryServer( )
+{
+	listenFd = -1;
+	wakeFds[0] = wakeFds[1] = -1;
+	droppedFrames = 0;
+	quit = false;
+}
+
+
+TelemetryServer::~TelemetryServer( )
+{
+	Stop( );
+}
+
+
+#ifdef WIN32
+
+bool
+TelemetryServer::Start( const char *addr )
+{
+	fprintf( stderr, "Telemetry isn't available on this platform\n" );
+	return false;
+}
+
+void	TelemetryServer::Stop( )				{ }
+void	TelemetryServer::Publish( TelemetryFrame & )		{ }
+bool	TelemetryServer::Listen( )				{ return false; }
+void	TelemetryServer::Run( )					{ }
+void	TelemetryServer::Format( const TelemetryFrame &, std::string & )	{ }
+
+#else
+
+static void
+SetNonBlocking( int fd )
+{
+	fcntl( fd, F_SETFL, fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+}
+
+
+// one byte down the self-pipe. a full pipe (EAGAIN) is fine: the server already has a wake-up
+// pending. anything else, it wakes on its poll timeout anyway:
+
+static void
+Wake( int fd )
+{
+	char c = 0;
+	while( write( fd, &c, 1 ) < 0  &&  errno == EINTR )
+		;
+}
+
+
+bool
+TelemetryServer::Listen( )
+{
+	if( address.find( '/' ) != std::string::npos )
+	{
+		struct sockaddr_un sun;
+		memset( &sun, 0, sizeof(sun) );
+		sun.sun_family = AF_UNIX;
+		if( address.size( ) >= sizeof(sun.sun_path) )
+		{
+			fprintf( stderr, "Telemetry socket path '%s' is too long\n", address.c_str( ) );
+			return false;
+		}
+		strcpy( sun.sun_path, address.c_str( ) );
+		unlink( address.c_str( ) );		// a stale socket from an earlier run
+
+		listenFd = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if( listenFd < 0  ||  bind( listenFd, (struct sockaddr *)&sun, sizeof(sun) ) != 0 )
+			return false;
+	}
+	else
+	{
+		struct sockaddr_in sin;
+		memset( &sin, 0, sizeof(sin) );
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons( (unsigned short)atoi( address.c_str( ) ) );
+		sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );		// local clients only
+
+		listenFd = socket( AF_INET, SOCK_STREAM, 0 );
+		if( listenFd < 0 )
+			return false;
+		int on = 1;
+		setsockopt( listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+		if( bind( listenFd, (struct sockaddr *)&sin, sizeof(sin) ) != 0 )
+			return false;
+	}
+
+	if( listen( listenFd, 8 ) != 0 )
+		return false;
+	SetNonBlocking( listenFd );
+	return true;
+}
+
+
+bool
+TelemetryServer::Start( const char *addr )
+{
+	Stop( );
+	address = addr;
+	if( ! Listen( ) )
+	{
+		fprintf( stderr, "Cannot listen for telemetry on '%s': %s\n", addr, strerror( errno ) );
+		Stop( );
+		return false;
+	}
+	if( pipe( wakeFds ) != 0 )
+	{
+		Stop( );
+		return false;
+	}
+	SetNonBlocking( wakeFds[0] );
+	SetNonBlocking( wakeFds[1] );
+
+	quit = false;
+	worker = std::thread( &TelemetryServer::Run, this );
+	fprintf( stderr, "Telemetry on '%s'\n", addr );
+	return true;
+}
+
+
+void
+TelemetryServer::Stop( )
+{
+	if( worker.joinable( ) )
+	{
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			quit = true;
+		}
+		Wake( wakeFds[1] );
+		worker.join( );
+	}
+
+	for( int i = 0; i < (int)clients.size( ); i++ )
+		close( clients[i].fd );
+	clients.clear( );
+	if( listenFd >= 0 )
+	{
+		close( listenFd );
+		if( address.find( '/' ) != std::string::npos )
+			unlink( address.c_str( ) );
+	}
+	if( wakeFds[0] >= 0 )	close( wakeFds[0] );
+	if( wakeFds[1] >= 0 )	close( wakeFds[1] );
+	listenFd = wakeFds[0] = wakeFds[1] = -1;
+	queue.clear( );
+}
+
+
+// called from the simulation thread. the frame's vectors are moved out, so the caller can
+// refill the same TelemetryFrame next tick:
+
+void
+TelemetryServer::Publish( TelemetryFrame &frame )
+{
+	if( ! worker.joinable( ) )
+		return;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		if( (int)queue.size( ) >= TELEMETRY_MAX_QUEUED_FRAMES )
+		{
+			queue.pop_front( );
+			droppedFrames++;
+		}
+		queue.push_back( std::move( frame ) );
+	}
+	Wake( wakeFds[1] );
+}
+
+
+void
+TelemetryServer::Format( const TelemetryFrame &frame, std::string &text )
+{
+	text.clear( );
+	char line[128];
+	int n = (int)frame.angle.size( );
+	long long nanoseconds = llround( frame.clock * 1.e9 );		// line protocol's default precision
+	for( int i = 0; i < n; i++ )
+	{
+		int len = snprintf( line, sizeof(line), "panel,id=%d angle=%.2f,sun=%.4f,de=%.6g %lld\n",
+				i+1, frame.angle[i], frame.sun[i], frame.energyDelta[i], nanoseconds );
+		text.append( line, len );
+	}
+}
+
+
+void
+TelemetryServer::Run( )
+{
+	std::deque<TelemetryFrame> frames;
+	std::string text;
+	std::vector<struct pollfd> fds;
+	char scratch[256];
+
+	for( ; ; )
+	{
+		fds.clear( );
+		fds.push_back( { wakeFds[0], POLLIN, 0 } );
+		fds.push_back( { listenFd, POLLIN, 0 } );
+		for( int i = 0; i < (int)clients.size( ); i++ )
+			fds.push_back( { clients[i].fd, (short)( clients[i].out.empty( ) ? POLLIN : POLLIN|POLLOUT ), 0 } );
+		poll( fds.data( ), fds.size( ), POLL_TIMEOUT );
+
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			if( quit )
+				return;
+			frames.swap( queue );
+		}
+		while( read( wakeFds[0], scratch, sizeof(scratch) ) > 0 )
+			;
+
+		// new clients:
+
+		if( fds[1].revents & POLLIN )
+		{
+			int fd;
+			while( ( fd = accept( listenFd, NULL, NULL ) ) >= 0 )
+			{
+				SetNonBlocking( fd );
+				clients.push_back( { fd, std::string( ), 0 } );
+			}
+		}
+
+		// format each frame once, queue it for every client that has room:
+
+		for( int f = 0; f < (int)frames.size( ); f++ )
+		{
+			Format( frames[f], text );
+			for( int i = 0; i < (int)clients.size( ); i++ )
+			{
+				if( clients[i].out.size( ) + text.size( ) > TELEMETRY_MAX_CLIENT_BUFFER )
+					clients[i].skipped++;
+				else
+					clients[i].out += text;
+			}
+		}
+		frames.clear( );
+
+		// send what each client will take, and notice the ones that went away:
+
+		for( int i = 0; i < (int)clients.size( ); i++ )
+		{
+			Client &c = clients[i];
+			bool closed = false;
+			if( i+2 < (int)fds.size( )  &&  ( fds[i+2].revents & ( POLLIN|POLLHUP|POLLERR ) ) )
+			{
+				ssize_t n = recv( c.fd, scratch, sizeof(scratch), MSG_DONTWAIT );
+				closed = n == 0  ||  ( n < 0  &&  errno != EAGAIN  &&  errno != EWOULDBLOCK );
+			}
+			if( ! closed  &&  ! c.out.empty( ) )
+			{
+				ssize_t n = send( c.fd, c.out.data( ), c.out.size( ), MSG_DONTWAIT | MSG_NOSIGNAL );
+				if( n > 0 )
+					c.out.erase( 0, n );
+				else if( n < 0  &&  errno != EAGAIN  &&  errno != EWOULDBLOCK )
+					closed = true;
+			}
+			if( closed )
+			{
+				if( c.skipped > 0 )
+					fprintf( stderr, "Telemetry client left, %ld frames skipped while it was behind\n", c.skipped );
+				close( c.fd );
+				clients.erase( clients.begin( ) + i );
+				fds.erase( fds.begin( ) + i+2 );
+				i--;
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdio.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// live telemetry:
+// the simulation publishes a frame of per-panel values every tick; a server thread formats them
+// and streams them to any number of local clients in InfluxDB line protocol, one line per panel:
+//
+//	panel,id=3 angle=-12.5,sun=0.831,de=0.00118 86460000000000
+//
+// (angle in degrees, sun = sunlight strength, de = kWh/m^2 collected since the last frame,
+//  and the simulation clock as the timestamp, in integer nanoseconds like the protocol expects).
+// the endpoint is a Unix domain socket if the address has a '/', else a localhost TCP port,
+// so 'nc -U /tmp/solar.sock' or 'nc 127.0.0.1 7070' is a client.
+//
+// the simulation thread never waits on a client: Publish( ) only appends to a short queue,
+// dropping the oldest frame if the server thread is behind, and a client that reads too slowly
+// has whole frames skipped once its send buffer is full.
+
+const int TELEMETRY_MAX_QUEUED_FRAMES = 64;
+const size_t TELEMETRY_MAX_CLIENT_BUFFER = 1 << 20;	// bytes waiting per client before frames are skipped
+
+
+struct TelemetryFrame
+{
+	double			clock;
+	std::vector<float>	angle;
+	std::vector<float>	sun;
+	std::vector<float>	energyDelta;
+};
+
+
+class TelemetryServer
+{
+private:
+	struct Client
+	{
+		int		fd;
+		std::string	out;		// formatted, not yet sent
+		long		skipped;	// frames dropped for this client
+	};
+
+	std::string			address;
+	int				listenFd;
+	int				wakeFds[2];	// self-pipe: Publish( ) pokes the server thread
+	std::thread			worker;
+	std::mutex			lock;
+	std::deque<TelemetryFrame>	queue;
+	long				droppedFrames;
+	bool				quit;
+	std::vector<Client>		clients;
+
+	void	Format( const TelemetryFrame &, std::string & );
+	bool	Listen( );
+	void	Run( );
+
+public:
+		TelemetryServer( );
+		~TelemetryServer( );
+
+	void	Publish( TelemetryFrame & );
+	bool	Start( const char * );
+	void	Stop( );
+};
+
+#endif	// TELEMETRY_H
@@ -0,0 +1,513 @@
+#include "terrain.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include "glew.h"
+#include <GL/gl.h>
+#endif
+
+#include "glstate.h"
+
+
+static const int ChunkSide = TERRAIN_CHUNK_CELLS + 1;		// vertices along a chunk's edge
+static const int FloatsPerVertex = 5;				// x y z u v
+
+
+TerrainRenderer::TerrainRenderer( )
+{
+	field = NULL;
+	rootLevel = 0;
+	cellsX = cellsZ = 0;
+	gridVertices = ChunkSide * ChunkSide;
+	indexBuffer = 0;
+	numIndices = 0;
+	resident = 0;
+	frame = 0;
+	builds = evictions = 0;
+	pending = 0;
+	quit = false;
+}
+
+
+TerrainRenderer::~TerrainRenderer( )
+{
+	StopBuilder( );
+}
+
+
+void
+TerrainRenderer::StopBuilder( )
+{
+	if( ! builder.joinable( ) )
+		return;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_one( );
+	builder.join( );
+}
+
+
+// with the GL context current:
+
+void
+TerrainRenderer::Close( )
+{
+	StopBuilder( );
+	for( size_t i = 0; i < nodes.size( ); i++ )
+		if( nodes[i].state == CHUNK_READY )
+		{
+			glDeleteVertexArrays( 1, &nodes[i].vao );
+			glDeleteBuffers( 1, &nodes[i].vbo );
+		}
+	if( indexBuffer != 0 )
+		glDeleteBuffers( 1, &indexBuffer );
+	indexBuffer = 0;
+	nodes.clear( );
+	drawList.clear( );
+	requests.clear( );
+	built.clear( );
+	resident = 0;
+	pending = 0;
+	field = NULL;
+}
+
+
+// with the GL context current. builds the root chunk before it returns:
+
+bool
+TerrainRenderer::Open( const Heightfield *heightfield )
+{
+	Close( );
+	if( heightfield == NULL  ||  ! heightfield->IsLoaded( ) )
+		return false;
+	field = heightfield;
+	cellsX = field->GetWidth( ) - 1;
+	cellsZ = field->GetHeight( ) - 1;
+	rootLevel = 0;
+	while( ( TERRAIN_CHUNK_CELLS << rootLevel ) < std::max( cellsX, cellsZ ) )
+		rootLevel++;
+
+	// every chunk has the same triangles: the grid, then a skirt of two triangles per edge
+	// segment, hanging from the grid's edge vertices to the skirt's own:
+
+	std::vector<unsigned short> indices;
+	for( int j = 0; j < TERRAIN_CHUNK_CELLS; j++ )
+		for( int i = 0; i < TERRAIN_CHUNK_CELLS; i++ )
+		{
+			unsigned short a = (unsigned short)( j * ChunkSide + i ), b = a + 1;
+			unsigned short c = a + ChunkSide, d = c + 1;
+			unsigned short quad[6] = { a, c, b, b, c, d };
+			indices.insert( indices.end( ), quad, quad + 6 );
+		}
+	for( int edge = 0; edge < 4; edge++ )
+		for( int k = 0; k < TERRAIN_CHUNK_CELLS; k++ )
+		{
+			int top[2];
+			for( int t = 0; t < 2; t++ )
+			{
+				int e = k + t;
+				top[t] = edge == 0 ? e : ( edge == 1 ? TERRAIN_CHUNK_CELLS * ChunkSide + e :
+					( edge == 2 ? e * ChunkSide : e * ChunkSide + TERRAIN_CHUNK_CELLS ) );
+			}
+			unsigned short s0 = (unsigned short)( gridVertices + edge * ChunkSide + k ), s1 = s0 + 1;
+			unsigned short quad[6] = { (unsigned short)top[0], s0, (unsigned short)top[1], (unsigned short)top[1], s0, s1 };
+			indices.insert( indices.end( ), quad, quad + 6 );
+		}
+	numIndices = (int)indices.size( );
+	glGenBuffers( 1, &indexBuffer );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, indexBuffer );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, indices.size( ) * sizeof(unsigned short), indices.data( ), GL_STATIC_DRAW );
+
+	Node root;
+	root.level = rootLevel;
+	root.x = root.z = 0;
+	root.children[0] = root.children[1] = root.children[2] = root.children[3] = -1;
+	root.state = CHUNK_REQUESTED;
+	root.error = 0.f;
+	root.vao = root.vbo = 0;
+	root.lastUsed = 0;
+	nodes.push_back( root );
+
+	Built b = Built( );
+	b.node = 0;
+	b.level = rootLevel;
+	b.x = b.z = 0;
+	Build( b );
+	pending = 1;
+	Upload( b );
+
+	quit = false;
+	builder = std::thread( &TerrainRenderer::Run, this );
+	fprintf( stderr, "Terrain: %dx%d samples, %d levels of %dx%d-cell chunks\n", field->GetWidth( ), field->GetHeight( ),
+		rootLevel + 1, TERRAIN_CHUNK_CELLS, TERRAIN_CHUNK_CELLS );
+	return true;
+}
+
+
+// the chunk's vertices, on the builder thread (or in Open( ) for the root).
+// vertices past the heightfield's far edges are clamped onto it, which only folds up
+// triangles that have no area.
+// the error is measured at every sample for the finest levels, and at every quarter of a
+// vertex spacing for the coarser ones -- the coarse chunks are only ever seen from far away:
+
+void
+TerrainRenderer::Build( Built &b )
+{
+	int stride = 1 << b.level;
+	int sx0 = b.x * TERRAIN_CHUNK_CELLS * stride;
+	int sz0 = b.z * TERRAIN_CHUNK_CELLS * stride;
+	float half = 0.5f * field->GetSize( );
+	float spacing = field->GetSpacing( );
+	float toU = spacing / field->GetSize( );
+
+	b.vertices.resize( FloatsPerVertex * ( gridVertices + 4 * ChunkSide ) );
+	std::vector<float> heights( gridVertices );
+	float minY = 1e30f, maxY = -1e30f;
+	float *v = b.vertices.data( );
+	for( int j = 0; j < ChunkSide; j++ )
+	{
+		int sz = std::min( sz0 + j * stride, cellsZ );
+		for( int i = 0; i < ChunkSide; i++ )
+		{
+			int sx = std::min( sx0 + i * stride, cellsX );
+			float h = field->Sample( sx, sz );
+			heights[ j * ChunkSide + i ] = h;
+			minY = std::min( minY, h );
+			maxY = std::max( maxY, h );
+			v[0] = -half + (float)sx * spacing;
+			v[1] = h;
+			v[2] = -half + (float)sz * spacing;
+			v[3] = (float)sx * toU;
+			v[4] = (float)sz * toU;
+			v += FloatsPerVertex;
+		}
+	}
+
+	float error = 0.f;
+	if( stride > 1 )
+	{
+		int step = std::max( 1, stride / 4 );
+		int sxEnd = std::min( sx0 + TERRAIN_CHUNK_CELLS * stride, cellsX );
+		int szEnd = std::min( sz0 + TERRAIN_CHUNK_CELLS * stride, cellsZ );
+		for( int sz = sz0; sz <= szEnd; sz += step )
+		{
+			int j = std::min( ( sz - sz0 ) / stride, TERRAIN_CHUNK_CELLS - 1 );
+			float fz = (float)( sz - sz0 - j * stride ) / (float)stride;
+			for( int sx = sx0; sx <= sxEnd; sx += step )
+			{
+				int i = std::min( ( sx - sx0 ) / stride, TERRAIN_CHUNK_CELLS - 1 );
+				float fx = (float)( sx - sx0 - i * stride ) / (float)stride;
+
+				// the two triangles of a cell share the diagonal from (i+1, j) to (i, j+1):
+				const float *a = &heights[ j * ChunkSide + i ];
+				float mesh = fx + fz <= 1.f ? a[0] + ( a[1] - a[0] ) * fx + ( a[ChunkSide] - a[0] ) * fz
+							: a[ChunkSide+1] + ( a[ChunkSide] - a[ChunkSide+1] ) * ( 1.f - fx ) + ( a[1] - a[ChunkSide+1] ) * ( 1.f - fz );
+				float h = field->Sample( sx, sz );
+				error = std::max( error, fabsf( h - mesh ) );
+				minY = std::min( minY, h );
+				maxY = std::max( maxY, h );
+			}
+		}
+	}
+
+	// the skirt reaches below anything a neighbor's edge could be -- a neighbor's edge runs
+	// between the same samples, so it stays inside this chunk's range of heights:
+
+	float depth = ( maxY - minY ) + (float)stride * spacing;
+	for( int edge = 0; edge < 4; edge++ )
+		for( int k = 0; k < ChunkSide; k++ )
+		{
+			int top = edge == 0 ? k : ( edge == 1 ? TERRAIN_CHUNK_CELLS * ChunkSide + k :
+				( edge == 2 ? k * ChunkSide : k * ChunkSide + TERRAIN_CHUNK_CELLS ) );
+			const float *t = &b.vertices[ FloatsPerVertex * top ];
+			v[0] = t[0];
+			v[1] = t[1] - depth;
+			v[2] = t[2];
+			v[3] = t[3];
+			v[4] = t[4];
+			v += FloatsPerVertex;
+		}
+
+	const float *first = b.vertices.data( );
+	const float *last = &b.vertices[ FloatsPerVertex * ( gridVertices - 1 ) ];
+	b.error = error;
+	b.boxMin = glm::vec3( first[0], minY - depth, first[2] );
+	b.boxMax = glm::vec3( last[0], maxY, last[2] );
+}
+
+
+void
+TerrainRenderer::Run( )
+{
+	for( ; ; )
+	{
+		Built b = Built( );
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [this]( ) { return ! requests.empty( ) || quit; } );
+			if( quit )
+				return;
+			b = std::move( requests.front( ) );
+			requests.pop_front( );
+		}
+
+		Build( b );
+
+		std::lock_guard<std::mutex> guard( lock );
+		built.push_back( std::move( b ) );
+	}
+}
+
+
+void
+TerrainRenderer::Request( int index )
+{
+	Node &n = nodes[index];
+	if( n.state != CHUNK_NONE  ||  pending >= TERRAIN_MAX_REQUESTS )
+		return;
+	n.state = CHUNK_REQUESTED;
+	pending++;
+
+	Built b = Built( );			// zeroed: error and the box are only filled in by Build( ), on the thread
+	b.node = index;
+	b.level = n.level;
+	b.x = n.x;
+	b.z = n.z;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		requests.push_back( std::move( b ) );
+	}
+	wake.notify_one( );
+}
+
+
+void
+TerrainRenderer::Upload( Built &b )
+{
+	Node &n = nodes[b.node];
+	n.error = b.error;
+	n.boxMin = b.boxMin;
+	n.boxMax = b.boxMax;
+
+	glGenVertexArrays( 1, &n.vao );
+	glGenBuffers( 1, &n.vbo );
+	GlState.BindVertexArray( n.vao );
+	GlState.BindBuffer( GL_ARRAY_BUFFER, n.vbo );
+	glBufferData( GL_ARRAY_BUFFER, b.vertices.size( ) * sizeof(float), b.vertices.data( ), GL_STATIC_DRAW );
+	glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, FloatsPerVertex * sizeof(float), (void *)0 );
+	glEnableVertexAttribArray( 0 );
+	glVertexAttribPointer( 1, 2, GL_FLOAT, GL_FALSE, FloatsPerVertex * sizeof(float), (void *)( 3 * sizeof(float) ) );
+	glEnableVertexAttribArray( 1 );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, indexBuffer );
+	GlState.BindVertexArray( 0 );
+
+	n.state = CHUNK_READY;
+	n.lastUsed = frame;
+	resident++;
+	pending--;
+	builds++;
+}
+
+
+// the node's c-th child, made the first time it's asked for:
+
+int
+TerrainRenderer::Child( int index, int c )
+{
+	if( nodes[index].children[c] != -1 )
+		return nodes[index].children[c];
+
+	Node child;
+	child.level = nodes[index].level - 1;
+	child.x = 2 * nodes[index].x + ( c & 1 );
+	child.z = 2 * nodes[index].z + ( c >> 1 );
+	int span = TERRAIN_CHUNK_CELLS << child.level;
+	if( child.x * span >= cellsX  ||  child.z * span >= cellsZ )
+	{
+		nodes[index].children[c] = -2;
+		return -2;
+	}
+	child.children[0] = child.children[1] = child.children[2] = child.children[3] = -1;
+	child.state = CHUNK_NONE;
+	child.error = 0.f;
+	child.vao = child.vbo = 0;
+	child.lastUsed = frame;
+	nodes.push_back( child );
+	nodes[index].children[c] = (int)nodes.size( ) - 1;
+	return nodes[index].children[c];
+}
+
+
+// is the box at least partly inside the frustum's six planes?
+
+bool
+TerrainRenderer::Visible( const glm::vec4 *planes, glm::vec3 boxMin, glm::vec3 boxMax )
+{
+	for( int p = 0; p < 6; p++ )
+	{
+		glm::vec3 corner( planes[p].x > 0.f ? boxMax.x : boxMin.x,
+				  planes[p].y > 0.f ? boxMax.y : boxMin.y,
+				  planes[p].z > 0.f ? boxMax.z : boxMin.z );
+		if( glm::dot( glm::vec3( planes[p] ), corner ) + planes[p].w < 0.f )
+			return false;
+	}
+	return true;
+}
+
+
+// pixelsPerUnit is how many pixels a world unit covers at distance 1 (perspective) or anywhere (ortho):
+
+void
+TerrainRenderer::Select( int index, const glm::vec4 *planes, glm::vec3 eye, float pixelsPerUnit, bool perspective )
+{
+	if( nodes[index].state != CHUNK_READY )
+		return;
+	nodes[index].lastUsed = frame;
+	if( ! Visible( planes, nodes[index].boxMin, nodes[index].boxMax ) )
+		return;
+
+	float distance = 1.f;
+	if( perspective )
+	{
+		glm::vec3 nearest = glm::clamp( eye, nodes[index].boxMin, nodes[index].boxMax );
+		distance = std::max( glm::length( eye - nearest ), 1e-4f );
+	}
+	if( nodes[index].level == 0  ||  nodes[index].error * pixelsPerUnit / distance <= TERRAIN_PIXEL_ERROR )
+	{
+		drawList.push_back( index );
+		return;
+	}
+
+	// split only once every child that can be seen has been built; until then, this chunk
+	// stands in for them. a child's own box isn't known before it's built, so it's guessed
+	// from its place and this chunk's heights:
+
+	int children[4];
+	bool ready = true;
+	for( int c = 0; c < 4; c++ )
+	{
+		children[c] = Child( index, c );
+		if( children[c] < 0  ||  nodes[children[c]].state == CHUNK_READY )
+			continue;
+		const Node &child = nodes[children[c]];
+		float span = (float)( TERRAIN_CHUNK_CELLS << child.level ) * field->GetSpacing( );
+		float half = 0.5f * field->GetSize( );
+		glm::vec3 guessMin( -half + (float)child.x * span, nodes[index].boxMin.y, -half + (float)child.z * span );
+		glm::vec3 guessMax( guessMin.x + span, nodes[index].boxMax.y, guessMin.z + span );
+		if( Visible( planes, guessMin, guessMax ) )
+		{
+			Request( children[c] );
+			ready = false;
+		}
+	}
+	if( ! ready )
+	{
+		drawList.push_back( index );
+		return;
+	}
+	for( int c = 0; c < 4; c++ )
+		if( children[c] >= 0 )
+			Select( children[c], planes, eye, pixelsPerUnit, perspective );
+}
+
+
+// drop the chunks used longest ago until there are TERRAIN_MAX_CHUNKS; the ones this frame
+// walked through or drew, and the root, stay:
+
+void
+TerrainRenderer::Evict( )
+{
+	std::vector<int> candidates;
+	for( int i = 1; i < (int)nodes.size( ); i++ )
+		if( nodes[i].state == CHUNK_READY  &&  nodes[i].lastUsed < frame )
+			candidates.push_back( i );
+	std::sort( candidates.begin( ), candidates.end( ),
+		[this]( int a, int b ) { return nodes[a].lastUsed < nodes[b].lastUsed; } );
+	for( size_t k = 0; k < candidates.size( )  &&  resident > TERRAIN_MAX_CHUNKS; k++ )
+	{
+		Node &n = nodes[ candidates[k] ];
+		glDeleteVertexArrays( 1, &n.vao );
+		glDeleteBuffers( 1, &n.vbo );
+		n.vao = n.vbo = 0;
+		n.state = CHUNK_NONE;
+		resident--;
+		evictions++;
+	}
+}
+
+
+// once a frame, before Draw( ), with the GL context current:
+// uploads what the builder has finished and picks the chunks to draw for this view
+
+void
+TerrainRenderer::Update( const glm::mat4 &projection, const glm::mat4 &view, int viewportHeight )
+{
+	if( field == NULL )
+		return;
+	frame++;
+
+	std::deque<Built> ready;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		for( int k = 0; k < TERRAIN_UPLOADS_PER_FRAME  &&  ! built.empty( ); k++ )
+		{
+			ready.push_back( std::move( built.front( ) ) );
+			built.pop_front( );
+		}
+	}
+	for( size_t k = 0; k < ready.size( ); k++ )
+		Upload( ready[k] );
+
+	// the frustum's planes, inside where ax + by + cz + d >= 0 (Gribb and Hartmann):
+
+	glm::mat4 m = projection * view;
+	glm::vec4 rows[4];
+	for( int r = 0; r < 4; r++ )
+		rows[r] = glm::vec4( m[0][r], m[1][r], m[2][r], m[3][r] );
+	glm::vec4 planes[6] = { rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1],
+				rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2] };
+
+	glm::vec3 eye = glm::vec3( glm::inverse( view )[3] );
+	bool perspective = projection[3][3] == 0.f;
+	float pixelsPerUnit = projection[1][1] * 0.5f * (float)viewportHeight;
+
+	drawList.clear( );
+	Select( 0, planes, eye, pixelsPerUnit, perspective );
+	if( resident > TERRAIN_MAX_CHUNKS )
+		Evict( );
+}
+
+
+// the chunks Update( ) picked, with whatever program and textures are bound. returns the draw calls:
+
+int
+TerrainRenderer::Draw( )
+{
+	for( size_t k = 0; k < drawList.size( ); k++ )
+	{
+		GlState.BindVertexArray( nodes[ drawList[k] ].vao );
+		glDrawElements( GL_TRIANGLES, numIndices, GL_UNSIGNED_SHORT, (void *)0 );
+	}
+	return (int)drawList.size( );
+}
+
+
+void
+TerrainRenderer::PrintStats( )
+{
+	if( field == NULL )
+		return;
+	fprintf( stderr, "Terrain: %ld chunks built, %ld evicted, %d resident, %d drawn in the last frame\n",
+		builds, evictions, resident, (int)drawList.size( ) );
+}
@@ -0,0 +1,118 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "heightfield.h"
+
+
+// a heightfield drawn as a chunked quadtree (Ulrich's "chunked LOD"):
+//
+//	chunks		every node is a TERRAIN_CHUNK_CELLS square grid of cells over its part of the
+//			heightfield, the root taking every 2^levels-th sample and the leaves every one.
+//			a node knows its geometric error -- the most its mesh is off from the samples
+//			under it -- and the box its heights lie in
+//	selection	each frame the tree is walked from the root; a node is drawn if its error,
+//			projected to the screen at its distance, is under TERRAIN_PIXEL_ERROR, or
+//			split into its children if they've all been built, or drawn meanwhile if not.
+//			nodes outside the view frustum are skipped
+//	seams		neighbors at different levels don't share edge vertices, so every chunk hangs
+//			a skirt down from its edges deeper than any gap between them can be
+//	streaming	chunk meshes are built by a thread from the samples -- for a raw heightmap,
+//			straight from the mapped file, so only the pages under the chunks the view needs
+//			are ever read. the GL thread uploads TERRAIN_UPLOADS_PER_FRAME of them a frame,
+//			and above TERRAIN_MAX_CHUNKS drops the ones used longest ago. the root is built
+//			at Open( ) and never goes, so there's always a terrain to draw
+//
+// the vertices are the layout main.cpp's terrain quad always had: position at location 0,
+// texture coordinates 0..1 across the heightfield at location 1.
+// the heightfield must stay loaded while the renderer is open.
+
+const int TERRAIN_CHUNK_CELLS = 32;
+const float TERRAIN_PIXEL_ERROR = 2.f;
+const int TERRAIN_UPLOADS_PER_FRAME = 4;
+const int TERRAIN_MAX_CHUNKS = 512;
+const int TERRAIN_MAX_REQUESTS = 32;		// chunks waiting for the builder at a time
+
+
+class TerrainRenderer
+{
+private:
+	enum ChunkStates
+	{
+		CHUNK_NONE,
+		CHUNK_REQUESTED,
+		CHUNK_READY
+	};
+
+	struct Node
+	{
+		int		level, x, z;		// covers samples x*span .. (x+1)*span, span = TERRAIN_CHUNK_CELLS << level
+		int		children[4];		// node indices, -1 if not made yet, -2 if off the heightfield
+		int		state;
+		float		error;			// world units, known once built
+		glm::vec3	boxMin, boxMax;
+		unsigned int	vao, vbo;
+		long		lastUsed;		// frame
+	};
+
+	struct Built
+	{
+		int			node;
+		int			level, x, z;
+		std::vector<float>	vertices;
+		float			error;
+		glm::vec3		boxMin, boxMax;
+	};
+
+	const Heightfield *	field;
+	int			rootLevel;
+	int			cellsX, cellsZ;		// sample intervals along x and z
+	int			gridVertices;		// per chunk, without the skirt
+	unsigned int		indexBuffer;
+	int			numIndices;
+
+	std::vector<Node>	nodes;
+	std::vector<int>	drawList;
+	int			resident;
+	long			frame;
+	long			builds, evictions;
+
+	// the hand-off to the builder:
+	std::thread		builder;
+	std::mutex		lock;
+	std::condition_variable	wake;
+	std::deque<Built>	requests;		// just the node and where it is
+	std::deque<Built>	built;
+	int			pending;		// requested and not uploaded yet
+	bool			quit;
+
+	void	Build( Built & );
+	int	Child( int, int );
+	void	Evict( );
+	void	Request( int );
+	void	Run( );
+	void	Select( int, const glm::vec4 *, glm::vec3, float, bool );
+	void	StopBuilder( );
+	void	Upload( Built & );
+	bool	Visible( const glm::vec4 *, glm::vec3, glm::vec3 );
+
+public:
+		TerrainRenderer( );
+		~TerrainRenderer( );
+
+	void	Close( );
+	int	Draw( );
+	bool	IsOpen( )			{ return field != NULL; }
+	bool	Open( const Heightfield * );
+	void	PrintStats( );
+	void	Update( const glm::mat4 &projection, const glm::mat4 &view, int viewportHeight );
+};
+
+#endif	// TERRAIN_H
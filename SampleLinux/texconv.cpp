@@ -0,0 +1,159 @@
+// texture converter:
+// turns an image stb_image can read into a KTX file holding the whole mip chain, block-compressed,
+// so the sample uploads it with glCompressedTexImage2D and generates no mipmaps at run time:
+//
+//	texconv grass.jpg grass.ktx
+//	texconv -format bc7 grass.jpg grass.ktx
+//
+// or, when the output ends in .vt, into a page file of tiles for virtual texturing (see pagefile.h),
+// for images too big to be one texture -- the sample drapes it over the terrain with --ortho:
+//
+//	texconv site-orthophoto.png site.vt
+//
+// options:
+//	-format F	bc1, bc3, bc7 or rgba (uncompressed) -- default bc1 for opaque images, bc3 otherwise
+//	-mips N		mip levels to write, 0 for all of them (default 0)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "ktx.h"
+#include "blockcompress.h"
+#include "image.h"
+#include "pagefile.h"
+
+
+int
+main( int argc, char *argv[ ] )
+{
+	const char *formatName = NULL;
+	int maxLevels = 0;
+	const char *inPath = NULL;
+	const char *outPath = NULL;
+
+	for( int i = 1; i < argc; i++ )
+	{
+		const char *opt = argv[i];
+		if( opt[0] != '-' )
+		{
+			if( inPath == NULL )
+				inPath = opt;
+			else
+				outPath = opt;
+			continue;
+		}
+		const char *val = i+1 < argc ? argv[i+1] : NULL;
+		if( val == NULL )
+		{
+			fprintf( stderr, "Option '%s' needs a value\n", opt );
+			return 1;
+		}
+		i++;
+
+		if(      strcmp( opt, "-format" ) == 0 )	formatName = val;
+		else if( strcmp( opt, "-mips" ) == 0 )		maxLevels = atoi( val );
+		else
+		{
+			fprintf( stderr, "Unknown option '%s'\n", opt );
+			return 1;
+		}
+	}
+	if( inPath == NULL  ||  outPath == NULL )
+	{
+		fprintf( stderr, "Usage: texconv [-format bc1|bc3|bc7|rgba] [-mips N] in-image out.ktx|out.vt\n" );
+		return 1;
+	}
+
+	int width, height, n;
+	unsigned char *pixels = stbi_load( inPath, &width, &height, &n, 4 );
+	if( pixels == NULL )
+	{
+		fprintf( stderr, "Cannot read '%s': %s\n", inPath, stbi_failure_reason( ) );
+		return 1;
+	}
+	std::vector<unsigned char> rgba( pixels, pixels + 4 * (size_t)width * height );
+	stbi_image_free( pixels );
+
+	bool opaque = true;
+	for( size_t i = 3; i < rgba.size( )  &&  opaque; i += 4 )
+		opaque = rgba[i] == 255;
+
+	int format;
+	if( formatName == NULL )
+		format = opaque ? BLOCK_BC1 : BLOCK_BC3;
+	else if( strcmp( formatName, "bc1" ) == 0 )	format = BLOCK_BC1;
+	else if( strcmp( formatName, "bc3" ) == 0 )	format = BLOCK_BC3;
+	else if( strcmp( formatName, "bc7" ) == 0 )	format = BLOCK_BC7;
+	else if( strcmp( formatName, "rgba" ) == 0 )	format = -1;
+	else
+	{
+		fprintf( stderr, "Unknown format '%s'\n", formatName );
+		return 1;
+	}
+
+	size_t outLength = strlen( outPath );
+	if( outLength >= 3  &&  strcmp( outPath + outLength - 3, ".vt" ) == 0 )
+	{
+		if( ! PageFile::Write( outPath, format < 0 ? PAGE_RGBA : format, rgba.data( ), width, height ) )
+			return 1;
+		PageFile pages;
+		if( ! pages.Open( outPath ) )
+			return 1;
+		long long tiles = 0;
+		for( int l = 0; l < pages.GetNumLevels( ); l++ )
+			tiles += (long long)pages.GetTilesX( l ) * pages.GetTilesY( l );
+		fprintf( stderr, "%s: %dx%d, %d levels, %lld tiles of %zu bytes\n", outPath, width, height,
+			pages.GetNumLevels( ), tiles, pages.TileBytes( ) );
+		return 0;
+	}
+
+	KtxImage image;
+	if( format < 0 )
+	{
+		image.glType = KTX_GL_UNSIGNED_BYTE;
+		image.glFormat = KTX_GL_RGBA;
+		image.glInternalFormat = KTX_GL_RGBA8;
+	}
+	else
+	{
+		image.glType = 0;
+		image.glFormat = 0;
+		image.glInternalFormat = format == BLOCK_BC1 ? GL_FORMAT_BC1 : ( format == BLOCK_BC3 ? GL_FORMAT_BC3 : GL_FORMAT_BC7 );
+	}
+	image.glBaseInternalFormat = format == BLOCK_BC1 ? KTX_GL_RGB : KTX_GL_RGBA;
+
+	size_t uncompressed = 0;
+	for( int w = width, h = height; ; )
+	{
+		KtxLevel level;
+		level.width = w;
+		level.height = h;
+		if( format < 0 )
+			level.data = rgba;
+		else
+		{
+			level.data.resize( BlockCompressedSize( format, w, h ) );
+			CompressBlocks( format, rgba.data( ), w, h, level.data.data( ) );
+		}
+		image.levels.push_back( level );
+		uncompressed += rgba.size( );
+
+		if( ( w == 1  &&  h == 1 )  ||  (int)image.levels.size( ) == maxLevels )
+			break;
+		rgba = HalfSize( rgba.data( ), w, h, w, h );
+	}
+	if( ! WriteKtx( outPath, image ) )
+		return 1;
+
+	size_t bytes = 0;
+	for( size_t l = 0; l < image.levels.size( ); l++ )
+		bytes += image.levels[l].data.size( );
+	fprintf( stderr, "%s: %dx%d, %d levels, %s, %zu bytes (%.1fx smaller than rgba)\n", outPath, width, height,
+		(int)image.levels.size( ), formatName != NULL ? formatName : ( opaque ? "bc1" : "bc3" ),
+		bytes, (double)uncompressed / (double)bytes );
+	return 0;
+}
@@ -0,0 +1,483 @@
+#include "texturemanager.h"
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include "glew.h"
+#include <GL/gl.h>
+#endif
+
+#include "stb_image.h"
+#include "metrics.h"
+#include "blockcompress.h"
+
+unsigned char *	BmpToTexture( char *, int *, int * );
+
+
+// BmpToTexture keeps the headers it reads in globals, so only one thread at a time may be in it:
+
+static std::mutex	BmpLock;
+
+
+TextureManager::TextureManager( )
+{
+	quit = false;
+	pbos[0] = pbos[1] = 0;
+	pboSize[0] = pboSize[1] = 0;
+	nextPbo = 0;
+	uploadBudget = TEXTURE_UPLOAD_BUDGET;
+	current = -1;
+	s3tc = bptc = false;
+	decodeSeconds = decodedBytes = -1;
+}
+
+
+// no GL here -- the context may be gone by the time this runs. Stop( ) cleans up the GL side:
+
+TextureManager::~TextureManager( )
+{
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_all( );
+	for( int i = 0; i < (int)workers.size( ); i++ )
+		workers[i].join( );
+	for( int i = 0; i < (int)textures.size( ); i++ )
+		FreePixels( textures[i] );
+}
+
+
+// on the GL thread:
+
+void
+TextureManager::Start( int numThreads )
+{
+	GLint numExtensions = 0;
+	glGetIntegerv( GL_NUM_EXTENSIONS, &numExtensions );
+	for( int i = 0; i < numExtensions; i++ )
+	{
+		const char *name = (const char *)glGetStringi( GL_EXTENSIONS, i );
+		if( strcmp( name, "GL_EXT_texture_compression_s3tc" ) == 0 )
+			s3tc = true;
+		if( strcmp( name, "GL_ARB_texture_compression_bptc" ) == 0 )
+			bptc = true;
+	}
+
+	quit = false;
+	for( int i = 0; i < numThreads; i++ )
+		workers.push_back( std::thread( &TextureManager::Run, this ) );
+}
+
+
+void
+TextureManager::Stop( )
+{
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_all( );
+	for( int i = 0; i < (int)workers.size( ); i++ )
+		workers[i].join( );
+	workers.clear( );
+
+	for( int i = 0; i < 2; i++ )
+	{
+		if( pbos[i] != 0 )
+			glDeleteBuffers( 1, &pbos[i] );
+		pbos[i] = 0;
+		pboSize[i] = 0;
+	}
+}
+
+
+void
+TextureManager::SetMetrics( int decodeSecondsHistogram, int decodedBytesCounter )
+{
+	decodeSeconds = decodeSecondsHistogram;
+	decodedBytes = decodedBytesCounter;
+}
+
+
+void
+TextureManager::SetUploadBudget( size_t bytesPerUpdate )
+{
+	uploadBudget = bytesPerUpdate;
+}
+
+
+// on the GL thread. the placeholder color is 0xRRGGBBAA:
+
+int
+TextureManager::Load( const char *path, unsigned int placeholderColor )
+{
+	Texture t;
+	t.path = path;
+	t.state = QUEUED;
+	t.texture = 0;
+	t.pixels = NULL;
+	t.fromBmp = false;
+	t.width = t.height = t.comps = 0;
+	t.rowsUploaded = 0;
+	t.ktx = NULL;
+	t.levelsUploaded = 0;
+
+	unsigned char color[4] = { (unsigned char)( placeholderColor >> 24 ), (unsigned char)( placeholderColor >> 16 ),
+				   (unsigned char)( placeholderColor >> 8 ),  (unsigned char)( placeholderColor ) };
+	glGenTextures( 1, &t.placeholder );
+	glBindTexture( GL_TEXTURE_2D, t.placeholder );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, color );
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	int handle;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		textures.push_back( t );
+		handle = (int)textures.size( ) - 1;
+		jobs.push_back( handle );
+	}
+	wake.notify_one( );
+	return handle;
+}
+
+
+unsigned int
+TextureManager::Get( int handle )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	if( handle < 0  ||  handle >= (int)textures.size( ) )
+		return 0;
+	const Texture &t = textures[handle];
+	return t.state == READY ? t.texture : t.placeholder;
+}
+
+
+bool
+TextureManager::IsReady( int handle )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	return handle >= 0  &&  handle < (int)textures.size( )  &&  textures[handle].state == READY;
+}
+
+
+void
+TextureManager::Run( )
+{
+	for( ; ; )
+	{
+		int handle;
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [this]( ) { return ! jobs.empty( ) || quit; } );
+			if( quit )
+				return;
+			handle = jobs.front( );
+			jobs.pop_front( );
+		}
+		Decode( handle );
+	}
+}
+
+
+// on a worker thread:
+
+void
+TextureManager::Decode( int handle )
+{
+	std::string path;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		path = textures[handle].path;
+	}
+
+	auto start = std::chrono::steady_clock::now( );
+	unsigned char *pixels = NULL;
+	KtxImage *ktx = NULL;
+	int width = 0, height = 0, comps = 0;
+	size_t bytes = 0;
+	const char *extension = path.size( ) >= 4 ? path.c_str( ) + path.size( ) - 4 : "";
+	bool fromBmp = strcasecmp( extension, ".bmp" ) == 0;
+	if( strcasecmp( extension, ".ktx" ) == 0 )
+	{
+		ktx = new KtxImage;
+		if( ! ReadKtx( path.c_str( ), *ktx )  ||  ! Unpack( *ktx ) )
+		{
+			delete ktx;
+			ktx = NULL;
+		}
+		else
+		{
+			width = ktx->levels[0].width;
+			height = ktx->levels[0].height;
+			for( size_t l = 0; l < ktx->levels.size( ); l++ )
+				bytes += ktx->levels[l].data.size( );
+		}
+	}
+	else if( fromBmp )
+	{
+		std::lock_guard<std::mutex> guard( BmpLock );
+		pixels = BmpToTexture( (char *)path.c_str( ), &width, &height );
+		comps = 3;
+	}
+	else
+	{
+		// 3 or 4 channels, whatever is in the file:
+		int n = 0;
+		if( stbi_info( path.c_str( ), &width, &height, &n ) )
+		{
+			comps = n == 3 ? 3 : 4;
+			pixels = stbi_load( path.c_str( ), &width, &height, &n, comps );
+		}
+		bytes = (size_t)width * height * comps;
+	}
+	double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now( ) - start ).count( );
+
+	bool ok = pixels != NULL  ||  ktx != NULL;
+	if( ! ok )
+		fprintf( stderr, "Cannot load texture '%s'\n", path.c_str( ) );
+	else
+	{
+		Metrics.Observe( decodeSeconds, seconds );
+		Metrics.Add( decodedBytes, bytes );
+	}
+
+	std::lock_guard<std::mutex> guard( lock );
+	Texture &t = textures[handle];
+	t.pixels = pixels;
+	t.ktx = ktx;
+	t.fromBmp = fromBmp;
+	t.width = width;
+	t.height = height;
+	t.comps = comps;
+	t.state = ok ? DECODED : FAILED;
+}
+
+
+// on a worker thread: blocks the GL can't take become rgba8, level by level:
+
+bool
+TextureManager::Unpack( KtxImage &ktx )
+{
+	int format = BlockFormatOf( ktx.glInternalFormat );
+	if( ktx.glFormat != 0 )
+		return true;				// uncompressed already
+	if( format < 0 )
+		return false;
+	if( ( format == BLOCK_BC7 && bptc )  ||  ( format != BLOCK_BC7 && s3tc ) )
+		return true;
+
+	for( size_t l = 0; l < ktx.levels.size( ); l++ )
+	{
+		KtxLevel &level = ktx.levels[l];
+		std::vector<unsigned char> rgba( 4 * (size_t)level.width * level.height );
+		if( level.data.size( ) < BlockCompressedSize( format, level.width, level.height )
+		 ||  ! DecompressBlocks( format, level.data.data( ), level.width, level.height, rgba.data( ) ) )
+			return false;
+		level.data.swap( rgba );
+	}
+	ktx.glType = KTX_GL_UNSIGNED_BYTE;
+	ktx.glFormat = KTX_GL_RGBA;
+	ktx.glInternalFormat = KTX_GL_RGBA8;
+	return true;
+}
+
+
+void
+TextureManager::FreePixels( Texture &t )
+{
+	delete t.ktx;
+	t.ktx = NULL;
+	if( t.pixels == NULL )
+		return;
+	if( t.fromBmp )
+		delete [ ] t.pixels;
+	else
+		stbi_image_free( t.pixels );
+	t.pixels = NULL;
+}
+
+
+// on the GL thread, once a frame: upload up to the budget's worth of decoded rows.
+// returns true while there are textures still on their way:
+
+bool
+TextureManager::Update( )
+{
+	size_t budget = uploadBudget;
+	while( budget > 0 )
+	{
+		if( current < 0 )
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			for( int i = 0; i < (int)textures.size( ); i++ )
+			{
+				if( textures[i].state == DECODED )
+				{
+					textures[i].state = UPLOADING;
+					current = i;
+					break;
+				}
+			}
+			if( current < 0 )
+				break;
+
+			// storage for the whole image; the slices fill it in:
+
+			Texture &t = textures[current];
+			glGenTextures( 1, &t.texture );
+			glBindTexture( GL_TEXTURE_2D, t.texture );
+			if( t.ktx == NULL )
+			{
+				GLenum format = t.comps == 4 ? GL_RGBA : GL_RGB;
+				glTexImage2D( GL_TEXTURE_2D, 0, format, t.width, t.height, 0, format, GL_UNSIGNED_BYTE, NULL );
+			}
+		}
+
+		// only this thread touches an UPLOADING texture, but Load( ) may grow the vector,
+		// so it's indexed again each time:
+
+		Texture &t = textures[current];
+		if( t.ktx != NULL ? UploadLevel( t, budget ) : UploadSlice( t, budget ) )
+		{
+			Finish( current );
+			current = -1;
+		}
+	}
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	std::lock_guard<std::mutex> guard( lock );
+	for( int i = 0; i < (int)textures.size( ); i++ )
+		if( textures[i].state != READY  &&  textures[i].state != FAILED )
+			return true;
+	return false;
+}
+
+
+// copy size bytes into a pixel-unpack buffer and leave it bound; the upload then reads from
+// the pointer this returns. the two buffers alternate, so filling one doesn't wait on
+// the last transfer out of the other:
+
+const void *
+TextureManager::Stage( const void *src, size_t size )
+{
+	int p = nextPbo;
+	nextPbo = 1 - nextPbo;
+	if( pbos[p] == 0 )
+		glGenBuffers( 1, &pbos[p] );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbos[p] );
+	if( pboSize[p] < size )
+	{
+		glBufferData( GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW );
+		pboSize[p] = size;
+	}
+	void *dst = glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+	if( dst == NULL )
+	{
+		glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+		return src;
+	}
+	memcpy( dst, src, size );
+	glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+	return NULL;				// offset 0 of the bound buffer
+}
+
+
+// the next rows of a decoded image:
+
+bool
+TextureManager::UploadSlice( Texture &t, size_t &budget )
+{
+	size_t rowBytes = (size_t)t.width * t.comps;
+	// clamped while still a size_t: an unlimited budget is SIZE_MAX, which doesn't fit an int:
+	size_t remaining = (size_t)( t.height - t.rowsUploaded );
+	int rows = (int)std::min( budget / rowBytes, remaining );
+	if( rows < 1 )
+		rows = 1;
+	size_t size = rows * rowBytes;
+	const void *src = Stage( t.pixels + t.rowsUploaded * rowBytes, size );
+	GLenum format = t.comps == 4 ? GL_RGBA : GL_RGB;
+
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glBindTexture( GL_TEXTURE_2D, t.texture );
+	glTexSubImage2D( GL_TEXTURE_2D, 0, 0, t.rowsUploaded, t.width, rows, format, GL_UNSIGNED_BYTE, src );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+	t.rowsUploaded += rows;
+	budget -= size < budget ? size : budget;
+	return t.rowsUploaded == t.height;
+}
+
+
+// the next mip level of a ktx file, whole -- the budget only says how many levels a call gets:
+
+bool
+TextureManager::UploadLevel( Texture &t, size_t &budget )
+{
+	const KtxLevel &level = t.ktx->levels[ t.levelsUploaded ];
+	size_t size = level.data.size( );
+	const void *src = Stage( level.data.data( ), size );
+
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glBindTexture( GL_TEXTURE_2D, t.texture );
+	if( t.ktx->glFormat == 0 )
+		glCompressedTexImage2D( GL_TEXTURE_2D, t.levelsUploaded, t.ktx->glInternalFormat, level.width, level.height, 0, (GLsizei)size, src );
+	else
+		glTexImage2D( GL_TEXTURE_2D, t.levelsUploaded, t.ktx->glInternalFormat, level.width, level.height, 0,
+			t.ktx->glFormat, t.ktx->glType, src );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+	t.levelsUploaded++;
+	budget -= size < budget ? size : budget;
+	return t.levelsUploaded == (int)t.ktx->levels.size( );
+}
+
+
+void
+TextureManager::Finish( int handle )
+{
+	Texture &t = textures[handle];
+	glBindTexture( GL_TEXTURE_2D, t.texture );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	if( t.ktx != NULL )
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, t.levelsUploaded - 1 );
+	else
+		glGenerateMipmap( GL_TEXTURE_2D );
+
+	// the levels below 0 are only ever sampled with a mipmapped filter:
+	bool mipmapped = t.ktx != NULL ? t.levelsUploaded > 1 : ( t.width > 1  ||  t.height > 1 );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR );
+	glDeleteTextures( 1, &t.placeholder );
+
+	std::lock_guard<std::mutex> guard( lock );
+	FreePixels( t );
+	t.placeholder = 0;
+	t.state = READY;
+}
+
+
+// for when a frame has to have everything (the golden images, a benchmark's steady state):
+
+void
+TextureManager::WaitForAll( )
+{
+	size_t budget = uploadBudget;
+	uploadBudget = (size_t)-1;
+	while( Update( ) )
+		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+	uploadBudget = budget;
+}
@@ -0,0 +1,93 @@
+#ifndef TEXTUREMANAGER_H
+#define TEXTUREMANAGER_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ktx.h"
+
+
+// textures that load without stalling a frame:
+// Load( ) returns a handle at once, and the image is decoded on a pool of worker threads
+// (stb_image, or BmpToTexture for .bmp files). each frame, Update( ) on the GL thread uploads
+// decoded pixels through a pair of pixel-unpack buffers, at most uploadBudget bytes per call,
+// a slice of rows at a time. until the whole image is up, Get( ) gives a 1x1 placeholder
+// of the color passed to Load( ), so the caller binds Get( handle ) every frame and never waits.
+//
+// .ktx files (see texconv) are uploaded level by level as they are stored, block-compressed
+// with glCompressedTexImage2D and with no glGenerateMipmap. if the GL can't take the file's
+// block format, the worker decompresses it to rgba first.
+//
+// stbi_load images and ktx files keep their top row at t = 0, bmps their bottom row, as the
+// loaders have always given them to glTexImage2D.
+
+const int TEXTURE_DECODE_THREADS = 2;
+const size_t TEXTURE_UPLOAD_BUDGET = 4 << 20;		// bytes per Update( )
+
+
+class TextureManager
+{
+private:
+	enum States { QUEUED, DECODED, UPLOADING, READY, FAILED };
+
+	struct Texture
+	{
+		std::string	path;
+		int		state;
+		unsigned int	placeholder;		// 1x1, shown until ready
+		unsigned int	texture;		// the real one, once uploading starts
+		unsigned char *	pixels;			// decoded, waiting for upload
+		bool		fromBmp;		// pixels are new[ ]'ed, not stbi_image_free'd
+		int		width, height, comps;
+		int		rowsUploaded;
+		KtxImage *	ktx;			// instead of pixels, for .ktx files
+		int		levelsUploaded;
+	};
+
+	std::vector<Texture>		textures;	// indexed by handle
+	std::mutex			lock;		// guards textures' state and pixels, and jobs
+	std::condition_variable		wake;
+	std::deque<int>			jobs;		// handles waiting to be decoded
+	std::vector<std::thread>	workers;
+	bool				quit;
+
+	unsigned int	pbos[2];
+	size_t		pboSize[2];
+	int		nextPbo;
+	size_t		uploadBudget;
+	int		current;			// handle being uploaded, -1 if none
+	bool		s3tc, bptc;			// block formats the GL takes
+
+	int		decodeSeconds;			// metrics handles, -1 if none
+	int		decodedBytes;
+
+	void	Decode( int );
+	void	Finish( int );
+	void	FreePixels( Texture & );
+	void	Run( );
+	bool	Unpack( KtxImage & );
+	const void *	Stage( const void *, size_t );
+	bool	UploadLevel( Texture &, size_t & );
+	bool	UploadSlice( Texture &, size_t & );
+
+public:
+		TextureManager( );
+		~TextureManager( );
+
+	unsigned int	Get( int );
+	bool		IsReady( int );
+	int		Load( const char *, unsigned int = 0x808080ff );
+	void		SetMetrics( int, int );
+	void		SetUploadBudget( size_t );
+	void		Start( int = TEXTURE_DECODE_THREADS );
+	void		Stop( );
+	bool		Update( );
+	void		WaitForAll( );
+};
+
+#endif	// TEXTUREMANAGER_H
@@ -0,0 +1,221 @@
+#include "tracker.h"
+
+#include <math.h>
+#include <algorithm>
+
+
+// panels whose x differs by less than this are in the same row:
+
+const float ROW_TOLERANCE = 1.e-3f;
+
+
+void
+ComputeRowCoverage( const glm::vec3 *positions, int numPanels, float panelWidth, float *gcr )
+{
+	// the distinct row x's, sorted:
+
+	std::vector<float> rows( numPanels );
+	for( int i = 0; i < numPanels; i++ )
+		rows[i] = positions[i].x;
+	std::sort( rows.begin( ), rows.end( ) );
+
+	std::vector<float> unique;
+	for( int i = 0; i < numPanels; i++ )
+	{
+		if( unique.empty( )  ||  rows[i] - unique.back( ) > ROW_TOLERANCE )
+			unique.push_back( rows[i] );
+	}
+	int numRows = (int)unique.size( );
+
+	// look up each panel's row and take the pitch to its nearest neighbor.
+	// the edge rows use their one neighbor too: if they tracked freely they would
+	// shade every row behind them at low sun.
+
+	for( int i = 0; i < numPanels; i++ )
+	{
+		int r = (int)( std::lower_bound( unique.begin( ), unique.end( ), positions[i].x - ROW_TOLERANCE ) - unique.begin( ) );
+		float pitch = 1.e+37f;
+		if( r+1 < numRows )	pitch = unique[r+1] - unique[r];
+		if( r-1 >= 0 )		pitch = fminf( pitch, unique[r] - unique[r-1] );
+		gcr[i] = numRows > 1 ? panelWidth / pitch : 0.f;
+	}
+}
+
+
+// the loops below are written branch-free over flat arrays so the compiler can vectorize them
+
+void
+ComputePanelRotations( const glm::vec3 *positions, int numPanels, glm::vec3 lightPos, int mode,
+			float maxTiltDeg, const float *gcr, float *anglesDeg )
+{
+	if( mode == TRUE_TRACKING )
+	{
+		for( int i = 0; i < numPanels; i++ )
+		{
+			float dx = lightPos.x - positions[i].x;
+			float dy = lightPos.y - positions[i].y;
+			float dz = lightPos.z - positions[i].z;
+			float len = sqrtf( dx*dx + dy*dy + dz*dz );
+			float dotVal = glm::clamp( dy / len, -1.f, 1.f );	// panel normal is +y before rotating
+			float angleDeg = glm::degrees( acosf( dotVal ) );
+			angleDeg = angleDeg > maxTiltDeg ? maxTiltDeg : angleDeg;
+			anglesDeg[i] = dx > 0.f ? -angleDeg : angleDeg;
+		}
+		return;
+	}
+
+	// backtracking:
+	// start from the true-tracking angle in the plane perpendicular to the axis, then, when the
+	// shadow of a row would reach the next one ( cos(theta)/gcr < 1 ), rotate back just far enough
+	// that the shadow edge lands on the neighbor's edge. at night the panels stow flat.
+
+	for( int i = 0; i < numPanels; i++ )
+	{
+		float dx = lightPos.x - positions[i].x;
+		float dy = lightPos.y - positions[i].y;
+		float thetaT = atan2f( -dx, dy );
+
+		float temp = gcr[i] > 0.f ? fabsf( cosf( thetaT ) ) / gcr[i] : 2.f;
+		float correction = temp < 1.f ? acosf( fminf( temp, 1.f ) ) : 0.f;
+		float theta = thetaT - copysignf( correction, thetaT );
+
+		float angleDeg = glm::degrees( theta );
+		angleDeg = glm::clamp( angleDeg, -maxTiltDeg, maxTiltDeg );
+		anglesDeg[i] = dy > 0.f ? angleDeg : 0.f;
+	}
+}
+
+
+// a slewing panel this close to its target counts as there:
+
+const float ARRIVED = 1.e-3f;
+
+
+TrackerActuators::TrackerActuators( )
+{
+}
+
+
+// numPanels, starting angles (degrees), maxRate (degrees/sec), deadband (degrees)
+// the panels start at rest with their targets where they are:
+
+void
+TrackerActuators::Init( int numPanels, const float *startAngles, float rate, float band )
+{
+	angle.assign( startAngles, startAngles + numPanels );
+	target.assign( startAngles, startAngles + numPanels );
+	maxRate.assign( numPanels, rate );
+	deadband.assign( numPanels, band );
+	moving.assign( numPanels, 0.f );
+}
+
+
+const float *
+TrackerActuators::GetAngles( )
+{
+	return angle.data( );
+}
+
+
+int
+TrackerActuators::GetNumPanels( )
+{
+	return (int)angle.size( );
+}
+
+
+// target - current, degrees, per panel:
+
+void
+TrackerActuators::GetTrackingErrors( float *errors )
+{
+	int n = (int)angle.size( );
+	for( int i = 0; i < n; i++ )
+		errors[i] = target[i] - angle[i];
+}
+
+
+float
+TrackerActuators::GetMeanAbsError( )
+{
+	int n = (int)angle.size( );
+	if( n == 0 )
+		return 0.f;
+	float sum = 0.f;
+	for( int i = 0; i < n; i++ )
+		sum += fabsf( target[i] - angle[i] );
+	return sum / (float)n;
+}
+
+
+// every actuator's whole state, so a restored field carries on exactly where it left off:
+
+bool
+TrackerActuators::Restore( SnapshotIn &in )
+{
+	in.GetFloats( angle );
+	in.GetFloats( target );
+	in.GetFloats( maxRate );
+	in.GetFloats( deadband );
+	in.GetFloats( moving );
+	size_t n = angle.size( );
+	return in.IsOk( )  &&  target.size( ) == n  &&  maxRate.size( ) == n  &&  deadband.size( ) == n  &&  moving.size( ) == n;
+}
+
+
+void
+TrackerActuators::Save( SnapshotOut &out )
+{
+	out.PutFloats( angle );
+	out.PutFloats( target );
+	out.PutFloats( maxRate );
+	out.PutFloats( deadband );
+	out.PutFloats( moving );
+}
+
+
+void
+TrackerActuators::SetMaxRate( float rate )
+{
+	maxRate.assign( maxRate.size( ), rate < 0.f ? 0.f : rate );
+}
+
+
+void
+TrackerActuators::SetDeadband( float band )
+{
+	deadband.assign( deadband.size( ), band < 0.f ? 0.f : band );
+}
+
+
+void
+TrackerActuators::SetTargets( const float *targets )
+{
+	target.assign( targets, targets + target.size( ) );
+}
+
+
+// advance every actuator by dt seconds:
+
+void
+TrackerActuators::Step( float dt )
+{
+	int n = (int)angle.size( );
+	float *a = angle.data( );
+	const float *t = target.data( );
+	const float *r = maxRate.data( );
+	const float *d = deadband.data( );
+	float *m = moving.data( );
+
+	for( int i = 0; i < n; i++ )
+	{
+		float err = t[i] - a[i];
+		float mag = fabsf( err );
+		float go = mag > d[i] ? 1.f : m[i];
+		float maxStep = r[i] * dt;
+		float delta = err > maxStep ? maxStep : err;
+		delta = delta < -maxStep ? -maxStep : delta;
+		a[i] += go * delta;
+		m[i] = mag - fabsf( delta ) > ARRIVED ? go : 0.f;
+	}
+}
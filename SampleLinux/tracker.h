@@ -0,0 +1,73 @@
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include <stdio.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "snapshot.h"
+
+
+// single-axis trackers:
+// every panel rotates about an axis parallel to world +z, so its tilt is one angle
+// (degrees, positive rotates the panel normal towards -x)
+
+enum TrackingModes
+{
+	TRUE_TRACKING,		// point straight at the sun, up to the tilt limit
+	BACKTRACKING		// back off at low sun so a row never shades the next one
+};
+
+const float DEFAULT_MAX_TILT = 75.f;
+
+
+// rows are the panels that share an axis (same x).
+// for each panel, its row's ground coverage ratio: panel width / pitch to the nearest
+// neighboring row (0. if the field is a single row):
+
+void	ComputeRowCoverage( const glm::vec3 *, int, float, float * );
+
+
+// tilt of every panel for the given sun position, as a batch over the whole field:
+//	positions, numPanels, lightPos, mode, maxTiltDeg, gcr, anglesDeg
+
+void	ComputePanelRotations( const glm::vec3 *, int, glm::vec3, int, float, const float *, float * );
+
+
+// tracker motors:
+// each panel slews towards its target angle at no more than maxRate degrees per second.
+// a panel at rest only starts moving once its target is more than deadband degrees away,
+// then keeps going until it gets there, like a real tracker controller.
+// all per-panel state is structure-of-arrays and Step( ) is one branch-free pass, so it
+// vectorizes and stays cheap for very large fields.
+
+const float DEFAULT_MAX_RATE = 0.01f;	// degrees/sec of simulated time (36 degrees an hour)
+const float DEFAULT_DEADBAND = 1.f;	// degrees
+
+class TrackerActuators
+{
+private:
+	std::vector<float>	angle;		// where each panel is now
+	std::vector<float>	target;		// where its controller wants it
+	std::vector<float>	maxRate;
+	std::vector<float>	deadband;
+	std::vector<float>	moving;		// 1. while slewing, 0. while holding (a float so Step( ) stays branch-free)
+
+public:
+		TrackerActuators( );
+
+	void		Init( int, const float *, float, float );
+	const float *	GetAngles( );
+	int		GetNumPanels( );
+	void		GetTrackingErrors( float * );
+	float		GetMeanAbsError( );
+	bool		Restore( SnapshotIn & );
+	void		Save( SnapshotOut & );
+	void		SetMaxRate( float );
+	void		SetDeadband( float );
+	void		SetTargets( const float * );
+	void		Step( float );
+};
+
+#endif	// TRACKER_H
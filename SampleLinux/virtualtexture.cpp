@@ -0,0 +1,618 @@
+#include "virtualtexture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include "glew.h"
+#include <GL/gl.h>
+#endif
+
+#include "blockcompress.h"
+#include "programcache.h"
+#include "glstate.h"
+
+
+// the feedback pass: the tile and level each pixel would sample, as integers.
+// the buffer is VT_FEEDBACK_SCALE times smaller, so its derivatives are that much bigger:
+
+static const char *FeedbackVertexSource = R"(
+	#version 330 core
+	layout (location = 0) in vec3 aPos;
+	layout (location = 1) in vec2 aTexCoord;
+	out vec2 TexCoord;
+	uniform mat4 modelViewProjection;
+	void main() {
+		gl_Position = modelViewProjection * vec4(aPos, 1.0);
+		TexCoord = aTexCoord;
+	}
+)";
+
+static const char *FeedbackFragmentSource = R"(
+	#version 330 core
+	in vec2 TexCoord;
+	layout (location = 0) out uvec4 Feedback;
+	uniform vec2 vtSize;
+	uniform float vtTileSize, vtMaxLevel, vtLodBias;
+	void main() {
+		vec2 texel = clamp(TexCoord, 0., 1.) * vtSize;
+		vec2 dx = dFdx(texel), dy = dFdy(texel);
+		float lod = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy))) - vtLodBias), 0., vtMaxLevel);
+		vec2 tile = floor(min(texel, vtSize - 1.) / (vtTileSize * exp2(lod)));
+		Feedback = uvec4(uint(tile.x), uint(tile.y), uint(lod), 1u);
+	}
+)";
+
+
+static const char *FeedbackUniformNames[VT_NUM_FEEDBACK_UNIFORMS] = { "modelViewProjection", "vtSize", "vtTileSize", "vtMaxLevel", "vtLodBias" };
+static const char *SceneUniformNames[VT_NUM_SCENE_UNIFORMS] = { "vtAtlas", "vtIndirection", "vtSize", "vtTileSize", "vtBorder", "vtAtlasSize", "vtMaxLevel" };
+
+
+static bool
+HasExtension( const char *name )
+{
+	GLint numExtensions = 0;
+	glGetIntegerv( GL_NUM_EXTENSIONS, &numExtensions );
+	for( int i = 0; i < numExtensions; i++ )
+		if( strcmp( (const char *)glGetStringi( GL_EXTENSIONS, i ), name ) == 0 )
+			return true;
+	return false;
+}
+
+
+static unsigned int
+GlFormatOf( int format )
+{
+	switch( format )
+	{
+		case BLOCK_BC1:		return GL_FORMAT_BC1;
+		case BLOCK_BC3:		return GL_FORMAT_BC3;
+		case BLOCK_BC7:		return GL_FORMAT_BC7;
+	}
+	return GL_RGBA8;
+}
+
+
+VirtualTexture::VirtualTexture( )
+{
+	open = false;
+	atlasFormat = PAGE_RGBA;
+	unpackBlocks = false;
+	atlasSize = tableSize = 0;
+	atlas = indirection = 0;
+	feedbackFbo = feedbackColor = feedbackDepth = feedbackProgram = 0;
+	feedbackWidth = feedbackHeight = 0;
+	readPbos[0] = readPbos[1] = 0;
+	readWidth[0] = readWidth[1] = readHeight[0] = readHeight[1] = 0;
+	nextRead = 0;
+	for( int u = 0; u < VT_NUM_FEEDBACK_UNIFORMS; u++ )
+		feedbackUniforms[u] = -1;
+	for( int u = 0; u < VT_NUM_SCENE_UNIFORMS; u++ )
+		sceneUniforms[u] = -1;
+	savedDrawFbo = savedReadFbo = savedProgram = 0;
+	frame = 0;
+	loads = evictions = 0;
+	quit = false;
+}
+
+
+// Close( ) needs the GL context, so by the time this runs it should already have been called:
+
+VirtualTexture::~VirtualTexture( )
+{
+	StopLoader( );
+}
+
+
+void
+VirtualTexture::StopLoader( )
+{
+	if( ! loader.joinable( ) )
+		return;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_one( );
+	loader.join( );
+}
+
+
+// with the GL context current:
+
+bool
+VirtualTexture::Open( const char *path )
+{
+	Close( );
+	if( ! pages.Open( path ) )
+		return false;
+
+	int format = pages.GetFormat( );
+	bool supported = format == PAGE_RGBA
+		||  ( format == BLOCK_BC7 ? HasExtension( "GL_ARB_texture_compression_bptc" ) : HasExtension( "GL_EXT_texture_compression_s3tc" ) );
+	atlasFormat = supported ? format : PAGE_RGBA;
+	unpackBlocks = ! supported;
+
+	ShaderStage stages[2] = { { GL_VERTEX_SHADER, &FeedbackVertexSource, 1 }, { GL_FRAGMENT_SHADER, &FeedbackFragmentSource, 1 } };
+	feedbackProgram = Programs.Build( "vt-feedback", stages, 2 );
+	if( feedbackProgram == 0 )
+	{
+		pages.Close( );
+		return false;
+	}
+	for( int u = 0; u < VT_NUM_FEEDBACK_UNIFORMS; u++ )
+		feedbackUniforms[u] = glGetUniformLocation( feedbackProgram, FeedbackUniformNames[u] );
+
+	// the atlas, uninitialized -- only pages with tiles in them are ever sampled:
+	atlasSize = VT_ATLAS_PAGES * PAGE_SIZE;
+	glGenTextures( 1, &atlas );
+	glBindTexture( GL_TEXTURE_2D, atlas );
+	if( atlasFormat == PAGE_RGBA )
+		glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, atlasSize, atlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+	else
+		glCompressedTexImage2D( GL_TEXTURE_2D, 0, GlFormatOf( atlasFormat ), atlasSize, atlasSize, 0,
+			(GLsizei)BlockCompressedSize( atlasFormat, atlasSize, atlasSize ), NULL );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0 );
+
+	// the indirection texture is square and a power of 2, with a level for every level of tiles,
+	// so it's mipmap-complete whatever the page file's shape. the texels past the tiles are never
+	// looked at, but get filled in like the rest:
+	int numLevels = pages.GetNumLevels( );
+	tableSize = 1;
+	while( tableSize < pages.GetTilesX( 0 )  ||  tableSize < pages.GetTilesY( 0 )  ||  tableSize < ( 1 << ( numLevels - 1 ) ) )
+		tableSize *= 2;
+	glGenTextures( 1, &indirection );
+	glBindTexture( GL_TEXTURE_2D, indirection );
+	table.resize( numLevels );
+	for( int l = 0; l < numLevels; l++ )
+	{
+		int size = tableSize >> l;
+		table[l].assign( 4 * (size_t)size * size, 0 );
+		glTexImage2D( GL_TEXTURE_2D, l, GL_RGBA8UI, size, size, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, NULL );
+	}
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1 );
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	slots.assign( VT_ATLAS_PAGES * VT_ATLAS_PAGES, Slot( ) );
+	for( size_t s = 0; s < slots.size( ); s++ )
+	{
+		slots[s].key = -1;
+		slots[s].lastUsed = -1;
+	}
+	resident.clear( );
+	inFlight.clear( );
+	requests.clear( );
+	loaded.clear( );
+	changed.clear( );
+	frame = 0;
+	loads = evictions = 0;
+	open = true;
+
+	// the coarsest level's single tile, now, so every texel has something to show:
+	Loaded root;
+	root.key = Key( numLevels - 1, 0, 0 );
+	root.data.resize( pages.TileBytes( ) );
+	root.ok = pages.ReadTile( numLevels - 1, 0, 0, root.data.data( ) );
+	if( root.ok  &&  unpackBlocks )
+	{
+		std::vector<unsigned char> rgba( 4 * (size_t)PAGE_SIZE * PAGE_SIZE );
+		root.ok = DecompressBlocks( format, root.data.data( ), PAGE_SIZE, PAGE_SIZE, rgba.data( ) );
+		root.data.swap( rgba );
+	}
+	if( ! root.ok )
+	{
+		fprintf( stderr, "Cannot read the top tile of '%s'\n", path );
+		Close( );
+		return false;
+	}
+	Place( root );
+	slots[ resident[root.key] ].lastUsed = 0x7fffffff;		// pinned
+
+	// and the whole table filled in from it, by way of the texels of the top level:
+	int topSize = tableSize >> ( numLevels - 1 );
+	for( int y = 0; y < topSize; y++ )
+		for( int x = 0; x < topSize; x++ )
+			changed.push_back( Key( numLevels - 1, x, y ) );
+	UpdateTable( );
+
+	quit = false;
+	loader = std::thread( &VirtualTexture::Run, this );
+	fprintf( stderr, "Virtual texture '%s': %dx%d, %d levels, an atlas of %d pages%s\n", path, pages.GetWidth( ), pages.GetHeight( ),
+		numLevels, (int)slots.size( ), unpackBlocks ? " (tiles decompressed, the GL can't take their blocks)" : "" );
+	return true;
+}
+
+
+// with the GL context current:
+
+void
+VirtualTexture::Close( )
+{
+	StopLoader( );
+	if( ! open )
+		return;
+
+	glDeleteTextures( 1, &atlas );
+	glDeleteTextures( 1, &indirection );
+	GlState.ForgetProgram( feedbackProgram );
+	glDeleteProgram( feedbackProgram );
+	if( feedbackFbo != 0 )
+	{
+		glDeleteFramebuffers( 1, &feedbackFbo );
+		glDeleteRenderbuffers( 1, &feedbackColor );
+		glDeleteRenderbuffers( 1, &feedbackDepth );
+	}
+	for( int i = 0; i < 2; i++ )
+		if( readPbos[i] != 0 )
+			glDeleteBuffers( 1, &readPbos[i] );
+	atlas = indirection = feedbackProgram = 0;
+	feedbackFbo = feedbackColor = feedbackDepth = 0;
+	feedbackWidth = feedbackHeight = 0;
+	readPbos[0] = readPbos[1] = 0;
+	readWidth[0] = readWidth[1] = readHeight[0] = readHeight[1] = 0;
+	pages.Close( );
+	open = false;
+}
+
+
+bool
+VirtualTexture::CreateFeedback( int width, int height )
+{
+	if( feedbackFbo == 0 )
+	{
+		glGenFramebuffers( 1, &feedbackFbo );
+		glGenRenderbuffers( 1, &feedbackColor );
+		glGenRenderbuffers( 1, &feedbackDepth );
+	}
+	glBindRenderbuffer( GL_RENDERBUFFER, feedbackColor );
+	glRenderbufferStorage( GL_RENDERBUFFER, GL_RGBA16UI, width, height );
+	glBindRenderbuffer( GL_RENDERBUFFER, feedbackDepth );
+	glRenderbufferStorage( GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height );
+	glBindRenderbuffer( GL_RENDERBUFFER, 0 );
+
+	GlState.BindFramebuffer( GL_FRAMEBUFFER, feedbackFbo );
+	glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedbackColor );
+	glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth );
+	feedbackWidth = width;
+	feedbackHeight = height;
+	return glCheckFramebufferStatus( GL_FRAMEBUFFER ) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+
+// switch to the feedback buffer and program; the caller then draws whatever wears the texture,
+// and calls EndFeedback( ). viewportWidth, viewportHeight, and the geometry's model-view-projection:
+
+void
+VirtualTexture::BeginFeedback( int viewportWidth, int viewportHeight, const float *modelViewProjection )
+{
+	if( ! open )
+		return;
+	savedDrawFbo = GlState.GetDrawFramebuffer( );
+	savedReadFbo = GlState.GetReadFramebuffer( );
+	savedProgram = GlState.GetProgram( );
+	GlState.GetViewport( savedViewport );
+
+	int width = std::max( 1, viewportWidth / VT_FEEDBACK_SCALE );
+	int height = std::max( 1, viewportHeight / VT_FEEDBACK_SCALE );
+	if( width != feedbackWidth  ||  height != feedbackHeight )
+		CreateFeedback( width, height );
+	GlState.BindFramebuffer( GL_FRAMEBUFFER, feedbackFbo );
+	GlState.Viewport( 0, 0, width, height );
+	static const GLuint none[4] = { 0, 0, 0, 0 };
+	glClearBufferuiv( GL_COLOR, 0, none );
+	glClear( GL_DEPTH_BUFFER_BIT );
+
+	GlState.UseProgram( feedbackProgram );
+	GlState.UniformMatrix4fv( feedbackUniforms[VT_FB_MVP], modelViewProjection );
+	GlState.Uniform2f( feedbackUniforms[VT_FB_SIZE], (float)pages.GetWidth( ), (float)pages.GetHeight( ) );
+	GlState.Uniform1f( feedbackUniforms[VT_FB_TILE_SIZE], (float)PAGE_TILE_SIZE );
+	GlState.Uniform1f( feedbackUniforms[VT_FB_MAX_LEVEL], (float)( pages.GetNumLevels( ) - 1 ) );
+	GlState.Uniform1f( feedbackUniforms[VT_FB_LOD_BIAS], log2f( (float)VT_FEEDBACK_SCALE ) );
+}
+
+
+// start reading the feedback back and put the caller's framebuffer, viewport and program back:
+
+void
+VirtualTexture::EndFeedback( )
+{
+	if( ! open )
+		return;
+	int r = nextRead;
+	nextRead = 1 - nextRead;
+	if( readPbos[r] == 0 )
+		glGenBuffers( 1, &readPbos[r] );
+	GlState.BindBuffer( GL_PIXEL_PACK_BUFFER, readPbos[r] );
+	if( readWidth[r] != feedbackWidth  ||  readHeight[r] != feedbackHeight )
+		glBufferData( GL_PIXEL_PACK_BUFFER, 8 * (GLsizeiptr)feedbackWidth * feedbackHeight, NULL, GL_STREAM_READ );
+	readWidth[r] = feedbackWidth;
+	readHeight[r] = feedbackHeight;
+	glReadBuffer( GL_COLOR_ATTACHMENT0 );
+	glReadPixels( 0, 0, feedbackWidth, feedbackHeight, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, (void *)0 );
+	GlState.BindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+	GlState.BindFramebuffer( GL_DRAW_FRAMEBUFFER, savedDrawFbo );
+	GlState.BindFramebuffer( GL_READ_FRAMEBUFFER, savedReadFbo );
+	GlState.Viewport( savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3] );
+	GlState.UseProgram( savedProgram );
+}
+
+
+// the uniforms Bind( ) sets, in the scene shader's VIRTUAL_TEXTURE variant -- whenever it's
+// (re)linked:
+
+void
+VirtualTexture::Locate( unsigned int program )
+{
+	for( int u = 0; u < VT_NUM_SCENE_UNIFORMS; u++ )
+		sceneUniforms[u] = program != 0 ? glGetUniformLocation( program, SceneUniformNames[u] ) : -1;
+}
+
+
+// the atlas and indirection textures on these units, and the uniforms shaders/scene.frag wants,
+// in the program Locate( ) was given -- which the caller has made current through GlState:
+
+void
+VirtualTexture::Bind( int atlasUnit, int indirectionUnit )
+{
+	if( ! open )
+		return;
+	GlState.ActiveTexture( GL_TEXTURE0 + atlasUnit );
+	GlState.BindTexture( GL_TEXTURE_2D, atlas );
+	GlState.ActiveTexture( GL_TEXTURE0 + indirectionUnit );
+	GlState.BindTexture( GL_TEXTURE_2D, indirection );
+	GlState.ActiveTexture( GL_TEXTURE0 );
+
+	GlState.Uniform1i( sceneUniforms[VT_ATLAS], atlasUnit );
+	GlState.Uniform1i( sceneUniforms[VT_INDIRECTION], indirectionUnit );
+	GlState.Uniform2f( sceneUniforms[VT_SIZE], (float)pages.GetWidth( ), (float)pages.GetHeight( ) );
+	GlState.Uniform1f( sceneUniforms[VT_TILE_SIZE], (float)PAGE_TILE_SIZE );
+	GlState.Uniform1f( sceneUniforms[VT_BORDER], (float)PAGE_BORDER );
+	GlState.Uniform1f( sceneUniforms[VT_ATLAS_SIZE], (float)atlasSize );
+	GlState.Uniform1f( sceneUniforms[VT_MAX_LEVEL], (float)( pages.GetNumLevels( ) - 1 ) );
+}
+
+
+// once a frame, before the feedback pass: look at the feedback from two frames ago, ask for
+// what's missing, and put what the loader has finished into the atlas:
+
+void
+VirtualTexture::Update( )
+{
+	if( ! open )
+		return;
+	frame++;
+	if( readWidth[nextRead] > 0 )
+		ReadFeedback( nextRead );
+
+	for( int n = 0; n < VT_UPLOADS_PER_FRAME; n++ )
+	{
+		Loaded tile;
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			if( loaded.empty( ) )
+				break;
+			tile = std::move( loaded.front( ) );
+			loaded.pop_front( );
+		}
+		inFlight.erase( tile.key );
+		if( tile.ok )
+			Place( tile );
+	}
+
+	if( ! changed.empty( ) )
+		UpdateTable( );
+}
+
+
+void
+VirtualTexture::ReadFeedback( int r )
+{
+	std::vector<long long> needed;
+	GlState.BindBuffer( GL_PIXEL_PACK_BUFFER, readPbos[r] );
+	const unsigned short *pixels = (const unsigned short *)glMapBufferRange( GL_PIXEL_PACK_BUFFER, 0,
+		8 * (GLsizeiptr)readWidth[r] * readHeight[r], GL_MAP_READ_BIT );
+	if( pixels != NULL )
+	{
+		int numPixels = readWidth[r] * readHeight[r];
+		for( int i = 0; i < numPixels; i++ )
+		{
+			const unsigned short *p = &pixels[ 4*i ];
+			if( p[3] != 0 )
+				needed.push_back( Key( p[2], p[0], p[1] ) );
+		}
+		glUnmapBuffer( GL_PIXEL_PACK_BUFFER );
+	}
+	GlState.BindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+	std::sort( needed.begin( ), needed.end( ) );
+	needed.erase( std::unique( needed.begin( ), needed.end( ) ), needed.end( ) );
+
+	// the tiles seen, and their ancestors, are in use; the missing ones are wanted:
+	std::unordered_set<long long> seen;
+	std::vector<long long> wanted;
+	int numLevels = pages.GetNumLevels( );
+	for( long long key : needed )
+	{
+		int level = LevelOf( key ), x = XOf( key ), y = YOf( key );
+		if( level >= numLevels  ||  x >= pages.GetTilesX( level )  ||  y >= pages.GetTilesY( level ) )
+			continue;
+		for( ; level < numLevels; level++, x /= 2, y /= 2 )
+		{
+			long long k = Key( level, x, y );
+			if( ! seen.insert( k ).second )
+				break;			// and so were its ancestors
+			auto it = resident.find( k );
+			if( it != resident.end( ) )
+				slots[ it->second ].lastUsed = std::max( slots[ it->second ].lastUsed, frame );
+			else if( inFlight.count( k ) == 0 )
+				wanted.push_back( k );
+		}
+	}
+
+	// coarse ones first: each makes a whole region sharper, and the fine ones may never be needed
+	// long enough to arrive. what the loader hasn't started on is replaced by the new list:
+	std::sort( wanted.begin( ), wanted.end( ), []( long long a, long long b ) { return LevelOf( a ) > LevelOf( b ); } );
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		for( long long k : requests )
+			inFlight.erase( k );
+		requests.clear( );
+		for( size_t i = 0; i < wanted.size( )  &&  (int)requests.size( ) < VT_MAX_REQUESTS; i++ )
+			if( inFlight.insert( wanted[i] ).second )
+				requests.push_back( wanted[i] );
+	}
+	wake.notify_one( );
+}
+
+
+// copy a loaded tile into a free page, or the one used longest ago -- but not one the last
+// feedback asked for. if every page was, the tile is dropped and asked for again later:
+
+void
+VirtualTexture::Place( Loaded &tile )
+{
+	int best = -1;
+	for( int s = 0; s < (int)slots.size( ); s++ )
+	{
+		if( slots[s].key < 0 )
+		{
+			best = s;
+			break;
+		}
+		if( slots[s].lastUsed < frame  &&  ( best < 0  ||  slots[s].lastUsed < slots[best].lastUsed ) )
+			best = s;
+	}
+	if( best < 0 )
+		return;
+	if( slots[best].key >= 0 )
+	{
+		resident.erase( slots[best].key );
+		changed.push_back( slots[best].key );
+		evictions++;
+	}
+
+	int px = ( best % VT_ATLAS_PAGES ) * PAGE_SIZE;
+	int py = ( best / VT_ATLAS_PAGES ) * PAGE_SIZE;
+	GlState.BindTexture( GL_TEXTURE_2D, atlas );
+	if( atlasFormat == PAGE_RGBA )
+		glTexSubImage2D( GL_TEXTURE_2D, 0, px, py, PAGE_SIZE, PAGE_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, tile.data.data( ) );
+	else
+		glCompressedTexSubImage2D( GL_TEXTURE_2D, 0, px, py, PAGE_SIZE, PAGE_SIZE, GlFormatOf( atlasFormat ),
+			(GLsizei)tile.data.size( ), tile.data.data( ) );
+	GlState.BindTexture( GL_TEXTURE_2D, 0 );
+
+	slots[best].key = tile.key;
+	slots[best].lastUsed = frame;
+	resident[tile.key] = best;
+	loads++;
+	changed.push_back( tile.key );
+}
+
+
+// a tile's texel: its own page if it has one, otherwise its parent's:
+
+void
+VirtualTexture::FillEntry( int l, int x, int y )
+{
+	int size = tableSize >> l;
+	unsigned char *t = &table[l][ 4 * ( (size_t)y * size + x ) ];
+	auto it = resident.find( Key( l, x, y ) );
+	if( it != resident.end( ) )
+	{
+		t[0] = (unsigned char)( it->second % VT_ATLAS_PAGES );
+		t[1] = (unsigned char)( it->second / VT_ATLAS_PAGES );
+		t[2] = (unsigned char)l;
+		t[3] = 1;
+	}
+	else if( l + 1 < (int)table.size( ) )
+		memcpy( t, &table[l+1][ 4 * ( (size_t)( y/2 ) * ( size/2 ) + x/2 ) ], 4 );
+	else
+		memcpy( t, &table[l][0], 4 );		// past the edge of the top level's one tile
+}
+
+
+// only the texels a placed or evicted tile covers change: its own, and those of its descendants,
+// at every level below it. coarse tiles first, so the parents' texels are right by the time
+// their children copy them:
+
+void
+VirtualTexture::UpdateTable( )
+{
+	std::sort( changed.begin( ), changed.end( ), []( long long a, long long b )
+		{ return LevelOf( a ) != LevelOf( b ) ? LevelOf( a ) > LevelOf( b ) : a < b; } );
+	changed.erase( std::unique( changed.begin( ), changed.end( ) ), changed.end( ) );
+
+	GlState.BindTexture( GL_TEXTURE_2D, indirection );
+	for( long long key : changed )
+	{
+		int x0 = XOf( key ), y0 = YOf( key ), n = 1;
+		for( int l = LevelOf( key ); l >= 0; l--, x0 *= 2, y0 *= 2, n *= 2 )
+		{
+			int size = tableSize >> l;
+			for( int y = y0; y < y0 + n; y++ )
+				for( int x = x0; x < x0 + n; x++ )
+					FillEntry( l, x, y );
+			glPixelStorei( GL_UNPACK_ROW_LENGTH, size );
+			glTexSubImage2D( GL_TEXTURE_2D, l, x0, y0, n, n, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE,
+				&table[l][ 4 * ( (size_t)y0 * size + x0 ) ] );
+		}
+	}
+	glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+	GlState.BindTexture( GL_TEXTURE_2D, 0 );
+	changed.clear( );
+}
+
+
+void
+VirtualTexture::Run( )
+{
+	int format = pages.GetFormat( );
+	for( ; ; )
+	{
+		Loaded tile;
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [this]( ) { return ! requests.empty( ) || quit; } );
+			if( quit )
+				return;
+			tile.key = requests.front( );
+			requests.pop_front( );
+		}
+
+		tile.data.resize( pages.TileBytes( ) );
+		tile.ok = pages.ReadTile( LevelOf( tile.key ), XOf( tile.key ), YOf( tile.key ), tile.data.data( ) );
+		if( tile.ok  &&  unpackBlocks )
+		{
+			std::vector<unsigned char> rgba( 4 * (size_t)PAGE_SIZE * PAGE_SIZE );
+			tile.ok = DecompressBlocks( format, tile.data.data( ), PAGE_SIZE, PAGE_SIZE, rgba.data( ) );
+			tile.data.swap( rgba );
+		}
+
+		std::lock_guard<std::mutex> guard( lock );
+		loaded.push_back( std::move( tile ) );
+	}
+}
+
+
+void
+VirtualTexture::PrintStats( )
+{
+	if( ! open )
+		return;
+	fprintf( stderr, "Virtual texture: %ld tiles loaded, %ld pages reused, %d of %d pages resident\n",
+		loads, evictions, (int)resident.size( ), (int)slots.size( ) );
+}
@@ -0,0 +1,119 @@
+#ifndef VIRTUALTEXTURE_H
+#define VIRTUALTEXTURE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "pagefile.h"
+
+
+// a texture far bigger than the GL could hold -- a site orthophoto tens of thousands of texels
+// across -- of which only the tiles the view needs, at the resolution it needs them, are ever read:
+//
+//	feedback	each frame the textured geometry is drawn again, 1/VT_FEEDBACK_SCALE the size, by a
+//			shader that writes the tile and mip level each pixel would sample. the buffer is read
+//			back into a pixel-pack buffer and looked at two frames later, so nothing waits on it
+//	loading		the missing tiles (and their parents, coarse ones first) go to a loader thread
+//			that reads them from the page file
+//	atlas		tiles land in a VT_ATLAS_PAGES x VT_ATLAS_PAGES texture of pages, at most
+//			VT_UPLOADS_PER_FRAME a frame; when it's full, the page used longest ago is reused.
+//			the single tile of the coarsest level is loaded at Open( ) and never leaves
+//	indirection	a mipmapped integer texture with a texel per tile of each level, saying which atlas
+//			page to sample and at what level -- the tile's own, or its nearest resident ancestor's
+//
+// the shader side (the uniforms Bind( ) sets) is the VIRTUAL_TEXTURE variant of
+// shaders/scene.frag; Locate( ) finds them in that variant's program, once it's linked.
+
+const int VT_ATLAS_PAGES = 16;			// the atlas is this many pages square
+const int VT_FEEDBACK_SCALE = 8;
+const int VT_UPLOADS_PER_FRAME = 8;
+const int VT_MAX_REQUESTS = 64;			// tiles waiting for the loader at a time
+
+enum VtFeedbackUniforms { VT_FB_MVP, VT_FB_SIZE, VT_FB_TILE_SIZE, VT_FB_MAX_LEVEL, VT_FB_LOD_BIAS, VT_NUM_FEEDBACK_UNIFORMS };
+enum VtSceneUniforms { VT_ATLAS, VT_INDIRECTION, VT_SIZE, VT_TILE_SIZE, VT_BORDER, VT_ATLAS_SIZE, VT_MAX_LEVEL, VT_NUM_SCENE_UNIFORMS };
+
+
+class VirtualTexture
+{
+private:
+	struct Slot
+	{
+		long long	key;			// the tile in this page, -1 if none
+		long		lastUsed;		// frame
+	};
+
+	struct Loaded
+	{
+		long long			key;
+		std::vector<unsigned char>	data;
+		bool				ok;
+	};
+
+	PageFile	pages;
+	bool		open;
+	int		atlasFormat;			// the page file's, or PAGE_RGBA if the GL can't take it
+	bool		unpackBlocks;			// the loader decompresses the tiles
+	int		atlasSize;			// texels
+	int		tableSize;			// the indirection texture's level 0, in tiles (a power of 2)
+
+	unsigned int	atlas, indirection;
+	unsigned int	feedbackFbo, feedbackColor, feedbackDepth, feedbackProgram;
+	int		feedbackWidth, feedbackHeight;
+	unsigned int	readPbos[2];
+	int		readWidth[2], readHeight[2];
+	int		nextRead;
+	int		feedbackUniforms[VT_NUM_FEEDBACK_UNIFORMS];
+	int		sceneUniforms[VT_NUM_SCENE_UNIFORMS];	// in the program Locate( ) was given
+	unsigned int	savedDrawFbo, savedReadFbo, savedProgram;
+	int		savedViewport[4];
+
+	std::vector<Slot>			slots;
+	std::unordered_map<long long, int>	resident;	// tile -> slot
+	std::unordered_set<long long>		inFlight;	// requested, not uploaded yet
+	std::vector<std::vector<unsigned char>>	table;		// indirection texels, per level
+	std::vector<long long>			changed;	// tiles placed or evicted since UpdateTable( )
+	long					frame;
+	long					loads, evictions;
+
+	// the hand-off to the loader:
+	std::thread			loader;
+	std::mutex			lock;
+	std::condition_variable		wake;
+	std::deque<long long>		requests;
+	std::deque<Loaded>		loaded;
+	bool				quit;
+
+	static long long	Key( int level, int x, int y )	{ return ( (long long)level << 48 ) | ( (long long)y << 24 ) | x; }
+	static int		LevelOf( long long key )	{ return (int)( key >> 48 ); }
+	static int		XOf( long long key )		{ return (int)( key & 0xffffff ); }
+	static int		YOf( long long key )		{ return (int)( ( key >> 24 ) & 0xffffff ); }
+
+	bool	CreateFeedback( int, int );
+	void	FillEntry( int, int, int );
+	void	Place( Loaded & );
+	void	ReadFeedback( int );
+	void	Run( );
+	void	StopLoader( );
+	void	UpdateTable( );
+
+public:
+		VirtualTexture( );
+		~VirtualTexture( );
+
+	void	BeginFeedback( int, int, const float * );
+	void	Bind( int, int );
+	void	Close( );
+	void	EndFeedback( );
+	bool	IsOpen( )			{ return open; }
+	void	Locate( unsigned int );
+	bool	Open( const char * );
+	void	PrintStats( );
+	void	Update( );
+};
+
+#endif	// VIRTUALTEXTURE_H
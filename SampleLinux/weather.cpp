@@ -0,0 +1,318 @@
+#include "weather.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// the binary record is written straight from the struct:
+
+static_assert( sizeof(WeatherRecord) == 24, "WeatherRecord must pack to 24 bytes" );
+
+const char	WEATHER_MAGIC[4] = { 'W', 'T', 'H', 'R' };
+const int	WEATHER_VERSION  = 1;
+
+// clear-sky global horizontal irradiance with the sun straight overhead, W/m^2:
+
+const float	CLEAR_SKY_GHI = 1000.f;
+
+
+WeatherSeries::WeatherSeries( )
+{
+	fp = NULL;
+	binary = false;
+	dataStart = 0;
+	firstTime = 0.;
+	chunkPos = 0;
+	atEnd = true;
+	memset( &prev, 0, sizeof(prev) );
+	memset( &next, 0, sizeof(next) );
+}
+
+
+WeatherSeries::~WeatherSeries( )
+{
+	Close( );
+}
+
+
+void
+WeatherSeries::Close( )
+{
+	if( fp != NULL )
+		fclose( fp );
+	fp = NULL;
+	chunk.clear( );
+	chunk.shrink_to_fit( );
+}
+
+
+bool
+WeatherSeries::IsOpen( )
+{
+	return fp != NULL;
+}
+
+
+bool
+WeatherSeries::Open( const char *path )
+{
+	Close( );
+	fp = fopen( path, "rb" );
+	if( fp == NULL )
+	{
+		fprintf( stderr, "Cannot open weather file '%s'\n", path );
+		return false;
+	}
+
+	char magic[4];
+	binary = fread( magic, 1, 4, fp ) == 4  &&  memcmp( magic, WEATHER_MAGIC, 4 ) == 0;
+	if( binary )
+	{
+		int version = 0;
+		if( fread( &version, sizeof(int), 1, fp ) != 1  ||  version != WEATHER_VERSION )
+		{
+			fprintf( stderr, "Weather file '%s' has unknown version %d\n", path, version );
+			Close( );
+			return false;
+		}
+	}
+	else
+	{
+		// skip the CSV header line:
+
+		fseek( fp, 0, SEEK_SET );
+		char line[256];
+		if( fgets( line, sizeof(line), fp ) == NULL )
+		{
+			fprintf( stderr, "Weather file '%s' is empty\n", path );
+			Close( );
+			return false;
+		}
+	}
+	dataStart = ftell( fp );
+
+	// the first record's time, as it is in the file, and then the bracket again with every
+	// time measured from it:
+	firstTime = 0.;
+	Rewind( );
+	if( atEnd )
+	{
+		fprintf( stderr, "Weather file '%s' has no records\n", path );
+		Close( );
+		return false;
+	}
+	firstTime = prev.time;
+	Rewind( );
+	return true;
+}
+
+
+// one CSV line -> one record, skipping blank and '#' lines.
+// a blank field comes back negative ("not in the file"):
+
+bool
+WeatherSeries::ReadCsvRecord( WeatherRecord *r )
+{
+	char line[256];
+	while( fgets( line, sizeof(line), fp ) != NULL )
+	{
+		char *cp = line;
+		while( *cp == ' '  ||  *cp == '\t' )
+			cp++;
+		if( *cp == '\0'  ||  *cp == '\n'  ||  *cp == '\r'  ||  *cp == '#' )
+			continue;
+
+		double fields[5] = { 0., -1., -1., -1., -1. };
+		for( int f = 0; f < 5  &&  cp != NULL; f++ )
+		{
+			char *end;
+			double v = strtod( cp, &end );
+			if( end != cp )
+				fields[f] = v;
+			cp = strchr( end, ',' );
+			if( cp != NULL )
+				cp++;
+		}
+		r->time  = fields[0];
+		r->ghi   = (float)fields[1];
+		r->dni   = (float)fields[2];
+		r->dhi   = (float)fields[3];
+		r->cloud = (float)fields[4];
+		return true;
+	}
+	return false;
+}
+
+
+// refill the chunk buffer from the current file position, returns how many records it got:
+
+int
+WeatherSeries::FillChunk( )
+{
+	chunk.resize( WEATHER_CHUNK );
+	int n = 0;
+	if( binary )
+	{
+		n = (int)fread( chunk.data( ), sizeof(WeatherRecord), WEATHER_CHUNK, fp );
+	}
+	else
+	{
+		while( n < WEATHER_CHUNK  &&  ReadCsvRecord( &chunk[n] ) )
+			n++;
+	}
+	chunk.resize( n );
+	chunkPos = 0;
+	return n;
+}
+
+
+// slide the bracket one record forward, its time made relative to the first record's:
+
+bool
+WeatherSeries::Advance( )
+{
+	if( chunkPos >= (int)chunk.size( )  &&  FillChunk( ) == 0 )
+	{
+		atEnd = true;
+		return false;
+	}
+	prev = next;
+	next = chunk[chunkPos++];
+	next.time -= firstTime;
+	return true;
+}
+
+
+void
+WeatherSeries::Rewind( )
+{
+	fseek( fp, dataStart, SEEK_SET );
+	chunk.clear( );
+	chunkPos = 0;
+	atEnd = false;
+
+	// prime the bracket with the first two records (or the one, twice):
+
+	if( ! Advance( ) )
+		return;
+	prev = next;
+	Advance( );
+	atEnd = false;
+}
+
+
+// linear between two records, missing if either end is missing:
+
+static float
+Lerp( float a, float b, float f )
+{
+	if( a < 0.f  ||  b < 0.f )
+		return -1.f;
+	return a + f * ( b - a );
+}
+
+
+// the weather at time t (seconds since the start of the series), interpolated between
+// the bracketing records and held at the ends -- or a clear sky if no file is open.
+// sinElevation is the sine of the sun's elevation, used to fill in any missing
+// irradiance from the cloud cover (Kasten-Czeplak) and to split global into beam and diffuse.
+
+void
+WeatherSeries::Sample( double t, float sinElevation, WeatherRecord *out )
+{
+	out->time = t;
+	if( fp == NULL )
+	{
+		// no file: a clear sky
+
+		out->ghi = out->dni = out->dhi = -1.f;
+		out->cloud = 0.f;
+	}
+	else
+	{
+		if( t < prev.time  &&  prev.time > 0. )
+			Rewind( );
+		while( ! atEnd  &&  t > next.time )
+			Advance( );
+
+		float f = 0.f;
+		if( next.time > prev.time )
+			f = (float)( ( t - prev.time ) / ( next.time - prev.time ) );
+		if( f < 0.f )	f = 0.f;
+		if( f > 1.f )	f = 1.f;
+
+		out->ghi   = Lerp( prev.ghi,   next.ghi,   f );
+		out->dni   = Lerp( prev.dni,   next.dni,   f );
+		out->dhi   = Lerp( prev.dhi,   next.dhi,   f );
+		out->cloud = Lerp( prev.cloud, next.cloud, f );
+	}
+
+	// fill in whatever the file didn't have:
+
+	if( sinElevation <= 0.f )
+	{
+		out->ghi = out->dni = out->dhi = 0.f;
+		return;
+	}
+
+	float c = out->cloud < 0.f ? 0.f : out->cloud;
+	if( out->ghi < 0.f )
+	{
+		if( out->dni >= 0.f  &&  out->dhi >= 0.f )
+			out->ghi = out->dni * sinElevation + out->dhi;
+		else
+			out->ghi = CLEAR_SKY_GHI * sinElevation * ( 1.f - 0.75f * powf( c, 3.4f ) );
+	}
+	if( out->dhi < 0.f )
+	{
+		if( out->dni >= 0.f )
+			out->dhi = fmaxf( out->ghi - out->dni * sinElevation, 0.f );
+		else
+			out->dhi = out->ghi * fminf( 0.3f + 0.7f * c, 1.f );	// cloudier -> more diffuse
+	}
+	if( out->dni < 0.f )
+		out->dni = fmaxf( out->ghi - out->dhi, 0.f ) / sinElevation;
+}
+
+
+// CSV -> binary, a chunk at a time:
+
+bool
+WeatherSeries::ConvertCsvToBinary( const char *csvPath, const char *binPath )
+{
+	WeatherSeries in;
+	in.fp = fopen( csvPath, "rb" );
+	if( in.fp == NULL )
+	{
+		fprintf( stderr, "Cannot open weather file '%s'\n", csvPath );
+		return false;
+	}
+	char line[256];
+	if( fgets( line, sizeof(line), in.fp ) == NULL )
+	{
+		fprintf( stderr, "Weather file '%s' is empty\n", csvPath );
+		return false;
+	}
+
+	FILE *out = fopen( binPath, "wb" );
+	if( out == NULL )
+	{
+		fprintf( stderr, "Cannot create weather file '%s'\n", binPath );
+		return false;
+	}
+	fwrite( WEATHER_MAGIC, 1, 4, out );
+	fwrite( &WEATHER_VERSION, sizeof(int), 1, out );
+
+	long total = 0;
+	int n;
+	while( ( n = in.FillChunk( ) ) > 0 )
+	{
+		fwrite( in.chunk.data( ), sizeof(WeatherRecord), n, out );
+		total += n;
+	}
+	bool ok = ferror( out ) == 0;
+	fclose( out );
+	fprintf( stderr, "Wrote %ld weather records to '%s'\n", total, binPath );
+	return ok;
+}
@@ -0,0 +1,70 @@
+#ifndef WEATHER_H
+#define WEATHER_H
+
+#include <stdio.h>
+#include <vector>
+
+
+// one weather observation:
+// irradiances are W/m^2, cloud cover is 0. (clear) to 1. (overcast).
+// an irradiance that the file didn't have is negative, and gets derived from the cloud cover.
+
+struct WeatherRecord
+{
+	double	time;		// seconds since the start of the series
+	float	ghi;		// global horizontal
+	float	dni;		// direct normal
+	float	dhi;		// diffuse horizontal
+	float	cloud;
+};
+
+
+// a recorded weather time series, streamed from disk a chunk at a time
+// so that years of 1-minute data never have to be in memory at once.
+//
+// two file formats:
+//	CSV:	a header line, then lines of   time,ghi,dni,dhi,cloud
+//		(blank fields are allowed for any column but time)
+//	binary:	the 4 bytes "WTHR", a 4-byte version (1), then packed records of
+//		double time + 4 floats ghi,dni,dhi,cloud (24 bytes each)
+//
+// the times in the file can start anywhere -- epoch seconds, say: the series starts at the
+// first record's, and the records' times (and Sample( )'s t) are seconds from there.
+//
+// Sample( ) with no file open gives a clear sky.
+// Sample( ) expects times to mostly move forward, like a simulation clock.
+// going backwards rewinds to the start of the file and streams forward again.
+
+const int WEATHER_CHUNK = 4096;		// records read per refill
+
+class WeatherSeries
+{
+private:
+	FILE *			fp;
+	bool			binary;
+	long			dataStart;		// file offset of the first record
+	double			firstTime;		// time of the first record, as in the file
+	std::vector<WeatherRecord>	chunk;
+	int			chunkPos;
+	WeatherRecord		prev, next;		// the two records bracketing the last Sample( )
+	bool			atEnd;
+
+	bool	Advance( );
+	int	FillChunk( );
+	bool	ReadCsvRecord( WeatherRecord * );
+	void	Rewind( );
+
+public:
+		WeatherSeries( );
+		WeatherSeries( const WeatherSeries & ) = delete;	// owns the open file
+		~WeatherSeries( );
+
+	void	Close( );
+	bool	IsOpen( );
+	bool	Open( const char * );
+	void	Sample( double, float, WeatherRecord * );
+
+	static bool	ConvertCsvToBinary( const char *, const char * );
+};
+
+#endif	// WEATHER_H